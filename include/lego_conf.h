@@ -26,6 +26,10 @@
 #define LEGO_USE_MQTT 1
 #endif
 
+#ifndef LEGO_MQTT_ASYNC
+#define LEGO_MQTT_ASYNC (ARDUINO_ARCH_ESP32 > 0) // Non-blocking MQTT client, 0 = PubSubClient
+#endif
+
 #ifndef LEGO_USE_HTTP
 #define LEGO_USE_HTTP 0
 #endif
@@ -34,6 +38,15 @@
 #define LEGO_USE_MDNS 0 // (LEGO_HAS_NETWORK)
 #endif
 
+#ifndef LEGO_USE_COEX
+#define LEGO_USE_COEX (ARDUINO_ARCH_ESP32 > 0 && LEGO_USE_WIFI > 0) // Share the radio between WiFi and hub scans
+#endif
+
+#ifndef LEGO_USE_SUPERVISOR
+// On by default: trains driven over MQTT or a remote stop when that link goes quiet, build with 0 to keep them running
+#define LEGO_USE_SUPERVISOR (ARDUINO_ARCH_ESP32 > 0) // Stop the trains when a control link or hub task goes quiet
+#endif
+
 #ifndef LEGO_USE_SYSLOG
 #define LEGO_USE_SYSLOG 0
 #endif
@@ -49,6 +62,10 @@
 #define LEGO_USE_SPIFFS 1 //(LEGO_HAS_FILESYSTEM)
 #endif
 
+#ifndef LEGO_USE_CONFIG
+#define LEGO_USE_CONFIG (LEGO_USE_SPIFFS) // Settings saved in SPIFFS, changed with config/<name>
+#endif
+
 #ifndef LEGO_USE_EEPROM
 #define LEGO_USE_EEPROM 0
 #endif
@@ -69,6 +86,10 @@
 #define LEGO_NUM_OUTPUTS 3
 #endif
 
+#ifndef LEGO_NUM_CHANNELS
+#define LEGO_NUM_CHANNELS 9 // Train channels shared by all controllers in the group, one color each
+#endif
+
 #ifndef LEGO_NUM_PAGES
 #if defined(ARDUINO_ARCH_ESP8266)
 #define LEGO_NUM_PAGES 4
@@ -103,6 +124,10 @@
 // #include "LEGO_eeprom.h"
 #endif
 
+#if LEGO_USE_CONFIG > 0
+#include "lego_config.h"
+#endif
+
 #if LEGO_USE_WIFI > 0
 #include "lego_wifi.h"
 #endif
@@ -132,11 +157,19 @@
 #endif
 
 #if LEGO_USE_TELNET > 0
-#include "LEGO_telnet.h"
+#include "lego_telnet.h"
 #endif
 
 #if LEGO_USE_MDNS > 0
-#include "LEGO_mdns.h"
+#include "lego_mdns.h"
+#endif
+
+#if LEGO_USE_COEX > 0
+#include "lego_coex.h"
+#endif
+
+#if LEGO_USE_SUPERVISOR > 0
+#include "lego_supervisor.h"
 #endif
 
 #if LEGO_USE_BUTTON > 0
@@ -144,7 +177,7 @@
 #endif
 
 #if LEGO_USE_OTA > 0
-#include "LEGO_ota.h"
+#include "lego_ota.h"
 #endif
 
 #if LEGO_USE_TASMOTA_SLAVE > 0
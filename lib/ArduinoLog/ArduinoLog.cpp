@@ -108,30 +108,36 @@ void Logging::setSuffix(printfunction f)
 void Logging::print(Print * logOutput, const __FlashStringHelper * format, va_list args)
 {
 #ifndef DISABLE_LOGGING
+    va_list ap; // A va_list parameter may be an array that decayed to a pointer, &args is then no va_list *
+    va_copy(ap, args);
     PGM_P p = reinterpret_cast<PGM_P>(format);
     char c  = pgm_read_byte(p++);
     for(; c != 0; c = pgm_read_byte(p++)) {
         if(c == '%') {
             c = pgm_read_byte(p++);
-            printFormat(logOutput, c, (va_list *)&args);
+            printFormat(logOutput, c, &ap);
         } else {
             logOutput->print(c);
         }
     }
+    va_end(ap);
 #endif
 }
 
 void Logging::print(Print * logOutput, const char * format, va_list args)
 {
 #ifndef DISABLE_LOGGING
+    va_list ap; // A va_list parameter may be an array that decayed to a pointer, &args is then no va_list *
+    va_copy(ap, args);
     for(; *format != 0; ++format) {
         if(*format == '%') {
             ++format;
-            printFormat(logOutput, *format, (va_list *)&args);
+            printFormat(logOutput, *format, &ap);
         } else {
             logOutput->print(*format);
         }
     }
+    va_end(ap);
 #endif
 }
 
@@ -141,10 +147,10 @@ void Logging::printFormat(Print * logOutput, const char format, va_list * args)
     if(format == '%') {
         logOutput->print(format);
     } else if(format == 's') {
-        register char * s = (char *)va_arg(*args, int);
+        char * s = va_arg(*args, char *);
         logOutput->print(s);
     } else if(format == 'S') {
-        register __FlashStringHelper * s = (__FlashStringHelper *)va_arg(*args, int);
+        __FlashStringHelper * s = va_arg(*args, __FlashStringHelper *);
         logOutput->print(s);
     } else if(format == 'd' || format == 'i') {
         logOutput->print(va_arg(*args, int), DEC);
@@ -291,6 +291,7 @@ class Logging {
             va_list args;
             va_start(args, msg);
             print(_logOutput[i], msg, args);
+            va_end(args);
             
             if(_suffix != NULL) {
                 _suffix(level, _logOutput[i]);
@@ -0,0 +1,243 @@
+/* Arduino core subset for the native unit tests
+ *
+ * Just enough of the ESP32 Arduino core for the modules built in env:native: flash strings are plain strings,
+ * millis() and micros() count from the start of the process and Serial writes to stdout.
+ */
+#ifndef NATIVE_HOST_ARDUINO_H
+#define NATIVE_HOST_ARDUINO_H
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+
+#define IRAM_ATTR
+#define PROGMEM
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+#define FPSTR(pstr_pointer) (reinterpret_cast<const __FlashStringHelper *>(pstr_pointer))
+#define PSTR(s) (s)
+#define PGM_P const char *
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+#define sprintf_P sprintf
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcasecmp_P strcasecmp
+#define strncasecmp_P strncasecmp
+#define strstr_P strstr
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcat_P strcat
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+using std::max;
+using std::min;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(uint32_t ms);
+void yield(void);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+class String {
+  public:
+    String(const char * cstr = "") : buffer(cstr ? cstr : "")
+    {}
+    String(const __FlashStringHelper * str) : buffer(reinterpret_cast<const char *>(str))
+    {}
+    String(const std::string & str) : buffer(str)
+    {}
+    explicit String(char c) : buffer(1, c)
+    {}
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(double value, unsigned char decimals = 2);
+
+    const char * c_str() const
+    {
+        return buffer.c_str();
+    }
+    unsigned int length() const
+    {
+        return buffer.length();
+    }
+    bool reserve(unsigned int size)
+    {
+        buffer.reserve(size);
+        return true;
+    }
+    char operator[](unsigned int index) const
+    {
+        return index < buffer.length() ? buffer[index] : 0;
+    }
+    void toUpperCase();
+    void toLowerCase();
+
+    template <typename T> String & operator+=(const T & value)
+    {
+        buffer += String(value).buffer;
+        return *this;
+    }
+    String & operator+=(const String & str)
+    {
+        buffer += str.buffer;
+        return *this;
+    }
+    String & operator+=(char c)
+    {
+        buffer += c;
+        return *this;
+    }
+    friend String operator+(const String & lhs, const String & rhs)
+    {
+        return String(lhs.buffer + rhs.buffer);
+    }
+    bool operator==(const String & rhs) const
+    {
+        return buffer == rhs.buffer;
+    }
+    bool operator==(const char * rhs) const
+    {
+        return buffer == rhs;
+    }
+
+  private:
+    std::string buffer;
+};
+
+class Print {
+  public:
+    virtual ~Print()
+    {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    size_t write(const char * str)
+    {
+        return str ? write((const uint8_t *)str, strlen(str)) : 0;
+    }
+    size_t write(const char * buffer, size_t size)
+    {
+        return write((const uint8_t *)buffer, size);
+    }
+    virtual int availableForWrite()
+    {
+        return 0;
+    }
+    virtual void flush()
+    {}
+
+    size_t printf(const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+    size_t print(const __FlashStringHelper * str)
+    {
+        return write(reinterpret_cast<const char *>(str));
+    }
+    size_t print(const String & str)
+    {
+        return write(str.c_str());
+    }
+    size_t print(const char * str)
+    {
+        return write(str);
+    }
+    size_t print(char c)
+    {
+        return write((uint8_t)c);
+    }
+    size_t print(unsigned char value, int base = DEC)
+    {
+        return print((unsigned long)value, base);
+    }
+    size_t print(int value, int base = DEC)
+    {
+        return print((long)value, base);
+    }
+    size_t print(unsigned int value, int base = DEC)
+    {
+        return print((unsigned long)value, base);
+    }
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+
+    template <typename T> size_t println(const T & value)
+    {
+        size_t n = print(value);
+        return n + println();
+    }
+    template <typename T> size_t println(const T & value, int format)
+    {
+        size_t n = print(value, format);
+        return n + println();
+    }
+    size_t println(void)
+    {
+        return write("\r\n");
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read()      = 0;
+    virtual int peek()      = 0;
+};
+
+// Written to stdout, reading returns nothing
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long baud)
+    {}
+    int available() override
+    {
+        return 0;
+    }
+    int read() override
+    {
+        return -1;
+    }
+    int peek() override
+    {
+        return -1;
+    }
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t * buffer, size_t size) override;
+    using Print::write;
+    void flush() override;
+    operator bool() const
+    {
+        return true;
+    }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,168 @@
+/* Stand-ins for the modules that need the radio, the flash or the broker
+ *
+ * The modules built in env:native call into lego_ble, lego_hal and lego_mqtt and read the settings of lego_debug.
+ * Here the hubs are reduced to the shared channel table of lego_group, so a test sees the result of a command
+ * through ble_get_motor_speed, and nothing is sent anywhere.
+ */
+#include <Arduino.h>
+#include "lego_conf.h"
+#include "lego_ble.h"
+#include "lego_group.h"
+#include "lego_hal.h"
+#include "lego_debug.h"
+#include "lego_syslog.h"
+
+static groupChannels_t hostChannels;
+static bool hostEstopRaised = false;
+
+/* ===== lego_ble ===== */
+
+void ble_setup(void)
+{
+    groupReset(&hostChannels);
+}
+
+void ble_loop(void)
+{}
+
+void ble_print_dashboard(Print * output)
+{}
+
+void ble_set_motor_speed(uint8_t channel, int8_t speed, commandStamp_t stamp)
+{
+    groupSetSpeed(&hostChannels, channel, speed);
+}
+
+void ble_sync_motor_speed(uint8_t channel, int8_t speed, commandStamp_t stamp)
+{
+    groupSyncSpeed(&hostChannels, channel, speed);
+}
+
+int8_t ble_get_motor_speed(uint8_t channel)
+{
+    return channel < LEGO_NUM_CHANNELS ? hostChannels.speed[channel] : 0;
+}
+
+channelMask_t ble_take_changed_channels(void)
+{
+    return groupTakeChanged(&hostChannels);
+}
+
+void ble_emergency_stop(commandStamp_t stamp)
+{
+    groupStopAll(&hostChannels, true);
+    hostEstopRaised = true;
+    statsCount(statsCounters.estops);
+}
+
+void ble_sync_emergency_stop(commandStamp_t stamp)
+{
+    groupStopAll(&hostChannels, false);
+    statsCount(statsCounters.estops);
+}
+
+bool ble_take_emergency_stop(void)
+{
+    bool raised     = hostEstopRaised;
+    hostEstopRaised = false;
+    return raised;
+}
+
+uint16_t ble_get_hubs_version(void)
+{
+    return 0;
+}
+
+size_t ble_get_hubs_json(char * buffer, size_t size)
+{
+    return snprintf(buffer, size, "[]");
+}
+
+size_t ble_get_sensors_json(uint8_t index, char * buffer, size_t size)
+{
+    return snprintf(buffer, size, "[]");
+}
+
+uint32_t ble_take_changed_sensors(void)
+{
+    return 0;
+}
+
+void ble_get_hub_state(uint8_t index, bleHubState_t * state)
+{
+    memset(state, 0, sizeof(*state));
+}
+
+void ble_start_scan(void)
+{}
+
+bool ble_set_conn_profile(uint8_t hubclass, const char * params)
+{
+    return hubclass < BLE_PROFILE_COUNT;
+}
+
+bool ble_set_hub_led(uint8_t index, uint8_t color)
+{
+    return false; // No hub connected
+}
+
+void ble_remote_button(int8_t index, uint8_t portNumber, uint8_t state, commandStamp_t stamp)
+{}
+
+void ble_replay_property(int8_t index, uint8_t hubProperty, uint8_t * pData)
+{}
+
+bool ble_set_hub_config(const char * address, uint8_t channel, bool invert, uint8_t trim)
+{
+    return channel < LEGO_NUM_CHANNELS;
+}
+
+/* ===== lego_hal ===== */
+
+void halRestart(void)
+{}
+
+uint8_t halGetHeapFragmentation(void)
+{
+    return 0;
+}
+
+size_t halGetMaxFreeBlock(void)
+{
+    return 0;
+}
+
+size_t halGetFreeHeap(void)
+{
+    return 0;
+}
+
+/* ===== lego_debug ===== */
+
+String debugHeader(void)
+{
+    return String("LEGO train controller on the host");
+}
+
+#if LEGO_USE_SYSLOG > 0
+char debugSyslogHost[32]    = "";
+uint16_t debugSyslogPort    = 514;
+uint8_t debugSyslogFacility = 0;
+uint8_t debugSyslogProtocol = 0;
+uint16_t debugSyslogRate    = SYSLOG_RATE;
+#endif
+
+/* ===== lego_mqtt ===== */
+
+#if LEGO_USE_MQTT > 0
+char mqttNodeName[16] = "node1";
+
+void mqtt_send_statusupdate(void)
+{}
+
+void mqtt_send_latency(void)
+{}
+
+void mqtt_inject_message(char * topic, byte * payload, unsigned int length)
+{}
+#endif
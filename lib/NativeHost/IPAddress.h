@@ -0,0 +1,25 @@
+/* IPv4 address of the Arduino core for the native unit tests, stored in network byte order like on the ESP32
+ */
+#ifndef NATIVE_HOST_IPADDRESS_H
+#define NATIVE_HOST_IPADDRESS_H
+
+#include "Arduino.h"
+
+class IPAddress {
+  public:
+    IPAddress(uint32_t address = 0) : address(address)
+    {}
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth);
+
+    operator uint32_t() const
+    {
+        return address;
+    }
+    bool fromString(const char * address);
+    String toString() const;
+
+  private:
+    uint32_t address;
+};
+
+#endif
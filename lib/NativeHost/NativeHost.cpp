@@ -0,0 +1,532 @@
+/* Arduino core, FreeRTOS, WiFi, lwIP DNS and mbedTLS SHA-256 subsets for the native unit tests
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "WiFi.h"
+#include "WiFiUdp.h"
+#include "lwip/dns.h"
+#include "mbedtls/sha256.h"
+
+HardwareSerial Serial;
+
+static uint64_t host_now_us(void)
+{
+    static uint64_t start = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    if(start == 0) start = us - 1; // Never 0, the modules use 0 for "not yet"
+    return us - start;
+}
+
+// Both wrap at 32 bits like on the ESP32
+unsigned long millis(void)
+{
+    return (uint32_t)(host_now_us() / 1000);
+}
+
+unsigned long micros(void)
+{
+    return (uint32_t)host_now_us();
+}
+
+void delay(uint32_t ms)
+{
+    struct timespec wait = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000};
+    nanosleep(&wait, NULL);
+}
+
+void yield(void)
+{
+    sched_yield();
+}
+
+long random(long howbig)
+{
+    return howbig > 0 ? rand() % howbig : 0;
+}
+
+long random(long howsmall, long howbig)
+{
+    return howsmall < howbig ? howsmall + random(howbig - howsmall) : howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+    srand(seed);
+}
+
+/* ===== String ===== */
+
+static std::string host_format_number(unsigned long value, bool negative, unsigned char base)
+{
+    char digits[66];
+    char * pos = digits + sizeof(digits) - 1;
+    *pos       = 0;
+    if(base < 2) base = 10;
+    do {
+        uint8_t digit = value % base;
+        *--pos        = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while(value != 0);
+    if(negative) *--pos = '-';
+    return pos;
+}
+
+String::String(int value, unsigned char base) : String((long)value, base)
+{}
+
+String::String(unsigned int value, unsigned char base) : String((unsigned long)value, base)
+{}
+
+String::String(long value, unsigned char base)
+    : buffer(base == 10 && value < 0 ? host_format_number(-(unsigned long)value, true, base)
+                                     : host_format_number((unsigned long)value, false, base))
+{}
+
+String::String(unsigned long value, unsigned char base) : buffer(host_format_number(value, false, base))
+{}
+
+String::String(double value, unsigned char decimals)
+{
+    char number[40];
+    snprintf(number, sizeof(number), "%.*f", decimals, value);
+    buffer = number;
+}
+
+void String::toUpperCase()
+{
+    for(size_t i = 0; i < buffer.length(); i++) buffer[i] = toupper(buffer[i]);
+}
+
+void String::toLowerCase()
+{
+    for(size_t i = 0; i < buffer.length(); i++) buffer[i] = tolower(buffer[i]);
+}
+
+/* ===== Print ===== */
+
+size_t Print::write(const uint8_t * buffer, size_t size)
+{
+    size_t n = 0;
+    while(size--) n += write(*buffer++);
+    return n;
+}
+
+size_t Print::printf(const char * format, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return len > 0 ? write((const uint8_t *)buffer, min((size_t)len, sizeof(buffer) - 1)) : 0;
+}
+
+size_t Print::print(long value, int base)
+{
+    return print(String(value, base));
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+    return print(String(value, base));
+}
+
+size_t Print::print(double value, int digits)
+{
+    return print(String(value, digits));
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t * buffer, size_t size)
+{
+    return fwrite(buffer, 1, size, stdout);
+}
+
+void HardwareSerial::flush()
+{
+    fflush(stdout);
+}
+
+/* ===== lwIP DNS ===== */
+
+struct hostDnsLookup_t
+{
+    char name[256];
+    dns_found_callback found;
+    void * arg;
+};
+
+static void * host_dns_lookup(void * param)
+{
+    hostDnsLookup_t * lookup = (hostDnsLookup_t *)param;
+    struct addrinfo hints;
+    struct addrinfo * result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(lookup->name, NULL, &hints, &result) == 0 && result != NULL) {
+        ip_addr_t address;
+        memset(&address, 0, sizeof(address));
+        address.u_addr.ip4.addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr;
+        lookup->found(lookup->name, &address, lookup->arg);
+    } else {
+        lookup->found(lookup->name, NULL, lookup->arg);
+    }
+
+    if(result != NULL) freeaddrinfo(result);
+    delete lookup;
+    return NULL;
+}
+
+err_t dns_gethostbyname(const char * hostname, ip_addr_t * addr, dns_found_callback found, void * callback_arg)
+{
+    if(hostname == NULL || strlen(hostname) >= sizeof(hostDnsLookup_t::name) || found == NULL) return ERR_ARG;
+
+    hostDnsLookup_t * lookup = new hostDnsLookup_t;
+    strcpy(lookup->name, hostname);
+    lookup->found = found;
+    lookup->arg   = callback_arg;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, host_dns_lookup, lookup) != 0) {
+        delete lookup;
+        return ERR_ARG;
+    }
+    pthread_detach(thread);
+    return ERR_INPROGRESS;
+}
+
+/* ===== FreeRTOS ===== */
+
+struct hostTask_t
+{
+    pthread_t thread;
+    TaskFunction_t code;
+    void * parameters;
+    pthread_mutex_t mutex;
+    pthread_cond_t notified;
+    uint32_t notifications;
+};
+
+struct hostSemaphore_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t given;
+    uint32_t count;
+};
+
+static thread_local hostTask_t * hostCurrentTask = NULL;
+
+static hostTask_t * host_task_new(void)
+{
+    hostTask_t * task = new hostTask_t();
+    pthread_mutex_init(&task->mutex, NULL);
+    pthread_cond_init(&task->notified, NULL);
+    return task;
+}
+
+static void * host_task_run(void * param)
+{
+    hostCurrentTask = (hostTask_t *)param;
+    hostCurrentTask->code(hostCurrentTask->parameters);
+    return NULL;
+}
+
+// Absolute CLOCK_REALTIME deadline for pthread_cond_timedwait
+static struct timespec host_deadline(TickType_t ticks)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticks / 1000;
+    deadline.tv_nsec += (long)(ticks % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+// Waits until the counter is non-zero, call with the mutex held. Returns false on a timeout.
+static bool host_wait(pthread_mutex_t * mutex, pthread_cond_t * cond, uint32_t * counter, TickType_t ticks)
+{
+    struct timespec deadline = host_deadline(ticks);
+    while(*counter == 0) {
+        if(ticks == portMAX_DELAY) {
+            pthread_cond_wait(cond, mutex);
+        } else if(pthread_cond_timedwait(cond, mutex, &deadline) == ETIMEDOUT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char * name, uint32_t stackDepth, void * parameters,
+                       UBaseType_t priority, TaskHandle_t * created)
+{
+    hostTask_t * task = host_task_new();
+    task->code        = code;
+    task->parameters  = parameters;
+    if(pthread_create(&task->thread, NULL, host_task_run, task) != 0) {
+        delete task;
+        return pdFALSE;
+    }
+    pthread_detach(task->thread);
+    if(created != NULL) *created = task;
+    return pdPASS;
+}
+
+// The test thread gets a handle on first use, like the loop task on the ESP32
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if(hostCurrentTask == NULL) hostCurrentTask = host_task_new();
+    return hostCurrentTask;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    delay(ticks);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    pthread_exit(NULL);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->mutex);
+    task->notifications++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->mutex);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait)
+{
+    hostTask_t * task = xTaskGetCurrentTaskHandle();
+
+    pthread_mutex_lock(&task->mutex);
+    host_wait(&task->mutex, &task->notified, &task->notifications, ticksToWait);
+    uint32_t count = task->notifications;
+    if(count > 0) task->notifications = clearCountOnExit ? 0 : count - 1;
+    pthread_mutex_unlock(&task->mutex);
+    return count;
+}
+
+static SemaphoreHandle_t host_semaphore_new(uint32_t count)
+{
+    hostSemaphore_t * semaphore = new hostSemaphore_t();
+    pthread_mutex_init(&semaphore->mutex, NULL);
+    pthread_cond_init(&semaphore->given, NULL);
+    semaphore->count = count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return host_semaphore_new(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return host_semaphore_new(0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+    pthread_mutex_lock(&semaphore->mutex);
+    bool taken = host_wait(&semaphore->mutex, &semaphore->given, &semaphore->count, ticksToWait);
+    if(taken) semaphore->count--;
+    pthread_mutex_unlock(&semaphore->mutex);
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    pthread_mutex_lock(&semaphore->mutex);
+    bool given = semaphore->count == 0;
+    semaphore->count = 1;
+    pthread_cond_signal(&semaphore->given);
+    pthread_mutex_unlock(&semaphore->mutex);
+    return given ? pdTRUE : pdFALSE;
+}
+
+/* ===== WiFi ===== */
+
+WiFiClass WiFi;
+
+IPAddress::IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth)
+{
+    uint8_t bytes[4] = {first, second, third, fourth};
+    memcpy(&address, bytes, sizeof(address));
+}
+
+bool IPAddress::fromString(const char * text)
+{
+    struct in_addr parsed;
+    if(inet_pton(AF_INET, text, &parsed) != 1) return false;
+    address = parsed.s_addr;
+    return true;
+}
+
+String IPAddress::toString() const
+{
+    struct in_addr printed;
+    printed.s_addr = address;
+    return String(inet_ntoa(printed));
+}
+
+// Blocks like the ESP32 version, only call it off the loop
+int WiFiClass::hostByName(const char * host, IPAddress & result)
+{
+    struct addrinfo hints;
+    struct addrinfo * found = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+
+    if(getaddrinfo(host, NULL, &hints, &found) != 0 || found == NULL) return 0;
+    result = IPAddress(((struct sockaddr_in *)found->ai_addr)->sin_addr.s_addr);
+    freeaddrinfo(found);
+    return 1;
+}
+
+WiFiUDP::~WiFiUDP()
+{
+    if(socket >= 0) close(socket);
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+    if(socket < 0) socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+    this->ip   = ip;
+    this->port = port;
+    packet.clear();
+    return socket >= 0;
+}
+
+int WiFiUDP::endPacket()
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(port);
+    address.sin_addr.s_addr = ip;
+
+    ssize_t sent = sendto(socket, packet.data(), packet.size(), 0, (struct sockaddr *)&address, sizeof(address));
+    return sent == (ssize_t)packet.size();
+}
+
+size_t WiFiUDP::write(uint8_t c)
+{
+    packet += (char)c;
+    return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t * buffer, size_t size)
+{
+    packet.append((const char *)buffer, size);
+    return size;
+}
+
+/* ===== mbedTLS SHA-256 ===== */
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t sha256_rotr(uint32_t value, uint8_t bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256_block(mbedtls_sha256_context * ctx, const uint8_t * block)
+{
+    uint32_t w[64], s[8];
+    for(uint8_t i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    for(uint8_t i = 16; i < 64; i++) {
+        uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i]        = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof(s));
+    for(uint8_t i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (sha256_rotr(s[4], 6) ^ sha256_rotr(s[4], 11) ^ sha256_rotr(s[4], 25)) +
+                      ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[i] + w[i];
+        uint32_t t2 = (sha256_rotr(s[0], 2) ^ sha256_rotr(s[0], 13) ^ sha256_rotr(s[0], 22)) +
+                      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for(uint8_t i = 0; i < 8; i++) ctx->state[i] += s[i];
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context * ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context * ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context * ctx, int is224)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    if(is224) return -1;
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->total = 0;
+    return 0;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context * ctx, const unsigned char * input, size_t length)
+{
+    while(length > 0) {
+        size_t used  = ctx->total % 64;
+        size_t chunk = min(length, 64 - used);
+        memcpy(ctx->buffer + used, input, chunk);
+        ctx->total += chunk;
+        input += chunk;
+        length -= chunk;
+        if(used + chunk == 64) sha256_block(ctx, ctx->buffer);
+    }
+    return 0;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context * ctx, unsigned char output[32])
+{
+    uint64_t bits   = ctx->total * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padding  = (ctx->total % 64 < 56 ? 56 : 120) - ctx->total % 64;
+    for(uint8_t i = 0; i < 8; i++) pad[padding + i] = bits >> (56 - i * 8);
+    mbedtls_sha256_update_ret(ctx, pad, padding + 8);
+
+    for(uint8_t i = 0; i < 32; i++) output[i] = ctx->state[i / 4] >> (24 - i % 4 * 8);
+    return 0;
+}
@@ -0,0 +1,20 @@
+/* WiFi of the Arduino core for the native unit tests, the host is always connected
+ */
+#ifndef NATIVE_HOST_WIFI_H
+#define NATIVE_HOST_WIFI_H
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+class WiFiClass {
+  public:
+    bool isConnected()
+    {
+        return true;
+    }
+    int hostByName(const char * host, IPAddress & result);
+};
+
+extern WiFiClass WiFi;
+
+#endif
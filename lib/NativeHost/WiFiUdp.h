@@ -0,0 +1,27 @@
+/* UDP client of the Arduino core for the native unit tests, a packet is collected and sent with one sendto
+ */
+#ifndef NATIVE_HOST_WIFIUDP_H
+#define NATIVE_HOST_WIFIUDP_H
+
+#include <string>
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+class WiFiUDP : public Print {
+  public:
+    ~WiFiUDP();
+    int beginPacket(IPAddress ip, uint16_t port);
+    int endPacket();
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t * buffer, size_t size) override;
+    using Print::write;
+
+  private:
+    int socket = -1;
+    IPAddress ip;
+    uint16_t port = 0;
+    std::string packet;
+};
+
+#endif
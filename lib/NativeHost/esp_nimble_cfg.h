@@ -0,0 +1 @@
+#include "nimconfig.h"
@@ -0,0 +1,50 @@
+/* FreeRTOS subset for the native unit tests, backed by pthreads
+ */
+#ifndef NATIVE_HOST_FREERTOS_H
+#define NATIVE_HOST_FREERTOS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFFUL
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) (ms)
+
+// Critical sections may nest like on the ESP32, so the mutex is recursive
+typedef struct
+{
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP}
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(&(mux)->mutex)
+
+// Tasks are detached threads, priorities and stack sizes are ignored
+typedef struct hostTask_t * TaskHandle_t;
+typedef void (*TaskFunction_t)(void * parameters);
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char * name, uint32_t stackDepth, void * parameters,
+                       UBaseType_t priority, TaskHandle_t * created);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task); // Only a task ending itself, task is NULL
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait);
+
+// Mutexes and binary semaphores are both counters, a mutex starts out given
+typedef struct hostSemaphore_t * SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+
+#endif
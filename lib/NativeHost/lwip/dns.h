@@ -0,0 +1,34 @@
+/* lwIP DNS client for the native unit tests
+ *
+ * The name is looked up on a thread of its own and the callback runs there, like lwIP calls it from the tcpip
+ * task, so a caller sees ERR_INPROGRESS and the answer arrives later. Only IPv4 addresses are returned.
+ */
+#ifndef NATIVE_HOST_LWIP_DNS_H
+#define NATIVE_HOST_LWIP_DNS_H
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+#define ERR_OK 0
+#define ERR_INPROGRESS -5
+#define ERR_ARG -16
+
+// Same layout as the dual stack ip_addr_t of the ESP32
+typedef struct
+{
+    uint32_t addr;
+} ip4_addr_t;
+typedef struct
+{
+    union {
+        ip4_addr_t ip4;
+    } u_addr;
+    uint8_t type;
+} ip_addr_t;
+#define ip_2_ip4(ipaddr) (&((ipaddr)->u_addr.ip4))
+
+typedef void (*dns_found_callback)(const char * name, const ip_addr_t * ipaddr, void * callback_arg);
+
+err_t dns_gethostbyname(const char * hostname, ip_addr_t * addr, dns_found_callback found, void * callback_arg);
+
+#endif
@@ -0,0 +1,15 @@
+/* lwIP socket API for the native unit tests, lwIP follows the BSD names so the host sockets stand in directly
+ */
+#ifndef NATIVE_HOST_LWIP_SOCKETS_H
+#define NATIVE_HOST_LWIP_SOCKETS_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#endif
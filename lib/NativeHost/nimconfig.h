@@ -0,0 +1,3 @@
+#ifndef CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 9 // Hub slots of the stand-in lego_ble
+#endif
@@ -1,7 +1,12 @@
 #include <Arduino.h>
+#include "lego_conf.h"
 #include "lego_ble.h"
+#include "lego_capture.h"
 #include "lego_debug.h"
+#include "lego_estop.h"
+#include "ArduinoLog.h"
 #include "Lpf2Hub.h"
+#include "lego_sensor.h"
 
 char knownDevices[][18] = {
     "90:84:2b:14:xx:xx", // Red Train Hub
@@ -13,8 +18,27 @@ char knownDevices[][18] = {
 };
 byte knownDeviceChannel[] = {2, 2, 4, 4, 0, 6}; // Links default hubs and remotes together
 Color channelColor[]      = {GREEN, BLUE, RED, PURPLE, YELLOW, CYAN, PINK, WHITE, ORANGE};
+static_assert(LEGO_NUM_CHANNELS <= sizeof(channelColor) / sizeof(channelColor[0]), "Every channel needs a color");
 
-#define MAX_BLE_DEVICES CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+// Link health sampling, the interval per hub grows with the number of connected hubs
+#define BLE_HEALTH_INTERVAL_PER_HUB 2000 // ms of sample interval added for every connected hub
+#define BLE_HEALTH_INTERVAL_MIN 5000     // ms, never sample a single hub faster than this
+#define BLE_HEALTH_RSSI_WARN -85         // dBm, average RSSI below this is a degrading link
+#define BLE_HEALTH_RTT_WARN 300          // ms, average round-trip time above this is a degrading link
+#define BLE_HEALTH_MISSED_WARN 2         // consecutive unanswered requests before flagging the link
+
+// Connection parameters per hub class, intervals in 1.25 ms units and supervision timeout in 10 ms units
+struct bleConnProfile_t
+{
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t latency; // Number of connection events the hub may skip when it has nothing to send
+    uint16_t timeout;
+};
+bleConnProfile_t bleConnProfile[BLE_PROFILE_COUNT] = {
+    {6, 12, 0, 200},  // Remote: 7.5-15 ms so button presses arrive immediately, 2 s timeout
+    {24, 48, 4, 400}, // Train hub: 30-60 ms, mostly idle between speed writes, 4 s timeout
+};
 
 struct hubData_t
 {
@@ -23,16 +47,52 @@ struct hubData_t
     char address[18] = "";
     uint8_t channel  = 0;
     SemaphoreHandle_t updateMutex;
-    int8_t motorSpeed = 0;
+    int8_t motorSpeed = 0; // Target speed of this hub, the channel speed after inversion and trim
     byte batteryLevel = 0;
     byte batteryType  = 0;
     bool isPressed    = false;
+    bool invert       = false; // Runs in the opposite direction of the channel, e.g. a reversed loco in a consist
+    uint8_t trim      = 100;   // Percentage of the channel speed, to match the speed of locos in a consist
+    commandStamp_t stamp;      // Ingress of the command that set motorSpeed, until it is written to the hub
     // bool isReady = false;
+
+    // Link health statistics
+    int8_t rssi                     = 0; // Last sampled RSSI in dBm
+    int8_t rssiAvg                  = 0; // Rolling average RSSI in dBm
+    int8_t rssiMin                  = 0; // Worst RSSI since connecting
+    uint16_t rttLast                = 0; // Round-trip time of the last RSSI request in ms
+    uint16_t rttAvg                 = 0; // Rolling average round-trip time in ms
+    uint16_t rttMax                 = 0; // Worst round-trip time since connecting
+    uint16_t healthSamples          = 0; // Number of answered RSSI requests since connecting
+    uint8_t healthMissed            = 0; // Consecutive RSSI requests without a response
+    unsigned long healthRequestTime = 0; // millis() of the pending RSSI request, 0 = none pending
+    bool isDegraded                 = false;
+
+    uint8_t connProfile    = BLE_PROFILE_HUB;
+    bool connParamsPending = false; // The hub task still needs to (re)apply the connection parameters
+    bool estopPending      = false; // Write zero even when the hub already heads for a standstill
+    uint8_t buttons[2]     = {0};   // Last state of the left and right remote buttons
+
+    sensorPort_t sensors[SENSOR_PORTS] = {}; // Devices on the hub ports and their latest readings
 };
 hubData_t device[MAX_BLE_DEVICES];
 
 // The global channel speed for each channel, replicated by the local hubs connected to that channel
-uint8_t channelSpeed[MAX_BLE_DEVICES];
+groupChannels_t bleChannels;
+uint16_t bleHubsVersion = 0; // Incremented when the set of connected hubs or their channels changes
+
+// Emergency stop, written by all hub tasks at once
+uint8_t bleEstopCombo = BLE_ESTOP_COMBO; // Remote buttons that raise it, saved by the configuration store
+SemaphoreHandle_t bleHubWake[MAX_BLE_DEVICES]; // Ends the delay of a hub task early, not a task notification
+estopFanout_t bleEstop;      // Hubs yet to write the last emergency stop, guarded by bleMembersMux
+bool bleEstopRaised = false; // Raised by a local source, to be replicated to the group
+
+uint32_t bleSensorsChanged = 0; // Bitmask of the hubs with new port devices or readings, to be published
+
+// Precomputed list of the connected train hubs following each channel
+uint8_t channelMembers[LEGO_NUM_CHANNELS][MAX_BLE_DEVICES];
+uint8_t channelMemberCount[LEGO_NUM_CHANNELS];
+portMUX_TYPE bleMembersMux = portMUX_INITIALIZER_UNLOCKED;
 
 SemaphoreHandle_t bleScanMutex;      // Single ScanToken to allow a task to scan for new devices
 unsigned long scan_end_time = 30000; // The millis until which to be scanning for new devices at startup
@@ -71,10 +131,165 @@ void ble_start_scan(void)
     scan_end_time = millis() + 30000; // Scan for 30 seconds after a device disconnected
 }
 
+void hubPropertyChangeCallback(void * hub, HubPropertyReference hubProperty, uint8_t * pData);
+void bleSwitchHubChannel(Lpf2Hub * hub);
+
+uint8_t ble_connected_count(void)
+{
+    uint8_t count = 0;
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        if(device[i].hub != NULL) count++;
+    }
+    return count;
+}
+
+// Spread the RSSI requests so the total request rate stays the same regardless of the number of hubs
+unsigned long ble_health_interval(void)
+{
+    unsigned long interval = (unsigned long)ble_connected_count() * BLE_HEALTH_INTERVAL_PER_HUB;
+    return max((unsigned long)BLE_HEALTH_INTERVAL_MIN, interval);
+}
+
+void ble_health_reset(int8_t index)
+{
+    if(index < 0 || index >= MAX_BLE_DEVICES) return;
+
+    device[index].rssi              = 0;
+    device[index].rssiAvg           = 0;
+    device[index].rssiMin           = 0;
+    device[index].rttLast           = 0;
+    device[index].rttAvg            = 0;
+    device[index].rttMax            = 0;
+    device[index].healthSamples     = 0;
+    device[index].healthMissed      = 0;
+    device[index].healthRequestTime = 0;
+    device[index].isDegraded        = false;
+}
+
+// Flag links that are getting worse, before they actually drop
+void ble_health_evaluate(int8_t index)
+{
+    hubData_t * data = &device[index];
+    bool degraded    = data->healthMissed >= BLE_HEALTH_MISSED_WARN ||
+                    (data->healthSamples > 0 &&
+                     (data->rssiAvg < BLE_HEALTH_RSSI_WARN || data->rttAvg > BLE_HEALTH_RTT_WARN));
+
+    if(degraded == data->isDegraded) return;
+    data->isDegraded = degraded;
+
+    if(degraded) {
+        Log.warning(F("BLE: Link %d (%s) degrading: RSSI %d dBm, RTT %u ms, missed %u"), index, data->address,
+                    data->rssiAvg, data->rttAvg, data->healthMissed);
+    } else {
+        Log.notice(F("BLE: Link %d (%s) recovered: RSSI %d dBm, RTT %u ms"), index, data->address, data->rssiAvg,
+                   data->rttAvg);
+    }
+}
+
+// Called from the hub task, requests a new RSSI sample and times the response
+void ble_health_request(int8_t index, Lpf2Hub * hub)
+{
+    if(index < 0 || index >= MAX_BLE_DEVICES) return;
+
+    if(device[index].healthRequestTime != 0) {
+        // The previous request was never answered
+        if(device[index].healthMissed < 255) device[index].healthMissed++;
+        ble_health_evaluate(index);
+    }
+
+    device[index].healthRequestTime = max(1UL, millis());
+    hub->requestHubPropertyUpdate(HubPropertyReference::RSSI, hubPropertyChangeCallback);
+}
+
+// Called from the property callback when an RSSI response arrives
+void ble_health_update(int8_t index, int8_t rssi)
+{
+    if(index < 0 || index >= MAX_BLE_DEVICES) return;
+    hubData_t * data = &device[index];
+
+    if(data->healthRequestTime != 0) {
+        unsigned long rtt = millis() - data->healthRequestTime;
+        data->rttLast     = rtt > 0xFFFF ? 0xFFFF : rtt;
+        data->rttAvg      = data->healthSamples == 0 ? data->rttLast : (data->rttAvg * 3 + data->rttLast) / 4;
+        if(data->rttLast > data->rttMax) data->rttMax = data->rttLast;
+        data->healthRequestTime = 0;
+    }
+
+    data->rssi    = rssi;
+    data->rssiAvg = data->healthSamples == 0 ? rssi : (data->rssiAvg * 3 + rssi) / 4;
+    if(data->healthSamples == 0 || rssi < data->rssiMin) data->rssiMin = rssi;
+
+    if(data->healthSamples < 0xFFFF) data->healthSamples++;
+    data->healthMissed = 0;
+    ble_health_evaluate(index);
+}
+
+// Are the buttons held on this remote the emergency stop combination?
+static bool ble_estop_combo(uint8_t index)
+{
+    uint8_t left  = device[index].buttons[(byte)PoweredUpRemoteHubPort::LEFT];
+    uint8_t right = device[index].buttons[(byte)PoweredUpRemoteHubPort::RIGHT];
+
+    switch(bleEstopCombo) {
+        case BLE_ESTOP_BOTH_STOP:
+            return left == (uint8_t)ButtonState::STOP && right == (uint8_t)ButtonState::STOP;
+        case BLE_ESTOP_BOTH_DOWN:
+            return left == (uint8_t)ButtonState::DOWN && right == (uint8_t)ButtonState::DOWN;
+        default:
+            return false;
+    }
+}
+
+// Apply a remote button state, from the remote callback or from a replayed capture
+void ble_remote_button(int8_t index, uint8_t portNumber, uint8_t state, commandStamp_t stamp)
+{
+    if(index < 0 || index >= MAX_BLE_DEVICES) return;
+    ButtonState buttonState = (ButtonState)state;
+
+    // Serial.print("HubChannel: ");
+    // Serial.println(device[index].channel, HEX);
+    uint8_t channel    = device[index].channel;
+    int8_t local_speed = ble_get_motor_speed(channel);
+    int8_t new_speed   = local_speed;
+
+    // Serial.print("Buttonstate: ");
+    // Serial.println((byte)buttonState, HEX);
+
+    stamp.remote = index; // Each remote is a control link of its own for the supervisor
+    if(portNumber < 2) device[index].buttons[portNumber] = state;
+    if(ble_estop_combo(index)) return ble_emergency_stop(stamp);
+
+    // Blink on key press
+    Lpf2Hub * myRemote = device[index].hub;
+    if(myRemote != NULL) {
+        myRemote->setLedColor(buttonState == ButtonState::RELEASED ? channelColor[channel] : Color::BLACK);
+    }
+
+    if(buttonState == ButtonState::UP) {
+        // Serial.println("Up");
+        new_speed = min(100, local_speed + 10);
+    } else if(buttonState == ButtonState::DOWN) {
+        // Serial.println("Down");
+        new_speed = max(-100, local_speed - 10);
+    } else if(buttonState == ButtonState::STOP) {
+        // Serial.println("Stop");
+        new_speed = 0;
+    }
+
+    if(local_speed != new_speed) {
+        ble_set_motor_speed(channel, new_speed, stamp);
+        local_speed = new_speed;
+    }
+
+    // Serial.print("Current speed:");
+    // Serial.println(local_speed, DEC);
+}
+
 // callback function to handle updates of remote buttons
 void remoteCallback(void * hub, byte portNumber, DeviceType deviceType, uint8_t * pData)
 {
-    Lpf2Hub * myRemote = (Lpf2Hub *)hub;
+    commandStamp_t stamp = statsStamp(STATS_SOURCE_REMOTE);
+    Lpf2Hub * myRemote   = (Lpf2Hub *)hub;
     // Serial.print("HubAddress: ");
     // Serial.println(myRemote->getHubAddress().toString().c_str());
     // Serial.print("HubName: ");
@@ -86,50 +301,186 @@ void remoteCallback(void * hub, byte portNumber, DeviceType deviceType, uint8_t
         int8_t index = findHubIndex(myRemote->getHubAddress().toString().c_str());
         // Serial.print("HubIndex: ");
         // Serial.println(index, HEX);
-        // Serial.print("HubChannel: ");
-        // Serial.println(device[index].channel, HEX);
-        uint8_t channel    = device[index].channel;
-        int8_t local_speed = ble_get_motor_speed(channel);
-        int8_t new_speed   = local_speed;
 
         ButtonState buttonState = myRemote->parseRemoteButton(pData);
-        // Serial.print("Buttonstate: ");
-        // Serial.println((byte)buttonState, HEX);
+        captureRemoteButton(index, portNumber, (uint8_t)buttonState);
+        ble_remote_button(index, portNumber, (uint8_t)buttonState, stamp);
+    }
+}
 
-        // Blink on key press
-        myRemote->setLedColor(buttonState == ButtonState::RELEASED ? channelColor[channel] : Color::BLACK);
+// Port value notifications of the hub sensors, called for every reading so it only decodes in place
+void sensorCallback(void * hub, byte portNumber, DeviceType deviceType, uint8_t * pData)
+{
+    if(portNumber >= SENSOR_PORTS) return;
 
-        if(buttonState == ButtonState::UP) {
-            // Serial.println("Up");
-            new_speed = min(100, local_speed + 10);
-        } else if(buttonState == ButtonState::DOWN) {
-            // Serial.println("Down");
-            new_speed = max(-100, local_speed - 10);
-        } else if(buttonState == ButtonState::STOP) {
-            // Serial.println("Stop");
-            new_speed = 0;
-        }
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        if(device[i].hub != hub) continue; // Match the pointer, the address string would allocate
+
+        portENTER_CRITICAL(&bleMembersMux);
+        bool changed = sensorDecode(&device[i].sensors[portNumber], pData);
+        portEXIT_CRITICAL(&bleMembersMux);
+
+        if(changed) __atomic_fetch_or(&bleSensorsChanged, 1UL << i, __ATOMIC_RELAXED);
+        return;
+    }
+}
 
-        if(local_speed != new_speed) {
-            ble_set_motor_speed(channel, new_speed);
-            local_speed = new_speed;
+// Pick up devices plugged into or pulled from the hub ports and start the notifications of the sensors
+static void ble_detect_ports(uint8_t index, Lpf2Hub * hub)
+{
+    for(uint8_t port = 0; port < SENSOR_PORTS; port++) {
+        uint8_t type = hub->getDeviceTypeForPortNumber(port);
+        if(type == 255) type = 0; // Nothing attached
+        if(type == device[index].sensors[port].deviceType) continue;
+
+        portENTER_CRITICAL(&bleMembersMux);
+        sensorAttach(&device[index].sensors[port], type);
+        portEXIT_CRITICAL(&bleMembersMux);
+        __atomic_fetch_or(&bleSensorsChanged, 1UL << index, __ATOMIC_RELAXED);
+
+        Log.notice(F("BLE: Hub %u port %u device type %u"), index, port, type);
+        uint8_t kind = device[index].sensors[port].kind;
+        if(kind != SENSOR_KIND_NONE && kind != SENSOR_KIND_MOTOR) hub->activatePortDevice(port, sensorCallback);
+    }
+}
+
+static void ble_reset_ports(uint8_t index)
+{
+    portENTER_CRITICAL(&bleMembersMux);
+    for(uint8_t port = 0; port < SENSOR_PORTS; port++) sensorAttach(&device[index].sensors[port], 0);
+    portEXIT_CRITICAL(&bleMembersMux);
+    __atomic_fetch_or(&bleSensorsChanged, 1UL << index, __ATOMIC_RELAXED);
+}
+
+// Port A carries the train motor, a motor on another port runs along with it
+static void ble_write_speed(uint8_t index, Lpf2Hub * hub, int8_t speed)
+{
+    hub->setBasicMotorSpeed((byte)PoweredUpHubPort::A, speed);
+    for(uint8_t port = 1; port < SENSOR_PORTS; port++) {
+        if(sensorIsMotor(&device[index].sensors[port])) hub->setBasicMotorSpeed(port, speed);
+    }
+}
+
+static inline int8_t ble_member_speed(uint8_t index, int8_t speed)
+{
+    int16_t scaled = (int16_t)speed * device[index].trim / 100;
+    scaled         = constrain(scaled, -100, 100);
+    return device[index].invert ? -scaled : scaled;
+}
+
+// Report that a command from an MQTT envelope has reached the hub, never called inside bleMembersMux
+static void ble_ack_command(uint32_t seq, uint8_t index)
+{
+#if LEGO_USE_MQTT > 0
+    mqtt_ack_command(seq, index);
+#endif
+}
+
+// Acks collected inside bleMembersMux and sent after it is released
+struct bleAckList_t
+{
+    uint8_t count = 0;
+    uint32_t seq[MAX_BLE_DEVICES];
+    uint8_t hub[MAX_BLE_DEVICES];
+};
+
+static inline void ble_ack_later(bleAckList_t & acks, uint32_t seq, uint8_t index)
+{
+    if(seq == 0 || acks.count >= MAX_BLE_DEVICES) return;
+    acks.seq[acks.count]   = seq;
+    acks.hub[acks.count++] = index;
+}
+
+static void ble_ack_send(const bleAckList_t & acks)
+{
+    for(uint8_t i = 0; i < acks.count; i++) ble_ack_command(acks.seq[i], acks.hub[i]);
+}
+
+// Fan a channel speed out to all hubs of the channel in one pass
+static void ble_fanout_speed(uint8_t channel, const commandStamp_t & stamp)
+{
+    bleAckList_t acks;
+
+#if LEGO_USE_COEX > 0
+    coexNoteCommand(); // Scans wait for a pause in the command traffic
+#endif
+#if LEGO_USE_SUPERVISOR > 0
+    supervisorNoteCommand(channel, bleChannels.speed[channel], stamp); // The sender now drives this channel
+#endif
+    portENTER_CRITICAL(&bleMembersMux);
+    bool empty = channelMemberCount[channel] == 0;
+    for(uint8_t i = 0; i < channelMemberCount[channel]; i++) {
+        uint8_t index = channelMembers[channel][i];
+        int8_t speed  = ble_member_speed(index, bleChannels.speed[channel]);
+        if(device[index].motorSpeed == speed) {
+            ble_ack_later(acks, stamp.seq, index); // Already heading for this speed
+            continue;
         }
 
-        // Serial.print("Current speed:");
-        // Serial.println(local_speed, DEC);
+        ble_ack_later(acks, device[index].stamp.seq, index); // Superseded before the hub task picked it up
+        device[index].stamp      = stamp;
+        device[index].motorSpeed = speed;
+    }
+    portEXIT_CRITICAL(&bleMembersMux);
+
+#if LEGO_USE_MQTT > 0
+    if(empty && stamp.seq != 0) ble_ack_command(stamp.seq, MQTT_ACK_NO_HUB); // Nobody to wait for
+#endif
+    ble_ack_send(acks);
+}
+
+// Rebuild the channel member lists after a hub connected, disconnected or changed channel
+void ble_update_members(void)
+{
+    portENTER_CRITICAL(&bleMembersMux);
+    memset(channelMemberCount, 0, sizeof(channelMemberCount));
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        uint8_t channel = device[i].channel;
+        if(device[i].hub == NULL || device[i].connProfile == BLE_PROFILE_REMOTE || channel >= LEGO_NUM_CHANNELS)
+            continue;
+
+        channelMembers[channel][channelMemberCount[channel]++] = i;
+        device[i].motorSpeed = ble_member_speed(i, bleChannels.speed[channel]);
     }
+    portEXIT_CRITICAL(&bleMembersMux);
+
+    bleHubsVersion++;
+}
+
+// Configure a hub slot by address, also before the hub is connected
+bool ble_set_hub_config(const char * address, uint8_t channel, bool invert, uint8_t trim)
+{
+    int8_t index = findHubIndex(address);
+    if(index < 0 || channel >= LEGO_NUM_CHANNELS || trim > 200) return false;
+
+    device[index].channel = channel;
+    device[index].invert  = invert;
+    device[index].trim    = trim;
+    if(device[index].hub != NULL) device[index].hub->setLedColor(channelColor[channel]);
+
+    ble_update_members();
+    return true;
+}
+
+bool ble_set_hub_led(uint8_t index, uint8_t color)
+{
+    if(index >= MAX_BLE_DEVICES || color >= Color::NUM_COLORS || device[index].hub == NULL) return false;
+
+    device[index].hub->setLedColor((Color)color);
+    return true;
 }
 
 // Change Channel+Color on HubButton Presses
 void bleSwitchHubChannel(Lpf2Hub * hub)
 {
-    byte index = findHubIndex(hub->getHubAddress().toString().c_str());
+    int8_t index = findHubIndex(hub->getHubAddress().toString().c_str());
     if(index >= 0) {
         device[index].channel++;
-        if(device[index].channel >= MAX_BLE_DEVICES) {
+        if(device[index].channel >= LEGO_NUM_CHANNELS) {
             device[index].channel = 0;
         }
         hub->setLedColor(channelColor[device[index].channel]);
+        ble_update_members();
     }
 }
 
@@ -148,6 +499,7 @@ void hubPropertyChangeCallback(void * hub, HubPropertyReference hubProperty, uin
     // Serial.println(index, HEX);
     // Serial.print("HubChannel: ");
     // Serial.println(device[index].channel, HEX);
+    captureHubProperty(index, (uint8_t)hubProperty, pData);
 
     if(hubProperty == HubPropertyReference::BATTERY_VOLTAGE) {
         device[index].batteryLevel = myHub->parseBatteryLevel(pData);
@@ -192,6 +544,7 @@ void hubPropertyChangeCallback(void * hub, HubPropertyReference hubProperty, uin
     if(hubProperty == HubPropertyReference::RSSI) {
         // Serial.print("RSSI: ");
         // Serial.println(myHub->parseRssi(pData), DEC);
+        ble_health_update(index, myHub->parseRssi(pData));
         return;
     }
 
@@ -210,6 +563,73 @@ void hubPropertyChangeCallback(void * hub, HubPropertyReference hubProperty, uin
     }
 }
 
+// Apply a captured hub property message, payload values start at byte 5 of the hub property message
+void ble_replay_property(int8_t index, uint8_t hubProperty, uint8_t * pData)
+{
+    if(index < 0 || index >= MAX_BLE_DEVICES) return;
+
+    switch((HubPropertyReference)hubProperty) {
+        case HubPropertyReference::BATTERY_VOLTAGE:
+            device[index].batteryLevel = pData[5];
+            break;
+        case HubPropertyReference::RSSI:
+            ble_health_update(index, (int8_t)pData[5]);
+            break;
+        case HubPropertyReference::BUTTON:
+            if((ButtonState)pData[5] == ButtonState::PRESSED && device[index].hub != NULL) {
+                bleSwitchHubChannel(device[index].hub);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Called from the hub task after connecting or when the profile of its hub class has changed
+void ble_apply_conn_profile(int8_t index, Lpf2Hub * hub)
+{
+    if(index < 0 || index >= MAX_BLE_DEVICES) return;
+    device[index].connParamsPending = false;
+
+    NimBLEClient * client = NimBLEDevice::getClientByPeerAddress(hub->getHubAddress());
+    if(client == NULL) return;
+
+    bleConnProfile_t * profile = &bleConnProfile[device[index].connProfile];
+    client->updateConnParams(profile->minInterval, profile->maxInterval, profile->latency, profile->timeout);
+    Log.notice(F("BLE: Link %d requested interval %u-%u, latency %u, timeout %u"), index, profile->minInterval,
+               profile->maxInterval, profile->latency, profile->timeout);
+}
+
+// Payload format: "minInterval,maxInterval,latency,timeout" in BLE units
+bool ble_set_conn_profile(uint8_t hubclass, const char * params)
+{
+    if(hubclass >= BLE_PROFILE_COUNT) return false;
+
+    unsigned int minInterval, maxInterval, latency, timeout;
+    if(sscanf(params, "%u,%u,%u,%u", &minInterval, &maxInterval, &latency, &timeout) != 4) {
+        Log.warning(F("BLE: Invalid connection parameters %s"), params);
+        return false;
+    }
+
+    // Limits from the Bluetooth Core specification, the timeout must cover at least two effective intervals
+    if(minInterval < 6 || maxInterval > 3200 || minInterval > maxInterval || latency > 499 || timeout < 10 ||
+       timeout > 3200 || timeout * 4 <= (1 + latency) * maxInterval) {
+        Log.warning(F("BLE: Connection parameters out of range %s"), params);
+        return false;
+    }
+
+    bleConnProfile[hubclass].minInterval = minInterval;
+    bleConnProfile[hubclass].maxInterval = maxInterval;
+    bleConnProfile[hubclass].latency     = latency;
+    bleConnProfile[hubclass].timeout     = timeout;
+
+    // Let the hub tasks renegotiate their live connections
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        if(device[i].hub != NULL && device[i].connProfile == hubclass) device[i].connParamsPending = true;
+    }
+    return true;
+}
+
 void bleRequestHubDetails(Lpf2Hub * hub)
 {
     hub->requestHubPropertyUpdate(HubPropertyReference::RSSI, hubPropertyChangeCallback);
@@ -217,17 +637,155 @@ void bleRequestHubDetails(Lpf2Hub * hub)
     hub->requestHubPropertyUpdate(HubPropertyReference::HW_VERSION, hubPropertyChangeCallback);
 }
 
-void ble_set_motor_speed(uint8_t channel, int8_t speed)
+// Speed change from a local source, replicated to the other controllers in the group
+void ble_set_motor_speed(uint8_t channel, int8_t speed, commandStamp_t stamp)
+{
+    if(groupSetSpeed(&bleChannels, channel, speed)) ble_fanout_speed(channel, stamp);
+}
+
+// Speed change received from another controller in the group, not replicated again
+void ble_sync_motor_speed(uint8_t channel, int8_t speed, commandStamp_t stamp)
+{
+    if(groupSyncSpeed(&bleChannels, channel, speed)) ble_fanout_speed(channel, stamp);
+}
+
+// Returns the channels changed since the previous call
+channelMask_t ble_take_changed_channels(void)
+{
+    return groupTakeChanged(&bleChannels);
+}
+
+// Zero every channel and have every train hub write it right away, past the ramps and the unchanged-speed shortcut
+static void ble_halt_all(const commandStamp_t & stamp, bool replicate)
+{
+    uint32_t waiting = 0;
+    bleAckList_t acks;
+
+    portENTER_CRITICAL(&bleMembersMux);
+    groupStopAll(&bleChannels, replicate);
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        if(device[i].hub == NULL || device[i].connProfile == BLE_PROFILE_REMOTE) continue;
+        ble_ack_later(acks, device[i].stamp.seq, i);
+        device[i].motorSpeed   = 0;
+        device[i].stamp        = stamp;
+        device[i].estopPending = true;
+        waiting |= 1UL << i;
+    }
+    estopRaise(&bleEstop, waiting, micros());
+    portEXIT_CRITICAL(&bleMembersMux);
+    ble_ack_send(acks);
+
+    // Wake the hub tasks instead of waiting for the end of their delay, only those with a hub to write to
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        if(waiting & (1UL << i)) xSemaphoreGive(bleHubWake[i]);
+    }
+
+#if LEGO_USE_SUPERVISOR > 0
+    for(uint8_t channel = 0; channel < LEGO_NUM_CHANNELS; channel++) supervisorNoteCommand(channel, 0, stamp);
+#endif
+    statsCount(statsCounters.estops);
+    Log.warning(F("BLE: Emergency stop for %u hubs"), __builtin_popcount(waiting));
+}
+
+// The hub wrote the emergency stop, or lost its connection which stops the motor as well
+static void ble_estop_done(uint8_t index, bool written)
+{
+    uint32_t now   = micros();
+    uint32_t worst = 0;
+
+    portENTER_CRITICAL(&bleMembersMux);
+    bool last = estopDone(&bleEstop, index, written, now, &worst);
+    if(!written) device[index].estopPending = false;
+    portEXIT_CRITICAL(&bleMembersMux);
+    if(!last) return;
+
+    statsCounters.estopLastLatency = worst;
+    if(worst > statsCounters.estopMaxLatency) statsCounters.estopMaxLatency = worst;
+    Log.notice(F("BLE: Emergency stop written to all hubs in %u us"), worst);
+}
+
+// Emergency stop from a local source, replicated to the other controllers in the group
+void ble_emergency_stop(commandStamp_t stamp)
+{
+    ble_halt_all(stamp, true);
+    __atomic_store_n(&bleEstopRaised, true, __ATOMIC_RELAXED);
+}
+
+// Emergency stop raised by another controller in the group, not replicated again
+void ble_sync_emergency_stop(commandStamp_t stamp)
+{
+    ble_halt_all(stamp, false);
+}
+
+// Returns whether a local emergency stop was raised since the previous call
+bool ble_take_emergency_stop(void)
+{
+    return __atomic_exchange_n(&bleEstopRaised, false, __ATOMIC_RELAXED);
+}
+
+uint16_t ble_get_hubs_version(void)
+{
+    return bleHubsVersion;
+}
+
+// JSON array of the hubs connected to this controller
+size_t ble_get_hubs_json(char * buffer, size_t size)
 {
-    if(channel < MAX_BLE_DEVICES) {
-        channelSpeed[channel] = speed;
+    size_t len = snprintf_P(buffer, size, PSTR("["));
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES && len < size; i++) {
+        if(device[i].hub == NULL) continue;
+        len += snprintf_P(buffer + len, size - len,
+                          PSTR("%s{\"addr\":\"%s\",\"ch\":%u,\"remote\":%s,\"invert\":%s,\"trim\":%u}"),
+                          len > 1 ? "," : "", device[i].address, device[i].channel,
+                          device[i].connProfile == BLE_PROFILE_REMOTE ? "true" : "false",
+                          device[i].invert ? "true" : "false", device[i].trim);
     }
+    if(len < size) len += snprintf_P(buffer + len, size - len, PSTR("]"));
+    return len < size ? len : size - 1;
+}
+
+// JSON object with the port devices of a hub and their readings
+size_t ble_get_sensors_json(uint8_t index, char * buffer, size_t size)
+{
+    sensorPort_t ports[SENSOR_PORTS];
+    char json[SENSOR_PORTS * 48 + 3];
+
+    if(index >= MAX_BLE_DEVICES) return 0;
+    portENTER_CRITICAL(&bleMembersMux);
+    memcpy(ports, device[index].sensors, sizeof(ports));
+    portEXIT_CRITICAL(&bleMembersMux);
+
+    sensorGetJson(ports, SENSOR_PORTS, json, sizeof(json));
+    size_t len = snprintf_P(buffer, size, PSTR("{\"addr\":\"%s\",\"ch\":%u,\"ports\":%s}"), device[index].address,
+                            device[index].channel, json);
+    return len < size ? len : size - 1;
+}
+
+// Returns the hubs with new port devices or readings since the previous call
+uint32_t ble_take_changed_sensors(void)
+{
+    return __atomic_exchange_n(&bleSensorsChanged, 0, __ATOMIC_RELAXED);
+}
+
+void ble_get_hub_state(uint8_t index, bleHubState_t * state)
+{
+    memset(state, 0, sizeof(bleHubState_t));
+    if(index >= MAX_BLE_DEVICES || device[index].hub == NULL) return;
+
+    state->connected = true;
+    state->remote    = device[index].connProfile == BLE_PROFILE_REMOTE;
+    state->degraded  = device[index].isDegraded;
+    state->channel   = device[index].channel;
+    state->speed     = state->remote ? ble_get_motor_speed(device[index].channel) : device[index].motorSpeed;
+    state->battery   = device[index].batteryLevel;
+    state->rssi      = device[index].rssiAvg;
+    state->rtt       = device[index].rttAvg;
 }
 
 int8_t ble_get_motor_speed(uint8_t channel)
 {
-    if(channel < MAX_BLE_DEVICES) {
-        return channelSpeed[channel];
+    if(channel < LEGO_NUM_CHANNELS) {
+        return bleChannels.speed[channel];
     } else {
         return 0;
     }
@@ -235,62 +793,77 @@ int8_t ble_get_motor_speed(uint8_t channel)
 
 void ble_ready_wait()
 {
+#if LEGO_USE_SUPERVISOR > 0
+    supervisorWatchTask(); // A connect or disconnect that never finishes resets the controller
+#endif
     do {
         // Wait for active connect or disconnect events to finnish up
     } while(ble_gap_conn_active() || ble_gap_disc_active());
+#if LEGO_USE_SUPERVISOR > 0
+    supervisorReleaseTask();
+#endif
 }
 
-void ble_Serial_output(void * parameter)
+// Connection table with the cursor homed, refreshed in place on an ANSI terminal
+void ble_print_dashboard(Print * output)
 {
     char buffer[256];
-    while(1) {
-        Serial.print(TERM_COLOR_GRAY
-                     "\e[?25l\e[0;0fTsk#  Speed  Name                Address             Battery\e[0K\n");
-        Serial.print(TERM_COLOR_GRAY "----  -----  ------------------  ------------------  -------\e[0K\n");
-        for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
-
-            switch(device[i].channel) {
-                case 0:
-                    Serial.print(TERM_COLOR_GREEN);
-                    break;
-                case 1:
-                    Serial.print(TERM_COLOR_BLUE);
-                    break;
-                case 2:
-                    Serial.print(TERM_COLOR_RED);
-                    break;
-                case 3:
-                    Serial.print(TERM_COLOR_PURPLE);
-                    break;
-                case 4:
-                    Serial.print(TERM_COLOR_YELLOW);
-                    break;
-                case 5:
-                    Serial.print(TERM_COLOR_CYAN);
-                    break;
-                case 6:
-                    Serial.print(TERM_COLOR_MAGENTA);
-                    break;
-                case 7:
-                    Serial.print(TERM_COLOR_WHITE);
-                    break;
-                case 8:
-                    Serial.print(TERM_COLOR_ORANGE);
-                    break;
-                default:
-                    Serial.print(TERM_COLOR_GRAY);
-            }
+    output->print(TERM_COLOR_GRAY
+                  "\e[?25l\e[0;0fTsk#  Speed  Name                Address             Battery  RSSI  RTT\e[0K\n");
+    output->print(TERM_COLOR_GRAY
+                  "----  -----  ------------------  ------------------  -------  ----  -----\e[0K\n");
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
 
-            if(device[i].hub != NULL) {
-                snprintf(buffer, sizeof(buffer), "%2d. %6d    %-19s %-19s %3d %%\e[0K\n", i,
-                         ble_get_motor_speed(device[i].channel), device[i].hub->getHubName().c_str(), device[i].address,
-                         device[i].batteryLevel);
-            } else {
-                snprintf(buffer, sizeof(buffer), TERM_COLOR_GRAY "%2d.\e[0K\n", i);
-            }
-            Serial.print(buffer);
+        switch(device[i].channel) {
+            case 0:
+                output->print(TERM_COLOR_GREEN);
+                break;
+            case 1:
+                output->print(TERM_COLOR_BLUE);
+                break;
+            case 2:
+                output->print(TERM_COLOR_RED);
+                break;
+            case 3:
+                output->print(TERM_COLOR_PURPLE);
+                break;
+            case 4:
+                output->print(TERM_COLOR_YELLOW);
+                break;
+            case 5:
+                output->print(TERM_COLOR_CYAN);
+                break;
+            case 6:
+                output->print(TERM_COLOR_MAGENTA);
+                break;
+            case 7:
+                output->print(TERM_COLOR_WHITE);
+                break;
+            case 8:
+                output->print(TERM_COLOR_ORANGE);
+                break;
+            default:
+                output->print(TERM_COLOR_GRAY);
         }
-        Serial.print(TERM_COLOR_RESET "\e[0K\n\e[?25l");
+
+        if(device[i].hub != NULL) {
+            snprintf(buffer, sizeof(buffer), "%2d. %6d    %-19s %-19s %3d %%   %4d %4u%s\e[0K\n", i,
+                     device[i].connProfile == BLE_PROFILE_REMOTE ? ble_get_motor_speed(device[i].channel)
+                                                                 : device[i].motorSpeed,
+                     device[i].hub->getHubName().c_str(), device[i].address, device[i].batteryLevel,
+                     device[i].rssiAvg, device[i].rttAvg, device[i].isDegraded ? "!" : "");
+        } else {
+            snprintf(buffer, sizeof(buffer), TERM_COLOR_GRAY "%2d.\e[0K\n", i);
+        }
+        output->print(buffer);
+    }
+    output->print(TERM_COLOR_RESET "\e[0K\n\e[?25l");
+}
+
+void ble_Serial_output(void * parameter)
+{
+    while(1) {
+        ble_print_dashboard(&Serial);
         delay(1000);
     }
 }
@@ -306,6 +879,8 @@ void ble_hub_task(void * parameter)
     int new_speed              = 0;
     bool isInitialized         = false;
     unsigned long lastlooptime = 0;
+    unsigned long lasthealth   = 0;
+    unsigned long lastdetect   = 0;
     int8_t index               = -1;
     bool hasToken              = false; // Is this task allowed to use the global BLE scan resource?
                                         // Only one task can be scanning at the same time
@@ -318,6 +893,14 @@ void ble_hub_task(void * parameter)
                     // A disconnect just happened, reset the dangling initialization state and start scanning
                     isInitialized = false;
                     if(index >= 0) device[index].hub = NULL;
+                    if(index >= 0) ble_estop_done(index, false);
+                    if(index >= 0) ble_reset_ports(index);
+#if LEGO_USE_SUPERVISOR > 0
+                    supervisorReleaseTask();
+                    if(index >= 0) safetyHubIdle(index);
+#endif
+                    ble_health_reset(index);
+                    ble_update_members();
                     ble_start_scan(); // Extend scan_end_time
                 }                     // isInitialized
 
@@ -351,8 +934,13 @@ void ble_hub_task(void * parameter)
                     Serial.print(tasknr);
                     Serial.print("scan ");
                     // myHub.init(address[tasknr], 1);              // BLE scan
+#if LEGO_USE_COEX > 0
+                    coexWaitForScan(); // Sets the scan window for the current mode and load
+#endif
+                    unsigned long scanStart = millis();
                     myHub.init(20); // BLE scan for any device
                     ble_ready_wait();
+                    statsCount(statsCounters.bleScanTime, millis() - scanStart);
 
                     Serial.print(tasknr);
                     Serial.print("scan=done ");
@@ -409,6 +997,14 @@ void ble_hub_task(void * parameter)
                 byte waitTime     = 100;
                 index             = findHubIndex(myHub.getHubAddress().toString().c_str());
                 device[index].hub = &myHub;
+                ble_health_reset(index);
+                lasthealth = millis();
+
+                device[index].connProfile =
+                    myHub.getHubType() == HubType::POWERED_UP_REMOTE ? BLE_PROFILE_REMOTE : BLE_PROFILE_HUB;
+                device[index].connParamsPending = true; // Applied once the initialization messages are out
+                ble_update_members();
+                if(device[index].connProfile == BLE_PROFILE_HUB) statsBootMark(STATS_BOOT_FIRST_HUB);
 
                 myHub.setLedColor(Color::BLACK);
                 delay(waitTime);
@@ -447,27 +1043,57 @@ void ble_hub_task(void * parameter)
                 myHub.setLedColor(channelColor[device[index].channel]);
                 delay(waitTime);
 
-                Serial.print("Port A: Device Type ");
-                Serial.println(myHub.getDeviceTypeForPortNumber((byte)PoweredUpHubPort::A));
+                if(device[index].connProfile == BLE_PROFILE_HUB) ble_detect_ports(index, &myHub);
+                lastdetect = millis();
 
                 xSemaphoreGive(bleScanMutex); // Release scan token
                 hasToken = false;
+#if LEGO_USE_SUPERVISOR > 0
+                supervisorWatchTask(); // Watched for as long as the hub stays connected
+#endif
             } else {
 
                 /********** isConnected && isInitialized **************************/
+#if LEGO_USE_SUPERVISOR > 0
+                // Heartbeats for the supervisor and the task watchdog, a hang from here on stops the train
+                supervisorTaskAlive();
+                if(device[index].connProfile == BLE_PROFILE_REMOTE) {
+                    safetyBeatLink(SAFETY_LINK_REMOTE + index, millis());
+                } else {
+                    safetyBeatHub(index, device[index].channel, millis());
+                }
+#endif
                 if(myHub.getHubType() == HubType::POWERED_UP_REMOTE) {
                     // Nothing yet
                 } else {
 
-                    // Check if the global channelSpeed and localSpeed match
-                    new_speed = ble_get_motor_speed(device[index].channel);
-                    if(local_speed != new_speed) {
-                        myHub.setBasicMotorSpeed((byte)PoweredUpHubPort::A, new_speed); // Update motorSpeed
+                    // Check if the target speed of this hub and localSpeed match,
+                    // the target and its stamp are taken together so a newer command can't lose its stamp
+                    portENTER_CRITICAL(&bleMembersMux);
+                    commandStamp_t stamp       = device[index].stamp;
+                    new_speed                  = device[index].motorSpeed;
+                    bool estop                 = device[index].estopPending;
+                    device[index].stamp        = commandStamp_t();
+                    device[index].estopPending = false;
+                    portEXIT_CRITICAL(&bleMembersMux);
+
+                    if(local_speed != new_speed || estop) {
+                        ble_write_speed(index, &myHub, new_speed); // Update motorSpeed
                         local_speed = new_speed;
+                        if(estop) ble_estop_done(index, true);
+
+                        statsRecordLatency(stamp, index);
+                        statsRecordWrite(index);
 
                         Serial.print("Current speed:\t");
                         Serial.println(local_speed, DEC);
                     }
+                    if(stamp.seq != 0) ble_ack_command(stamp.seq, index);
+
+                    if(millis() - lastdetect >= SENSOR_DETECT_INTERVAL) {
+                        lastdetect = millis();
+                        ble_detect_ports(index, &myHub);
+                    }
                 }
 
                 // Only update if the battery level goes down or the delta is more than 1%
@@ -478,6 +1104,13 @@ void ble_hub_task(void * parameter)
                 Serial.println(currentBattery, DEC);
             } */
 
+                if(device[index].connParamsPending) ble_apply_conn_profile(index, &myHub);
+
+                if(millis() - lasthealth >= ble_health_interval()) {
+                    lasthealth = millis();
+                    ble_health_request(index, &myHub);
+                }
+
                 if(millis() - lastlooptime >= 20000) {
                     lastlooptime = millis();
                     // bleRequestHubDetails(&myHub);
@@ -488,7 +1121,8 @@ void ble_hub_task(void * parameter)
 
         } // isConnected
 
-        delay(50); // let the CPU breathe
+        // Let the CPU breathe, an emergency stop wakes us early. Not a task notification, NimBLE waits on those
+        xSemaphoreTake(bleHubWake[tasknr], 50 / portTICK_PERIOD_MS);
 
     } // while
 
@@ -505,7 +1139,6 @@ void ble_setup()
         while(1) {
         }
     }
-    delay(5000);
 
     esp_err_t errRc = esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_DEFAULT, ESP_PWR_LVL_P9);
     esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_ADV, ESP_PWR_LVL_P9);
@@ -513,6 +1146,8 @@ void ble_setup()
 
     /* create Mutexes & Tasks */
     bleScanMutex = xSemaphoreCreateMutex();
+    groupReset(&bleChannels);
+
     for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
         if(i < sizeof(knownDevices) / sizeof(*knownDevices)) // number of devices
         {
@@ -526,8 +1161,8 @@ void ble_setup()
             device[i].channel = 0;
         }
 
-        channelSpeed[i]       = 0;
         device[i].updateMutex = xSemaphoreCreateMutex();
+        bleHubWake[i]         = xSemaphoreCreateBinary();
         xTaskCreate(ble_hub_task, "BleTask0", 8192, (void *)i, 1, NULL);
     }
     xTaskCreate(ble_Serial_output, "BleTask1", 8192, (void *)0, 1, NULL);
@@ -2,18 +2,66 @@
 #define LEGO_BLE_H
 
 #include <Arduino.h>
+#include "lego_conf.h"
+#include "lego_stats.h"
+#include "lego_group.h"
 
 #include "nimconfig.h"
 #include "esp_nimble_cfg.h"
-#if CONFIG_BT_NIMBLE_MAX_CONNECTIONS < 9
-#error "NimBLE-Arduino\src\nimconfig.h: CONFIG_BT_NIMBLE_MAX_CONNECTIONS should be 9"
+#if CONFIG_BT_NIMBLE_MAX_CONNECTIONS < 1
+#error "NimBLE-Arduino\src\nimconfig.h: CONFIG_BT_NIMBLE_MAX_CONNECTIONS should be at least 1"
+#elif CONFIG_BT_NIMBLE_MAX_CONNECTIONS < 9
+#warning "CONFIG_BT_NIMBLE_MAX_CONNECTIONS is below 9, use more controllers in the MQTT group for more hubs"
 #endif
 
+#define MAX_BLE_DEVICES CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define BLE_HUBS_JSON_SIZE (MAX_BLE_DEVICES * 88 + 3) // Buffer for ble_get_hubs_json with every slot in use
+
+enum { BLE_PROFILE_REMOTE = 0, BLE_PROFILE_HUB = 1, BLE_PROFILE_COUNT };
+
+// Remote button combinations that raise an emergency stop
+enum { BLE_ESTOP_OFF = 0, BLE_ESTOP_BOTH_STOP, BLE_ESTOP_BOTH_DOWN, BLE_ESTOP_COUNT };
+
+#ifndef BLE_ESTOP_COMBO
+#define BLE_ESTOP_COMBO BLE_ESTOP_BOTH_STOP // Both red buttons of a remote pressed together
+#endif
+
+// Snapshot of a hub slot for status displays, compared as a whole to detect changes
+struct bleHubState_t
+{
+    bool connected;
+    bool remote;
+    bool degraded;
+    uint8_t channel;
+    int8_t speed;
+    uint8_t battery;
+    int8_t rssi;
+    uint16_t rtt;
+};
+
+extern uint8_t bleEstopCombo; // BLE_ESTOP_* remote button combination
+
 void ble_setup(void);
 void ble_loop(void);
 
-void ble_set_motor_speed(uint8_t index, int8_t speed);
-int8_t ble_get_motor_speed(uint8_t index);
+void ble_print_dashboard(Print * output);
+void ble_set_motor_speed(uint8_t channel, int8_t speed, commandStamp_t stamp);
+void ble_sync_motor_speed(uint8_t channel, int8_t speed, commandStamp_t stamp);
+int8_t ble_get_motor_speed(uint8_t channel);
+channelMask_t ble_take_changed_channels(void);
+void ble_emergency_stop(commandStamp_t stamp);
+void ble_sync_emergency_stop(commandStamp_t stamp);
+bool ble_take_emergency_stop(void);
+uint16_t ble_get_hubs_version(void);
+size_t ble_get_hubs_json(char * buffer, size_t size);
+size_t ble_get_sensors_json(uint8_t index, char * buffer, size_t size);
+uint32_t ble_take_changed_sensors(void);
+void ble_get_hub_state(uint8_t index, bleHubState_t * state);
 void ble_start_scan(void);
+bool ble_set_conn_profile(uint8_t hubclass, const char * params);
+bool ble_set_hub_led(uint8_t index, uint8_t color);
+void ble_remote_button(int8_t index, uint8_t portNumber, uint8_t state, commandStamp_t stamp);
+void ble_replay_property(int8_t index, uint8_t hubProperty, uint8_t * pData);
+bool ble_set_hub_config(const char * address, uint8_t channel, bool invert, uint8_t trim);
 
 #endif
\ No newline at end of file
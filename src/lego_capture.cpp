@@ -0,0 +1,463 @@
+#include <Arduino.h>
+#include "ArduinoLog.h"
+
+#include "lego_conf.h"
+#include "lego_ble.h"
+#include "lego_capture.h"
+#include "lego_dispatch.h"
+
+#if LEGO_USE_MQTT > 0
+#include "lego_mqtt.h"
+#endif
+
+#ifndef CAPTURE_BUFFER_SIZE
+#define CAPTURE_BUFFER_SIZE 4096 // Bytes of ingress events buffered until the loop writes them out
+#endif
+
+#define CAPTURE_FILE "/capture.bin"
+#define CAPTURE_MAGIC "PUPC\x01"
+#define CAPTURE_MAX_DATA (MQTT_MAX_PACKET_SIZE + 256)
+
+// The serial port also carries the log and the dashboard, so there every record goes out as a SLIP frame that
+// starts with CAPTURE_FRAME_MARK. A reader splits the stream at SLIP_END, unescapes each frame and keeps only the
+// frames that start with the mark and whose length matches the record header, the first frame holds CAPTURE_MAGIC.
+#define CAPTURE_FRAME_MARK "PC"
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+enum { CAPTURE_EVENT_MQTT = 1, CAPTURE_EVENT_REMOTE, CAPTURE_EVENT_HUBPROP };
+
+// Every event is stored as this header followed by length bytes of data:
+//   MQTT:    index = topic length, data = topic + payload
+//   REMOTE:  index = hub index, data = port + button state
+//   HUBPROP: index = hub index, data = property + raw hub property message
+struct __attribute__((packed)) captureRecord_t
+{
+    uint32_t delta; // us since the previous event
+    uint8_t type;
+    uint8_t index;
+    uint16_t length;
+};
+
+uint8_t captureMode = CAPTURE_OFF;
+uint8_t captureBuffer[CAPTURE_BUFFER_SIZE];
+size_t captureHead       = 0; // Written by the ingress callbacks
+size_t captureTail       = 0; // Read by captureLoop
+uint32_t captureLastTime = 0;
+uint32_t captureRecorded = 0;
+uint32_t captureDropped  = 0;
+portMUX_TYPE captureMux  = portMUX_INITIALIZER_UNLOCKED;
+
+#if LEGO_USE_SPIFFS > 0
+File captureFile;
+#endif
+
+// Replay state
+captureRecord_t replayRecord;
+bool replayPending    = false;
+uint8_t replayFactor  = 1;
+uint32_t replayLast   = 0; // micros() at which the previous event was due
+uint32_t replayEvents = 0;
+uint32_t replayStart  = 0;
+
+static void captureCopyIn(size_t & head, const void * data, size_t length)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    while(length--) {
+        captureBuffer[head] = *bytes++;
+        head                = (head + 1) % CAPTURE_BUFFER_SIZE;
+    }
+}
+
+static void captureCopyOut(size_t & tail, void * data, size_t length)
+{
+    uint8_t * bytes = (uint8_t *)data;
+    while(length--) {
+        *bytes++ = captureBuffer[tail];
+        tail     = (tail + 1) % CAPTURE_BUFFER_SIZE;
+    }
+}
+
+static void captureSlipWrite(const uint8_t * data, size_t length)
+{
+    while(length--) {
+        uint8_t c = *data++;
+        if(c == SLIP_END) {
+            Serial.write(SLIP_ESC);
+            Serial.write(SLIP_ESC_END);
+        } else if(c == SLIP_ESC) {
+            Serial.write(SLIP_ESC);
+            Serial.write(SLIP_ESC_ESC);
+        } else {
+            Serial.write(c);
+        }
+    }
+}
+
+static void captureSerialFrame(const void * header, size_t headerLength, size_t & tail, size_t length)
+{
+    Serial.write(SLIP_END);
+    captureSlipWrite((const uint8_t *)CAPTURE_FRAME_MARK, sizeof(CAPTURE_FRAME_MARK) - 1);
+    captureSlipWrite((const uint8_t *)header, headerLength);
+    while(length > 0) { // The data may wrap around the end of the ring
+        size_t chunk = min(length, (size_t)(CAPTURE_BUFFER_SIZE - tail));
+        captureSlipWrite(captureBuffer + tail, chunk);
+        tail = (tail + chunk) % CAPTURE_BUFFER_SIZE;
+        length -= chunk;
+    }
+    Serial.write(SLIP_END);
+}
+
+// Appends one event to the ring buffer, called from the MQTT loop and the BLE callbacks
+static void captureEvent(uint8_t type, uint8_t index, const void * data1, size_t length1, const void * data2,
+                         size_t length2)
+{
+    captureRecord_t record;
+    record.type   = type;
+    record.index  = index;
+    record.length = length1 + length2;
+
+    portENTER_CRITICAL(&captureMux);
+    size_t used = (captureHead + CAPTURE_BUFFER_SIZE - captureTail) % CAPTURE_BUFFER_SIZE;
+    if(captureMode != CAPTURE_SPIFFS && captureMode != CAPTURE_SERIAL) {
+        // Not capturing
+    } else if(used + sizeof(record) + record.length >= CAPTURE_BUFFER_SIZE) {
+        captureDropped++;
+    } else {
+        uint32_t now    = micros();
+        record.delta    = now - captureLastTime;
+        captureLastTime = now;
+
+        size_t head = captureHead;
+        captureCopyIn(head, &record, sizeof(record));
+        captureCopyIn(head, data1, length1);
+        captureCopyIn(head, data2, length2);
+        captureHead = head;
+        captureRecorded++;
+    }
+    portEXIT_CRITICAL(&captureMux);
+}
+
+void captureMqtt(const char * topic, const uint8_t * payload, size_t length)
+{
+    if(captureMode == CAPTURE_OFF || captureMode == CAPTURE_REPLAY) return;
+
+    size_t topicLength = strlen(topic);
+    if(topicLength > 255 || topicLength + length > CAPTURE_MAX_DATA) {
+        captureDropped++;
+        return;
+    }
+    captureEvent(CAPTURE_EVENT_MQTT, topicLength, topic, topicLength, payload, length);
+}
+
+void captureRemoteButton(int8_t index, uint8_t portNumber, uint8_t state)
+{
+    if(captureMode == CAPTURE_OFF || captureMode == CAPTURE_REPLAY) return;
+
+    uint8_t data[2] = {portNumber, state};
+    captureEvent(CAPTURE_EVENT_REMOTE, index, data, sizeof(data), NULL, 0);
+}
+
+void captureHubProperty(int8_t index, uint8_t hubProperty, const uint8_t * pData)
+{
+    if(captureMode == CAPTURE_OFF || captureMode == CAPTURE_REPLAY) return;
+
+    // The first byte of a hub message is its length
+    captureEvent(CAPTURE_EVENT_HUBPROP, index, &hubProperty, 1, pData, pData[0]);
+}
+
+// Writes the buffered events to the capture file or the serial port
+static void captureFlush(uint8_t mode)
+{
+    if(mode == CAPTURE_SERIAL) {
+        // Whole records only, the callbacks never leave a partial record in the ring
+        size_t head = __atomic_load_n(&captureHead, __ATOMIC_ACQUIRE);
+        while(captureTail != head) {
+            captureRecord_t record;
+            size_t tail = captureTail;
+            captureCopyOut(tail, &record, sizeof(record));
+            captureSerialFrame(&record, sizeof(record), tail, record.length);
+
+            portENTER_CRITICAL(&captureMux);
+            captureTail = tail;
+            portEXIT_CRITICAL(&captureMux);
+        }
+        return;
+    }
+
+    while(captureTail != captureHead) {
+        size_t head   = __atomic_load_n(&captureHead, __ATOMIC_ACQUIRE);
+        size_t length = (head >= captureTail ? head : CAPTURE_BUFFER_SIZE) - captureTail;
+        if(length == 0) break;
+
+#if LEGO_USE_SPIFFS > 0
+        if(mode == CAPTURE_SPIFFS) captureFile.write(captureBuffer + captureTail, length);
+#endif
+
+        portENTER_CRITICAL(&captureMux);
+        captureTail = (captureTail + length) % CAPTURE_BUFFER_SIZE;
+        portEXIT_CRITICAL(&captureMux);
+    }
+}
+
+bool captureStart(uint8_t mode)
+{
+    if(mode != CAPTURE_SPIFFS && mode != CAPTURE_SERIAL) return false;
+    captureStop();
+
+#if LEGO_USE_SPIFFS > 0
+    if(mode == CAPTURE_SPIFFS) {
+        if(!SPIFFS.begin(true) || !(captureFile = SPIFFS.open(CAPTURE_FILE, FILE_WRITE))) {
+            Log.error(F("CAPT: Failed to create %s"), CAPTURE_FILE);
+            return false;
+        }
+        captureFile.write((const uint8_t *)CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+    }
+#else
+    if(mode == CAPTURE_SPIFFS) return false;
+#endif
+    if(mode == CAPTURE_SERIAL) {
+        size_t tail = 0;
+        captureSerialFrame(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1, tail, 0);
+    }
+
+    captureHead     = 0;
+    captureTail     = 0;
+    captureRecorded = 0;
+    captureDropped  = 0;
+    captureLastTime = micros();
+    captureMode     = mode;
+
+    Log.notice(F("CAPT: Capturing to %s"), mode == CAPTURE_SPIFFS ? CAPTURE_FILE : "serial");
+    return true;
+}
+
+void captureStop()
+{
+    uint8_t mode = captureMode;
+    captureMode  = CAPTURE_OFF;
+
+    if(mode == CAPTURE_SPIFFS || mode == CAPTURE_SERIAL) {
+        captureFlush(mode); // Write out what is left in the buffer
+        Log.notice(F("CAPT: Stopped, %u events captured, %u dropped"), captureRecorded, captureDropped);
+    } else if(mode == CAPTURE_REPLAY) {
+        Log.notice(F("CAPT: Replayed %u events in %u ms"), replayEvents, millis() - replayStart);
+    }
+
+#if LEGO_USE_SPIFFS > 0
+    if(captureFile) captureFile.close();
+#endif
+    replayPending = false;
+}
+
+/* ===== Replay ===== */
+
+#if LEGO_USE_SPIFFS > 0
+static bool captureReadRecord()
+{
+    replayPending = captureFile.read((uint8_t *)&replayRecord, sizeof(replayRecord)) == sizeof(replayRecord);
+    return replayPending;
+}
+
+// Feeds one captured event back into the same code paths as the live event
+static void captureReplayRecord(uint8_t * data)
+{
+    commandStamp_t stamp;
+
+    switch(replayRecord.type) {
+#if LEGO_USE_MQTT > 0
+        case CAPTURE_EVENT_MQTT: {
+            char topic[256];
+            memcpy(topic, data, replayRecord.index);
+            topic[replayRecord.index] = 0;
+            mqtt_inject_message(topic, data + replayRecord.index, replayRecord.length - replayRecord.index);
+            break;
+        }
+#endif
+        case CAPTURE_EVENT_REMOTE:
+            stamp = statsStamp(STATS_SOURCE_REMOTE);
+            ble_remote_button(replayRecord.index, data[0], data[1], stamp);
+            break;
+
+        case CAPTURE_EVENT_HUBPROP:
+            ble_replay_property(replayRecord.index, data[0], data + 1);
+            break;
+    }
+}
+#endif
+
+// Replays the capture file, speedFactor 0 replays as fast as possible
+bool captureReplay(uint8_t speedFactor)
+{
+#if LEGO_USE_SPIFFS > 0
+    captureStop();
+
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    if(!SPIFFS.begin(true) || !(captureFile = SPIFFS.open(CAPTURE_FILE, FILE_READ)) ||
+       captureFile.read((uint8_t *)magic, sizeof(magic)) != sizeof(magic) ||
+       memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        Log.error(F("CAPT: No valid capture in %s"), CAPTURE_FILE);
+        captureStop();
+        return false;
+    }
+
+    replayFactor = speedFactor;
+    replayEvents = 0;
+    replayStart  = millis();
+    replayLast   = micros();
+    captureMode  = CAPTURE_REPLAY;
+    captureReadRecord();
+
+    Log.notice(F("CAPT: Replaying %s at %ux"), CAPTURE_FILE, speedFactor);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void captureLoop()
+{
+    if(captureMode == CAPTURE_SPIFFS || captureMode == CAPTURE_SERIAL) {
+        captureFlush(captureMode);
+        return;
+    }
+
+#if LEGO_USE_SPIFFS > 0
+    if(captureMode != CAPTURE_REPLAY) return;
+
+    static uint8_t data[CAPTURE_MAX_DATA + 1]; // Room for the terminator the MQTT handler adds
+    for(uint8_t events = 0; replayPending; events++) {
+        if(events >= 32) return; // Give the rest of the loop a turn when replaying at full speed
+
+        uint32_t wait = replayFactor == 0 ? 0 : replayRecord.delta / replayFactor;
+        if(micros() - replayLast < wait) return; // Not due yet, keep the loop running
+        replayLast += wait;
+
+        if(replayRecord.length > CAPTURE_MAX_DATA ||
+           captureFile.read(data, replayRecord.length) != replayRecord.length) {
+            break;
+        }
+        captureReplayRecord(data);
+        replayEvents++;
+        captureReadRecord();
+    }
+    captureStop();
+#endif
+}
+
+/* ===== Native replay driver ===== */
+
+#if !defined(ARDUINO_ARCH_ESP32)
+// Next SLIP frame of a serial capture, unescaped. The log text between two frames comes out as a frame of its own
+// and is dropped by the caller for lack of the mark. Returns false at the end of the file.
+static bool captureSlipNext(FILE * file, uint8_t * frame, size_t size, size_t & length)
+{
+    bool escaped = false;
+    int c;
+
+    length = 0;
+    while((c = fgetc(file)) != EOF) {
+        if(c == SLIP_END) return true;
+        if(c == SLIP_ESC) {
+            escaped = true;
+            continue;
+        }
+        if(escaped) c = c == SLIP_ESC_END ? SLIP_END : c == SLIP_ESC_ESC ? SLIP_ESC : c;
+        escaped = false;
+
+        if(length < size) frame[length] = c;
+        length++; // An oversized frame keeps counting and is rejected
+    }
+    return length > 0;
+}
+
+// MQTT events go through the same command topics as on the controller, the other events to the lego_ble stand-in
+static void captureReplayHostRecord(uint8_t * data, const char * nodeTopic, const char * groupTopic)
+{
+    commandStamp_t stamp;
+
+    switch(replayRecord.type) {
+        case CAPTURE_EVENT_MQTT: {
+            char topic[256];
+            memcpy(topic, data, replayRecord.index);
+            topic[replayRecord.index] = 0;
+
+            const char * payload = (const char *)data + replayRecord.index;
+            size_t length        = replayRecord.length - replayRecord.index;
+            if(topic == strstr(topic, nodeTopic)) {
+                stamp = statsStamp(STATS_SOURCE_MQTT);
+                dispatchTopic(topic + strlen(nodeTopic), payload, length, stamp);
+            } else if(topic == strstr(topic, groupTopic)) {
+                stamp = statsStamp(STATS_SOURCE_GROUP);
+                dispatchTopic(topic + strlen(groupTopic), payload, length, stamp);
+            }
+            break;
+        }
+
+        case CAPTURE_EVENT_REMOTE:
+            stamp = statsStamp(STATS_SOURCE_REMOTE);
+            ble_remote_button(replayRecord.index, data[0], data[1], stamp);
+            break;
+
+        case CAPTURE_EVENT_HUBPROP:
+            ble_replay_property(replayRecord.index, data[0], data + 1);
+            break;
+    }
+}
+
+// Replays a capture on the host, either the serial stream of capture=serial or JSON lines as typed on the console.
+// Topics are matched against the node and group prefix of the controller that recorded it, e.g. "lego/node1/".
+// speedFactor 0 replays as fast as possible. Returns the number of events or command lines replayed.
+uint32_t captureReplayFile(FILE * file, const char * nodeTopic, const char * groupTopic, uint8_t speedFactor)
+{
+    static uint8_t frame[sizeof(CAPTURE_FRAME_MARK) - 1 + sizeof(captureRecord_t) + CAPTURE_MAX_DATA + 1];
+    const size_t mark = sizeof(CAPTURE_FRAME_MARK) - 1;
+
+    int first = fgetc(file);
+    ungetc(first, file);
+    if(first == '{' || first == '[') { // JSON lines
+        dispatchParser_t parser;
+        uint32_t lines = 0;
+        int c;
+        dispatchJsonlBegin(parser, statsStamp(STATS_SOURCE_SERIAL));
+        while((c = fgetc(file)) != EOF) {
+            dispatchJsonlFeed(parser, (char)c);
+            if(c == '\n') lines++;
+        }
+        dispatchJsonlEnd(parser);
+        return lines;
+    }
+
+    bool started   = false;
+    uint32_t due   = micros();
+    replayEvents   = 0;
+    replayStart    = millis();
+    size_t length;
+    while(captureSlipNext(file, frame, sizeof(frame) - 1, length)) {
+        if(length > sizeof(frame) - 1 || length < mark || memcmp(frame, CAPTURE_FRAME_MARK, mark) != 0) continue;
+        uint8_t * body = frame + mark;
+        length -= mark;
+
+        if(!started) { // Everything before the magic belongs to an earlier session
+            started = length == sizeof(CAPTURE_MAGIC) - 1 && memcmp(body, CAPTURE_MAGIC, length) == 0;
+            continue;
+        }
+        if(length < sizeof(replayRecord)) continue;
+        memcpy(&replayRecord, body, sizeof(replayRecord));
+        if(replayRecord.length != length - sizeof(replayRecord)) continue;
+
+        if(speedFactor != 0) {
+            due += replayRecord.delta / speedFactor;
+            while((int32_t)(due - micros()) > 0) yield();
+        }
+        body[length] = 0; // The payload is handled as a string, like the MQTT receive buffer
+        captureReplayHostRecord(body + sizeof(replayRecord), nodeTopic, groupTopic);
+        replayEvents++;
+    }
+
+    Log.notice(F("CAPT: Replayed %u events in %u ms"), replayEvents, millis() - replayStart);
+    return replayEvents;
+}
+#endif
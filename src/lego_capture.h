@@ -0,0 +1,22 @@
+#ifndef LEGO_CAPTURE_H
+#define LEGO_CAPTURE_H
+
+#include <Arduino.h>
+
+enum { CAPTURE_OFF = 0, CAPTURE_SPIFFS, CAPTURE_SERIAL, CAPTURE_REPLAY };
+
+void captureLoop(void);
+bool captureStart(uint8_t mode);
+void captureStop(void);
+bool captureReplay(uint8_t speedFactor);
+
+void captureMqtt(const char * topic, const uint8_t * payload, size_t length);
+void captureRemoteButton(int8_t index, uint8_t portNumber, uint8_t state);
+void captureHubProperty(int8_t index, uint8_t hubProperty, const uint8_t * pData);
+
+#if !defined(ARDUINO_ARCH_ESP32)
+#include <stdio.h>
+uint32_t captureReplayFile(FILE * file, const char * nodeTopic, const char * groupTopic, uint8_t speedFactor);
+#endif
+
+#endif
@@ -0,0 +1,110 @@
+/* WiFi and BLE coexistence policy
+ *
+ * WiFi, the hub connections and the hub scans share one radio. Hub connections only need short connection events,
+ * a scan occupies the radio for its whole window, which is what delays MQTT commands and BLE writes.
+ * Each mode trades command latency against discovery speed: how long the layout must be quiet before a hub task
+ * may start scanning, the scan duty cycle on a busy and an idle layout, and the radio preference of the ESP32
+ * coexistence arbiter. Command latency is recorded per mode so the modes can be compared on the real layout.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_COEX > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+#include <NimBLEDevice.h>
+#include "esp_coexist.h"
+
+#include "lego_coex.h"
+#include "lego_stats.h"
+
+#define COEX_POLL_TIME 100 // ms between checks while a scan is held back
+
+struct coexProfile_t
+{
+    uint16_t quietTime;  // ms without speed commands before a scan may start
+    uint16_t interval;   // Scan interval in ms
+    uint16_t busyWindow; // Scan window in ms while the layout is busy
+    uint16_t idleWindow; // Scan window in ms on an idle layout
+    esp_coex_prefer_t preference;
+};
+
+static const coexProfile_t coexProfiles[COEX_MODE_COUNT] = {
+    {3000, 100, 10, 30, ESP_COEX_PREFER_BALANCE},  // Control: scans only in pauses, at most 30% of the radio time
+    {1000, 100, 30, 60, ESP_COEX_PREFER_BALANCE},  // Balanced
+    {0, 100, 100, 100, ESP_COEX_PREFER_BT},        // Discovery: continuous scanning, BLE wins the radio
+};
+
+static const char * const coexModeNames[COEX_MODE_COUNT] = {"control", "balanced", "discovery"};
+
+uint8_t coexMode = COEX_MODE; // Saved by the configuration store
+
+static uint8_t coexAppliedMode                = COEX_MODE_COUNT;
+static volatile unsigned long coexLastCommand = 0;
+
+uint8_t coexGetMode(void)
+{
+    return coexMode < COEX_MODE_COUNT ? coexMode : COEX_MODE_BALANCED;
+}
+
+const char * coexModeName(uint8_t mode)
+{
+    return mode < COEX_MODE_COUNT ? coexModeNames[mode] : "";
+}
+
+bool coexSetMode(const char * name)
+{
+    for(uint8_t i = 0; i < COEX_MODE_COUNT; i++) {
+        if(!strcmp(name, coexModeNames[i])) {
+            coexMode = i;
+            coexEverySecond(); // Apply the radio preference right away
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called for every speed command, from whichever task received it
+void coexNoteCommand(void)
+{
+    coexLastCommand = millis();
+}
+
+// Called by a hub task that holds the scan token, returns when the mode allows the scan to start
+void coexWaitForScan(void)
+{
+    unsigned long start = millis();
+    bool deferred       = false;
+
+    while(millis() - coexLastCommand < coexProfiles[coexGetMode()].quietTime && millis() - start < COEX_MAX_DEFER) {
+        deferred = true;
+        delay(COEX_POLL_TIME);
+    }
+    if(deferred) {
+        statsCount(statsCounters.coexDeferrals);
+        statsCount(statsCounters.coexDeferredTime, millis() - start);
+    }
+
+    const coexProfile_t * profile = &coexProfiles[coexGetMode()];
+    bool busy                     = millis() - coexLastCommand < COEX_BUSY_TIME;
+    NimBLEScan * scan             = NimBLEDevice::getScan();
+    scan->setInterval(profile->interval);
+    scan->setWindow(busy ? profile->busyWindow : profile->idleWindow);
+}
+
+void coexSetup(void)
+{
+    coexLastCommand = millis() - COEX_BUSY_TIME; // Nothing to wait for at boot
+    coexEverySecond();
+}
+
+void coexEverySecond(void)
+{
+    uint8_t mode = coexGetMode();
+    if(mode == coexAppliedMode) return;
+
+    esp_coex_preference_set(coexProfiles[mode].preference);
+    coexAppliedMode = mode;
+    Log.notice(F("COEX: Mode %s"), coexModeNames[mode]);
+}
+
+#endif // LEGO_USE_COEX
@@ -0,0 +1,30 @@
+#ifndef LEGO_COEX_H
+#define LEGO_COEX_H
+
+#include <Arduino.h>
+
+enum { COEX_MODE_CONTROL = 0, COEX_MODE_BALANCED, COEX_MODE_DISCOVERY, COEX_MODE_COUNT };
+
+#ifndef COEX_MODE
+#define COEX_MODE COEX_MODE_BALANCED
+#endif
+
+#ifndef COEX_BUSY_TIME
+#define COEX_BUSY_TIME 10000 // ms after a speed command during which the layout counts as busy
+#endif
+
+#ifndef COEX_MAX_DEFER
+#define COEX_MAX_DEFER 20000 // ms a scan may be postponed, so discovery never stops on a busy layout
+#endif
+
+extern uint8_t coexMode;
+
+void coexSetup(void);
+void coexEverySecond(void);
+void coexNoteCommand(void);
+void coexWaitForScan(void);
+bool coexSetMode(const char * name);
+uint8_t coexGetMode(void);
+const char * coexModeName(uint8_t mode);
+
+#endif
@@ -0,0 +1,292 @@
+/* Runtime configuration store
+ *
+ * The settings stay the plain globals of their modules, so reading one on the hot path is a variable access. This
+ * table maps a setting name to that global, loads /config.bin over the compiled-in defaults at boot and saves
+ * changes made through config/<name>.
+ * The file holds one record per setting: id, length and the raw value, followed by a checksum. Ids are never
+ * reused, records with an unknown id are skipped so older and newer firmware can share the file.
+ * Changes are collected for CONFIG_SAVE_DELAY, then written to flash once and applied to the modules they affect.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_CONFIG > 0 && LEGO_USE_SPIFFS > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+
+#include "lego_ble.h"
+#include "lego_debug.h"
+#include "lego_config.h"
+
+#define CONFIG_FILE_SIZE 512 // Largest file accepted, all settings at their maximum length fit
+#define CONFIG_MAGIC_0 'L'
+#define CONFIG_MAGIC_1 'C'
+#define CONFIG_FORMAT 1
+
+enum { CONFIG_TYPE_STRING = 0, CONFIG_TYPE_UINT8, CONFIG_TYPE_UINT16 };
+
+// What has to happen before a changed setting takes effect
+enum { CONFIG_APPLY_NONE = 0, CONFIG_APPLY_WIFI = 1, CONFIG_APPLY_MQTT = 2, CONFIG_APPLY_REBOOT = 4 };
+
+struct configEntry_t
+{
+    uint8_t id; // Record id in the file
+    const char * name;
+    uint8_t type;
+    uint8_t size; // Capacity of a string including the terminator
+    uint8_t apply;
+    bool secret; // Not shown by configPrint
+    void * value;
+};
+
+static const configEntry_t configEntries[] = {
+#if LEGO_USE_WIFI > 0
+    {1, "wifi/ssid", CONFIG_TYPE_STRING, sizeof(wifiSsid), CONFIG_APPLY_WIFI, false, wifiSsid},
+    {2, "wifi/password", CONFIG_TYPE_STRING, sizeof(wifiPassword), CONFIG_APPLY_WIFI, true, wifiPassword},
+#endif
+#if LEGO_USE_MQTT > 0
+    {10, "mqtt/host", CONFIG_TYPE_STRING, sizeof(mqttServer), CONFIG_APPLY_MQTT, false, mqttServer},
+    {11, "mqtt/port", CONFIG_TYPE_UINT16, 0, CONFIG_APPLY_MQTT, false, &mqttPort},
+    {12, "mqtt/user", CONFIG_TYPE_STRING, sizeof(mqttUser), CONFIG_APPLY_MQTT, false, mqttUser},
+    {13, "mqtt/password", CONFIG_TYPE_STRING, sizeof(mqttPassword), CONFIG_APPLY_MQTT, true, mqttPassword},
+    {14, "mqtt/node", CONFIG_TYPE_STRING, sizeof(mqttNodeName), CONFIG_APPLY_MQTT | CONFIG_APPLY_REBOOT, false,
+     mqttNodeName}, // Also the mDNS hostname
+    {15, "mqtt/group", CONFIG_TYPE_STRING, sizeof(mqttGroupName), CONFIG_APPLY_MQTT, false, mqttGroupName},
+#endif
+#if LEGO_USE_SYSLOG > 0
+    {20, "syslog/host", CONFIG_TYPE_STRING, sizeof(debugSyslogHost), CONFIG_APPLY_NONE, false, debugSyslogHost},
+    {21, "syslog/port", CONFIG_TYPE_UINT16, 0, CONFIG_APPLY_NONE, false, &debugSyslogPort},
+    {22, "syslog/facility", CONFIG_TYPE_UINT8, 0, CONFIG_APPLY_NONE, false, &debugSyslogFacility},
+    {23, "syslog/protocol", CONFIG_TYPE_UINT8, 0, CONFIG_APPLY_NONE, false, &debugSyslogProtocol},
+    {24, "syslog/rate", CONFIG_TYPE_UINT16, 0, CONFIG_APPLY_NONE, false, &debugSyslogRate},
+#endif
+#if LEGO_USE_COEX > 0
+    {25, "coex/mode", CONFIG_TYPE_UINT8, 0, CONFIG_APPLY_NONE, false, &coexMode}, // Picked up by coexEverySecond
+#endif
+    {26, "remote/estop", CONFIG_TYPE_UINT8, 0, CONFIG_APPLY_NONE, false, &bleEstopCombo}, // 0 off, 1 both red, 2 both -
+    {30, "debug/teleperiod", CONFIG_TYPE_UINT16, 0, CONFIG_APPLY_NONE, false, &debugTelePeriod},
+};
+
+#define CONFIG_ENTRY_COUNT (sizeof(configEntries) / sizeof(*configEntries))
+
+static uint8_t configPendingApply     = CONFIG_APPLY_NONE;
+static bool configPendingSave         = false;
+static unsigned long configChangeTime = 0;
+
+static uint16_t config_checksum(const uint8_t * data, size_t length)
+{
+    uint16_t sum1 = 0, sum2 = 0; // Fletcher-16
+    for(size_t i = 0; i < length; i++) {
+        sum1 = (sum1 + data[i]) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+    return (sum2 << 8) | sum1;
+}
+
+static const configEntry_t * config_find_name(const char * name)
+{
+    for(size_t i = 0; i < CONFIG_ENTRY_COUNT; i++) {
+        if(!strcmp(configEntries[i].name, name)) return &configEntries[i];
+    }
+    return NULL;
+}
+
+static const configEntry_t * config_find_id(uint8_t id)
+{
+    for(size_t i = 0; i < CONFIG_ENTRY_COUNT; i++) {
+        if(configEntries[i].id == id) return &configEntries[i];
+    }
+    return NULL;
+}
+
+static uint8_t config_value_length(const configEntry_t * entry)
+{
+    switch(entry->type) {
+        case CONFIG_TYPE_STRING:
+            return strlen((const char *)entry->value);
+        case CONFIG_TYPE_UINT16:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Copy a record from the file into the setting, a record that doesn't fit the setting is ignored
+static bool config_load_record(const configEntry_t * entry, const uint8_t * data, uint8_t length)
+{
+    if(entry->type == CONFIG_TYPE_STRING) {
+        if(length >= entry->size) return false;
+        memcpy(entry->value, data, length);
+        ((char *)entry->value)[length] = 0;
+    } else if(entry->type == CONFIG_TYPE_UINT16) {
+        if(length != 2) return false;
+        *(uint16_t *)entry->value = data[0] | (data[1] << 8);
+    } else {
+        if(length != 1) return false;
+        *(uint8_t *)entry->value = data[0];
+    }
+    return true;
+}
+
+static void config_load(void)
+{
+    // A save interrupted between removing the old file and the rename leaves only the new one
+    const char * name = SPIFFS.exists(CONFIG_FILE) ? CONFIG_FILE : CONFIG_FILE ".new";
+    File file         = SPIFFS.open(name, FILE_READ);
+    if(!file) {
+        Log.notice(F("CONF: No saved settings, using the defaults"));
+        return;
+    }
+
+    uint8_t buffer[CONFIG_FILE_SIZE];
+    size_t size = file.read(buffer, sizeof(buffer));
+    bool whole  = file.available() == 0;
+    file.close();
+
+    if(!whole || size < 5 || buffer[0] != CONFIG_MAGIC_0 || buffer[1] != CONFIG_MAGIC_1 ||
+       config_checksum(buffer, size - 2) != (buffer[size - 2] | (buffer[size - 1] << 8))) {
+        Log.error(F("CONF: %s is damaged, using the defaults"), name);
+        return;
+    }
+    if(buffer[2] != CONFIG_FORMAT) {
+        Log.warning(F("CONF: Unknown format %u in %s, using the defaults"), buffer[2], name);
+        return;
+    }
+
+    uint8_t loaded = 0;
+    for(size_t pos = 3; pos + 2 <= size - 2;) {
+        uint8_t id     = buffer[pos];
+        uint8_t length = buffer[pos + 1];
+        pos += 2;
+        if(pos + length > size - 2) break;
+
+        const configEntry_t * entry = config_find_id(id);
+        if(entry != NULL && config_load_record(entry, buffer + pos, length)) loaded++;
+        pos += length;
+    }
+    Log.notice(F("CONF: Loaded %u settings from %s"), loaded, name);
+}
+
+// The file is written next to the old one and renamed over it, a power cut never leaves half a file
+static bool config_save(void)
+{
+    uint8_t buffer[CONFIG_FILE_SIZE];
+    size_t size = 0;
+
+    buffer[size++] = CONFIG_MAGIC_0;
+    buffer[size++] = CONFIG_MAGIC_1;
+    buffer[size++] = CONFIG_FORMAT;
+    for(size_t i = 0; i < CONFIG_ENTRY_COUNT; i++) {
+        const configEntry_t * entry = &configEntries[i];
+        uint8_t length              = config_value_length(entry);
+
+        buffer[size++] = entry->id;
+        buffer[size++] = length;
+        if(entry->type == CONFIG_TYPE_UINT16) {
+            uint16_t value = *(uint16_t *)entry->value;
+            buffer[size++] = value & 0xFF;
+            buffer[size++] = value >> 8;
+        } else {
+            memcpy(buffer + size, entry->value, length);
+            size += length;
+        }
+    }
+    uint16_t checksum = config_checksum(buffer, size);
+    buffer[size++]    = checksum & 0xFF;
+    buffer[size++]    = checksum >> 8;
+
+    File file = SPIFFS.open(CONFIG_FILE ".new", FILE_WRITE);
+    if(!file) return false;
+    bool written = file.write(buffer, size) == size;
+    file.close();
+
+    if(!written) return false;
+    SPIFFS.remove(CONFIG_FILE);
+    return SPIFFS.rename(CONFIG_FILE ".new", CONFIG_FILE);
+}
+
+static void config_apply(uint8_t apply)
+{
+#if LEGO_USE_WIFI > 0
+    if(apply & CONFIG_APPLY_WIFI) wifiReconnect();
+#endif
+#if LEGO_USE_MQTT > 0
+    if(apply & CONFIG_APPLY_MQTT) mqttApplyConfig();
+#endif
+    if(apply & CONFIG_APPLY_REBOOT) Log.warning(F("CONF: Some changes take full effect after a reboot"));
+}
+
+// Parse a text value into the setting, rejects values out of range for its type
+bool configSet(const char * key, const char * value)
+{
+    const configEntry_t * entry = config_find_name(key);
+    if(entry == NULL) return false;
+
+    if(entry->type == CONFIG_TYPE_STRING) {
+        if(strlen(value) >= entry->size) return false;
+        strcpy((char *)entry->value, value);
+
+    } else {
+        char * end;
+        unsigned long number = strtoul(value, &end, 10);
+        unsigned long limit  = entry->type == CONFIG_TYPE_UINT16 ? 0xFFFF : 0xFF;
+        if(!isdigit(*value) || *end != 0 || number > limit) return false;
+
+        if(entry->type == CONFIG_TYPE_UINT16) {
+            *(uint16_t *)entry->value = number;
+        } else {
+            *(uint8_t *)entry->value = number;
+        }
+    }
+
+    configPendingApply |= entry->apply;
+    configPendingSave = true;
+    configChangeTime  = millis();
+    Log.notice(F("CONF: %s changed"), entry->name);
+    return true;
+}
+
+void configPrint(Print * output)
+{
+    for(size_t i = 0; i < CONFIG_ENTRY_COUNT; i++) {
+        const configEntry_t * entry = &configEntries[i];
+        output->print(entry->name);
+        output->print('=');
+        if(entry->secret) {
+            output->println(strlen((const char *)entry->value) > 0 ? F("********") : F(""));
+        } else if(entry->type == CONFIG_TYPE_STRING) {
+            output->println((const char *)entry->value);
+        } else if(entry->type == CONFIG_TYPE_UINT16) {
+            output->println(*(uint16_t *)entry->value);
+        } else {
+            output->println(*(uint8_t *)entry->value);
+        }
+    }
+}
+
+// Load the saved settings over the compiled-in defaults, before the modules that use them start
+void configSetup(void)
+{
+    if(!SPIFFS.begin(true)) {
+        Log.error(F("CONF: SPIFFS not mounted, using the defaults"));
+        return;
+    }
+    config_load();
+}
+
+void configLoop(void)
+{
+    if(!configPendingSave || millis() - configChangeTime < CONFIG_SAVE_DELAY) return;
+
+    uint8_t apply      = configPendingApply;
+    configPendingSave  = false;
+    configPendingApply = CONFIG_APPLY_NONE;
+
+    if(config_save()) {
+        Log.notice(F("CONF: Settings saved to %s"), CONFIG_FILE);
+    } else {
+        Log.error(F("CONF: Failed to save %s"), CONFIG_FILE);
+    }
+    config_apply(apply);
+}
+
+#endif // LEGO_USE_CONFIG
@@ -0,0 +1,19 @@
+#ifndef LEGO_CONFIG_H
+#define LEGO_CONFIG_H
+
+#include <Arduino.h>
+
+#ifndef CONFIG_FILE
+#define CONFIG_FILE "/config.bin"
+#endif
+
+#ifndef CONFIG_SAVE_DELAY
+#define CONFIG_SAVE_DELAY 2000 // ms without changes before they are saved and applied
+#endif
+
+void configSetup(void);
+void configLoop(void);
+bool configSet(const char * key, const char * value);
+void configPrint(Print * output);
+
+#endif
@@ -13,6 +13,8 @@
 #endif
 
 #include "lego_hal.h"
+#include "lego_stats.h"
+#include "lego_dispatch.h"
 #if LEGO_USE_MQTT > 0
 #include "lego_mqtt.h"
 #endif
@@ -32,7 +34,7 @@
 #endif
 
 #if LEGO_USE_SYSLOG > 0
-#include "Syslog.h"
+#include "lego_syslog.h"
 
 #ifndef SYSLOG_SERVER
 #define SYSLOG_SERVER ""
@@ -42,28 +44,11 @@
 #define SYSLOG_PORT 514
 #endif
 
-#ifndef APP_NAME
-#define APP_NAME "PUPT"
-#endif
-
-// variables for debug stream writer
-// static String debugOutput((char *)0);
-// static StringStream debugStream((String &)debugOutput);
-
-extern char mqttNodeName[16];
-const char * syslogAppName  = APP_NAME;
 char debugSyslogHost[32]    = SYSLOG_SERVER;
 uint16_t debugSyslogPort    = SYSLOG_PORT;
 uint8_t debugSyslogFacility = 0;
-uint8_t debugSyslogProtocol = 0;
-
-// A UDP instance to let us send and receive packets over UDP
-WiFiUDP syslogClient;
-
-// Create a new syslog instance with LOG_KERN facility
-// Syslog syslog(syslogClient, SYSLOG_SERVER, SYSLOG_PORT, MQTT_CLIENT, APP_NAME, LOG_KERN);
-// Create a new empty syslog instance
-Syslog * syslog;
+uint8_t debugSyslogProtocol = 0;           // 0 = RFC 5424, 1 = RFC 3164
+uint16_t debugSyslogRate    = SYSLOG_RATE; // Datagrams per second
 #endif // USE_SYSLOG
 
 // Serial Settings
@@ -72,6 +57,8 @@ char serialInputBuffer[1024];
 uint16_t debugSerialBaud = SERIAL_SPEED / 10; // Multiplied by 10
 bool debugSerialStarted  = false;
 bool debugAnsiCodes      = true;
+bool debugJsonlMode      = false; // Serial input is streamed to the JSON lines parser
+dispatchParser_t debugJsonlParser;
 
 unsigned long debugLastMillis = 0;
 uint16_t debugTelePeriod      = 300;
@@ -108,24 +95,18 @@ void debugStart()
     // log/logf method)
 }
 
-#if LEGO_USE_SYSLOG > 0
-void syslogSend(uint8_t priority, const char * debugText)
-{
-    if(strlen(debugSyslogHost) != 0 && WiFi.isConnected()) {
-        syslog->log(priority, debugText);
-    }
-}
-#endif
-
 void debugSetup()
 {
+    Log.setPrefix(debugPrintPrefix);
+    Log.setSuffix(debugPrintSuffix);
+
+    // setup() has started the port, the log, the dispatcher rates and the boot report go out here
+    debugSerialStarted = true;
+    Log.registerOutput(DEBUG_LOG_SLOT_SERIAL, &Serial, LOG_LEVEL_TRACE, true);
+
 #if LEGO_USE_SYSLOG > 0
-    syslog = new Syslog(syslogClient, debugSyslogProtocol == 0 ? SYSLOG_PROTO_IETF : SYSLOG_PROTO_BSD);
-    syslog->server(debugSyslogHost, debugSyslogPort);
-    syslog->deviceHostname(mqttNodeName);
-    syslog->appName(syslogAppName);
-    uint16_t priority = (uint16_t)(debugSyslogFacility + 16) << 3; // localx facility, x = 0-7
-    syslog->defaultPriority(priority);
+    syslogSetup();
+    Log.registerOutput(DEBUG_LOG_SLOT_SYSLOG, syslogOutput(), LOG_LEVEL_NOTICE, true);
 #endif
 }
 
@@ -208,6 +189,13 @@ static void debugPrintPriority(int level, Print * _logOutput)
 
 void debugPrintPrefix(int level, Print * _logOutput)
 {
+#if LEGO_USE_SYSLOG > 0
+    if(_logOutput == syslogOutput()) {
+        syslogBeginRecord(level); // The syslog header carries the priority, skip the decorations
+        return;
+    }
+#endif
+
     debugPrintTimestamp(level, _logOutput);
     debugPrintMemory(level, _logOutput);
     debugPrintPriority(level, _logOutput);
@@ -215,6 +203,13 @@ void debugPrintPrefix(int level, Print * _logOutput)
 
 void debugPrintSuffix(int level, Print * _logOutput)
 {
+#if LEGO_USE_SYSLOG > 0
+    if(_logOutput == syslogOutput()) {
+        syslogEndRecord();
+        return;
+    }
+#endif
+
     if(debugAnsiCodes)
         _logOutput->println(F(TERM_COLOR_RESET));
     else
@@ -226,10 +221,23 @@ void debugLoop()
 {
     while(Serial.available()) {
         char ch = Serial.read();
+
+        if(debugJsonlMode) {
+            // An empty line or Ctrl-D ends the stream
+            if(ch == 4 || (ch == '\n' && serialInputIndex == 0)) {
+                dispatchJsonlEnd(debugJsonlParser);
+                debugJsonlMode = false;
+            } else if(ch != '\r') {
+                dispatchJsonlFeed(debugJsonlParser, ch);
+                serialInputIndex = ch == '\n' ? 0 : 1;
+            }
+            continue;
+        }
+
         Serial.print(ch);
         if(ch == 13 || ch == 10) {
             serialInputBuffer[serialInputIndex] = 0;
-            // if(serialInputIndex > 0) dispatchCommand(serialInputBuffer);
+            if(serialInputIndex > 0) dispatchCommand(serialInputBuffer, statsStamp(STATS_SOURCE_SERIAL));
             serialInputIndex = 0;
         } else {
             if(serialInputIndex < sizeof(serialInputBuffer) - 1) {
@@ -237,7 +245,8 @@ void debugLoop()
             }
             serialInputBuffer[serialInputIndex] = 0;
             if(strcmp(serialInputBuffer, "jsonl=") == 0) {
-                //    dispatchJsonl(Serial);
+                dispatchJsonlBegin(debugJsonlParser, statsStamp(STATS_SOURCE_SERIAL));
+                debugJsonlMode   = true;
                 serialInputIndex = 0;
             }
         }
@@ -282,10 +291,31 @@ void debugLoop()
 #endif
 }*/
 
+// Log the boot profile once every milestone was reached, to Serial and the other log outputs. It is published as
+// soon as the broker is connected.
+static void debug_boot_report()
+{
+    static bool logged    = false;
+    static bool published = false;
+    if(published || !statsBootComplete()) return;
+
+    char buffer[256];
+    statsGetBootJson(buffer, sizeof(buffer));
+    if(!logged) Log.notice(F("BOOT: Phases %s"), buffer);
+    logged = true;
+
+#if LEGO_USE_MQTT > 0
+    if(!mqttIsConnected()) return;
+    mqtt_send_state(F("boot"), buffer);
+#endif
+    published = true;
+}
+
 void debugEverySecond()
 {
+    debug_boot_report();
     if(debugTelePeriod > 0 && (millis() - debugLastMillis) >= debugTelePeriod * 1000) {
-        // dispatchStatusUpdate();
+        dispatchStatusUpdate();
         debugLastMillis = millis();
     }
     // printLocalTime();
@@ -16,6 +16,20 @@
 
 #define F_CONFIG_BAUD SERIAL_SPEED
 
+// ArduinoLog output slots
+#define DEBUG_LOG_SLOT_SERIAL 0
+#define DEBUG_LOG_SLOT_TELNET 1
+#define DEBUG_LOG_SLOT_SYSLOG 2
+
+// Syslog settings, only defined with LEGO_USE_SYSLOG
+extern char debugSyslogHost[32];
+extern uint16_t debugSyslogPort;
+extern uint8_t debugSyslogFacility;
+extern uint8_t debugSyslogProtocol;
+extern uint16_t debugSyslogRate;
+extern unsigned long debugLastMillis; // Last periodic status update
+extern uint16_t debugTelePeriod;
+
 String debugHeader(void);
 
 void debugSetup();
@@ -23,6 +37,8 @@ void debugLoop(void);
 void debugEverySecond(void);
 void debugStart(void);
 void debugStop(void);
+void debugPrintPrefix(int level, Print * _logOutput);
+void debugPrintSuffix(int level, Print * _logOutput);
 
 void serialPrintln(String & debugText, uint8_t level);
 void serialPrintln(const char * debugText, uint8_t level);
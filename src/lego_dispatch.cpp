@@ -0,0 +1,511 @@
+#include <Arduino.h>
+#include "ArduinoLog.h"
+
+#include "lego_conf.h"
+#include "lego_ble.h"
+#include "lego_stats.h"
+#include "lego_dispatch.h"
+#include "lego_capture.h"
+
+#if LEGO_USE_MQTT > 0
+#include "lego_mqtt.h"
+#endif
+
+#if LEGO_USE_TELNET > 0
+#include "lego_telnet.h"
+#endif
+
+#if LEGO_USE_OTA > 0
+#include "lego_ota.h"
+#endif
+
+// JSON lines parser states
+enum {
+    PARSER_LINE = 0,    // Waiting for a line to start with { or [
+    PARSER_KEY_WAIT,    // Inside an object, waiting for a key
+    PARSER_KEY,         // Reading a key string
+    PARSER_COLON,       // Waiting for the colon after a key
+    PARSER_VALUE_WAIT,  // Waiting for a value
+    PARSER_VALUE,       // Reading a string value
+    PARSER_VALUE_ATOM,  // Reading a number, true, false or null
+    PARSER_ITEM_WAIT,   // Inside an array of command strings, waiting for an item
+    PARSER_ERROR        // Skipping the rest of an invalid line
+};
+
+typedef bool (*dispatchHandler_t)(const char * suffix, const char * value, const commandStamp_t & stamp);
+
+struct dispatchEntry_t
+{
+    const char * name; // The key matches if it starts with the name, the rest is passed as suffix
+    dispatchHandler_t handler;
+};
+
+// Text output for commands entered on a console, NULL for MQTT
+static Print * dispatchOutput(const commandStamp_t & stamp)
+{
+#if LEGO_USE_TELNET > 0
+    if(stamp.source == STATS_SOURCE_TELNET) return telnetConsoleOutput();
+#endif
+    return stamp.source == STATS_SOURCE_SERIAL ? &Serial : NULL;
+}
+
+static bool dispatchIsNumber(const char * text)
+{
+    if(*text == '-') text++;
+    if(*text == 0) return false;
+    for(; *text != 0; text++) {
+        if(!isdigit(*text)) return false;
+    }
+    return true;
+}
+
+/* ===== Command handlers ===== */
+
+// speed<channel>=<-100..100>
+static bool dispatchSpeed(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    if(!dispatchIsNumber(suffix) || !dispatchIsNumber(value)) return false;
+
+    int channel = atoi(suffix);
+    int speed   = constrain(atoi(value), -100, 100);
+    if(channel < 0 || channel >= LEGO_NUM_CHANNELS) return false;
+
+    // Commands on the group topic reach every controller and are not replicated again
+    if(stamp.source == STATS_SOURCE_GROUP)
+        ble_sync_motor_speed(channel, speed, stamp);
+    else
+        ble_set_motor_speed(channel, speed, stamp);
+    return true;
+}
+
+// led<hub>=<color>
+static bool dispatchLed(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    if(!dispatchIsNumber(suffix) || !dispatchIsNumber(value)) return false;
+    return ble_set_hub_led(atoi(suffix), atoi(value));
+}
+
+// estop stops every train of the group at once, ahead of any ramp
+static bool dispatchEstop(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    // Commands on the group topic reach every controller and are not replicated again
+    if(stamp.source == STATS_SOURCE_GROUP)
+        ble_sync_emergency_stop(stamp);
+    else
+        ble_emergency_stop(stamp);
+    return true;
+}
+
+static bool dispatchScan(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    ble_start_scan();
+    return true;
+}
+
+// latency prints or publishes the histograms, latency=reset clears them
+static bool dispatchLatency(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    if(!strcmp_P(value, PSTR("reset"))) {
+        statsResetLatency();
+    } else if(Print * output = dispatchOutput(stamp)) {
+        statsPrintLatency(output);
+    } else {
+#if LEGO_USE_MQTT > 0
+        mqtt_send_latency();
+#endif
+    }
+    return true;
+}
+
+// stats prints the runtime counters on the console or publishes them
+static bool dispatchStats(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    if(Print * output = dispatchOutput(stamp)) {
+        char buffer[STATS_JSON_SIZE];
+        statsGetJson(buffer, sizeof(buffer));
+        output->println(buffer);
+    } else {
+        dispatchStatusUpdate();
+    }
+    return true;
+}
+
+// capture=spiffs|serial starts recording ingress events, capture=stop or an empty value stops
+static bool dispatchCapture(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    if(!strcmp_P(value, PSTR("spiffs"))) return captureStart(CAPTURE_SPIFFS);
+    if(!strcmp_P(value, PSTR("serial"))) return captureStart(CAPTURE_SERIAL);
+    captureStop();
+    return true;
+}
+
+// replay=<speed factor> replays the capture file, 0 is as fast as possible
+static bool dispatchReplay(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    return captureReplay(*value ? atoi(value) : 1);
+}
+
+// config/<key>=<value>
+static bool dispatchConfigCommand(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    return dispatchConfig(suffix, value);
+}
+
+#if LEGO_USE_CONFIG > 0
+// config lists the saved settings on the console
+static bool dispatchConfigList(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    Print * output = dispatchOutput(stamp);
+    if(*suffix != 0 || output == NULL) return false;
+
+    configPrint(output);
+    return true;
+}
+#endif
+
+#if LEGO_USE_COEX > 0
+// coex=control|balanced|discovery selects the radio sharing mode
+static bool dispatchCoex(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    if(*value != 0) return coexSetMode(value);
+    Log.notice(F("COEX: Mode %s"), coexModeName(coexGetMode()));
+    return true;
+}
+#endif
+
+#if LEGO_USE_OTA > 0
+// ota=<url> [sha256] installs a firmware image, the trains only stop for the reboot
+static bool dispatchOta(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    char url[160];
+    size_t len = strcspn(value, " ");
+    if(len == 0 || len >= sizeof(url)) return false;
+
+    memcpy(url, value, len);
+    url[len] = 0;
+    while(value[len] == ' ') len++;
+    return otaStart(url, value + len);
+}
+#endif
+
+/* ===== Config handlers ===== */
+
+// bleremote / blehub = "minInterval,maxInterval,latency,timeout"
+static bool dispatchConfigBleRemote(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    return *suffix == 0 && ble_set_conn_profile(BLE_PROFILE_REMOTE, value);
+}
+
+static bool dispatchConfigBleHub(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    return *suffix == 0 && ble_set_conn_profile(BLE_PROFILE_HUB, value);
+}
+
+// hub/<address> = "channel,invert[,trim]" for consisting several hubs on one channel
+static bool dispatchConfigHub(const char * suffix, const char * value, const commandStamp_t & stamp)
+{
+    unsigned int channel, invert, trim = 100;
+    if(sscanf(value, "%u,%u,%u", &channel, &invert, &trim) < 2) return false;
+    return ble_set_hub_config(suffix, channel, invert != 0, trim);
+}
+
+// The same tables serve the serial console, MQTT and any other transport
+static const dispatchEntry_t dispatchCommands[] = {
+    {"speed", dispatchSpeed},     {"estop", dispatchEstop},
+    {"led", dispatchLed},         {"scan", dispatchScan},
+    {"latency", dispatchLatency}, {"stats", dispatchStats},
+    {"capture", dispatchCapture}, {"replay", dispatchReplay},
+    {"config/", dispatchConfigCommand},
+#if LEGO_USE_CONFIG > 0
+    {"config", dispatchConfigList},
+#endif
+#if LEGO_USE_COEX > 0
+    {"coex", dispatchCoex},
+#endif
+#if LEGO_USE_OTA > 0
+    {"ota", dispatchOta},
+#endif
+};
+
+static const dispatchEntry_t dispatchConfigs[] = {
+    {"bleremote", dispatchConfigBleRemote},
+    {"blehub", dispatchConfigBleHub},
+    {"hub/", dispatchConfigHub},
+};
+
+static bool dispatchFind(const dispatchEntry_t * table, size_t count, const char * key, const char * value,
+                         const commandStamp_t & stamp)
+{
+    for(size_t i = 0; i < count; i++) {
+        size_t len = strlen(table[i].name);
+        if(strncmp(key, table[i].name, len) == 0) return table[i].handler(key + len, value, stamp);
+    }
+    return false;
+}
+
+bool dispatchKeyValue(const char * key, const char * value, const commandStamp_t & stamp)
+{
+    if(dispatchFind(dispatchCommands, sizeof(dispatchCommands) / sizeof(*dispatchCommands), key, value, stamp))
+        return true;
+
+    Log.warning(F("CMND: Invalid command %s = %s"), key, value);
+    return false;
+}
+
+bool dispatchConfig(const char * key, const char * value)
+{
+    if(dispatchFind(dispatchConfigs, sizeof(dispatchConfigs) / sizeof(*dispatchConfigs), key, value,
+                    commandStamp_t()))
+        return true;
+#if LEGO_USE_CONFIG > 0
+    if(configSet(key, value)) return true; // Saved settings, e.g. mqtt/host
+#endif
+
+    Log.warning(F("CMND: Invalid config %s = %s"), key, value);
+    return false;
+}
+
+// Accepts "key=value", "key value" or just "key"
+bool dispatchCommand(const char * cmdline, const commandStamp_t & stamp)
+{
+    char key[DISPATCH_KEY_SIZE];
+    size_t len = strcspn(cmdline, "= ");
+    if(len == 0 || len >= sizeof(key)) {
+        Log.warning(F("CMND: Invalid command %s"), cmdline);
+        return false;
+    }
+
+    memcpy(key, cmdline, len);
+    key[len]           = 0;
+    const char * value = cmdline + len;
+    while(*value == '=' || *value == ' ') value++;
+
+    return dispatchKeyValue(key, value, stamp);
+}
+
+// Named speed topics kept from the first MQTT interface, command/<color> = speed of that channel
+static const struct
+{
+    const char * color;
+    uint8_t channel;
+} dispatchColors[] = {{"red", 0}, {"yellow", 3}, {"green", 4}, {"purple", 5}};
+
+// Command topics below the node or group prefix, payload must be terminated:
+//   command              payload "key=value"
+//   command/json[l]      payload of JSON lines, '{"speed2":50,"led2":9}' or '["speed2=50", "scan"]'
+//   command/<color>      payload speed
+//   command/<key>        payload value, or no payload for a command without value
+bool dispatchTopic(const char * topic, const char * payload, size_t length, const commandStamp_t & stamp)
+{
+    if(!strcmp_P(topic, PSTR("command"))) return dispatchCommand(payload, stamp);
+    if(topic != strstr_P(topic, PSTR("command/"))) return false;
+    topic += 8u;
+
+    if(!strcmp_P(topic, PSTR("json")) || !strcmp_P(topic, PSTR("jsonl"))) {
+        dispatchJsonl(payload, length, stamp);
+        return true;
+    }
+
+    for(size_t i = 0; i < sizeof(dispatchColors) / sizeof(*dispatchColors); i++) {
+        if(strcmp(topic, dispatchColors[i].color) != 0) continue;
+        char key[12];
+        snprintf_P(key, sizeof(key), PSTR("speed%u"), dispatchColors[i].channel);
+        return dispatchKeyValue(key, payload, stamp);
+    }
+
+    return length == 0 ? dispatchCommand(topic, stamp) : dispatchKeyValue(topic, payload, stamp);
+}
+
+// Periodic status publish, runs every debugTelePeriod seconds
+void dispatchStatusUpdate(void)
+{
+#if LEGO_USE_MQTT > 0
+    mqtt_send_statusupdate();
+    mqtt_send_latency();
+#endif
+    statsNewWindow();
+}
+
+/* ===== JSON lines ===== */
+
+void dispatchJsonlBegin(dispatchParser_t & parser, const commandStamp_t & stamp)
+{
+    parser.state     = PARSER_LINE;
+    parser.stamp     = stamp;
+    parser.keyLen    = 0;
+    parser.valueLen  = 0;
+    parser.inArray   = false;
+    parser.escaped   = false;
+    parser.commands  = 0;
+    parser.errors    = 0;
+    parser.startTime = 0;
+}
+
+static void dispatchJsonlError(dispatchParser_t & parser)
+{
+    parser.errors++;
+    parser.state = PARSER_ERROR;
+}
+
+static void dispatchJsonlValue(dispatchParser_t & parser)
+{
+    parser.value[parser.valueLen] = 0;
+
+    bool success;
+    if(parser.inArray) {
+        success = dispatchCommand(parser.value, parser.stamp);
+    } else {
+        parser.key[parser.keyLen] = 0;
+        success = dispatchKeyValue(parser.key, strcmp_P(parser.value, PSTR("null")) ? parser.value : "",
+                                   parser.stamp);
+    }
+
+    if(success)
+        parser.commands++;
+    else
+        parser.errors++;
+
+    parser.keyLen   = 0;
+    parser.valueLen = 0;
+    parser.state    = parser.inArray ? PARSER_ITEM_WAIT : PARSER_KEY_WAIT;
+}
+
+// Handles the character after a value or item: a separator, the end of the object or array or the end of the line
+static void dispatchJsonlNext(dispatchParser_t & parser, char ch)
+{
+    if(ch == '}' && !parser.inArray) {
+        parser.state = PARSER_LINE;
+    } else if(ch == ']' && parser.inArray) {
+        parser.state = PARSER_LINE;
+    } else if(ch != ',' && !isspace(ch)) {
+        dispatchJsonlError(parser);
+    }
+}
+
+// Parses one byte, a command is dispatched as soon as its value is complete
+void dispatchJsonlFeed(dispatchParser_t & parser, char ch)
+{
+    if(parser.startTime == 0) parser.startTime = max(1UL, micros());
+
+    switch(parser.state) {
+        case PARSER_LINE:
+            if(ch == '{' || ch == '[') {
+                parser.stamp.time = micros(); // Latency of each line counts from its first byte
+                parser.inArray    = ch == '[';
+                parser.keyLen     = 0;
+                parser.valueLen   = 0;
+                parser.state      = parser.inArray ? PARSER_ITEM_WAIT : PARSER_KEY_WAIT;
+            } else if(!isspace(ch)) {
+                dispatchJsonlError(parser);
+            }
+            break;
+
+        case PARSER_KEY_WAIT:
+            if(ch == '"') {
+                parser.state = PARSER_KEY;
+            } else {
+                dispatchJsonlNext(parser, ch);
+            }
+            break;
+
+        case PARSER_ITEM_WAIT:
+            if(ch == '"') {
+                parser.escaped = false;
+                parser.state   = PARSER_VALUE;
+            } else {
+                dispatchJsonlNext(parser, ch);
+            }
+            break;
+
+        case PARSER_KEY:
+            if(ch == '"') {
+                parser.state = PARSER_COLON;
+            } else if(parser.keyLen < sizeof(parser.key) - 1) {
+                parser.key[parser.keyLen++] = ch;
+            } else {
+                dispatchJsonlError(parser);
+            }
+            break;
+
+        case PARSER_COLON:
+            if(ch == ':') {
+                parser.state = PARSER_VALUE_WAIT;
+            } else if(!isspace(ch)) {
+                dispatchJsonlError(parser);
+            }
+            break;
+
+        case PARSER_VALUE_WAIT:
+            if(ch == '"') {
+                parser.escaped = false;
+                parser.state   = PARSER_VALUE;
+            } else if(ch == '{' || ch == '[' || ch == '}' || ch == ',' || ch == '\n') {
+                dispatchJsonlError(parser); // Nested values are not supported
+            } else if(!isspace(ch)) {
+                parser.value[parser.valueLen++] = ch;
+                parser.state                    = PARSER_VALUE_ATOM;
+            }
+            break;
+
+        case PARSER_VALUE:
+            if(parser.escaped) {
+                parser.escaped = false;
+            } else if(ch == '\\') {
+                parser.escaped = true;
+                break;
+            } else if(ch == '"') {
+                dispatchJsonlValue(parser);
+                break;
+            }
+
+            if(parser.valueLen < sizeof(parser.value) - 1) {
+                parser.value[parser.valueLen++] = ch;
+            } else {
+                dispatchJsonlError(parser);
+            }
+            break;
+
+        case PARSER_VALUE_ATOM:
+            if(ch == ',' || ch == '}' || isspace(ch)) {
+                dispatchJsonlValue(parser);
+                if(ch == '}') parser.state = PARSER_LINE;
+            } else if(parser.valueLen < sizeof(parser.value) - 1) {
+                parser.value[parser.valueLen++] = ch;
+            } else {
+                dispatchJsonlError(parser);
+            }
+            break;
+
+        default: // PARSER_ERROR
+            break;
+    }
+
+    // Every line starts over, an incomplete line is an error
+    if(ch == '\n' && parser.state != PARSER_LINE) {
+        if(parser.state != PARSER_ERROR) parser.errors++;
+        parser.state = PARSER_LINE;
+    }
+}
+
+void dispatchJsonlFeed(dispatchParser_t & parser, const char * data, size_t length)
+{
+    while(length--) dispatchJsonlFeed(parser, *data++);
+}
+
+void dispatchJsonlEnd(dispatchParser_t & parser)
+{
+    if(parser.state != PARSER_LINE) dispatchJsonlFeed(parser, '\n'); // Flush a trailing atom or report the error
+    if(parser.startTime == 0) return;
+
+    uint32_t elapsed = micros() - parser.startTime;
+    uint32_t rate    = elapsed > 0 ? (uint64_t)parser.commands * 1000000 / elapsed : 0;
+    Log.notice(F("CMND: %u commands, %u errors in %u us (%u cmd/s)"), parser.commands, parser.errors, elapsed, rate);
+}
+
+void dispatchJsonl(const char * payload, size_t length, const commandStamp_t & stamp)
+{
+    dispatchParser_t parser;
+    dispatchJsonlBegin(parser, stamp);
+    dispatchJsonlFeed(parser, payload, length);
+    dispatchJsonlEnd(parser);
+}
@@ -0,0 +1,38 @@
+#ifndef LEGO_DISPATCH_H
+#define LEGO_DISPATCH_H
+
+#include <Arduino.h>
+#include "lego_stats.h"
+
+#define DISPATCH_KEY_SIZE 48
+#define DISPATCH_VALUE_SIZE 64
+
+// Streaming JSON lines parser state, one per transport so no allocations are needed
+struct dispatchParser_t
+{
+    uint8_t state;
+    uint8_t keyLen;
+    uint8_t valueLen;
+    bool inArray;
+    bool escaped;
+    char key[DISPATCH_KEY_SIZE];
+    char value[DISPATCH_VALUE_SIZE];
+    uint16_t commands;
+    uint16_t errors;
+    uint32_t startTime;   // micros() of the first byte
+    commandStamp_t stamp; // Ingress of the message, shared by all its commands
+};
+
+bool dispatchKeyValue(const char * key, const char * value, const commandStamp_t & stamp);
+bool dispatchCommand(const char * cmdline, const commandStamp_t & stamp);
+bool dispatchConfig(const char * key, const char * value);
+bool dispatchTopic(const char * topic, const char * payload, size_t length, const commandStamp_t & stamp);
+void dispatchStatusUpdate(void);
+
+void dispatchJsonlBegin(dispatchParser_t & parser, const commandStamp_t & stamp);
+void dispatchJsonlFeed(dispatchParser_t & parser, char ch);
+void dispatchJsonlFeed(dispatchParser_t & parser, const char * data, size_t length);
+void dispatchJsonlEnd(dispatchParser_t & parser);
+void dispatchJsonl(const char * payload, size_t length, const commandStamp_t & stamp);
+
+#endif
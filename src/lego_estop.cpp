@@ -0,0 +1,54 @@
+/* Emergency stop fan-out to the hubs and replication to the group
+ *
+ * Pure logic without hardware access, lego_ble and lego_mqtt supply the clock and serialize the calls. The fan-out
+ * tracks which train hubs still have to write the stop and how long the slowest one took, a hub that disconnects
+ * meanwhile is stopped by losing the connection and drops out without adding to the latency. A stop raised here is
+ * published to the group on every loop until the broker takes it, for at most MQTT_ESTOP_RETRY_TIME.
+ */
+#include "lego_estop.h"
+
+// Starts over for hubs, the bitmask of the train hubs that were told to write the stop
+void estopRaise(estopFanout_t * fanout, uint32_t hubs, uint32_t now)
+{
+    fanout->start   = now;
+    fanout->waiting = hubs;
+    fanout->worst   = 0;
+}
+
+// The hub wrote the stop, or lost its connection when written is false. Returns true for the last hub of the
+// fan-out, worst is then the latency of the slowest hub in us.
+bool estopDone(estopFanout_t * fanout, uint8_t hub, bool written, uint32_t now, uint32_t * worst)
+{
+    if(hub >= ESTOP_MAX_HUBS || !(fanout->waiting & (1UL << hub))) return false;
+
+    fanout->waiting &= ~(1UL << hub);
+    if(written && now - fanout->start > fanout->worst) fanout->worst = now - fanout->start;
+    *worst = fanout->worst;
+    return fanout->waiting == 0;
+}
+
+void estopRetryRaise(estopRetry_t * retry, uint32_t now)
+{
+    retry->pending = true;
+    retry->raised  = now;
+}
+
+bool estopRetryPending(const estopRetry_t * retry)
+{
+    return retry->pending;
+}
+
+// The broker took the publish
+void estopRetrySent(estopRetry_t * retry)
+{
+    retry->pending = false;
+}
+
+// Returns true once when the stop could not be published in time. It is dropped then, stale by now, trains may
+// have been started again on purpose.
+bool estopRetryExpired(estopRetry_t * retry, uint32_t now)
+{
+    if(!retry->pending || now - retry->raised <= MQTT_ESTOP_RETRY_TIME) return false;
+    retry->pending = false;
+    return true;
+}
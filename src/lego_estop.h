@@ -0,0 +1,34 @@
+#ifndef LEGO_ESTOP_H
+#define LEGO_ESTOP_H
+
+#include <stdint.h>
+
+#define ESTOP_MAX_HUBS 32 // Hubs are kept in a bitmask
+
+// A local emergency stop is retried while it can't be published to the group
+#ifndef MQTT_ESTOP_RETRY_TIME
+#define MQTT_ESTOP_RETRY_TIME 10000 // ms
+#endif
+
+struct estopFanout_t
+{
+    uint32_t start;   // micros() when the emergency stop was raised
+    uint32_t waiting; // Bitmask of the hubs that have yet to write it
+    uint32_t worst;   // us until the slowest hub so far wrote it
+};
+
+struct estopRetry_t
+{
+    bool pending;    // A local emergency stop is waiting to be published
+    uint32_t raised; // millis() when it was raised
+};
+
+void estopRaise(estopFanout_t * fanout, uint32_t hubs, uint32_t now);
+bool estopDone(estopFanout_t * fanout, uint8_t hub, bool written, uint32_t now, uint32_t * worst);
+
+void estopRetryRaise(estopRetry_t * retry, uint32_t now);
+bool estopRetryPending(const estopRetry_t * retry);
+void estopRetrySent(estopRetry_t * retry);
+bool estopRetryExpired(estopRetry_t * retry, uint32_t now);
+
+#endif
@@ -0,0 +1,78 @@
+/* Channel replication between the controllers of an MQTT group
+ *
+ * Pure logic without network access, so two controllers can be run against each other in a native test. A speed
+ * set by a local source (a remote, a node command, Rocrail) marks its channel; lego_mqtt takes the marks and
+ * publishes the speeds on <group>/channel/<n>/<node>. Every controller of the group, the sender included, receives
+ * that message: the sender recognizes its own node name and drops it, the others apply the speed with
+ * groupSyncSpeed, which doesn't mark the channel, so a speed crosses the broker once and never comes back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lego_group.h"
+
+void groupReset(groupChannels_t * channels)
+{
+    for(uint8_t i = 0; i < LEGO_NUM_CHANNELS; i++) channels->speed[i] = 0;
+    __atomic_store_n(&channels->changed, 0, __ATOMIC_RELAXED);
+}
+
+// Speed change from a local source, marked for replication when it differs. Returns false for an invalid channel.
+bool groupSetSpeed(groupChannels_t * channels, uint8_t channel, int8_t speed)
+{
+    if(channel >= LEGO_NUM_CHANNELS) return false;
+
+    if(channels->speed[channel] != speed)
+        __atomic_fetch_or(&channels->changed, (channelMask_t)1 << channel, __ATOMIC_RELAXED);
+    channels->speed[channel] = speed;
+    return true;
+}
+
+// Speed change received from the group, not replicated again
+bool groupSyncSpeed(groupChannels_t * channels, uint8_t channel, int8_t speed)
+{
+    if(channel >= LEGO_NUM_CHANNELS) return false;
+
+    channels->speed[channel] = speed;
+    return true;
+}
+
+// Zero every channel, returns the channels that were moving
+channelMask_t groupStopAll(groupChannels_t * channels, bool replicate)
+{
+    channelMask_t moving = 0;
+
+    for(uint8_t i = 0; i < LEGO_NUM_CHANNELS; i++) {
+        if(channels->speed[i] != 0) moving |= (channelMask_t)1 << i;
+        channels->speed[i] = 0;
+    }
+    if(replicate) __atomic_fetch_or(&channels->changed, moving, __ATOMIC_RELAXED);
+    return moving;
+}
+
+// Returns the channels changed by a local source since the previous call
+channelMask_t groupTakeChanged(groupChannels_t * channels)
+{
+    return __atomic_exchange_n(&channels->changed, 0, __ATOMIC_RELAXED);
+}
+
+// Topic a controller publishes a channel speed on: <groupTopic>channel/<n>/<node>
+size_t groupChannelTopic(char * buffer, size_t size, const char * groupTopic, uint8_t channel, const char * node)
+{
+    int len = snprintf(buffer, size, "%schannel/%u/%s", groupTopic, channel, node);
+    return len < 0 || (size_t)len >= size ? 0 : len;
+}
+
+// Channel of a replicated speed, subtopic is the part after the group topic: channel/<n>/<origin>.
+// Returns -1 when the subtopic is malformed, names no valid channel or is the echo of our own publish.
+int8_t groupParseChannel(const char * subtopic, const char * node)
+{
+    if(strncmp(subtopic, "channel/", 8) != 0) return -1;
+
+    char * origin;
+    long channel = strtol(subtopic + 8, &origin, 10);
+    if(origin == subtopic + 8 || *origin != '/' || channel < 0 || channel >= LEGO_NUM_CHANNELS) return -1;
+    if(strcmp(origin + 1, node) == 0) return -1;
+    return channel;
+}
@@ -0,0 +1,36 @@
+#ifndef LEGO_GROUP_H
+#define LEGO_GROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef LEGO_NUM_CHANNELS
+#define LEGO_NUM_CHANNELS 9 // Same default as lego_conf.h, the native tests include this header on its own
+#endif
+
+// Bitmask with one bit per channel
+#if LEGO_NUM_CHANNELS > 64
+#error "LEGO_NUM_CHANNELS can be at most 64"
+#elif LEGO_NUM_CHANNELS > 32
+typedef uint64_t channelMask_t;
+#else
+typedef uint32_t channelMask_t;
+#endif
+
+// Channel speeds shared by the controllers of an MQTT group. Speeds set by a local source are marked for
+// replication, speeds received from the group are applied without a mark so they are never echoed back.
+struct groupChannels_t
+{
+    int8_t speed[LEGO_NUM_CHANNELS];
+    channelMask_t changed; // Channels changed by a local source since the last groupTakeChanged
+};
+
+void groupReset(groupChannels_t * channels);
+bool groupSetSpeed(groupChannels_t * channels, uint8_t channel, int8_t speed);
+bool groupSyncSpeed(groupChannels_t * channels, uint8_t channel, int8_t speed);
+channelMask_t groupStopAll(groupChannels_t * channels, bool replicate);
+channelMask_t groupTakeChanged(groupChannels_t * channels);
+size_t groupChannelTopic(char * buffer, size_t size, const char * groupTopic, uint8_t channel, const char * node);
+int8_t groupParseChannel(const char * subtopic, const char * node);
+
+#endif
@@ -0,0 +1,269 @@
+/* HTTP control API
+ *
+ * REST endpoints for the channel speeds, the hub list and the runtime stats, plus a WebSocket on /ws that pushes
+ * changed channel speeds and hub states as soon as httpLoop notices them, so a throttle page never polls.
+ * Static files are served from /www on SPIFFS, a precompressed name.gz is sent in place of name.
+ * Request handlers run in the async_tcp task. They only read state and queue commands, httpLoop dispatches the
+ * commands and builds the state diffs in the main loop, so dispatch never runs concurrently with the other sources.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_HTTP > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+#include <ESPAsyncWebServer.h>
+
+#include "lego_ble.h"
+#include "lego_dispatch.h"
+#include "lego_stats.h"
+#include "lego_http.h"
+
+#define HTTP_STATE_SIZE 1536                // Full state of all channels and hubs
+#define HTTP_COMMAND_SIZE 256               // Longest command line or JSON message accepted
+#define HTTP_QUEUE_SIZE 8                   // Commands waiting for httpLoop
+#define HTTP_CACHE_CONTROL "max-age=604800" // Static files only change with a new SPIFFS image
+
+enum { HTTP_CMD_KEYVALUE = 0, HTTP_CMD_LINE, HTTP_CMD_JSONL };
+
+// A command received by a handler, copied whole into the queue
+struct httpCommand_t
+{
+    uint8_t kind;
+    uint16_t length;
+    commandStamp_t stamp;
+    char key[DISPATCH_KEY_SIZE];
+    char text[HTTP_COMMAND_SIZE];
+};
+
+uint16_t httpPort = HTTP_PORT;
+
+static AsyncWebServer * httpServer = NULL;
+static AsyncWebSocket httpSocket("/ws");
+static QueueHandle_t httpQueue = NULL;
+
+// State last pushed to the WebSocket clients
+static int8_t httpChannelSpeed[LEGO_NUM_CHANNELS];
+static bleHubState_t httpHubState[MAX_BLE_DEVICES];
+
+static size_t http_get_hub_json(char * buffer, size_t size, const bleHubState_t & state)
+{
+    return snprintf_P(buffer, size,
+                      PSTR("{\"connected\":%s,\"remote\":%s,\"ch\":%u,\"speed\":%d,\"battery\":%u,\"rssi\":%d,"
+                           "\"rtt\":%u,\"degraded\":%s}"),
+                      state.connected ? "true" : "false", state.remote ? "true" : "false", state.channel, state.speed,
+                      state.battery, state.rssi, state.rtt, state.degraded ? "true" : "false");
+}
+
+// Channels and hubs keyed by their index. With diff set only what changed since the last diff is included, and
+// the baseline is updated once the whole diff fit in the buffer. Returns 0 when nothing changed or it didn't fit.
+static size_t http_get_state_json(char * buffer, size_t size, bool diff)
+{
+    int8_t speeds[LEGO_NUM_CHANNELS];
+    bleHubState_t states[MAX_BLE_DEVICES];
+    uint8_t changes = 0;
+    size_t len      = snprintf_P(buffer, size, PSTR("{\"channels\":{"));
+
+    for(uint8_t i = 0; i < LEGO_NUM_CHANNELS && len < size; i++) {
+        speeds[i] = ble_get_motor_speed(i);
+        if(diff && speeds[i] == httpChannelSpeed[i]) continue;
+        len += snprintf_P(buffer + len, size - len, PSTR("%s\"%u\":%d"), changes++ ? "," : "", i, speeds[i]);
+    }
+
+    uint8_t hubs = 0;
+    if(len < size) len += snprintf_P(buffer + len, size - len, PSTR("},\"hubs\":{"));
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES && len < size; i++) {
+        ble_get_hub_state(i, &states[i]);
+        if(diff && !memcmp(&states[i], &httpHubState[i], sizeof(states[i]))) continue;
+        len += snprintf_P(buffer + len, size - len, PSTR("%s\"%u\":"), hubs++ ? "," : "", i);
+        if(len < size) len += http_get_hub_json(buffer + len, size - len, states[i]);
+    }
+    if(len < size) len += snprintf_P(buffer + len, size - len, PSTR("}}"));
+
+    if(len >= size) return 0; // Truncated, the next round tries again against the same baseline
+    if(!diff) return len;
+    if(changes + hubs == 0) return 0;
+
+    memcpy(httpChannelSpeed, speeds, sizeof(httpChannelSpeed));
+    memcpy(httpHubState, states, sizeof(httpHubState));
+    return len;
+}
+
+static void http_send_json(AsyncWebServerRequest * request, const char * json)
+{
+    AsyncWebServerResponse * response = request->beginResponse(200, "application/json", json);
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+}
+
+// Hand a command to httpLoop, false when the queue is full or the command too long
+static bool http_queue_command(uint8_t kind, const char * key, const char * text, size_t length)
+{
+    httpCommand_t command;
+    if(httpQueue == NULL || length >= sizeof(command.text)) return false;
+
+    command.kind   = kind;
+    command.length = length;
+    command.stamp  = statsStamp(STATS_SOURCE_HTTP);
+    strncpy(command.key, key != NULL ? key : "", sizeof(command.key) - 1);
+    command.key[sizeof(command.key) - 1] = 0;
+    memcpy(command.text, text, length);
+    command.text[length] = 0;
+
+    if(xQueueSend(httpQueue, &command, 0) == pdTRUE) return true;
+    Log.warning(F("HTTP: Command queue full, command dropped"));
+    return false;
+}
+
+// Form fields of a POST take precedence over the query string
+static AsyncWebParameter * http_get_param(AsyncWebServerRequest * request, const char * name)
+{
+    if(request->hasParam(name, true)) return request->getParam(name, true);
+    return request->hasParam(name) ? request->getParam(name) : NULL;
+}
+
+/* ===== Request handlers ===== */
+
+// GET /api/channels
+static void http_get_channels(AsyncWebServerRequest * request)
+{
+    char buffer[LEGO_NUM_CHANNELS * 5 + 3];
+    size_t len = snprintf_P(buffer, sizeof(buffer), PSTR("["));
+    for(uint8_t i = 0; i < LEGO_NUM_CHANNELS && len < sizeof(buffer); i++) {
+        len += snprintf_P(buffer + len, sizeof(buffer) - len, PSTR("%s%d"), i ? "," : "", ble_get_motor_speed(i));
+    }
+    if(len < sizeof(buffer)) snprintf_P(buffer + len, sizeof(buffer) - len, PSTR("]"));
+    http_send_json(request, buffer);
+}
+
+// POST /api/channels with channel=<n>&speed=<-100..100>, accepted once queued for httpLoop
+static void http_set_channel(AsyncWebServerRequest * request)
+{
+    AsyncWebParameter * channel = http_get_param(request, "channel");
+    AsyncWebParameter * speed   = http_get_param(request, "speed");
+    if(channel == NULL || speed == NULL) {
+        request->send(400, "text/plain", "Expected channel and speed");
+        return;
+    }
+
+    char key[DISPATCH_KEY_SIZE];
+    snprintf_P(key, sizeof(key), PSTR("speed%s"), channel->value().c_str());
+    if(http_queue_command(HTTP_CMD_KEYVALUE, key, speed->value().c_str(), speed->value().length())) {
+        request->send(202);
+    } else {
+        request->send(503, "text/plain", "Busy");
+    }
+}
+
+// GET /api/hubs
+static void http_get_hubs(AsyncWebServerRequest * request)
+{
+    char buffer[BLE_HUBS_JSON_SIZE];
+    ble_get_hubs_json(buffer, sizeof(buffer));
+    http_send_json(request, buffer);
+}
+
+// GET /api/stats
+static void http_get_stats(AsyncWebServerRequest * request)
+{
+    char buffer[STATS_JSON_SIZE];
+    statsGetJson(buffer, sizeof(buffer));
+    http_send_json(request, buffer);
+}
+
+// POST /api/command with cmd=<command line>, the same commands as the serial console, accepted once queued
+static void http_command(AsyncWebServerRequest * request)
+{
+    AsyncWebParameter * cmd = http_get_param(request, "cmd");
+    if(cmd == NULL || cmd->value().length() == 0) {
+        request->send(400, "text/plain", "Invalid command");
+    } else if(http_queue_command(HTTP_CMD_LINE, NULL, cmd->value().c_str(), cmd->value().length())) {
+        request->send(202);
+    } else {
+        request->send(503, "text/plain", "Busy");
+    }
+}
+
+static void http_not_found(AsyncWebServerRequest * request)
+{
+    request->send(404, "text/plain", "Not found");
+}
+
+// New clients get the full state once, after that they only receive the diffs from httpLoop.
+// Text messages are commands: a JSON object or array goes to the JSON lines parser, anything else is a command line.
+static void http_socket_event(AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg,
+                              uint8_t * data, size_t len)
+{
+    if(type == WS_EVT_CONNECT) {
+        char buffer[HTTP_STATE_SIZE];
+        if(http_get_state_json(buffer, sizeof(buffer), false) > 0) client->text(buffer);
+        Log.notice(F("HTTP: WebSocket client %u connected"), client->id());
+
+    } else if(type == WS_EVT_DATA) {
+        AwsFrameInfo * info = (AwsFrameInfo *)arg;
+        if(!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT || len == 0) return;
+
+        uint8_t kind = data[0] == '{' || data[0] == '[' ? HTTP_CMD_JSONL : HTTP_CMD_LINE;
+        if(!http_queue_command(kind, NULL, (const char *)data, len)) client->text("{\"error\":\"busy\"}");
+    }
+}
+
+static void http_dispatch(const httpCommand_t & command)
+{
+    switch(command.kind) {
+        case HTTP_CMD_KEYVALUE:
+            dispatchKeyValue(command.key, command.text, command.stamp);
+            break;
+        case HTTP_CMD_LINE:
+            dispatchCommand(command.text, command.stamp);
+            break;
+        case HTTP_CMD_JSONL:
+            dispatchJsonl(command.text, command.length, command.stamp);
+            break;
+    }
+}
+
+void httpSetup(void)
+{
+#if LEGO_USE_SPIFFS > 0
+    if(!SPIFFS.begin(true)) Log.warning(F("HTTP: SPIFFS not mounted, static files unavailable"));
+#endif
+
+    httpQueue  = xQueueCreate(HTTP_QUEUE_SIZE, sizeof(httpCommand_t));
+    httpServer = new AsyncWebServer(httpPort);
+    httpSocket.onEvent(http_socket_event);
+    httpServer->addHandler(&httpSocket);
+
+    httpServer->on("/api/channels", HTTP_GET, http_get_channels);
+    httpServer->on("/api/channels", HTTP_POST, http_set_channel);
+    httpServer->on("/api/hubs", HTTP_GET, http_get_hubs);
+    httpServer->on("/api/stats", HTTP_GET, http_get_stats);
+    httpServer->on("/api/command", HTTP_POST, http_command);
+
+#if LEGO_USE_SPIFFS > 0
+    httpServer->serveStatic("/", SPIFFS, "/www/").setDefaultFile("index.html").setCacheControl(HTTP_CACHE_CONTROL);
+#endif
+    httpServer->onNotFound(http_not_found);
+    httpServer->begin();
+
+    Log.notice(F("HTTP: Listening on port %u"), httpPort);
+}
+
+void httpLoop(void)
+{
+    httpCommand_t command;
+    while(httpQueue != NULL && xQueueReceive(httpQueue, &command, 0) == pdTRUE) http_dispatch(command);
+
+    // Skip a round while a client is still sending the previous diff, the changes are merged into the next one
+    if(httpSocket.count() == 0 || !httpSocket.availableForWriteAll()) return;
+
+    char buffer[HTTP_STATE_SIZE];
+    size_t len = http_get_state_json(buffer, sizeof(buffer), true);
+    if(len > 0) httpSocket.textAll(buffer, len);
+}
+
+void httpEvery5Seconds(void)
+{
+    httpSocket.cleanupClients(HTTP_MAX_SOCKETS);
+}
+
+#endif // LEGO_USE_HTTP
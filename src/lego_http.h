@@ -0,0 +1,20 @@
+#ifndef LEGO_HTTP_H
+#define LEGO_HTTP_H
+
+#include <Arduino.h>
+
+#ifndef HTTP_PORT
+#define HTTP_PORT 80
+#endif
+
+#ifndef HTTP_MAX_SOCKETS
+#define HTTP_MAX_SOCKETS 4 // Concurrent WebSocket clients, the oldest is dropped beyond this
+#endif
+
+extern uint16_t httpPort;
+
+void httpSetup(void);
+void httpLoop(void);
+void httpEvery5Seconds(void);
+
+#endif
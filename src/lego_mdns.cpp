@@ -0,0 +1,181 @@
+/* mDNS service advertisement and broker discovery
+ *
+ * Once the network is up the controller announces itself as <node>.local with the controller, HTTP and telnet
+ * services. Every service carries the node name, the number of connected hubs and the firmware version in its TXT
+ * record, the hub count is refreshed whenever the hub list changes.
+ * Without a configured broker an _mqtt._tcp lookup runs in its own task, so neither setup nor the BLE scan wait
+ * for the answer. The main loop hands a found broker to the MQTT client.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_MDNS > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+#include <ESPmDNS.h>
+
+#include "lego_ble.h"
+#include "lego_hal.h"
+#include "lego_mdns.h"
+
+enum { MDNS_DISCOVER_IDLE = 0, MDNS_DISCOVER_RUNNING, MDNS_DISCOVER_FOUND };
+
+bool mdnsDiscoverBroker = MDNS_DISCOVER_BROKER;
+
+static char mdnsHostname[24];
+static volatile bool mdnsNetworkIsUp    = false; // Set from the WiFi event handler
+static bool mdnsStarted                 = false;
+static uint16_t mdnsHubsVersion         = 0;
+static volatile uint8_t mdnsDiscovery   = MDNS_DISCOVER_IDLE;
+static unsigned long mdnsNextDiscovery  = 0;
+static unsigned long mdnsDiscoveryStart = 0;
+
+// Written by the discovery task before it sets MDNS_DISCOVER_FOUND
+static char mdnsBrokerHost[16];
+static uint16_t mdnsBrokerPort;
+
+static uint8_t mdns_count_hubs(void)
+{
+    uint8_t count = 0;
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        bleHubState_t state;
+        ble_get_hub_state(i, &state);
+        if(state.connected && !state.remote) count++;
+    }
+    return count;
+}
+
+// Adding an existing TXT key replaces its value
+static void mdns_set_txt(const char * service, const char * key, const char * value)
+{
+    MDNS.addServiceTxt(service, "tcp", key, value);
+}
+
+static void mdns_set_hubs_txt(const char * service)
+{
+    char hubs[4];
+    snprintf_P(hubs, sizeof(hubs), PSTR("%u"), mdns_count_hubs());
+    mdns_set_txt(service, "hubs", hubs);
+}
+
+static void mdns_add_service(const char * service, uint16_t port)
+{
+    char version[12];
+    snprintf_P(version, sizeof(version), PSTR("%u.%u.%u"), LEGO_VERSION_MAJOR, LEGO_VERSION_MINOR,
+               LEGO_VERSION_REVISION);
+
+    MDNS.addService(service, "tcp", port);
+    mdns_set_txt(service, "node", mdnsHostname);
+    mdns_set_txt(service, "version", version);
+    mdns_set_hubs_txt(service);
+}
+
+static void mdns_update_hubs(void)
+{
+    mdns_set_hubs_txt(MDNS_SERVICE);
+#if LEGO_USE_HTTP > 0
+    mdns_set_hubs_txt("http");
+#endif
+#if LEGO_USE_TELNET > 0
+    mdns_set_hubs_txt("telnet");
+#endif
+}
+
+static void mdns_start(void)
+{
+    if(!MDNS.begin(mdnsHostname)) {
+        Log.warning(F("MDNS: Failed to start responder for %s.local"), mdnsHostname);
+        mdnsNetworkIsUp = false; // Retry on the next network event
+        return;
+    }
+
+    // The controller service points at the HTTP API when there is one, its TXT record adds the MQTT group
+#if LEGO_USE_HTTP > 0
+    mdns_add_service(MDNS_SERVICE, httpPort);
+    mdns_add_service("http", httpPort);
+#else
+    mdns_add_service(MDNS_SERVICE, 0);
+#endif
+#if LEGO_USE_TELNET > 0
+    mdns_add_service("telnet", telnetPort);
+#endif
+#if LEGO_USE_MQTT > 0
+    mdns_set_txt(MDNS_SERVICE, "group", mqttGroupName);
+#endif
+
+    mdnsStarted     = true;
+    mdnsHubsVersion = ble_get_hubs_version();
+    Log.notice(F("MDNS: Responding as %s.local"), mdnsHostname);
+}
+
+#if LEGO_USE_MQTT > 0
+static void mdns_discover_task(void * parameter)
+{
+    int count = MDNS.queryService("mqtt", "tcp"); // Blocks for the query timeout when nobody answers
+    if(count > 0) {
+        strncpy(mdnsBrokerHost, MDNS.IP(0).toString().c_str(), sizeof(mdnsBrokerHost) - 1);
+        mdnsBrokerPort = MDNS.port(0);
+        mdnsDiscovery  = MDNS_DISCOVER_FOUND;
+    } else {
+        mdnsDiscovery = MDNS_DISCOVER_IDLE;
+    }
+    vTaskDelete(NULL);
+}
+
+static void mdns_discover_broker(void)
+{
+    if(mdnsDiscovery == MDNS_DISCOVER_FOUND) {
+        Log.notice(F("MDNS: Found broker %s:%u in %u ms"), mdnsBrokerHost, mdnsBrokerPort,
+                   millis() - mdnsDiscoveryStart);
+        mqttSetServer(mdnsBrokerHost, mdnsBrokerPort);
+        mdnsDiscovery = MDNS_DISCOVER_IDLE;
+        return;
+    }
+
+    if(mdnsDiscovery != MDNS_DISCOVER_IDLE || strlen(mqttServer) > 0) return;
+    if((long)(millis() - mdnsNextDiscovery) < 0) return;
+
+    mdnsNextDiscovery = millis() + MDNS_DISCOVER_INTERVAL;
+    if(mdnsDiscoveryStart == 0) mdnsDiscoveryStart = millis();
+    mdnsDiscovery = MDNS_DISCOVER_RUNNING;
+    if(xTaskCreate(mdns_discover_task, "MdnsTask", 3072, NULL, 1, NULL) != pdPASS) {
+        mdnsDiscovery = MDNS_DISCOVER_IDLE;
+    }
+}
+#endif
+
+void mdnsSetup(void)
+{
+#if LEGO_USE_MQTT > 0
+    if(strlen(mqttNodeName) > 0) {
+        strncpy(mdnsHostname, mqttNodeName, sizeof(mdnsHostname) - 1);
+        return;
+    }
+#endif
+    String mac = halGetMacAddress(3, "");
+    mac.toLowerCase();
+    snprintf_P(mdnsHostname, sizeof(mdnsHostname), PSTR("plate-%s"), mac.c_str());
+}
+
+// Called from the WiFi event handler, the responder is started from the loop
+void mdnsNetworkUp(void)
+{
+    mdnsNetworkIsUp = true;
+}
+
+void mdnsLoop(void)
+{
+    if(!mdnsNetworkIsUp) return;
+    if(!mdnsStarted) mdns_start();
+    if(!mdnsStarted) return;
+
+    if(mdnsHubsVersion != ble_get_hubs_version()) {
+        mdnsHubsVersion = ble_get_hubs_version();
+        mdns_update_hubs();
+    }
+
+#if LEGO_USE_MQTT > 0
+    if(mdnsDiscoverBroker) mdns_discover_broker();
+#endif
+}
+
+#endif // LEGO_USE_MDNS
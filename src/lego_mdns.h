@@ -0,0 +1,22 @@
+#ifndef LEGO_MDNS_H
+#define LEGO_MDNS_H
+
+#include <Arduino.h>
+
+#ifndef MDNS_SERVICE
+#define MDNS_SERVICE "puptrain" // Service type of the controller itself, browse for _puptrain._tcp
+#endif
+
+#ifndef MDNS_DISCOVER_BROKER
+#define MDNS_DISCOVER_BROKER 1 // Look up an _mqtt._tcp broker when none is configured
+#endif
+
+#ifndef MDNS_DISCOVER_INTERVAL
+#define MDNS_DISCOVER_INTERVAL 30000 // ms between broker lookups until one answers
+#endif
+
+void mdnsSetup(void);
+void mdnsLoop(void);
+void mdnsNetworkUp(void);
+
+#endif
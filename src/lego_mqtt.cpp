@@ -3,33 +3,17 @@
 
 #include <Arduino.h>
 #include "ArduinoLog.h"
-#include "PubSubClient.h"
-#include "tinyxml2.h" // tiny xml 2 library
-
-using namespace tinyxml2;
 
 #include "lego_mqtt.h"
 #include "lego_ble.h"
-
-#if defined(ARDUINO_ARCH_ESP32)
-#include <Wifi.h>
-WiFiClient mqttNetworkClient;
-#elif defined(ARDUINO_ARCH_ESP8266)
-#include <ESP8266WiFi.h>
-#include <EEPROM.h>
-#include <ESP.h>
-WiFiClient mqttNetworkClient;
-#else
-
-#if defined(W5500_MOSI) && defined(W5500_MISO) && defined(W5500_SCLK)
-#define W5500_LAN
-#include <Ethernet.h>
-#else
-#include <STM32Ethernet.h>
-#endif
-
-EthernetClient mqttNetworkClient;
-#endif
+#include "lego_group.h"
+#include "lego_sensor.h"
+#include "lego_dispatch.h"
+#include "lego_capture.h"
+#include "lego_estop.h"
+#include "lego_retry.h"
+#include "lego_mqtt_client.h"
+#include "lego_rocrail.h"
 
 #include "lego_hal.h"
 #include "lego_debug.h"
@@ -40,18 +24,21 @@ EthernetClient mqttNetworkClient;
 #include "user_config_override.h"
 #endif
 
-extern unsigned long debugLastMillis; // UpdateStatus timer
 
 char mqttNodeTopic[24];
 char mqttGroupTopic[24];
 bool mqttEnabled;
+bool mqttHubsPublished         = false; // The retained hub list needs to be (re)published
+uint16_t mqttHubsVersion       = 0;
+unsigned long mqttSensorsLast  = 0; // millis() of the last sensor update
+estopRetry_t mqttEstop;             // Local emergency stop waiting to be published to the group
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // These defaults may be overwritten with values saved by the web interface
 #ifdef MQTT_HOST
-char mqttServer[16] = MQTT_HOST;
+char mqttServer[64] = MQTT_HOST;
 #else
-char mqttServer[16]    = "";
+char mqttServer[64]    = "";
 #endif
 #ifdef MQTT_PORT
 uint16_t mqttPort = MQTT_PORT;
@@ -82,7 +69,41 @@ char mqttGroupName[16] = "";
 #define MQTT_PREFIX "lego"
 #endif
 
-PubSubClient mqttClient(mqttNetworkClient);
+// The offline queue and the reconnect backoff are sized in lego_retry.h
+#ifndef MQTT_QUEUE_BURST
+#define MQTT_QUEUE_BURST 2 // Queued messages sent per loop, so incoming commands keep flowing
+#endif
+
+// Commands sent as '#<seq> <payload>' are acknowledged on state/ack once the speed has been written to the hub
+#ifndef MQTT_ACK_QUEUE_SIZE
+#define MQTT_ACK_QUEUE_SIZE 16 // Acks waiting to be published
+#endif
+#ifndef MQTT_DEDUP_WINDOW
+#define MQTT_DEDUP_WINDOW 16 // Recent sequence ids, a retransmit within the window is not applied twice
+#endif
+
+struct mqttAck_t
+{
+    uint32_t seq;
+    uint8_t hub; // MQTT_ACK_NO_HUB in the dedup window until a hub has acked the command
+};
+mqttAck_t mqttAckQueue[MQTT_ACK_QUEUE_SIZE];
+uint8_t mqttAckHead     = 0;
+uint8_t mqttAckCount    = 0;
+uint32_t mqttAckDropped = 0;
+portMUX_TYPE mqttAckMux = portMUX_INITIALIZER_UNLOCKED; // Acks are queued from the hub tasks
+mqttAck_t mqttSeen[MQTT_DEDUP_WINDOW];
+uint8_t mqttSeenIndex   = 0;
+
+retryQueue_t mqttQueue;
+
+volatile bool mqttNetworkIsUp  = false; // Set from the WiFi event task
+bool mqttWasConnected          = false;
+retryBackoff_t mqttBackoff;
+unsigned long mqttOutageStart  = 0; // millis() when the connection was lost, 0 = connected
+char mqttClientId[24];
+uint8_t mqttReconnectCount     = 0;
+bool mqttFirstConnect          = true;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Send changed values OUT
@@ -94,134 +115,220 @@ void mqtt_log_no_connection()
 
 bool IRAM_ATTR mqttIsConnected()
 {
-    return mqttEnabled && mqttClient.connected();
+    return mqttEnabled && mqttClientConnected();
 }
 
-void IRAM_ATTR mqtt_send_state(const __FlashStringHelper * subtopic, const char * payload)
+// Keep the latest payload of a state topic until the broker is back, replacing an older queued value
+static void mqtt_queue_state(const char * subtopic, const char * payload)
 {
-    if(mqttIsConnected()) {
+    if(!retryQueuePut(&mqttQueue, subtopic, payload)) return mqtt_log_no_connection();
+    Log.verbose(F("MQTT: Queued state/%s, %u topics pending"), subtopic, mqttQueue.count);
+}
+
+// Send a few queued messages in the order they were last updated
+static void mqtt_flush_queue()
+{
+    for(uint8_t sent = 0; sent < MQTT_QUEUE_BURST && mqttQueue.count > 0; sent++) {
+        retryQueueItem_t * oldest = retryQueueOldest(&mqttQueue);
+
         char topic[64];
-        snprintf_P(topic, sizeof(topic), PSTR("%sstate/%s"), mqttNodeTopic, subtopic);
-        mqttClient.publish(topic, payload);
+        snprintf_P(topic, sizeof(topic), PSTR("%sstate/%s"), mqttNodeTopic, oldest->subtopic);
+        if(!mqttClientPublish(topic, oldest->payload)) return; // Retry on the next loop
+
+        Log.notice(F("MQTT PUB: %s = %s"), topic, oldest->payload);
+        retryQueueRemove(&mqttQueue, oldest);
+    }
+
+    if(mqttQueue.count == 0 && mqttQueue.dropped > 0) {
+        Log.warning(F("MQTT: %u state messages were lost while disconnected"), mqttQueue.dropped);
+        mqttQueue.dropped = 0;
+    }
+}
+
+// Called from any task when an enveloped command has reached a hub, the publish happens in mqttLoop
+void IRAM_ATTR mqtt_ack_command(uint32_t seq, uint8_t hub)
+{
+    portENTER_CRITICAL(&mqttAckMux);
+    if(mqttAckCount < MQTT_ACK_QUEUE_SIZE) {
+        mqttAck_t * ack = &mqttAckQueue[(mqttAckHead + mqttAckCount++) % MQTT_ACK_QUEUE_SIZE];
+        ack->seq        = seq;
+        ack->hub        = hub;
     } else {
-        return mqtt_log_no_connection();
+        mqttAckDropped++;
     }
+    portEXIT_CRITICAL(&mqttAckMux);
+}
 
-    // Log after char buffers are cleared
-    Log.notice(F("MQTT PUB: %sstate/%S = %s"), mqttNodeTopic, subtopic, payload);
+static void mqtt_send_acks()
+{
+    while(mqttAckCount > 0) {
+        mqttAck_t ack = mqttAckQueue[mqttAckHead]; // Only this loop removes entries
+
+        char topic[64];
+        char payload[40];
+        snprintf_P(topic, sizeof(topic), PSTR("%sstate/ack"), mqttNodeTopic);
+        if(ack.hub == MQTT_ACK_NO_HUB) {
+            snprintf_P(payload, sizeof(payload), PSTR("{\"seq\":%u,\"hub\":null}"), ack.seq);
+        } else {
+            snprintf_P(payload, sizeof(payload), PSTR("{\"seq\":%u,\"hub\":%u}"), ack.seq, ack.hub);
+        }
+        if(!mqttClientPublish(topic, payload)) return; // Retry on the next loop
+
+        portENTER_CRITICAL(&mqttAckMux);
+        mqttAckHead = (mqttAckHead + 1) % MQTT_ACK_QUEUE_SIZE;
+        mqttAckCount--;
+        portEXIT_CRITICAL(&mqttAckMux);
+
+        for(uint8_t i = 0; i < MQTT_DEDUP_WINDOW; i++) {
+            if(mqttSeen[i].seq == ack.seq && ack.hub != MQTT_ACK_NO_HUB) mqttSeen[i].hub = ack.hub;
+        }
+    }
+
+    if(mqttAckDropped > 0) {
+        Log.warning(F("MQTT: %u command acks were lost"), mqttAckDropped);
+        mqttAckDropped = 0;
+    }
 }
 
-void mqtt_send_statusupdate()
-{ // Periodically publish a JSON string indicating system status
-    char data[3 * 128];
-    memset(data, 0, sizeof(data));
-    {
-        char buffer[128];
-        memset(buffer, 0, sizeof(buffer));
+// Remembers the sequence id, a retransmit of a recent command is not applied again but always acked again:
+// with the hub once one has acked it, otherwise without a hub so the sender stops retransmitting
+static bool mqtt_is_duplicate(uint32_t seq)
+{
+    for(uint8_t i = 0; i < MQTT_DEDUP_WINDOW; i++) {
+        if(mqttSeen[i].seq != seq) continue;
 
-#if defined(ARDUINO_ARCH_ESP8266)
-        snprintf_P(buffer, sizeof(buffer), PSTR("\"espVcc\":%.2f,"), (float)ESP.getVcc() / 1000);
-        strcat(data, buffer);
-#endif
+        Log.notice(F("MQTT: Duplicate command #%u ignored"), seq);
+        mqtt_ack_command(seq, mqttSeen[i].hub);
+        return true;
     }
-    mqtt_send_state(F("statusupdate"), data);
-    debugLastMillis = millis();
+
+    mqttSeen[mqttSeenIndex].seq = seq;
+    mqttSeen[mqttSeenIndex].hub = MQTT_ACK_NO_HUB;
+    mqttSeenIndex               = (mqttSeenIndex + 1) % MQTT_DEDUP_WINDOW;
+    return false;
 }
 
-void handleXml(char * topic_p, byte * payload, unsigned int length)
+void IRAM_ATTR mqtt_send_state(const __FlashStringHelper * subtopic, const char * payload)
 {
-    XMLDocument xmlDocument;
-    if(xmlDocument.Parse((const char *)payload) != XML_SUCCESS) {
-        Serial.println("Error parsing");
-        return;
+    // Older values of the same topic must not overtake this one, so queue while the queue is draining
+    char topic[64];
+    snprintf_P(topic, sizeof(topic), PSTR("%sstate/%s"), mqttNodeTopic, subtopic);
+    if(!mqttIsConnected() || mqttQueue.count > 0 || !mqttClientPublish(topic, payload)) {
+        return mqtt_queue_state((const char *)subtopic, payload);
     }
 
-    Serial.println("Parsing XML successful");
+    // Log after char buffers are cleared
+    Log.notice(F("MQTT PUB: %sstate/%S = %s"), mqttNodeTopic, subtopic, payload);
+}
 
-    const char * rr_id = "-unknown--unknown--unknown--unknown--unknown--unknown--unknown-";
-    int rr_addr        = 0;
+// Advertise the hubs owned by this controller to the rest of the group
+void mqtt_send_hubs()
+{
+    char topic[64];
+    char payload[BLE_HUBS_JSON_SIZE];
 
-    // check for lc message
-    XMLElement * element = xmlDocument.FirstChildElement("lc");
-    if(element != NULL) {
-        Serial.println("<lc> node found. Processing loco message...");
+    mqttHubsVersion = ble_get_hubs_version();
+    ble_get_hubs_json(payload, sizeof(payload));
+    snprintf_P(topic, sizeof(topic), PSTR("%sstate/hubs"), mqttNodeTopic);
+    mqttHubsPublished = mqttClientPublish(topic, payload, true);
 
-        // -> process lc (loco) message
+    Log.notice(F("MQTT PUB: %s = %s"), topic, payload);
+}
 
-        // query id attribute. This is the loco id.
-        // The id is a mandatory field. If not found, the message is discarded.
-        // Nevertheless, the id has no effect on the controller behaviour. Only the "addr" attribute is relevant for
-        // checking if the message is for this controller - see below.
-        if(element->QueryStringAttribute("id", &rr_id) != XML_SUCCESS) {
-            Serial.println("id attribute not found or wrong type.");
-            return;
-        }
-        Serial.println("loco id: " + String(rr_id));
+// Replicate channel speeds set by local sources to the other controllers in the group
+void mqtt_send_channels()
+{
+    channelMask_t changed = ble_take_changed_channels();
 
-        // query addr attribute. This is the MattzoController id.
-        // If this does not equal the ControllerNo of this controller, the message is disregarded.
-        if(element->QueryIntAttribute("addr", &rr_addr) != XML_SUCCESS) {
-            Serial.println("addr attribute not found or wrong type. Message disregarded.");
-            return;
-        }
-        Serial.println("addr: " + String(rr_addr));
-        // if (rr_addr != controllerNo) {
-        //   Serial.println("Message disgarded, as it is not for me, but for MattzoController No. " + String(rr_addr));
-        //   return;
-        // }
-
-        // query dir attribute. This is direction information for the loco (forward, backward)
-        const char * rr_dir = "xxxxxx"; // expected values are "true" or "false"
-        int dir;
-        if(element->QueryStringAttribute("dir", &rr_dir) != XML_SUCCESS) {
-            Serial.println("dir attribute not found or wrong type.");
-            return;
-        }
-        Serial.println("dir (raw): " + String(rr_dir));
-        if(strcmp(rr_dir, "true") == 0) {
-            Serial.println("direction: forward");
-            dir = 1;
-        } else if(strcmp(rr_dir, "false") == 0) {
-            Serial.println("direction: backward");
-            dir = -1;
-        } else {
-            Serial.println("unknown dir value - disregarding message.");
-            return;
-        }
+    for(uint8_t channel = 0; changed != 0; channel++, changed >>= 1) {
+        if((changed & 1) == 0) continue;
 
-        // query V attribute. This is speed information for the loco and ranges from 0 to V_max (see below).
-        int rr_v = 0;
-        if(element->QueryIntAttribute("V", &rr_v) != XML_SUCCESS) {
-            Serial.println("V attribute not found or wrong type. Message disregarded.");
-            return;
-        }
-        Serial.println("speed: " + String(rr_v));
-
-        // query V_max attribute. This is maximum speed of the loco. It must be set in the loco settings in Rocrail as
-        // percentage value. The V_max attribute is required to map to loco speed from rocrail to a power setting in the
-        // MattzoController.
-        int rr_vmax = 0;
-        if(element->QueryIntAttribute("V_max", &rr_vmax) != XML_SUCCESS) {
-            Serial.println("V_max attribute not found or wrong type. Message disregarded.");
-            return;
-        }
-        Serial.println("V_max: " + String(rr_vmax));
+        char topic[64];
+        char payload[8];
+        groupChannelTopic(topic, sizeof(topic), mqttGroupTopic, channel, mqttNodeName);
+        snprintf_P(payload, sizeof(payload), PSTR("%d"), ble_get_motor_speed(channel));
+        mqttClientPublish(topic, payload);
+    }
+}
+
+// Publish the port devices of the hubs with new readings, at most once every SENSOR_PUBLISH_INTERVAL
+static void mqtt_send_sensors()
+{
+    if(millis() - mqttSensorsLast < SENSOR_PUBLISH_INTERVAL) return;
+    uint32_t changed = ble_take_changed_sensors();
+    if(changed == 0) return;
+    mqttSensorsLast = millis();
+
+    for(uint8_t index = 0; changed != 0; index++, changed >>= 1) {
+        if((changed & 1) == 0) continue;
+
+        char topic[64];
+        char payload[160];
+        snprintf_P(topic, sizeof(topic), PSTR("%sstate/sensors/%u"), mqttNodeTopic, index);
+        ble_get_sensors_json(index, payload, sizeof(payload));
+        mqttClientPublish(topic, payload);
+    }
+}
+
+// Replicate an emergency stop raised by a local source to the other controllers in the group. Not retained, a
+// retained stop would halt every controller that subscribes later, so a refused publish is retried from mqttLoop.
+static void mqtt_send_estop()
+{
+    char topic[64];
+    snprintf_P(topic, sizeof(topic), PSTR("%sestop/%s"), mqttGroupTopic, mqttNodeName);
+    if(!mqttClientPublish(topic, "1")) return;
+
+    estopRetrySent(&mqttEstop);
+    Log.warning(F("MQTT PUB: %s = 1"), topic);
+}
 
-        // set target train speed
-        int targetTrainSpeed = rr_v * dir;
-        int maxTrainSpeed    = rr_vmax;
-        Serial.println("Message parsing complete, target speed set to " + String(targetTrainSpeed) +
-                       ", max: " + String(maxTrainSpeed) + ")");
+// Publish the command latency histograms per source, per hub and per coexistence mode
+void mqtt_send_latency()
+{
+    if(!mqttIsConnected()) return mqtt_log_no_connection();
 
-        ble_set_motor_speed(4, targetTrainSpeed);
+    char topic[64];
+    char payload[192];
+    for(uint8_t i = STATS_SOURCE_NONE + 1; i < STATS_SOURCE_COUNT; i++) {
+        if(!statsGetLatencyJson(payload, sizeof(payload), STATS_LATENCY_SOURCE, i)) continue;
+        snprintf_P(topic, sizeof(topic), PSTR("%sstate/latency/%s"), mqttNodeTopic, statsSourceName(i));
+        mqttClientPublish(topic, payload);
+    }
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        if(!statsGetLatencyJson(payload, sizeof(payload), STATS_LATENCY_HUB, i)) continue;
+        snprintf_P(topic, sizeof(topic), PSTR("%sstate/latency/hub%u"), mqttNodeTopic, i);
+        mqttClientPublish(topic, payload);
     }
+#if LEGO_USE_COEX > 0
+    for(uint8_t i = 0; i < COEX_MODE_COUNT; i++) {
+        if(!statsGetLatencyJson(payload, sizeof(payload), STATS_LATENCY_COEX, i)) continue;
+        snprintf_P(topic, sizeof(topic), PSTR("%sstate/latency/coex/%s"), mqttNodeTopic, coexModeName(i));
+        mqttClientPublish(topic, payload);
+    }
+#endif
+}
+
+void mqtt_send_statusupdate()
+{ // Periodically publish a JSON string with the runtime statistics
+    debugLastMillis = millis();
+    if(!mqttIsConnected()) return mqtt_log_no_connection(); // Not queued, too big and stale by the next period
+
+    char topic[64];
+    char data[STATS_JSON_SIZE];
+    statsGetJson(data, sizeof(data));
+    snprintf_P(topic, sizeof(topic), PSTR("%sstate/stats"), mqttNodeTopic);
+    if(mqttClientPublish(topic, data)) Log.notice(F("MQTT PUB: %s = %s"), topic, data);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Receive incoming messages
 static void mqtt_message_cb(char * topic_p, byte * payload, unsigned int length)
 { // Handle incoming commands from MQTT
+    commandStamp_t stamp = statsStamp(STATS_SOURCE_MQTT);
     if(length >= MQTT_MAX_PACKET_SIZE) return;
+    statsCount(statsCounters.mqttIn);
+    statsCount(statsCounters.mqttInBytes, length);
+    captureMqtt(topic_p, payload, length);
     payload[length] = '\0';
 
     // String strTopic((char *)0);
@@ -230,68 +337,52 @@ static void mqtt_message_cb(char * topic_p, byte * payload, unsigned int length)
     char * topic = (char *)topic_p;
     Log.notice(F("MQTT RCV: %s = %s"), topic, (char *)payload);
 
+    bool fromGroup = false;
     if(topic == strstr(topic, mqttNodeTopic)) { // startsWith mqttNodeTopic
         topic += strlen(mqttNodeTopic);
     } else if(topic == strstr(topic, mqttGroupTopic)) { // startsWith mqttGroupTopic
         topic += strlen(mqttGroupTopic);
+        fromGroup    = true;
+        stamp.source = STATS_SOURCE_GROUP;
     } else {
         // Log.error(F("MQTT: Message received with invalid topic"));
-        handleXml(topic_p, payload, length);
+        rocrailParse((char *)payload, length, stamp);
         return;
     }
     // Log.trace(F("MQTT IN: short topic: %s"), topic);
 
-    if(!strcmp_P(topic, PSTR("command"))) {
-        // dispatchCommand((char *)payload);
-        return;
-    }
-
-    if(!strcmp_P(topic, PSTR("command/red"))) {
-        ble_set_motor_speed(0, atoi((const char *)payload));
-        return;
-    }
-
-    if(!strcmp_P(topic, PSTR("command/yellow"))) {
-        ble_set_motor_speed(3, atoi((const char *)payload));
-        return;
+    // Optional envelope '#<seq> <payload>' asks for an ack once the command has been written to the hub
+    if(payload[0] == '#') {
+        char * start = (char *)payload + 1;
+        stamp.seq    = strtoul(start, &start, 10);
+        if(*start == ' ') start++;
+        length -= (byte *)start - payload;
+        payload = (byte *)start;
+        if(stamp.seq != 0 && mqtt_is_duplicate(stamp.seq)) return;
     }
 
-    if(!strcmp_P(topic, PSTR("command/green"))) {
-        ble_set_motor_speed(4, atoi((const char *)payload));
+    // Speed replicated by another controller in the group: lego/<group>/channel/<n>/<node>
+    if(fromGroup && topic == strstr_P(topic, PSTR("channel/"))) {
+        int8_t channel = groupParseChannel(topic, mqttNodeName); // Our own publish comes back too
+        if(channel >= 0) ble_sync_motor_speed(channel, atoi((const char *)payload), stamp);
         return;
     }
 
-    if(!strcmp_P(topic, PSTR("command/purple"))) {
-        ble_set_motor_speed(5, atoi((const char *)payload));
+    // Emergency stop raised by another controller in the group: lego/<group>/estop/<node>
+    if(fromGroup && topic == strstr_P(topic, PSTR("estop/"))) {
+        if(strcmp(topic + 6u, mqttNodeName) != 0) ble_sync_emergency_stop(stamp);
         return;
     }
 
-    if(!strcmp_P(topic, PSTR("command/scan"))) {
-        ble_start_scan();
+    // Group commands reach every controller, the dispatcher doesn't replicate them
+    if(!strcmp_P(topic, PSTR("command")) || topic == strstr_P(topic, PSTR("command/"))) {
+        dispatchTopic(topic, (char *)payload, length, stamp);
         return;
     }
 
-    if(topic == strstr_P(topic, PSTR("command/"))) { // startsWith command/
-        topic += 8u;
-        // Log.trace(F("MQTT IN: command subtopic: %s"), topic);
-
-        if(!strcmp_P(topic, PSTR("json"))) { // '[...]/device/command/json' -m '["dim=5", "page 1"]' =
-                                             // nextionSendCmd("dim=50"), nextionSendCmd("page 1")
-                                             //  dispatchJson((char *)payload); // Send to nextionParseJson()
-        } else if(!strcmp_P(topic, PSTR("jsonl"))) {
-            //  dispatchJsonl((char *)payload);
-        } else if(length == 0) {
-            // dispatchCommand(topic);
-        } else { // '[...]/device/command/p[1].b[4].txt' -m '"Lights On"' ==
-                 // nextionSetAttr("p[1].b[4].txt", "\"Lights On\"")
-                 //  dispatchAttribute(topic, (char *)payload);
-        }
-        return;
-    }
-
-    if(topic == strstr_P(topic, PSTR("config/"))) { // startsWith command/
+    if(topic == strstr_P(topic, PSTR("config/"))) { // startsWith config/
         topic += 7u;
-        // dispatchConfig(topic, (char *)payload);
+        dispatchConfig(topic, (char *)payload);
         return;
     }
 
@@ -299,29 +390,81 @@ static void mqtt_message_cb(char * topic_p, byte * payload, unsigned int length)
     if(!strcmp_P(topic, PSTR("status")) && !strcmp_P((char *)payload, PSTR("OFF"))) {
         char topicBuffer[128];
         snprintf_P(topicBuffer, sizeof(topicBuffer), PSTR("%sstatus"), mqttNodeTopic);
-        mqttClient.publish(topicBuffer, "ON", true);
+        mqttClientPublish(topicBuffer, "ON", true);
         Log.notice(F("MQTT: binary_sensor state: [status] : ON"));
         return;
     }
 }
 
-void mqttSubscribeTo(const char * format, const char * data)
+// Consumers of messages too large for the receive buffer
+enum { MQTT_STREAM_SKIP = 0, MQTT_STREAM_ROCRAIL, MQTT_STREAM_JSONL };
+
+// Large messages are processed chunk by chunk as they arrive, only the parser state is kept between chunks
+static void mqtt_stream_cb(const char * topic, const uint8_t * data, size_t length, size_t offset, size_t total)
+{
+    static uint8_t consumer = MQTT_STREAM_SKIP;
+    static rocrailParser_t rocrailParser;
+    static dispatchParser_t jsonlParser;
+
+    if(offset == 0) {
+        commandStamp_t stamp  = statsStamp(STATS_SOURCE_MQTT);
+        const char * subtopic = NULL;
+        if(topic == strstr(topic, mqttNodeTopic)) {
+            subtopic = topic + strlen(mqttNodeTopic);
+        } else if(topic == strstr(topic, mqttGroupTopic)) {
+            subtopic     = topic + strlen(mqttGroupTopic);
+            stamp.source = STATS_SOURCE_GROUP;
+        }
+
+        Log.notice(F("MQTT RCV: %s = (%u bytes streamed)"), topic, total);
+        statsCount(statsCounters.mqttIn);
+        statsCount(statsCounters.mqttInBytes, total);
+        if(subtopic == NULL) {
+            consumer = MQTT_STREAM_ROCRAIL;
+            rocrailBegin(rocrailParser, stamp);
+        } else if(!strcmp_P(subtopic, PSTR("command/json")) || !strcmp_P(subtopic, PSTR("command/jsonl"))) {
+            consumer = MQTT_STREAM_JSONL;
+            dispatchJsonlBegin(jsonlParser, stamp);
+        } else {
+            consumer = MQTT_STREAM_SKIP;
+            statsCount(statsCounters.mqttDropped);
+            Log.warning(F("MQTT: Message on %s is too large, skipped"), topic);
+        }
+    }
+
+    switch(consumer) {
+        case MQTT_STREAM_ROCRAIL:
+            rocrailFeed(rocrailParser, (const char *)data, length);
+            if(offset + length == total) rocrailEnd(rocrailParser);
+            break;
+        case MQTT_STREAM_JSONL:
+            dispatchJsonlFeed(jsonlParser, (const char *)data, length);
+            if(offset + length == total) dispatchJsonlEnd(jsonlParser);
+            break;
+    }
+}
+
+// Feed a message into the receive path as if it came from the broker, the payload needs room for a terminator
+void mqtt_inject_message(char * topic, byte * payload, unsigned int length)
+{
+    mqtt_message_cb(topic, payload, length);
+}
+
+void mqttSubscribeTo(const char * format, const char * data, uint8_t qos = 0)
 {
     char topic[64];
     snprintf_P(topic, sizeof(topic), format, data);
-    if(mqttClient.subscribe(topic)) {
+    if(mqttClientSubscribe(topic, qos)) {
         Log.verbose(F("MQTT:    * Subscribed to %s"), topic);
     } else {
         Log.error(F("MQTT: Failed to subscribe to %s"), topic);
     }
 }
 
-void mqttReconnect()
+// Start a connection attempt, the subscriptions follow in mqtt_on_connected once the broker accepts
+bool mqttReconnect()
 {
     char buffer[128];
-    char mqttClientId[64];
-    static uint8_t mqttReconnectCount = 0;
-    bool mqttFirstConnect             = true;
 
     {
         String mac = halGetMacAddress(3, "");
@@ -333,59 +476,32 @@ void mqttReconnect()
 
     // Attempt to connect and set LWT and Clean Session
     snprintf_P(buffer, sizeof(buffer), PSTR("%sstatus"), mqttNodeTopic);
-    if(!mqttClient.connect(mqttClientId, mqttUser, mqttPassword, buffer, 0, false, "OFF", true)) {
+    if(!mqttClientConnect(mqttClientId, mqttUser, mqttPassword, buffer, "OFF")) {
         // Retry until we give up and restart after connectTimeout seconds
         mqttReconnectCount++;
-        snprintf_P(buffer, sizeof(buffer), PSTR("MQTT: %%s"));
-        switch(mqttClient.state()) {
-            case MQTT_CONNECTION_TIMEOUT:
-                strcat_P(buffer, PSTR("Server didn't respond within the keepalive time"));
-                break;
-            case MQTT_CONNECTION_LOST:
-                strcat_P(buffer, PSTR("Network connection was broken"));
-                break;
-            case MQTT_CONNECT_FAILED:
-                strcat_P(buffer, PSTR("Network connection failed"));
-                break;
-            case MQTT_DISCONNECTED:
-                strcat_P(buffer, PSTR("Client is disconnected cleanly"));
-                break;
-            case MQTT_CONNECTED:
-                strcat_P(buffer, PSTR("(Client is connected"));
-                break;
-            case MQTT_CONNECT_BAD_PROTOCOL:
-                strcat_P(buffer, PSTR("Server doesn't support the requested version of MQTT"));
-                break;
-            case MQTT_CONNECT_BAD_CLIENT_ID:
-                strcat_P(buffer, PSTR("Server rejected the client identifier"));
-                break;
-            case MQTT_CONNECT_UNAVAILABLE:
-                strcat_P(buffer, PSTR("Server was unable to accept the connection"));
-                break;
-            case MQTT_CONNECT_BAD_CREDENTIALS:
-                strcat_P(buffer, PSTR("Username or Password rejected"));
-                break;
-            case MQTT_CONNECT_UNAUTHORIZED:
-                strcat_P(buffer, PSTR("Client was not authorized to connect"));
-                break;
-            default:
-                strcat_P(buffer, PSTR("Unknown failure"));
-        }
-        Log.warning(buffer);
-
         if(mqttReconnectCount > 50) {
             Log.error(F("MQTT: %sRetry count exceeded, rebooting..."));
             //  dispatchReboot(false);
         }
-        return;
+        return false;
     }
 
+    return true;
+}
+
+static void mqtt_on_connected()
+{
+    char buffer[128];
+
+    statsBootMark(STATS_BOOT_MQTT_CONNECTED);
     Log.notice(F("MQTT: [SUCCESS] Connected to broker %s as clientID %s"), mqttServer, mqttClientId);
 
-    // Attempt to connect to broker, setting last will and testament
     // Subscribe to our incoming topics
-    mqttSubscribeTo(PSTR("%scommand/#"), mqttGroupTopic);
-    mqttSubscribeTo(PSTR("%scommand/#"), mqttNodeTopic);
+    mqttSubscribeTo(PSTR("%scommand/#"), mqttGroupTopic, 1); // QoS 1 so commands survive a lossy link
+    mqttSubscribeTo(PSTR("%schannel/#"), mqttGroupTopic);
+    mqttSubscribeTo(PSTR("%sestop/#"), mqttGroupTopic, 1);
+    mqttSubscribeTo(PSTR("%scommand/#"), mqttNodeTopic, 1);
+    mqttSubscribeTo(PSTR("%sconfig/#"), mqttNodeTopic, 1); // Settings and BLE profiles, retained ones reapplied
     mqttSubscribeTo(PSTR("%sstatus"), mqttNodeTopic);
     mqttSubscribeTo(PSTR("%s/service/command"), "rocrail");
 
@@ -393,40 +509,135 @@ void mqttReconnect()
     // make sure we get a full panel refresh at power on.  Sending OFF,
     // "ON" will be sent by the mqttStatusTopic subscription action.
     snprintf_P(buffer, sizeof(buffer), PSTR("%sstatus"), mqttNodeTopic);
-    mqttClient.publish(buffer, mqttFirstConnect ? "OFF" : "ON", true); //, 1);
+    mqttClientPublish(buffer, mqttFirstConnect ? "OFF" : "ON", true); //, 1);
 
     Log.notice(F("MQTT: binary_sensor state: [%sstatus] : %s"), mqttNodeTopic,
                mqttFirstConnect ? PSTR("OFF") : PSTR("ON"));
 
+    if(!mqttFirstConnect) statsCount(statsCounters.mqttReconnects);
     mqttFirstConnect   = false;
     mqttReconnectCount = 0;
+    retryBackoffReset(&mqttBackoff);
+
+    if(mqttOutageStart != 0) {
+        statsCounters.mqttLastOutage = millis() - mqttOutageStart;
+        statsCounters.mqttMaxOutage  = max(statsCounters.mqttMaxOutage, statsCounters.mqttLastOutage);
+        mqttOutageStart              = 0;
+        Log.notice(F("MQTT: Commands flowing again after %u ms"), statsCounters.mqttLastOutage);
+    }
+
+    mqtt_send_hubs();
 
     mqtt_send_statusupdate();
 }
 
+static void mqtt_set_topics()
+{
+    snprintf_P(mqttNodeTopic, sizeof(mqttNodeTopic), PSTR(MQTT_PREFIX "/%s/"), mqttNodeName);
+    snprintf_P(mqttGroupTopic, sizeof(mqttGroupTopic), PSTR(MQTT_PREFIX "/%s/"), mqttGroupName);
+}
+
 void mqttSetup()
 {
+    mqttClientSetCallback(mqtt_message_cb);
+    mqttClientSetStreamCallback(mqtt_stream_cb);
+
     mqttEnabled = strlen(mqttServer) > 0 && mqttPort > 0;
     if(mqttEnabled) {
-        mqttClient.setServer(mqttServer, 1883);
-        mqttClient.setCallback(mqtt_message_cb);
+        mqttClientSetServer(mqttServer, mqttPort);
         Log.notice(F("MQTT: Setup Complete"));
     } else {
         Log.notice(F("MQTT: Broker not configured"));
     }
 
-    snprintf_P(mqttNodeTopic, sizeof(mqttNodeTopic), PSTR(MQTT_PREFIX "/%s/"), mqttNodeName);
-    snprintf_P(mqttGroupTopic, sizeof(mqttGroupTopic), PSTR(MQTT_PREFIX "/%s/"), mqttGroupName);
+    mqtt_set_topics();
+    retryBackoffReset(&mqttBackoff);
+    mqttOutageStart = millis(); // Boot counts as an outage until the first connection
+}
+
+// Use a broker found after setup, e.g. by mDNS discovery
+void mqttSetServer(const char * host, uint16_t port)
+{
+    if(host != mqttServer) strncpy(mqttServer, host, sizeof(mqttServer) - 1);
+    mqttPort    = port;
+    mqttEnabled = strlen(mqttServer) > 0 && mqttPort > 0;
+    if(!mqttEnabled) return;
+
+    if(mqttClientConnected()) mqttClientDisconnect();
+    mqttClientSetServer(mqttServer, mqttPort);
+    retryBackoffReset(&mqttBackoff);
+}
+
+// Reconnect with changed broker settings or topic names, the old node status is set OFF first
+void mqttApplyConfig()
+{
+    mqttStop();
+    mqtt_set_topics();
+    mqttHubsPublished = false;
+    mqttSetServer(mqttServer, mqttPort);
+    if(!mqttEnabled) Log.notice(F("MQTT: Broker not configured"));
+}
+
+// Called from the WiFi event handler, only flags the loop to connect right away
+void mqttNetworkUp()
+{
+    mqttNetworkIsUp = true;
+    mqttBackoff.now = true;
+}
+
+void mqttNetworkDown()
+{
+    mqttNetworkIsUp = false;
+}
+
+// Try to connect when the backoff time has passed or a network event asked for it
+static void mqtt_connect_backoff()
+{
+    if(!mqttNetworkIsUp || mqttClientState() != MQTT_CLIENT_DISCONNECTED) return; // Attempt still in progress
+    if(!retryBackoffDue(&mqttBackoff, millis())) return;
+
+    // The backoff is reset once the broker accepts the connection
+    retryBackoffAttempt(&mqttBackoff, millis(), random(0x7FFFFFFF));
+    mqttReconnect();
 }
 
 void mqttLoop()
 {
-    if(mqttEnabled) mqttClient.loop();
+    if(!mqttEnabled) return;
+    mqttClientLoop();
+
+    bool isConnected = mqttClientConnected();
+    if(ble_take_emergency_stop()) estopRetryRaise(&mqttEstop, millis());
+    if(estopRetryExpired(&mqttEstop, millis()))
+        Log.error(F("MQTT: Emergency stop not replicated to the group within %u ms"), MQTT_ESTOP_RETRY_TIME);
+    if(!mqttWasConnected && isConnected) mqtt_on_connected();
+    if(mqttWasConnected && !isConnected) {
+        Log.warning(F("MQTT: Connection lost"));
+        mqttOutageStart = max(1UL, millis());
+        retryBackoffReset(&mqttBackoff);
+    }
+    mqttWasConnected = isConnected;
+
+    if(!isConnected) {
+        mqtt_connect_backoff();
+    } else {
+#if LEGO_USE_SUPERVISOR > 0
+        safetyBeatLink(SAFETY_LINK_MQTT, millis());
+#endif
+        if(estopRetryPending(&mqttEstop)) mqtt_send_estop(); // Ahead of everything else that is waiting to go out
+        mqtt_send_channels();
+        mqtt_send_sensors();
+        if(mqttAckCount > 0) mqtt_send_acks();
+        if(mqttQueue.count > 0) mqtt_flush_queue();
+        if(!mqttHubsPublished || mqttHubsVersion != ble_get_hubs_version()) mqtt_send_hubs();
+    }
 }
 
+// Fallback for missed network events, the reconnects themselves are paced by mqttLoop
 void mqttEvery5Seconds(bool wifiIsConnected)
 {
-    if(mqttEnabled && wifiIsConnected && !mqttClient.connected()) mqttReconnect();
+    if(wifiIsConnected && !mqttNetworkIsUp) mqttNetworkUp();
+    if(!wifiIsConnected) mqttNetworkDown();
 }
 
 String mqttGetNodename()
@@ -436,16 +647,16 @@ String mqttGetNodename()
 
 void mqttStop()
 {
-    if(mqttEnabled && mqttClient.connected()) {
+    if(mqttEnabled && mqttClientConnected()) {
         char topicBuffer[128];
 
         snprintf_P(topicBuffer, sizeof(topicBuffer), PSTR("%sstatus"), mqttNodeTopic);
-        mqttClient.publish(topicBuffer, "OFF");
+        mqttClientPublish(topicBuffer, "OFF");
 
         snprintf_P(topicBuffer, sizeof(topicBuffer), PSTR("%ssensor"), mqttNodeTopic);
-        mqttClient.publish(topicBuffer, "{\"status\": \"unavailable\"}");
+        mqttClientPublish(topicBuffer, "{\"status\": \"unavailable\"}");
 
-        mqttClient.disconnect();
+        mqttClientDisconnect();
         Log.notice(F("MQTT: Disconnected from broker"));
     }
 }
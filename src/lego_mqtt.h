@@ -1,15 +1,33 @@
 #ifndef LEGO_MQTT_H
 #define LEGO_MQTT_H
 
+#include <Arduino.h>
+
+// Settings, also written by the configuration store and read by mDNS and syslog
+extern char mqttServer[64]; // Host name or address of the broker
+extern uint16_t mqttPort;
+extern char mqttUser[23];
+extern char mqttPassword[32];
+extern char mqttNodeName[16];
+extern char mqttGroupName[16];
+
 void mqttSetup();
 void mqttLoop();
 void mqttEvery5Seconds(bool wifiIsConnected);
 void mqttStop();
-void mqttReconnect();
+bool mqttReconnect();
+void mqttNetworkUp();
+void mqttNetworkDown();
+void mqttSetServer(const char * host, uint16_t port);
+void mqttApplyConfig(void);
 
 void IRAM_ATTR mqtt_send_state(const __FlashStringHelper * subtopic, const char * payload);
 
 void mqtt_send_statusupdate(void);
+void mqtt_send_latency(void);
+#define MQTT_ACK_NO_HUB 0xFF // Ack for a command that was taken but has no hub to report
+void IRAM_ATTR mqtt_ack_command(uint32_t seq, uint8_t hub);
+void mqtt_inject_message(char * topic, byte * payload, unsigned int length);
 bool IRAM_ATTR mqttIsConnected();
 
 String mqttGetNodename(void);
@@ -0,0 +1,643 @@
+/* MQTT transport used by lego_mqtt
+ *
+ * The default client speaks MQTT 3.1.1 over a non-blocking socket: resolving the broker name, connecting, sending
+ * and receiving are state machines advanced by mqttClientLoop, which never waits on the network. Publishes are
+ * encoded into a transmit buffer that is written out as the socket accepts data, so a slow broker fills the buffer
+ * instead of stalling the loop. Publishes larger than MQTT_MAX_PACKET_SIZE are streamed to a consumer instead of
+ * being buffered. test/test_mqtt_client runs it against a broker stand-in on the host.
+ * Set LEGO_MQTT_ASYNC to 0 to fall back to the blocking PubSubClient library.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_MQTT > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+
+#include "lego_mqtt_client.h"
+#include "lego_stats.h"
+
+#if LEGO_MQTT_ASYNC > 0
+
+#include "lwip/sockets.h"
+#include "lwip/dns.h"
+
+#ifndef MQTT_TX_BUFFER_SIZE
+#define MQTT_TX_BUFFER_SIZE 2048 // Publishes that don't fit are refused and left to the caller to queue
+#endif
+#ifndef MQTT_KEEPALIVE
+#define MQTT_KEEPALIVE 15 // s
+#endif
+#define MQTT_CONNECT_TIMEOUT 5000 // ms for the DNS lookup, the TCP connect and the CONNACK
+#define MQTT_RX_BUDGET 512        // Bytes read per loop, bounds the time spent handling a burst
+
+// MQTT 3.1.1 control packet types
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82
+#define MQTT_PINGREQ 0xC0
+#define MQTT_DISCONNECT 0xE0
+
+static int mqttSocket                                = -1;
+static uint8_t mqttState                             = MQTT_CLIENT_DISCONNECTED;
+static const char * mqttError                        = "";
+static char mqttHost[64]                             = "";
+static uint16_t mqttHostPort                         = 1883;
+static mqttClientCallback_t mqttCallback             = NULL;
+static mqttClientStreamCallback_t mqttStreamCallback = NULL;
+static uint16_t mqttPacketId                         = 0;
+static unsigned long mqttConnectStart                = 0;
+static unsigned long mqttLastTx                      = 0;
+static unsigned long mqttLastRx                      = 0;
+
+// Filled in by the lwIP DNS callback on the tcpip task, picked up by mqttClientLoop
+static volatile uint8_t mqttAttempt     = 0; // Answers to an attempt that was given up are ignored
+static volatile uint32_t mqttDnsAddress = 0; // Network byte order, 0 = the lookup failed
+static volatile bool mqttDnsDone        = false;
+
+static uint8_t mqttTx[MQTT_TX_BUFFER_SIZE];
+static size_t mqttTxLength = 0; // Bytes waiting for the socket, always sent from the start of the buffer
+
+// Receive state, packets are assembled a byte at a time so partial reads simply resume on the next loop.
+// Publishes too large for the buffer keep only their topic, the payload is handed to the stream callback in chunks.
+enum { MQTT_RX_HEADER = 0, MQTT_RX_LENGTH, MQTT_RX_BODY, MQTT_RX_STREAM };
+static uint8_t mqttRx[MQTT_MAX_PACKET_SIZE + 1]; // Room for the terminator added to the payload
+static uint8_t mqttRxStage    = MQTT_RX_HEADER;
+static uint8_t mqttRxHeader   = 0;
+static uint8_t mqttRxShift    = 0;
+static size_t mqttRxRemaining = 0;
+static size_t mqttRxLength    = 0;
+static size_t mqttRxPayload   = 0; // Offset of the payload in a streamed publish
+static uint16_t mqttRxId      = 0; // Packet id of a streamed QoS 1 publish
+
+static void mqtt_client_close(const char * error)
+{
+    if(mqttSocket >= 0) close(mqttSocket);
+    mqttSocket   = -1;
+    mqttTxLength = 0;
+    mqttRxStage  = MQTT_RX_HEADER;
+
+    if(mqttState != MQTT_CLIENT_DISCONNECTED && error != NULL) {
+        mqttError = error;
+        Log.warning(F("MQTT: %S"), error);
+    }
+    mqttState = MQTT_CLIENT_DISCONNECTED;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transmit buffer
+
+static size_t mqtt_length_size(size_t remaining)
+{
+    return remaining < 128 ? 1 : remaining < 16384 ? 2 : 3;
+}
+
+// Reserve room for a whole packet, a packet is never split across two buffer fills
+static bool mqtt_tx_header(uint8_t type, size_t remaining)
+{
+    if(1 + mqtt_length_size(remaining) + remaining > sizeof(mqttTx) - mqttTxLength) return false;
+
+    mqttTx[mqttTxLength++] = type;
+    do {
+        uint8_t digit = remaining & 0x7F;
+        remaining >>= 7;
+        mqttTx[mqttTxLength++] = remaining > 0 ? digit | 0x80 : digit;
+    } while(remaining > 0);
+    return true;
+}
+
+static void mqtt_tx_bytes(const void * data, size_t length)
+{
+    memcpy(mqttTx + mqttTxLength, data, length);
+    mqttTxLength += length;
+}
+
+static void mqtt_tx_word(uint16_t value)
+{
+    mqttTx[mqttTxLength++] = value >> 8;
+    mqttTx[mqttTxLength++] = value & 0xFF;
+}
+
+static void mqtt_tx_string(const char * str)
+{
+    size_t length = strlen(str);
+    mqtt_tx_word(length);
+    mqtt_tx_bytes(str, length);
+}
+
+// Write as much of the transmit buffer as the socket accepts right now
+static void mqtt_tx_flush()
+{
+    if(mqttTxLength == 0) return;
+
+    int sent = send(mqttSocket, mqttTx, mqttTxLength, MSG_DONTWAIT);
+    if(sent < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) mqtt_client_close(PSTR("Network connection was broken"));
+        return;
+    }
+
+    mqttTxLength -= sent;
+    if(mqttTxLength > 0) memmove(mqttTx, mqttTx + sent, mqttTxLength); // Partial write, keep the rest
+    mqttLastTx = millis();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Receive path
+
+static void mqtt_rx_connack()
+{
+    switch(mqttRx[1]) {
+        case 0:
+            mqttState  = MQTT_CLIENT_CONNECTED;
+            mqttError  = "";
+            mqttLastRx = millis();
+            return;
+        case 1:
+            return mqtt_client_close(PSTR("Server doesn't support the requested version of MQTT"));
+        case 2:
+            return mqtt_client_close(PSTR("Server rejected the client identifier"));
+        case 3:
+            return mqtt_client_close(PSTR("Server was unable to accept the connection"));
+        case 4:
+            return mqtt_client_close(PSTR("Username or Password rejected"));
+        case 5:
+            return mqtt_client_close(PSTR("Client was not authorized to connect"));
+        default:
+            return mqtt_client_close(PSTR("Unknown failure"));
+    }
+}
+
+static void mqtt_rx_publish()
+{
+    uint8_t qos     = (mqttRxHeader >> 1) & 0x03;
+    size_t topicLen = (mqttRx[0] << 8) | mqttRx[1];
+    size_t offset   = 2 + topicLen + (qos > 0 ? 2 : 0);
+    if(offset > mqttRxLength) return; // Malformed
+
+    if(qos > 0) { // Acknowledge QoS 1, QoS 2 is never requested in our subscriptions
+        uint16_t id = (mqttRx[2 + topicLen] << 8) | mqttRx[3 + topicLen];
+        if(mqtt_tx_header(MQTT_PUBACK, 2)) mqtt_tx_word(id);
+    }
+
+    // Shift the topic over its length field to make room for the terminator, the payload stays in place
+    char * topic = (char *)mqttRx;
+    memmove(topic, mqttRx + 2, topicLen);
+    topic[topicLen] = '\0';
+
+    if(mqttCallback) mqttCallback(topic, mqttRx + offset, mqttRxLength - offset);
+}
+
+static void mqtt_rx_packet()
+{
+    mqttLastRx = millis();
+
+    switch(mqttRxHeader & 0xF0) {
+        case MQTT_CONNACK:
+            if(mqttState == MQTT_CLIENT_HANDSHAKE && mqttRxLength >= 2) mqtt_rx_connack();
+            break;
+        case MQTT_PUBLISH:
+            if(mqttState == MQTT_CLIENT_CONNECTED) mqtt_rx_publish();
+            break;
+        default: // SUBACK, PUBACK and PINGRESP only refresh the keepalive
+            break;
+    }
+}
+
+// Payload offset of a publish that is too large to buffer, 0 while the topic is incomplete or for other packets
+static size_t mqtt_rx_stream_offset()
+{
+    if((mqttRxHeader & 0xF0) != MQTT_PUBLISH || mqttRxRemaining <= MQTT_MAX_PACKET_SIZE || mqttRxLength < 2) return 0;
+
+    size_t offset = 2 + ((mqttRx[0] << 8) | mqttRx[1]) + ((mqttRxHeader & 0x06) ? 2 : 0);
+    return offset < MQTT_MAX_PACKET_SIZE ? offset : 0;
+}
+
+static void mqtt_rx_stream_begin()
+{
+    size_t topicLen = (mqttRx[0] << 8) | mqttRx[1];
+    if(mqttRxHeader & 0x06) mqttRxId = (mqttRx[2 + topicLen] << 8) | mqttRx[3 + topicLen];
+
+    memmove(mqttRx, mqttRx + 2, topicLen);
+    mqttRx[topicLen] = '\0';
+
+    mqttRxPayload = mqttRxLength;
+    mqttRxStage   = MQTT_RX_STREAM;
+    if(mqttStreamCallback == NULL) {
+        statsCount(statsCounters.mqttDropped);
+        Log.warning(F("MQTT: Skipping %u byte message on %s"), mqttRxRemaining - mqttRxPayload, (char *)mqttRx);
+    }
+}
+
+// Pass on the part of a received chunk that belongs to the streamed payload, returns the bytes consumed
+static size_t mqtt_rx_stream(const uint8_t * data, size_t length)
+{
+    size_t chunk = min(length, mqttRxRemaining - mqttRxLength);
+    size_t total = mqttRxRemaining - mqttRxPayload;
+
+    if(mqttStreamCallback && mqttState == MQTT_CLIENT_CONNECTED)
+        mqttStreamCallback((char *)mqttRx, data, chunk, mqttRxLength - mqttRxPayload, total);
+
+    mqttRxLength += chunk;
+    if(mqttRxLength == mqttRxRemaining) {
+        if((mqttRxHeader & 0x06) && mqtt_tx_header(MQTT_PUBACK, 2)) mqtt_tx_word(mqttRxId);
+        mqttRxStage = MQTT_RX_HEADER;
+    }
+    return chunk;
+}
+
+static void mqtt_rx_byte(uint8_t data)
+{
+    switch(mqttRxStage) {
+        case MQTT_RX_HEADER:
+            mqttRxHeader    = data;
+            mqttRxRemaining = 0;
+            mqttRxLength    = 0;
+            mqttRxShift     = 0;
+            mqttRxStage     = MQTT_RX_LENGTH;
+            break;
+
+        case MQTT_RX_LENGTH:
+            mqttRxRemaining |= (size_t)(data & 0x7F) << mqttRxShift;
+            mqttRxShift += 7;
+            if(data & 0x80) break;
+
+            mqttRxStage = MQTT_RX_BODY;
+            if(mqttRxRemaining == 0) {
+                mqtt_rx_packet();
+                mqttRxStage = MQTT_RX_HEADER;
+            }
+            break;
+
+        case MQTT_RX_BODY:
+            if(mqttRxLength < MQTT_MAX_PACKET_SIZE) mqttRx[mqttRxLength] = data;
+            mqttRxLength++;
+            if(mqttRxLength == mqtt_rx_stream_offset()) {
+                mqtt_rx_stream_begin();
+                break;
+            }
+            if(mqttRxLength < mqttRxRemaining) break;
+
+            if(mqttRxLength <= MQTT_MAX_PACKET_SIZE) {
+                mqtt_rx_packet();
+            } else {
+                statsCount(statsCounters.mqttDropped);
+                Log.warning(F("MQTT: Skipped a %u byte packet"), mqttRxLength);
+            }
+            mqttRxStage = MQTT_RX_HEADER;
+            break;
+    }
+}
+
+// Read what the socket has buffered, up to MQTT_RX_BUDGET bytes per loop
+static void mqtt_rx_poll()
+{
+    uint8_t buffer[128];
+
+    for(size_t total = 0; total < MQTT_RX_BUDGET && mqttSocket >= 0;) {
+        int received = recv(mqttSocket, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if(received == 0) return mqtt_client_close(PSTR("Network connection was broken"));
+        if(received < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) mqtt_client_close(PSTR("Network connection was broken"));
+            return;
+        }
+
+        for(int i = 0; i < received && mqttSocket >= 0;) {
+            if(mqttRxStage == MQTT_RX_STREAM) {
+                i += mqtt_rx_stream(buffer + i, received - i);
+            } else {
+                mqtt_rx_byte(buffer[i++]);
+            }
+        }
+        total += received;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Connection state machine
+
+static void mqtt_dns_found(const char * name, const ip_addr_t * ipaddr, void * arg)
+{
+    if((uintptr_t)arg != mqttAttempt) return;
+    mqttDnsAddress = ipaddr != NULL ? ip_2_ip4(ipaddr)->addr : 0;
+    __atomic_store_n(&mqttDnsDone, true, __ATOMIC_RELEASE);
+}
+
+// Starts the TCP connect to the resolved broker address, the CONNECT packet is already waiting in the buffer
+static bool mqtt_client_open(uint32_t address)
+{
+    struct sockaddr_in broker;
+    memset(&broker, 0, sizeof(broker));
+    broker.sin_family      = AF_INET;
+    broker.sin_port        = htons(mqttHostPort);
+    broker.sin_addr.s_addr = address;
+
+    mqttSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(mqttSocket < 0) {
+        mqtt_client_close(PSTR("Network connection failed"));
+        return false;
+    }
+
+    int flag = 1;
+    setsockopt(mqttSocket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    fcntl(mqttSocket, F_SETFL, fcntl(mqttSocket, F_GETFL, 0) | O_NONBLOCK);
+
+    if(connect(mqttSocket, (struct sockaddr *)&broker, sizeof(broker)) < 0 && errno != EINPROGRESS) {
+        mqtt_client_close(PSTR("Network connection failed"));
+        return false;
+    }
+
+    mqttState = MQTT_CLIENT_CONNECTING;
+    return true;
+}
+
+void mqttClientSetServer(const char * host, uint16_t port)
+{
+    strncpy(mqttHost, host, sizeof(mqttHost) - 1);
+    mqttHostPort = port;
+}
+
+void mqttClientSetCallback(mqttClientCallback_t callback)
+{
+    mqttCallback = callback;
+}
+
+void mqttClientSetStreamCallback(mqttClientStreamCallback_t callback)
+{
+    mqttStreamCallback = callback;
+}
+
+// Starts a connection attempt and returns immediately, mqttClientLoop completes it
+bool mqttClientConnect(const char * clientId, const char * user, const char * password, const char * willTopic,
+                       const char * willMessage)
+{
+    mqtt_client_close(NULL);
+    mqttState        = MQTT_CLIENT_RESOLVING;
+    mqttConnectStart = millis();
+    mqttAttempt      = mqttAttempt + 1;
+    __atomic_store_n(&mqttDnsDone, false, __ATOMIC_RELEASE);
+
+    // The CONNECT packet waits in the transmit buffer until the socket is writable
+    bool hasUser     = user != NULL && *user != '\0';
+    bool hasPassword = hasUser && password != NULL && *password != '\0';
+    bool hasWill     = willTopic != NULL && willMessage != NULL;
+    size_t length    = 10 + 2 + strlen(clientId);
+    uint8_t flags    = 0x02; // Clean session
+    if(hasWill) {
+        length += 2 + strlen(willTopic) + 2 + strlen(willMessage);
+        flags |= 0x04 | 0x20; // Retained will at QoS 0
+    }
+    if(hasUser) {
+        length += 2 + strlen(user);
+        flags |= 0x80;
+    }
+    if(hasPassword) {
+        length += 2 + strlen(password);
+        flags |= 0x40;
+    }
+
+    const uint8_t protocol[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04};
+    if(!mqtt_tx_header(MQTT_CONNECT, length)) {
+        mqtt_client_close(PSTR("Unknown failure"));
+        return false;
+    }
+    mqtt_tx_bytes(protocol, sizeof(protocol));
+    mqtt_tx_bytes(&flags, 1);
+    mqtt_tx_word(MQTT_KEEPALIVE);
+    mqtt_tx_string(clientId);
+    if(hasWill) {
+        mqtt_tx_string(willTopic);
+        mqtt_tx_string(willMessage);
+    }
+    if(hasUser) mqtt_tx_string(user);
+    if(hasPassword) mqtt_tx_string(password);
+
+    struct in_addr address;
+    if(inet_pton(AF_INET, mqttHost, &address) == 1) return mqtt_client_open(address.s_addr);
+
+    // A name answered from the lwIP cache connects right away, otherwise mqttClientLoop waits for the callback
+    ip_addr_t resolved;
+    switch(dns_gethostbyname(mqttHost, &resolved, mqtt_dns_found, (void *)(uintptr_t)mqttAttempt)) {
+        case ERR_OK:
+            return mqtt_client_open(ip_2_ip4(&resolved)->addr);
+        case ERR_INPROGRESS:
+            return true;
+        default:
+            mqtt_client_close(PSTR("Network connection failed"));
+            return false;
+    }
+}
+
+void mqttClientDisconnect()
+{
+    if(mqttState == MQTT_CLIENT_CONNECTED && mqtt_tx_header(MQTT_DISCONNECT, 0)) mqtt_tx_flush();
+    mqtt_client_close(NULL);
+    mqttError = PSTR("Client is disconnected cleanly");
+}
+
+void mqttClientLoop()
+{
+    if(mqttState != MQTT_CLIENT_DISCONNECTED && mqttState != MQTT_CLIENT_CONNECTED) {
+        if(millis() - mqttConnectStart > MQTT_CONNECT_TIMEOUT)
+            return mqtt_client_close(PSTR("Server didn't respond within the keepalive time"));
+    }
+
+    if(mqttState == MQTT_CLIENT_RESOLVING) {
+        if(!__atomic_load_n(&mqttDnsDone, __ATOMIC_ACQUIRE)) return;
+        if(mqttDnsAddress == 0) return mqtt_client_close(PSTR("Network connection failed"));
+        if(!mqtt_client_open(mqttDnsAddress)) return;
+    }
+    if(mqttSocket < 0) return;
+
+    if(mqttState == MQTT_CLIENT_CONNECTING) {
+        // Poll for write-ready without waiting, the socket becomes writable once the TCP handshake is done
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(mqttSocket, &writable);
+        struct timeval timeout = {0, 0};
+        if(select(mqttSocket + 1, NULL, &writable, NULL, &timeout) <= 0) return;
+
+        int error           = 0;
+        socklen_t errorSize = sizeof(error);
+        getsockopt(mqttSocket, SOL_SOCKET, SO_ERROR, &error, &errorSize);
+        if(error != 0) return mqtt_client_close(PSTR("Network connection failed"));
+
+        mqttState  = MQTT_CLIENT_HANDSHAKE;
+        mqttLastRx = millis();
+    }
+
+    mqtt_tx_flush();
+    if(mqttSocket >= 0) mqtt_rx_poll();
+    if(mqttState != MQTT_CLIENT_CONNECTED) return;
+
+    if(millis() - mqttLastRx > MQTT_KEEPALIVE * 1500UL)
+        return mqtt_client_close(PSTR("Server didn't respond within the keepalive time"));
+    if(millis() - mqttLastTx > MQTT_KEEPALIVE * 750UL && mqttTxLength == 0 && mqtt_tx_header(MQTT_PINGREQ, 0))
+        mqtt_tx_flush();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Outgoing packets, refused while disconnected or when the transmit buffer is full
+
+bool mqttClientPublish(const char * topic, const char * payload, bool retain)
+{
+    if(mqttState != MQTT_CLIENT_CONNECTED) return false;
+
+    size_t payloadLen = strlen(payload);
+    if(!mqtt_tx_header(MQTT_PUBLISH | (retain ? 0x01 : 0x00), 2 + strlen(topic) + payloadLen)) return false;
+    mqtt_tx_string(topic);
+    mqtt_tx_bytes(payload, payloadLen);
+    statsCount(statsCounters.mqttOut);
+    statsCount(statsCounters.mqttOutBytes, payloadLen);
+
+    mqtt_tx_flush(); // Usually goes out right away, otherwise the loop writes the rest
+    return true;
+}
+
+bool mqttClientSubscribe(const char * topic, uint8_t qos)
+{
+    if(mqttState != MQTT_CLIENT_CONNECTED) return false;
+    if(!mqtt_tx_header(MQTT_SUBSCRIBE, 2 + 2 + strlen(topic) + 1)) return false;
+
+    if(++mqttPacketId == 0) mqttPacketId = 1;
+    mqtt_tx_word(mqttPacketId);
+    mqtt_tx_string(topic);
+    mqttTx[mqttTxLength++] = qos;
+    return true;
+}
+
+uint8_t mqttClientState()
+{
+    return mqttState;
+}
+
+bool mqttClientConnected()
+{
+    return mqttState == MQTT_CLIENT_CONNECTED;
+}
+
+const char * mqttClientLastError()
+{
+    return mqttError;
+}
+
+#else // PubSubClient fallback, connect and publish block the calling task
+
+#include "PubSubClient.h"
+#include "lego_ble.h"
+
+// PubSubClient silently drops a publish that doesn't fit its packet buffer, header and topic included
+#define MQTT_PUBLISH_OVERHEAD 128
+static_assert(MQTT_MAX_PACKET_SIZE >= STATS_JSON_SIZE + MQTT_PUBLISH_OVERHEAD,
+              "MQTT_MAX_PACKET_SIZE too small for the stats payload");
+static_assert(MQTT_MAX_PACKET_SIZE >= BLE_HUBS_JSON_SIZE + MQTT_PUBLISH_OVERHEAD,
+              "MQTT_MAX_PACKET_SIZE too small for the hub list payload");
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <Wifi.h>
+WiFiClient mqttNetworkClient;
+#elif defined(ARDUINO_ARCH_ESP8266)
+#include <ESP8266WiFi.h>
+WiFiClient mqttNetworkClient;
+#else
+
+#if defined(W5500_MOSI) && defined(W5500_MISO) && defined(W5500_SCLK)
+#define W5500_LAN
+#include <Ethernet.h>
+#else
+#include <STM32Ethernet.h>
+#endif
+
+EthernetClient mqttNetworkClient;
+#endif
+
+#define MQTT_SOCKET_TIMEOUT 2 // s, bounds how long a connect attempt can hold up the loop
+
+PubSubClient mqttClient(mqttNetworkClient);
+
+void mqttClientSetServer(const char * host, uint16_t port)
+{
+    mqttClient.setServer(host, port);
+    mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+}
+
+void mqttClientSetCallback(mqttClientCallback_t callback)
+{
+    mqttClient.setCallback(callback);
+}
+
+void mqttClientSetStreamCallback(mqttClientStreamCallback_t callback)
+{} // PubSubClient drops messages that don't fit its buffer
+
+bool mqttClientConnect(const char * clientId, const char * user, const char * password, const char * willTopic,
+                       const char * willMessage)
+{
+    if(mqttClient.connect(clientId, user, password, willTopic, 0, true, willMessage, true)) return true;
+    Log.warning(F("MQTT: %S"), mqttClientLastError());
+    return false;
+}
+
+void mqttClientDisconnect()
+{
+    mqttClient.disconnect();
+}
+
+void mqttClientLoop()
+{
+    mqttClient.loop();
+}
+
+bool mqttClientPublish(const char * topic, const char * payload, bool retain)
+{
+    if(!mqttClient.publish(topic, payload, retain)) return false;
+
+    statsCount(statsCounters.mqttOut);
+    statsCount(statsCounters.mqttOutBytes, strlen(payload));
+    return true;
+}
+
+bool mqttClientSubscribe(const char * topic, uint8_t qos)
+{
+    return mqttClient.subscribe(topic, qos);
+}
+
+uint8_t mqttClientState()
+{
+    return mqttClient.connected() ? MQTT_CLIENT_CONNECTED : MQTT_CLIENT_DISCONNECTED;
+}
+
+bool mqttClientConnected()
+{
+    return mqttClient.connected();
+}
+
+const char * mqttClientLastError()
+{
+    switch(mqttClient.state()) {
+        case MQTT_CONNECTION_TIMEOUT:
+            return PSTR("Server didn't respond within the keepalive time");
+        case MQTT_CONNECTION_LOST:
+            return PSTR("Network connection was broken");
+        case MQTT_CONNECT_FAILED:
+            return PSTR("Network connection failed");
+        case MQTT_DISCONNECTED:
+            return PSTR("Client is disconnected cleanly");
+        case MQTT_CONNECTED:
+            return PSTR("Client is connected");
+        case MQTT_CONNECT_BAD_PROTOCOL:
+            return PSTR("Server doesn't support the requested version of MQTT");
+        case MQTT_CONNECT_BAD_CLIENT_ID:
+            return PSTR("Server rejected the client identifier");
+        case MQTT_CONNECT_UNAVAILABLE:
+            return PSTR("Server was unable to accept the connection");
+        case MQTT_CONNECT_BAD_CREDENTIALS:
+            return PSTR("Username or Password rejected");
+        case MQTT_CONNECT_UNAUTHORIZED:
+            return PSTR("Client was not authorized to connect");
+        default:
+            return PSTR("Unknown failure");
+    }
+}
+
+#endif // LEGO_MQTT_ASYNC
+#endif // LEGO_USE_MQTT
@@ -0,0 +1,35 @@
+#ifndef LEGO_MQTT_CLIENT_H
+#define LEGO_MQTT_CLIENT_H
+
+#include <Arduino.h>
+
+enum {
+    MQTT_CLIENT_DISCONNECTED = 0,
+    MQTT_CLIENT_RESOLVING,  // Waiting for the DNS lookup of the broker name
+    MQTT_CLIENT_CONNECTING, // TCP connect in progress
+    MQTT_CLIENT_HANDSHAKE,  // CONNECT sent, waiting for CONNACK
+    MQTT_CLIENT_CONNECTED
+};
+
+typedef void (*mqttClientCallback_t)(char * topic, byte * payload, unsigned int length);
+
+// Receives a publish too large for the receive buffer in chunks, offset 0 starts and offset + length == total ends it
+typedef void (*mqttClientStreamCallback_t)(const char * topic, const uint8_t * data, size_t length, size_t offset,
+                                           size_t total);
+
+void mqttClientSetServer(const char * host, uint16_t port);
+void mqttClientSetCallback(mqttClientCallback_t callback);
+void mqttClientSetStreamCallback(mqttClientStreamCallback_t callback);
+bool mqttClientConnect(const char * clientId, const char * user, const char * password, const char * willTopic,
+                       const char * willMessage);
+void mqttClientDisconnect(void);
+void mqttClientLoop(void);
+
+bool mqttClientPublish(const char * topic, const char * payload, bool retain = false);
+bool mqttClientSubscribe(const char * topic, uint8_t qos = 0);
+
+uint8_t mqttClientState(void);
+bool mqttClientConnected(void);
+const char * mqttClientLastError(void);
+
+#endif
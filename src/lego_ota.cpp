@@ -0,0 +1,433 @@
+/* Firmware update over HTTP
+ *
+ * otaStart hands the URL to a background task that downloads the image into the inactive app partition a flash
+ * sector at a time, while the loop and the hub tasks keep controlling the trains. A dropped connection is resumed
+ * with an HTTP Range request right after the last byte written. The finished image is read back from flash and
+ * checked against the expected SHA-256 before it becomes the boot partition, only then does otaLoop stop the trains
+ * and reboot.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_OTA > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+
+#include <WiFi.h>
+#include "lwip/sockets.h"
+#include "mbedtls/sha256.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include "esp_ota_ops.h"
+#endif
+
+#include "lego_ble.h"
+#include "lego_hal.h"
+#include "lego_stats.h"
+#include "lego_ota.h"
+
+#define OTA_TIMEOUT 10000 // ms without data before a download attempt is abandoned
+#define OTA_URL_SIZE 160
+
+enum { OTA_DOWNLOAD_DONE = 0, OTA_DOWNLOAD_RETRY, OTA_DOWNLOAD_FATAL };
+
+static volatile uint8_t otaState   = OTA_IDLE;
+static volatile uint32_t otaWritten = 0; // Bytes of the image in flash
+static volatile uint32_t otaSize    = 0; // Image size announced by the server
+static uint32_t otaErased           = 0; // Bytes at the start of the partition erased so far
+static uint32_t otaLastWritten      = 0; // otaWritten at the previous throughput report
+static unsigned long otaStartTime   = 0;
+static unsigned long otaStopTime    = 0;
+static char otaUrl[OTA_URL_SIZE];
+static uint8_t otaDigest[32];
+static bool otaHasDigest = false;
+
+/* ===== Partition access ===== */
+
+#if defined(ARDUINO_ARCH_ESP32)
+static const esp_partition_t * otaPartition = NULL;
+
+// Returns the capacity of the partition the image is written to
+static uint32_t ota_partition_begin(void)
+{
+    otaPartition = esp_ota_get_next_update_partition(NULL);
+    return otaPartition == NULL ? 0 : otaPartition->size;
+}
+
+// Sectors are erased just ahead of the data, so a resumed download never erases what was already written
+static bool ota_partition_write(uint32_t offset, const uint8_t * data, size_t length)
+{
+    while(offset + length > otaErased) {
+        if(esp_partition_erase_range(otaPartition, otaErased, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+        otaErased += SPI_FLASH_SEC_SIZE;
+    }
+    return esp_partition_write(otaPartition, offset, data, length) == ESP_OK;
+}
+
+static bool ota_partition_read(uint32_t offset, uint8_t * data, size_t length)
+{
+    return esp_partition_read(otaPartition, offset, data, length) == ESP_OK;
+}
+
+// The bootloader API validates the image header and checksum before switching
+static bool ota_partition_finish(void)
+{
+    return esp_ota_set_boot_partition(otaPartition) == ESP_OK;
+}
+
+#else
+// Host builds write the image to a file, so the download, resume and verification can be exercised off target
+#ifndef OTA_IMAGE_FILE
+#define OTA_IMAGE_FILE "ota_image.bin"
+#endif
+#ifndef OTA_PARTITION_SIZE
+#define OTA_PARTITION_SIZE 0x1E0000
+#endif
+static FILE * otaFile = NULL;
+
+static uint32_t ota_partition_begin(void)
+{
+    if(otaFile != NULL) fclose(otaFile);
+    otaFile = fopen(OTA_IMAGE_FILE, "w+b");
+    return otaFile == NULL ? 0 : OTA_PARTITION_SIZE;
+}
+
+// Flushed right away, like a flash write the chunk is in the file when the call returns
+static bool ota_partition_write(uint32_t offset, const uint8_t * data, size_t length)
+{
+    return fseek(otaFile, offset, SEEK_SET) == 0 && fwrite(data, 1, length, otaFile) == length && fflush(otaFile) == 0;
+}
+
+static bool ota_partition_read(uint32_t offset, uint8_t * data, size_t length)
+{
+    return fseek(otaFile, offset, SEEK_SET) == 0 && fread(data, 1, length, otaFile) == length;
+}
+
+static bool ota_partition_finish(void)
+{
+    return fflush(otaFile) == 0;
+}
+#endif
+
+/* ===== Download ===== */
+
+// http://host[:port]/path, TLS is not supported
+static bool ota_parse_url(const char * url, char * host, size_t size, uint16_t * port, const char ** path)
+{
+    if(strncmp_P(url, PSTR("http://"), 7) != 0) return false;
+    url += 7;
+
+    size_t len = strcspn(url, ":/");
+    if(len == 0 || len >= size) return false;
+    memcpy(host, url, len);
+    host[len] = 0;
+
+    *port = url[len] == ':' ? atoi(url + len + 1) : 80;
+    *path = strchr(url, '/');
+    if(*path == NULL) *path = "/";
+    return *port != 0;
+}
+
+static bool ota_parse_digest(const char * hex)
+{
+    if(strlen(hex) != sizeof(otaDigest) * 2) return false;
+
+    for(uint8_t i = 0; i < sizeof(otaDigest); i++) {
+        unsigned int value;
+        if(!isxdigit(hex[i * 2]) || !isxdigit(hex[i * 2 + 1]) || sscanf(hex + i * 2, "%2x", &value) != 1)
+            return false;
+        otaDigest[i] = value;
+    }
+    return true;
+}
+
+// The task may block on the socket, it only holds up itself
+static int ota_connect(const char * host, uint16_t port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port   = htons(port);
+    if(inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+        IPAddress ip;
+        if(!WiFi.hostByName(host, ip)) return -1;
+        address.sin_addr.s_addr = (uint32_t)ip;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(sock < 0) return -1;
+
+    struct timeval timeout = {OTA_TIMEOUT / 1000, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static bool ota_send(int sock, const char * text)
+{
+    size_t len = strlen(text);
+    return send(sock, text, len, 0) == (int)len;
+}
+
+// Reads a header line without its CR LF, returns its length or -1 when the connection failed
+static int ota_read_line(int sock, char * line, size_t size)
+{
+    size_t len = 0;
+    char ch;
+    while(recv(sock, &ch, 1, 0) == 1) {
+        if(ch == '\n') {
+            line[len] = 0;
+            return len;
+        }
+        if(ch != '\r' && len < size - 1) line[len++] = ch;
+    }
+    return -1;
+}
+
+static uint8_t ota_download(const char * host, uint16_t port, const char * path, uint32_t capacity, uint8_t * chunk)
+{
+    int sock = ota_connect(host, port);
+    if(sock < 0) {
+        Log.warning(F("OTA: Failed to connect to %s"), host);
+        return OTA_DOWNLOAD_RETRY;
+    }
+
+    char line[128];
+    snprintf_P(line, sizeof(line), PSTR(" HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n"), host);
+    bool sent = ota_send(sock, "GET ") && ota_send(sock, path) && ota_send(sock, line);
+    if(sent && otaWritten > 0) {
+        snprintf_P(line, sizeof(line), PSTR("Range: bytes=%u-\r\n"), otaWritten);
+        sent = ota_send(sock, line);
+    }
+    if(!sent || !ota_send(sock, "\r\n")) {
+        close(sock);
+        return OTA_DOWNLOAD_RETRY;
+    }
+
+    int status          = 0;
+    uint32_t length     = 0;
+    uint32_t rangeStart = 0;
+    uint32_t rangeTotal = 0;
+    if(ota_read_line(sock, line, sizeof(line)) < 0 || sscanf(line, "HTTP/1.%*d %d", &status) != 1) {
+        close(sock);
+        return OTA_DOWNLOAD_RETRY;
+    }
+    int len;
+    while((len = ota_read_line(sock, line, sizeof(line))) > 0) {
+        if(!strncasecmp_P(line, PSTR("Content-Length:"), 15)) {
+            length = strtoul(line + 15, NULL, 10);
+        } else if(!strncasecmp_P(line, PSTR("Content-Range:"), 14)) {
+            sscanf(line + 14, " bytes %u-%*u/%u", &rangeStart, &rangeTotal);
+        }
+    }
+    if(len < 0) {
+        close(sock);
+        return OTA_DOWNLOAD_RETRY;
+    }
+
+    if(status == 206 && rangeStart == otaWritten && rangeTotal > 0) {
+        otaSize = rangeTotal;
+    } else if(status == 200 && length > 0) {
+        if(otaWritten > 0) Log.warning(F("OTA: Server does not support resuming, starting over"));
+        otaWritten = 0;
+        otaErased  = 0;
+        otaSize    = length;
+    } else {
+        Log.error(F("OTA: Server replied %d"), status);
+        close(sock);
+        return status >= 400 && status < 500 ? OTA_DOWNLOAD_FATAL : OTA_DOWNLOAD_RETRY;
+    }
+
+    if(otaSize > capacity) {
+        Log.error(F("OTA: Image of %u bytes exceeds the partition"), otaSize);
+        close(sock);
+        return OTA_DOWNLOAD_FATAL;
+    }
+
+    size_t buffered = 0;
+    while(otaWritten + buffered < otaSize) {
+        size_t wanted = min((size_t)OTA_CHUNK_SIZE - buffered, (size_t)(otaSize - otaWritten - buffered));
+        int received  = recv(sock, chunk + buffered, wanted, 0);
+        if(received <= 0) break;
+
+        buffered += received;
+        if(buffered == OTA_CHUNK_SIZE || otaWritten + buffered == otaSize) {
+            if(!ota_partition_write(otaWritten, chunk, buffered)) {
+                Log.error(F("OTA: Flash write failed at %u"), otaWritten);
+                close(sock);
+                return OTA_DOWNLOAD_FATAL;
+            }
+            otaWritten += buffered;
+            buffered = 0;
+        }
+    }
+    close(sock);
+
+    // Keep what arrived before the connection dropped, the next attempt resumes right after it
+    if(buffered > 0 && ota_partition_write(otaWritten, chunk, buffered)) otaWritten += buffered;
+    return otaWritten == otaSize ? OTA_DOWNLOAD_DONE : OTA_DOWNLOAD_RETRY;
+}
+
+// Reads the image back from flash, so both the transfer and the flash writes are covered by the digest
+static bool ota_verify(uint8_t * chunk)
+{
+    uint8_t digest[32];
+    mbedtls_sha256_context context;
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts_ret(&context, 0);
+
+    bool valid = true;
+    for(uint32_t offset = 0; offset < otaSize && valid; offset += OTA_CHUNK_SIZE) {
+        size_t length = min((uint32_t)OTA_CHUNK_SIZE, otaSize - offset);
+        valid         = ota_partition_read(offset, chunk, length);
+        if(valid) mbedtls_sha256_update_ret(&context, chunk, length);
+    }
+    mbedtls_sha256_finish_ret(&context, digest);
+    mbedtls_sha256_free(&context);
+
+    if(!valid) {
+        Log.error(F("OTA: Flash read failed"));
+        return false;
+    }
+
+    char hex[sizeof(digest) * 2 + 1];
+    for(uint8_t i = 0; i < sizeof(digest); i++) snprintf_P(hex + i * 2, 3, PSTR("%02x"), digest[i]);
+    Log.notice(F("OTA: Image SHA-256 %s"), hex);
+
+    if(otaHasDigest && memcmp(digest, otaDigest, sizeof(digest)) != 0) {
+        Log.error(F("OTA: Checksum mismatch"));
+        return false;
+    }
+    return true;
+}
+
+static void ota_task(void * parameter)
+{
+    char host[64];
+    uint16_t port;
+    const char * path;
+    uint8_t result    = OTA_DOWNLOAD_FATAL;
+    uint32_t capacity = ota_partition_begin();
+    uint8_t * chunk   = (uint8_t *)malloc(OTA_CHUNK_SIZE);
+
+    if(capacity == 0) {
+        Log.error(F("OTA: No partition to write the update to"));
+    } else if(chunk == NULL) {
+        Log.error(F("OTA: Out of memory"));
+    } else if(!ota_parse_url(otaUrl, host, sizeof(host), &port, &path)) {
+        Log.error(F("OTA: Invalid URL %s"), otaUrl);
+    } else {
+        uint8_t retries = 0;
+        while(true) {
+            uint32_t before = otaWritten;
+            result          = ota_download(host, port, path, capacity, chunk);
+            if(result != OTA_DOWNLOAD_RETRY) break;
+
+            // Only attempts that made no progress count toward giving up
+            retries = otaWritten > before ? 0 : retries + 1;
+            if(retries > OTA_RETRIES) break;
+            Log.warning(F("OTA: Download interrupted at %u of %u bytes, resuming"), otaWritten, otaSize);
+            vTaskDelay(pdMS_TO_TICKS(1000 * retries));
+        }
+    }
+
+    if(result == OTA_DOWNLOAD_DONE) {
+        unsigned long elapsed = max(1UL, millis() - otaStartTime);
+        Log.notice(F("OTA: Downloaded %u bytes in %u ms, %u kB/s"), otaSize, elapsed, otaSize / elapsed);
+
+        otaState = OTA_VERIFYING;
+        if(ota_verify(chunk) && ota_partition_finish()) {
+            otaState = OTA_STOPPING;
+        } else {
+            Log.error(F("OTA: Image rejected"));
+            otaState = OTA_FAILED;
+        }
+    } else {
+        Log.error(F("OTA: Update failed"));
+        otaState = OTA_FAILED;
+    }
+
+    free(chunk);
+    vTaskDelete(NULL);
+}
+
+/* ===== Public API ===== */
+
+// sha256 is the expected digest in hex, or empty to accept any image the bootloader considers valid
+bool otaStart(const char * url, const char * sha256)
+{
+    // Claim the updater in one step, two callers that both see it idle can't both start a download
+    uint8_t previous = otaState;
+    if(previous == OTA_DOWNLOADING || previous == OTA_VERIFYING || previous == OTA_STOPPING ||
+       !__atomic_compare_exchange_n(&otaState, &previous, (uint8_t)OTA_DOWNLOADING, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+        Log.warning(F("OTA: An update is already in progress"));
+        return false;
+    }
+
+    otaHasDigest = sha256 != NULL && *sha256 != 0;
+    if(strlen(url) >= sizeof(otaUrl) || (otaHasDigest && !ota_parse_digest(sha256))) {
+        otaState = previous;
+        return false;
+    }
+
+    strncpy(otaUrl, url, sizeof(otaUrl));
+    otaWritten     = 0;
+    otaSize        = 0;
+    otaErased      = 0;
+    otaLastWritten = 0;
+    otaStopTime    = 0;
+    otaStartTime   = millis();
+
+    Log.notice(F("OTA: Downloading %s"), otaUrl);
+    if(xTaskCreate(ota_task, "OtaTask", 6144, NULL, 1, NULL) != pdPASS) {
+        otaState = OTA_FAILED;
+        return false;
+    }
+    return true;
+}
+
+uint8_t otaGetState(void)
+{
+    return otaState;
+}
+
+void otaSetup(void)
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    const esp_partition_t * running = esp_ota_get_running_partition();
+    if(running != NULL) Log.notice(F("OTA: Running from partition %s"), running->label);
+#endif
+}
+
+// Trains keep running during the download, they are only stopped once the new image is ready to boot
+void otaLoop(void)
+{
+    if(otaState != OTA_STOPPING) return;
+
+    if(otaStopTime == 0) {
+        Log.notice(F("OTA: Update ready, stopping all trains before the reboot"));
+
+        // Replicated to the group, so consists spread over several controllers stop together
+        commandStamp_t stamp;
+        for(uint8_t i = 0; i < LEGO_NUM_CHANNELS; i++) ble_set_motor_speed(i, 0, stamp);
+        otaStopTime = millis() | 1;
+
+    } else if(millis() - otaStopTime >= OTA_STOP_DELAY) {
+        halRestart();
+    }
+}
+
+void otaEverySecond(void)
+{
+    if(otaState != OTA_DOWNLOADING) return;
+
+    uint32_t written = otaWritten;
+    Log.notice(F("OTA: %u of %u bytes, %u kB/s"), written, otaSize, (written - otaLastWritten) / 1024);
+    otaLastWritten = written;
+}
+
+#endif // LEGO_USE_OTA
@@ -0,0 +1,26 @@
+#ifndef LEGO_OTA_H
+#define LEGO_OTA_H
+
+#include <Arduino.h>
+
+#ifndef OTA_CHUNK_SIZE
+#define OTA_CHUNK_SIZE 4096 // Bytes buffered before a flash write, one flash sector
+#endif
+
+#ifndef OTA_RETRIES
+#define OTA_RETRIES 5 // Interrupted downloads resumed before giving up
+#endif
+
+#ifndef OTA_STOP_DELAY
+#define OTA_STOP_DELAY 2000 // ms between stopping the trains and the reboot
+#endif
+
+enum { OTA_IDLE = 0, OTA_DOWNLOADING, OTA_VERIFYING, OTA_STOPPING, OTA_FAILED };
+
+void otaSetup(void);
+void otaLoop(void);
+void otaEverySecond(void);
+bool otaStart(const char * url, const char * sha256);
+uint8_t otaGetState(void);
+
+#endif
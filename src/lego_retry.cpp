@@ -0,0 +1,90 @@
+/* Reconnect backoff and offline queue of the MQTT link
+ *
+ * Pure logic without network access, lego_mqtt supplies the clock and the random numbers. After the connection is
+ * lost the first attempt goes out on the next loop, the following ones are spread over half to the whole backoff
+ * window, which doubles up to MQTT_BACKOFF_MAX. So once the broker is back the controller reconnects within
+ * MQTT_BACKOFF_MAX plus the time the connect itself takes, and a group of controllers doesn't retry in lockstep.
+ *
+ * State publishes made while disconnected are kept in MQTT_QUEUE_SIZE slots, one per subtopic with only its latest
+ * payload. The queue drains in the order the topics were last updated once the broker accepts publishes again.
+ */
+#include <string.h>
+
+#include "lego_retry.h"
+
+// Connected or settings changed: the next attempt goes out right away, the window starts over
+void retryBackoffReset(retryBackoff_t * backoff)
+{
+    backoff->delay = MQTT_BACKOFF_MIN;
+    backoff->now   = true;
+}
+
+bool retryBackoffDue(const retryBackoff_t * backoff, uint32_t now)
+{
+    return backoff->now || (int32_t)(now - backoff->nextAttempt) >= 0;
+}
+
+// Schedules the attempt after the one being made now, random is any uniformly distributed number.
+// Returns the ms until that attempt.
+uint32_t retryBackoffAttempt(retryBackoff_t * backoff, uint32_t now, uint32_t random)
+{
+    uint32_t wait        = backoff->delay / 2 + random % (backoff->delay / 2 + 1);
+    backoff->now         = false;
+    backoff->nextAttempt = now + wait;
+    backoff->delay       = backoff->delay * 2 < MQTT_BACKOFF_MAX ? backoff->delay * 2 : MQTT_BACKOFF_MAX;
+    return wait;
+}
+
+void retryQueueReset(retryQueue_t * queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+// Keeps the latest payload of a subtopic, replacing an older queued value. A full queue gives up the topic
+// updated longest ago. Returns false when the value was too long to be queued.
+bool retryQueuePut(retryQueue_t * queue, const char * subtopic, const char * payload)
+{
+    if(strlen(subtopic) >= sizeof(queue->items[0].subtopic) || strlen(payload) >= MQTT_QUEUE_PAYLOAD_SIZE) {
+        queue->dropped++;
+        return false;
+    }
+
+    retryQueueItem_t * slot = NULL;
+    for(uint8_t i = 0; i < MQTT_QUEUE_SIZE; i++) {
+        retryQueueItem_t * item = &queue->items[i];
+        if(item->order != 0 && !strcmp(item->subtopic, subtopic)) {
+            slot = item; // Last value wins
+            break;
+        }
+        if(slot == NULL || (slot->order != 0 && item->order < slot->order)) slot = item; // Free or oldest
+    }
+
+    if(slot->order == 0) {
+        queue->count++;
+    } else if(strcmp(slot->subtopic, subtopic)) {
+        queue->dropped++; // Queue full, the oldest topic is lost
+    }
+
+    slot->order = ++queue->order;
+    strncpy(slot->subtopic, subtopic, sizeof(slot->subtopic));
+    strncpy(slot->payload, payload, sizeof(slot->payload));
+    return true;
+}
+
+// Topic updated longest ago, NULL when the queue is empty
+retryQueueItem_t * retryQueueOldest(retryQueue_t * queue)
+{
+    retryQueueItem_t * oldest = NULL;
+    for(uint8_t i = 0; i < MQTT_QUEUE_SIZE; i++) {
+        if(queue->items[i].order != 0 && (oldest == NULL || queue->items[i].order < oldest->order))
+            oldest = &queue->items[i];
+    }
+    return oldest;
+}
+
+// Called once the item has been published
+void retryQueueRemove(retryQueue_t * queue, retryQueueItem_t * item)
+{
+    item->order = 0;
+    queue->count--;
+}
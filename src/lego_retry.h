@@ -0,0 +1,54 @@
+#ifndef LEGO_RETRY_H
+#define LEGO_RETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reconnect attempts back off exponentially with jitter, network events trigger an immediate attempt
+#ifndef MQTT_BACKOFF_MIN
+#define MQTT_BACKOFF_MIN 250 // ms
+#endif
+#ifndef MQTT_BACKOFF_MAX
+#define MQTT_BACKOFF_MAX 30000 // ms
+#endif
+
+// Outbound state publishes are kept while the broker is away, only the latest value per topic
+#ifndef MQTT_QUEUE_SIZE
+#define MQTT_QUEUE_SIZE 8 // Number of distinct state topics kept
+#endif
+#ifndef MQTT_QUEUE_PAYLOAD_SIZE
+#define MQTT_QUEUE_PAYLOAD_SIZE 128 // Longer payloads are dropped instead of queued
+#endif
+
+struct retryBackoff_t
+{
+    uint16_t delay;       // ms, the window the next attempt is scheduled in
+    uint32_t nextAttempt; // millis() of the next attempt
+    volatile bool now;    // Skip the remaining backoff, set from the WiFi event task
+};
+
+struct retryQueueItem_t
+{
+    uint32_t order; // 0 = free slot, otherwise the sequence number in which the topic was queued
+    char subtopic[24];
+    char payload[MQTT_QUEUE_PAYLOAD_SIZE];
+};
+
+struct retryQueue_t
+{
+    retryQueueItem_t items[MQTT_QUEUE_SIZE];
+    uint32_t order;
+    uint8_t count;
+    uint32_t dropped; // Values lost since the queue last ran empty
+};
+
+void retryBackoffReset(retryBackoff_t * backoff);
+bool retryBackoffDue(const retryBackoff_t * backoff, uint32_t now);
+uint32_t retryBackoffAttempt(retryBackoff_t * backoff, uint32_t now, uint32_t random);
+
+void retryQueueReset(retryQueue_t * queue);
+bool retryQueuePut(retryQueue_t * queue, const char * subtopic, const char * payload);
+retryQueueItem_t * retryQueueOldest(retryQueue_t * queue);
+void retryQueueRemove(retryQueue_t * queue, retryQueueItem_t * item);
+
+#endif
@@ -0,0 +1,55 @@
+/* WiFi roaming decisions
+ *
+ * Pure logic without radio access: lego_wifi feeds in an RSSI sample every second and asks for a scan when the
+ * smoothed signal has stayed below ROAM_RSSI_THRESHOLD for ROAM_WEAK_TIME. A scan result is only worth roaming to
+ * when it beats the current access point by ROAM_HYSTERESIS, so two access points of similar strength don't make
+ * the controller flip between them.
+ */
+#include "lego_roam.h"
+
+#define ROAM_SMOOTHING 2 // The average moves 1 / (1 << ROAM_SMOOTHING) towards each sample
+
+// Start over after every association, the samples of the previous access point no longer apply
+void roamReset(roamState_t * state, uint32_t now)
+{
+    state->rssi       = 0;
+    state->valid      = false;
+    state->associated = now;
+    state->weakSince  = 0;
+    state->lastScan   = now;
+}
+
+uint8_t roamSample(roamState_t * state, int8_t rssi, uint32_t now)
+{
+    if(rssi >= 0) return ROAM_STAY; // 0 means no reading
+
+    if(!state->valid) {
+        state->rssi  = rssi * 8;
+        state->valid = true;
+    } else {
+        state->rssi += (rssi * 8 - state->rssi) >> ROAM_SMOOTHING;
+    }
+
+    if(roamGetRssi(state) >= ROAM_RSSI_THRESHOLD) {
+        state->weakSince = 0;
+        return ROAM_STAY;
+    }
+    if(state->weakSince == 0) state->weakSince = now > 0 ? now : 1; // 0 means not weak
+
+    if(now - state->weakSince < ROAM_WEAK_TIME || now - state->lastScan < ROAM_SCAN_INTERVAL ||
+       now - state->associated < ROAM_HOLDOFF)
+        return ROAM_STAY;
+
+    state->lastScan = now;
+    return ROAM_SCAN;
+}
+
+int8_t roamGetRssi(const roamState_t * state)
+{
+    return state->valid ? state->rssi / 8 : 0;
+}
+
+bool roamShouldRoam(const roamState_t * state, int8_t candidateRssi)
+{
+    return state->valid && candidateRssi < 0 && candidateRssi >= roamGetRssi(state) + ROAM_HYSTERESIS;
+}
@@ -0,0 +1,44 @@
+#ifndef LEGO_ROAM_H
+#define LEGO_ROAM_H
+
+#include <stdint.h>
+
+#ifndef ROAM_RSSI_THRESHOLD
+#define ROAM_RSSI_THRESHOLD -70 // dBm, below this the controller looks for a stronger access point
+#endif
+
+#ifndef ROAM_HYSTERESIS
+#define ROAM_HYSTERESIS 8 // dB a candidate must be stronger than the current access point
+#endif
+
+#ifndef ROAM_WEAK_TIME
+#define ROAM_WEAK_TIME 10000 // ms the signal has to stay weak before a scan, a passing train doesn't count
+#endif
+
+#ifndef ROAM_SCAN_INTERVAL
+#define ROAM_SCAN_INTERVAL 30000 // ms between scans while the signal stays weak
+#endif
+
+#ifndef ROAM_HOLDOFF
+#define ROAM_HOLDOFF 60000 // ms after an association before roaming again
+#endif
+
+enum { ROAM_STAY = 0, ROAM_SCAN };
+
+// Signal history of the current association. The decisions only depend on the samples and times passed in,
+// so they can be replayed from recorded RSSI traces.
+struct roamState_t
+{
+    int16_t rssi;        // Smoothed RSSI in 1/8 dBm
+    bool valid;          // rssi holds at least one sample
+    uint32_t associated; // Time of the association
+    uint32_t weakSince;  // Time the smoothed RSSI went below the threshold, 0 while it is above
+    uint32_t lastScan;
+};
+
+void roamReset(roamState_t * state, uint32_t now);
+uint8_t roamSample(roamState_t * state, int8_t rssi, uint32_t now);
+int8_t roamGetRssi(const roamState_t * state);
+bool roamShouldRoam(const roamState_t * state, int8_t candidateRssi);
+
+#endif
@@ -0,0 +1,226 @@
+#include <Arduino.h>
+#include "ArduinoLog.h"
+
+#include "lego_conf.h"
+#include "lego_ble.h"
+#include "lego_stats.h"
+#include "lego_rocrail.h"
+
+#define ROCRAIL_CHANNEL 4 // Channel driven by Rocrail loco messages
+
+// XML scanner states
+enum {
+    ROCRAIL_TEXT = 0,    // Character data between tags
+    ROCRAIL_TAG_OPEN,    // After <
+    ROCRAIL_TAG_NAME,    // Reading the element name
+    ROCRAIL_IN_TAG,      // Inside a start tag, waiting for an attribute
+    ROCRAIL_ATTR_NAME,   // Reading an attribute name
+    ROCRAIL_ATTR_EQUALS, // Waiting for the quote that opens the attribute value
+    ROCRAIL_ATTR_VALUE,  // Reading an attribute value
+    ROCRAIL_EMPTY_END,   // After the / of an empty element tag
+    ROCRAIL_END_TAG,     // Inside an end tag
+    ROCRAIL_SKIP         // Inside a declaration, comment or processing instruction
+};
+
+// Loco attributes
+enum {
+    ROCRAIL_FOUND_ID       = 0x01,
+    ROCRAIL_FOUND_ADDR     = 0x02,
+    ROCRAIL_FOUND_DIR      = 0x04,
+    ROCRAIL_FOUND_SPEED    = 0x08,
+    ROCRAIL_FOUND_SPEEDMAX = 0x10,
+    ROCRAIL_FOUND_ALL      = 0x1F
+};
+
+void rocrailBegin(rocrailParser_t & parser, commandStamp_t stamp)
+{
+    parser.state    = ROCRAIL_TEXT;
+    parser.depth    = 0;
+    parser.nameLen  = 0;
+    parser.valueLen = 0;
+    parser.isLoco   = false;
+    parser.found    = 0;
+    parser.stamp    = stamp;
+}
+
+// Names longer than the buffer keep counting so they can never match a shorter name
+static void rocrailName(rocrailParser_t & parser, char ch)
+{
+    if(parser.nameLen < sizeof(parser.name) - 1) parser.name[parser.nameLen] = ch;
+    if(parser.nameLen < 255) parser.nameLen++;
+}
+
+static bool rocrailNameIs(rocrailParser_t & parser, PGM_P name)
+{
+    if(parser.nameLen >= sizeof(parser.name)) return false;
+    parser.name[parser.nameLen] = 0;
+    return !strcmp_P(parser.name, name);
+}
+
+static void rocrailAttribute(rocrailParser_t & parser)
+{
+    parser.value[parser.valueLen] = 0;
+
+    if(rocrailNameIs(parser, PSTR("id"))) {
+        strncpy(parser.id, parser.value, sizeof(parser.id));
+        parser.found |= ROCRAIL_FOUND_ID;
+    } else if(rocrailNameIs(parser, PSTR("addr"))) {
+        parser.addr = atoi(parser.value);
+        parser.found |= ROCRAIL_FOUND_ADDR;
+    } else if(rocrailNameIs(parser, PSTR("dir"))) {
+        // expected values are "true" or "false"
+        parser.dir = !strcmp_P(parser.value, PSTR("true")) ? 1 : !strcmp_P(parser.value, PSTR("false")) ? -1 : 0;
+        if(parser.dir != 0) parser.found |= ROCRAIL_FOUND_DIR;
+    } else if(rocrailNameIs(parser, PSTR("V"))) {
+        parser.speed = atoi(parser.value);
+        parser.found |= ROCRAIL_FOUND_SPEED;
+    } else if(rocrailNameIs(parser, PSTR("V_max"))) {
+        // Maximum speed of the loco, set as percentage in the Rocrail loco settings
+        parser.speedMax = atoi(parser.value);
+        parser.found |= ROCRAIL_FOUND_SPEEDMAX;
+    }
+}
+
+// A top level <lc> start tag is complete, the speed is applied without waiting for the rest of the message
+static void rocrailLoco(rocrailParser_t & parser)
+{
+    if((parser.found & ROCRAIL_FOUND_ALL) != ROCRAIL_FOUND_ALL) {
+        Log.warning(F("ROCRAIL: Loco message is missing attributes (0x%x), message disregarded"), parser.found);
+        statsCount(statsCounters.xmlDropped);
+        return;
+    }
+
+    // The addr attribute is the controller number, it is not checked yet
+    int targetTrainSpeed = parser.speed * parser.dir;
+    Log.notice(F("ROCRAIL: Loco %s addr %d speed %d, max %d"), parser.id, parser.addr, targetTrainSpeed,
+               parser.speedMax);
+
+    parser.stamp.source = STATS_SOURCE_XML;
+    ble_set_motor_speed(ROCRAIL_CHANNEL, targetTrainSpeed, parser.stamp);
+}
+
+static void rocrailTagEnd(rocrailParser_t & parser, bool isEmpty)
+{
+    if(parser.isLoco) rocrailLoco(parser);
+    if(!isEmpty && parser.depth < 255) parser.depth++;
+
+    parser.isLoco = false;
+    parser.state  = ROCRAIL_TEXT;
+}
+
+// Completes the element name at the first whitespace, / or >
+static void rocrailTagName(rocrailParser_t & parser)
+{
+    parser.isLoco = parser.depth == 0 && rocrailNameIs(parser, PSTR("lc"));
+    parser.found  = 0;
+    parser.state  = ROCRAIL_IN_TAG;
+}
+
+static void rocrailFeed(rocrailParser_t & parser, char ch)
+{
+    switch(parser.state) {
+        case ROCRAIL_TEXT:
+            if(ch == '<') parser.state = ROCRAIL_TAG_OPEN;
+            break;
+
+        case ROCRAIL_TAG_OPEN:
+            if(ch == '/') {
+                parser.state = ROCRAIL_END_TAG;
+            } else if(ch == '?' || ch == '!') {
+                parser.state = ROCRAIL_SKIP;
+            } else {
+                parser.nameLen = 0;
+                rocrailName(parser, ch);
+                parser.state = ROCRAIL_TAG_NAME;
+            }
+            break;
+
+        case ROCRAIL_TAG_NAME:
+            if(isspace(ch) || ch == '/' || ch == '>') {
+                rocrailTagName(parser);
+                rocrailFeed(parser, ch); // Handle the delimiter inside the tag
+            } else {
+                rocrailName(parser, ch);
+            }
+            break;
+
+        case ROCRAIL_IN_TAG:
+            if(ch == '>') {
+                rocrailTagEnd(parser, false);
+            } else if(ch == '/') {
+                parser.state = ROCRAIL_EMPTY_END;
+            } else if(!isspace(ch)) {
+                parser.nameLen = 0;
+                rocrailName(parser, ch);
+                parser.state = ROCRAIL_ATTR_NAME;
+            }
+            break;
+
+        case ROCRAIL_ATTR_NAME:
+            if(ch == '=' || isspace(ch)) {
+                parser.state = ROCRAIL_ATTR_EQUALS;
+            } else if(ch == '>') {
+                rocrailTagEnd(parser, false); // Attribute without a value
+            } else {
+                rocrailName(parser, ch);
+            }
+            break;
+
+        case ROCRAIL_ATTR_EQUALS:
+            if(ch == '"' || ch == '\'') {
+                parser.quote    = ch;
+                parser.valueLen = 0;
+                parser.state    = ROCRAIL_ATTR_VALUE;
+            } else if(ch == '>') {
+                rocrailTagEnd(parser, false);
+            }
+            break;
+
+        case ROCRAIL_ATTR_VALUE:
+            if(ch == parser.quote) {
+                if(parser.isLoco) rocrailAttribute(parser);
+                parser.state = ROCRAIL_IN_TAG;
+            } else if(parser.valueLen < sizeof(parser.value) - 1) {
+                parser.value[parser.valueLen++] = ch; // Longer values are truncated
+            }
+            break;
+
+        case ROCRAIL_EMPTY_END:
+            if(ch == '>') {
+                rocrailTagEnd(parser, true);
+            } else if(!isspace(ch)) {
+                parser.state = ROCRAIL_IN_TAG;
+            }
+            break;
+
+        case ROCRAIL_END_TAG:
+            if(ch == '>') {
+                if(parser.depth > 0) parser.depth--;
+                parser.state = ROCRAIL_TEXT;
+            }
+            break;
+
+        case ROCRAIL_SKIP:
+            if(ch == '>') parser.state = ROCRAIL_TEXT;
+            break;
+    }
+}
+
+void rocrailFeed(rocrailParser_t & parser, const char * data, size_t length)
+{
+    while(length--) rocrailFeed(parser, *data++);
+}
+
+void rocrailEnd(rocrailParser_t & parser)
+{
+    statsCount(statsCounters.xmlParsed);
+    if(parser.state != ROCRAIL_TEXT || parser.depth > 0) Log.verbose(F("ROCRAIL: Message ended inside an element"));
+}
+
+void rocrailParse(const char * payload, size_t length, commandStamp_t stamp)
+{
+    rocrailParser_t parser;
+    rocrailBegin(parser, stamp);
+    rocrailFeed(parser, payload, length);
+    rocrailEnd(parser);
+}
@@ -0,0 +1,36 @@
+#ifndef LEGO_ROCRAIL_H
+#define LEGO_ROCRAIL_H
+
+#include <Arduino.h>
+#include "lego_stats.h"
+
+#define ROCRAIL_NAME_SIZE 8
+#define ROCRAIL_VALUE_SIZE 32
+
+// Streaming scanner for Rocrail XML messages, one per transport so no allocations are needed.
+// Only the attributes of a top level <lc> element are kept, everything else is skipped as it arrives.
+struct rocrailParser_t
+{
+    uint8_t state;
+    uint8_t depth;
+    uint8_t nameLen;
+    uint8_t valueLen;
+    char quote;
+    bool isLoco;   // The current tag is a top level <lc>
+    uint8_t found; // Loco attributes seen so far
+    char name[ROCRAIL_NAME_SIZE];
+    char value[ROCRAIL_VALUE_SIZE];
+    char id[ROCRAIL_VALUE_SIZE];
+    int16_t addr;
+    int16_t speed;
+    int16_t speedMax;
+    int8_t dir;
+    commandStamp_t stamp;
+};
+
+void rocrailBegin(rocrailParser_t & parser, commandStamp_t stamp);
+void rocrailFeed(rocrailParser_t & parser, const char * data, size_t length);
+void rocrailEnd(rocrailParser_t & parser);
+void rocrailParse(const char * payload, size_t length, commandStamp_t stamp);
+
+#endif
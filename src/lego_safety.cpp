@@ -0,0 +1,125 @@
+/* Control path supervision
+ *
+ * Pure logic without hardware access, so it runs unchanged in a native test build. The control links and the hub
+ * tasks only store a timestamp when they are alive; every channel remembers the link of the last command that set
+ * it moving. safetyCheck runs from the supervisor task and compares the timestamps: when a link goes quiet the
+ * channels it drives are brought to a stop, when a hub task stalls the other hubs on its channel are stopped so a
+ * consist doesn't push or drag the stalled train. A new command for a channel from a live source takes over again.
+ */
+#include "lego_safety.h"
+
+struct safetyLink_t
+{
+    volatile uint32_t lastBeat; // 0 until the link shows up
+    bool lost;
+};
+
+struct safetyHub_t
+{
+    volatile uint32_t lastBeat; // 0 while the hub task has no connected hub
+    volatile uint8_t channel;
+    bool stalled;
+};
+
+static safetyLink_t safetyLinks[SAFETY_LINK_COUNT];
+static safetyHub_t safetyHubs[SAFETY_MAX_HUBS];
+static volatile uint8_t safetyOwner[SAFETY_MAX_CHANNELS]; // Link of the command that set each channel moving
+static uint32_t safetyRamping;                            // Channels being brought to a stop
+
+void safetyReset(void)
+{
+    for(uint8_t i = 0; i < SAFETY_LINK_COUNT; i++) {
+        safetyLinks[i].lastBeat = 0;
+        safetyLinks[i].lost     = false;
+    }
+    for(uint8_t i = 0; i < SAFETY_MAX_HUBS; i++) {
+        safetyHubs[i].lastBeat = 0;
+        safetyHubs[i].stalled  = false;
+    }
+    for(uint8_t i = 0; i < SAFETY_MAX_CHANNELS; i++) safetyOwner[i] = SAFETY_LINK_NONE;
+    __atomic_store_n(&safetyRamping, 0, __ATOMIC_RELAXED);
+}
+
+void safetyBeatLink(uint8_t link, uint32_t now)
+{
+    if(link < SAFETY_LINK_COUNT) safetyLinks[link].lastBeat = now > 0 ? now : 1; // 0 means not seen
+}
+
+void safetyBeatHub(uint8_t hub, uint8_t channel, uint32_t now)
+{
+    if(hub >= SAFETY_MAX_HUBS) return;
+    safetyHubs[hub].channel  = channel;
+    safetyHubs[hub].lastBeat = now > 0 ? now : 1;
+}
+
+// The hub task has no hub to drive, don't expect heartbeats
+void safetyHubIdle(uint8_t hub)
+{
+    if(hub < SAFETY_MAX_HUBS) safetyHubs[hub].lastBeat = 0;
+}
+
+// Called for every speed command, from whichever task received it
+void safetyNoteCommand(uint8_t channel, uint8_t link, int8_t speed)
+{
+    if(channel >= SAFETY_MAX_CHANNELS || link == SAFETY_LINK_SYSTEM) return;
+
+    safetyOwner[channel] = speed != 0 ? link : (uint8_t)SAFETY_LINK_NONE; // A stopped train needs no supervision
+    __atomic_fetch_and(&safetyRamping, ~(1UL << channel), __ATOMIC_RELAXED);
+}
+
+// Returns the channels that must start ramping down, the causes are added to lostLinks and stalledHubs
+uint32_t safetyCheck(uint32_t now, uint32_t * lostLinks, uint16_t * stalledHubs)
+{
+    uint32_t stop = 0;
+
+    for(uint8_t link = SAFETY_LINK_NONE + 1; link < SAFETY_LINK_COUNT; link++) {
+        uint32_t beat = safetyLinks[link].lastBeat;
+        if(beat == 0 || now - beat <= SAFETY_LINK_TIMEOUT) {
+            safetyLinks[link].lost = false;
+            continue;
+        }
+        if(safetyLinks[link].lost) continue; // Only once per outage
+
+        safetyLinks[link].lost = true;
+        *lostLinks |= 1UL << link;
+        for(uint8_t ch = 0; ch < SAFETY_MAX_CHANNELS; ch++) {
+            if(safetyOwner[ch] != link) continue;
+            safetyOwner[ch] = SAFETY_LINK_NONE;
+            stop |= 1UL << ch;
+        }
+    }
+
+    for(uint8_t hub = 0; hub < SAFETY_MAX_HUBS; hub++) {
+        uint32_t beat = safetyHubs[hub].lastBeat;
+        if(beat == 0 || now - beat <= SAFETY_HUB_TIMEOUT) {
+            safetyHubs[hub].stalled = false;
+            continue;
+        }
+        if(safetyHubs[hub].stalled) continue;
+
+        safetyHubs[hub].stalled = true;
+        *stalledHubs |= 1 << hub;
+        if(safetyHubs[hub].channel < SAFETY_MAX_CHANNELS) stop |= 1UL << safetyHubs[hub].channel;
+    }
+
+    __atomic_fetch_or(&safetyRamping, stop, __ATOMIC_RELAXED);
+    return stop;
+}
+
+uint32_t safetyGetRamping(void)
+{
+    return __atomic_load_n(&safetyRamping, __ATOMIC_RELAXED);
+}
+
+void safetyRampDone(uint8_t channel)
+{
+    if(channel < SAFETY_MAX_CHANNELS) __atomic_fetch_and(&safetyRamping, ~(1UL << channel), __ATOMIC_RELAXED);
+}
+
+// Next speed on the way to a standstill
+int8_t safetyRamp(int8_t speed)
+{
+    if(speed > SAFETY_RAMP_STEP) return speed - SAFETY_RAMP_STEP;
+    if(speed < -SAFETY_RAMP_STEP) return speed + SAFETY_RAMP_STEP;
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef LEGO_SAFETY_H
+#define LEGO_SAFETY_H
+
+#include <stdint.h>
+
+#define SAFETY_MAX_CHANNELS 32 // Channels are kept in a bitmask
+#define SAFETY_MAX_HUBS 16
+
+// Control links whose loss leaves the trains without a driver
+enum {
+    SAFETY_LINK_NONE = 0, // Console commands, nobody to lose
+    SAFETY_LINK_MQTT,     // Broker connection, carries the MQTT, Rocrail and group commands
+    SAFETY_LINK_REMOTE,   // Powered Up remotes, one link per hub slot starting here
+    SAFETY_LINK_COUNT  = SAFETY_LINK_REMOTE + SAFETY_MAX_HUBS,
+    SAFETY_LINK_SYSTEM = SAFETY_LINK_COUNT // Speed changes made by the supervisor itself
+};
+
+static_assert(SAFETY_LINK_COUNT <= 32, "Lost links are reported in a bitmask");
+
+#ifndef SAFETY_LINK_TIMEOUT
+#define SAFETY_LINK_TIMEOUT 3000 // ms without a heartbeat after which a control link counts as lost
+#endif
+
+#ifndef SAFETY_HUB_TIMEOUT
+#define SAFETY_HUB_TIMEOUT 5000 // ms without a heartbeat after which a hub task counts as stalled
+#endif
+
+#ifndef SAFETY_RAMP_STEP
+#define SAFETY_RAMP_STEP 10 // Speed units taken off every supervisor tick while bringing a train to a stop
+#endif
+
+void safetyReset(void);
+void safetyBeatLink(uint8_t link, uint32_t now);
+void safetyBeatHub(uint8_t hub, uint8_t channel, uint32_t now);
+void safetyHubIdle(uint8_t hub);
+void safetyNoteCommand(uint8_t channel, uint8_t link, int8_t speed);
+uint32_t safetyCheck(uint32_t now, uint32_t * lostLinks, uint16_t * stalledHubs);
+uint32_t safetyGetRamping(void);
+void safetyRampDone(uint8_t channel);
+int8_t safetyRamp(int8_t speed);
+
+#endif
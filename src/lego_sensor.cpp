@@ -0,0 +1,114 @@
+/* Hub port devices
+ *
+ * Pure decoding without hardware access. Legoino activates each device in its default mode and hands the raw port
+ * value message to the port callback; sensorDecode reads the value straight into the fixed state of the port, so
+ * the callback neither allocates nor formats. Message layout: length, hub id, message type, port, value.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "lego_sensor.h"
+
+// Device type ids of the LEGO Wireless Protocol
+#define SENSOR_TYPE_SIMPLE_MOTOR 1
+#define SENSOR_TYPE_TRAIN_MOTOR 2
+#define SENSOR_TYPE_TILT 34
+#define SENSOR_TYPE_COLOR_DISTANCE 37
+#define SENSOR_TYPE_MEDIUM_LINEAR_MOTOR 38
+#define SENSOR_TYPE_MOVE_HUB_MOTOR 39
+#define SENSOR_TYPE_MOVE_HUB_TILT 40
+#define SENSOR_TYPE_LARGE_MOTOR 46
+#define SENSOR_TYPE_XLARGE_MOTOR 47
+#define SENSOR_TYPE_MEDIUM_ANGULAR_MOTOR 75
+#define SENSOR_TYPE_LARGE_ANGULAR_MOTOR 76
+
+#define SENSOR_VALUE 4 // Offset of the value in a port value message
+
+static uint8_t sensor_kind(uint8_t deviceType)
+{
+    switch(deviceType) {
+        case SENSOR_TYPE_SIMPLE_MOTOR:
+        case SENSOR_TYPE_TRAIN_MOTOR:
+            return SENSOR_KIND_MOTOR;
+        case SENSOR_TYPE_COLOR_DISTANCE:
+            return SENSOR_KIND_COLOR_DISTANCE;
+        case SENSOR_TYPE_TILT:
+        case SENSOR_TYPE_MOVE_HUB_TILT:
+            return SENSOR_KIND_TILT;
+        case SENSOR_TYPE_MEDIUM_LINEAR_MOTOR:
+        case SENSOR_TYPE_MOVE_HUB_MOTOR:
+        case SENSOR_TYPE_LARGE_MOTOR:
+        case SENSOR_TYPE_XLARGE_MOTOR:
+        case SENSOR_TYPE_MEDIUM_ANGULAR_MOTOR:
+        case SENSOR_TYPE_LARGE_ANGULAR_MOTOR:
+            return SENSOR_KIND_TACHO;
+        default:
+            return SENSOR_KIND_NONE;
+    }
+}
+
+// A device was plugged in or pulled out, 0 or 255 for an empty port
+void sensorAttach(sensorPort_t * port, uint8_t deviceType)
+{
+    memset(port, 0, sizeof(sensorPort_t));
+    port->deviceType = deviceType == 255 ? 0 : deviceType;
+    port->kind       = sensor_kind(port->deviceType);
+}
+
+// Returns whether the reading changed
+bool sensorDecode(sensorPort_t * port, const uint8_t * message)
+{
+    uint8_t length      = message[0];
+    const uint8_t * val = message + SENSOR_VALUE;
+
+    switch(port->kind) {
+        case SENSOR_KIND_COLOR_DISTANCE: // Combined mode: color, proximity
+            if(length < SENSOR_VALUE + 2 || (port->color == val[0] && port->distance == val[1])) return false;
+            port->color    = val[0];
+            port->distance = val[1];
+            return true;
+        case SENSOR_KIND_TILT: // Angle mode: x, y
+            if(length < SENSOR_VALUE + 2 || (port->tiltX == (int8_t)val[0] && port->tiltY == (int8_t)val[1]))
+                return false;
+            port->tiltX = val[0];
+            port->tiltY = val[1];
+            return true;
+        case SENSOR_KIND_TACHO: { // Position mode: int32 little endian
+            if(length < SENSOR_VALUE + 4) return false;
+            int32_t position = (int32_t)((uint32_t)val[0] | (uint32_t)val[1] << 8 | (uint32_t)val[2] << 16 |
+                                         (uint32_t)val[3] << 24);
+            if(port->position == position) return false;
+            port->position = position;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool sensorIsMotor(const sensorPort_t * port)
+{
+    return port->kind == SENSOR_KIND_MOTOR || port->kind == SENSOR_KIND_TACHO;
+}
+
+// JSON array with the readings of each port
+size_t sensorGetJson(const sensorPort_t * ports, uint8_t count, char * buffer, size_t size)
+{
+    size_t len = snprintf(buffer, size, "[");
+    for(uint8_t i = 0; i < count && len < size; i++) {
+        const sensorPort_t * port = &ports[i];
+        len += snprintf(buffer + len, size - len, "%s{\"type\":%u", i ? "," : "", port->deviceType);
+        if(len >= size) break;
+
+        if(port->kind == SENSOR_KIND_COLOR_DISTANCE) {
+            len += snprintf(buffer + len, size - len, ",\"color\":%u,\"distance\":%u", port->color, port->distance);
+        } else if(port->kind == SENSOR_KIND_TILT) {
+            len += snprintf(buffer + len, size - len, ",\"x\":%d,\"y\":%d", port->tiltX, port->tiltY);
+        } else if(port->kind == SENSOR_KIND_TACHO) {
+            len += snprintf(buffer + len, size - len, ",\"position\":%ld", (long)port->position);
+        }
+        if(len < size) len += snprintf(buffer + len, size - len, "}");
+    }
+    if(len < size) len += snprintf(buffer + len, size - len, "]");
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,42 @@
+#ifndef LEGO_SENSOR_H
+#define LEGO_SENSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    SENSOR_KIND_NONE = 0,       // Empty port or a device without readings, e.g. lights
+    SENSOR_KIND_MOTOR,          // Train motor without feedback
+    SENSOR_KIND_COLOR_DISTANCE, // Color and distance sensor
+    SENSOR_KIND_TILT,           // Tilt sensor
+    SENSOR_KIND_TACHO,          // Motor with a rotation sensor
+};
+
+#define SENSOR_PORTS 2 // External ports of a Powered Up hub
+
+#ifndef SENSOR_DETECT_INTERVAL
+#define SENSOR_DETECT_INTERVAL 1000 // ms between checks for devices plugged into or pulled from a hub port
+#endif
+
+#ifndef SENSOR_PUBLISH_INTERVAL
+#define SENSOR_PUBLISH_INTERVAL 250 // ms between MQTT updates, readings in between only keep the latest value
+#endif
+
+// Latest readings of the device on one hub port, decoded in place from the port value notifications
+struct sensorPort_t
+{
+    uint8_t deviceType; // Device type id of the attached device, 0 when the port is empty
+    uint8_t kind;
+    uint8_t color;     // Color index seen by a color and distance sensor
+    uint8_t distance;  // Proximity of a color and distance sensor, 0 near to 10 far
+    int8_t tiltX;      // Degrees
+    int8_t tiltY;      // Degrees
+    int32_t position;  // Degrees turned by a tacho motor since it was attached
+};
+
+void sensorAttach(sensorPort_t * port, uint8_t deviceType);
+bool sensorDecode(sensorPort_t * port, const uint8_t * message);
+bool sensorIsMotor(const sensorPort_t * port);
+size_t sensorGetJson(const sensorPort_t * ports, uint8_t count, char * buffer, size_t size);
+
+#endif
@@ -0,0 +1,247 @@
+#include <Arduino.h>
+#include "lego_conf.h"
+#include "lego_ble.h"
+#include "lego_stats.h"
+#include "lego_hal.h"
+#if LEGO_USE_COEX > 0
+#include "lego_coex.h"
+#endif
+
+struct latencyHistogram_t
+{
+    uint32_t count;
+    uint32_t sum; // us, wraps after ~70 minutes of accumulated latency
+    uint32_t max; // us
+    uint32_t bucket[STATS_LATENCY_BUCKETS];
+};
+
+latencyHistogram_t latencyBySource[STATS_SOURCE_COUNT];
+latencyHistogram_t latencyByHub[MAX_BLE_DEVICES];
+#if LEGO_USE_COEX > 0
+latencyHistogram_t latencyByCoex[COEX_MODE_COUNT];
+#endif
+
+statsCounters_t statsCounters;
+uint32_t statsBleWrites[MAX_BLE_DEVICES];
+uint32_t statsLastLoops     = 0; // Loop counters at the start of the rate window
+uint32_t statsLastLoopBusy  = 0;
+unsigned long statsLastTime = 0;
+
+uint32_t statsBootTime[STATS_BOOT_COUNT]; // millis() when a boot phase ended, 0 while it hasn't
+
+const char * const statsBootNames[STATS_BOOT_COUNT] = {"serial", "debug",    "config", "wifi",          "ble",
+                                                       "mqtt",   "services", "setup",  "wifiIp", "mqttConnected",
+                                                       "firstHub"};
+
+const char * const statsSourceNames[STATS_SOURCE_COUNT] = {"none",  "remote", "mqtt",   "xml",
+                                                           "group", "serial", "telnet", "http"};
+
+commandStamp_t statsStamp(uint8_t source)
+{
+    commandStamp_t stamp;
+    stamp.source = source;
+    stamp.time   = micros();
+    return stamp;
+}
+
+const char * statsSourceName(uint8_t source)
+{
+    return source < STATS_SOURCE_COUNT ? statsSourceNames[source] : statsSourceNames[STATS_SOURCE_NONE];
+}
+
+static inline uint8_t statsLatencyBucket(uint32_t latency)
+{
+    uint32_t scaled = latency >> 8; // 256 us resolution in the first bucket
+    if(scaled == 0) return 0;
+
+    uint8_t bucket = 32 - __builtin_clz(scaled);
+    return bucket < STATS_LATENCY_BUCKETS ? bucket : STATS_LATENCY_BUCKETS - 1;
+}
+
+static void statsAddLatency(latencyHistogram_t * histogram, uint8_t bucket, uint32_t latency)
+{
+    // Hub tasks record concurrently, keep the counters consistent without taking a lock
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, latency, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->bucket[bucket], 1, __ATOMIC_RELAXED);
+
+    uint32_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while(latency > max &&
+          !__atomic_compare_exchange_n(&histogram->max, &max, latency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Called from the hub task right after the speed has been written to the hub
+void statsRecordLatency(const commandStamp_t & stamp, uint8_t hub)
+{
+    if(stamp.source == STATS_SOURCE_NONE || stamp.source >= STATS_SOURCE_COUNT) return;
+
+    uint32_t latency = micros() - stamp.time;
+    uint8_t bucket   = statsLatencyBucket(latency);
+
+    statsAddLatency(&latencyBySource[stamp.source], bucket, latency);
+    if(hub < MAX_BLE_DEVICES) statsAddLatency(&latencyByHub[hub], bucket, latency);
+#if LEGO_USE_COEX > 0
+    statsAddLatency(&latencyByCoex[coexGetMode()], bucket, latency);
+#endif
+}
+
+void statsResetLatency(void)
+{
+    memset(latencyBySource, 0, sizeof(latencyBySource));
+    memset(latencyByHub, 0, sizeof(latencyByHub));
+#if LEGO_USE_COEX > 0
+    memset(latencyByCoex, 0, sizeof(latencyByCoex));
+#endif
+}
+
+// JSON of a single histogram, returns false if it has no samples
+static latencyHistogram_t * statsGetHistogram(uint8_t group, uint8_t index)
+{
+    switch(group) {
+        case STATS_LATENCY_SOURCE:
+            return index < STATS_SOURCE_COUNT ? &latencyBySource[index] : NULL;
+        case STATS_LATENCY_HUB:
+            return index < MAX_BLE_DEVICES ? &latencyByHub[index] : NULL;
+#if LEGO_USE_COEX > 0
+        case STATS_LATENCY_COEX:
+            return index < COEX_MODE_COUNT ? &latencyByCoex[index] : NULL;
+#endif
+    }
+    return NULL;
+}
+
+bool statsGetLatencyJson(char * buffer, size_t size, uint8_t group, uint8_t index)
+{
+    latencyHistogram_t * histogram = statsGetHistogram(group, index);
+    if(histogram == NULL || histogram->count == 0) return false;
+
+    size_t len = snprintf_P(buffer, size, PSTR("{\"n\":%u,\"avg\":%u,\"max\":%u,\"hist\":["), histogram->count,
+                            histogram->sum / histogram->count, histogram->max);
+    for(uint8_t i = 0; i < STATS_LATENCY_BUCKETS && len < size; i++) {
+        len += snprintf_P(buffer + len, size - len, PSTR("%s%u"), i ? "," : "", histogram->bucket[i]);
+    }
+    if(len < size) snprintf_P(buffer + len, size - len, PSTR("]}"));
+    return true;
+}
+
+static void statsPrintHistogram(Print * output, const char * name, latencyHistogram_t * histogram)
+{
+    if(histogram->count == 0) return;
+
+    output->printf(PSTR("%-8s %7u %7u %8u "), name, histogram->count, histogram->sum / histogram->count,
+                   histogram->max);
+    for(uint8_t i = 0; i < STATS_LATENCY_BUCKETS; i++) output->printf(PSTR(" %7u"), histogram->bucket[i]);
+    output->println();
+}
+
+void statsPrintLatency(Print * output)
+{
+    output->print(F("Latency   Count  Avg us   Max us "));
+    for(uint8_t i = 0; i < STATS_LATENCY_BUCKETS - 1; i++) output->printf(PSTR(" <%6u"), 256u << i);
+    output->println(F("    more"));
+
+    for(uint8_t i = STATS_SOURCE_NONE + 1; i < STATS_SOURCE_COUNT; i++) {
+        statsPrintHistogram(output, statsSourceNames[i], &latencyBySource[i]);
+    }
+
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES; i++) {
+        char name[8];
+        snprintf_P(name, sizeof(name), PSTR("hub%u"), i);
+        statsPrintHistogram(output, name, &latencyByHub[i]);
+    }
+
+#if LEGO_USE_COEX > 0
+    for(uint8_t i = 0; i < COEX_MODE_COUNT; i++) {
+        statsPrintHistogram(output, coexModeName(i), &latencyByCoex[i]);
+    }
+#endif
+}
+
+// Called at the end of every loop() with the time it took
+void statsRecordLoop(uint32_t busy)
+{
+    statsCounters.loops++;
+    statsCounters.loopBusy += busy;
+}
+
+// Called from the hub task after every speed write
+void statsRecordWrite(uint8_t hub)
+{
+    if(hub < MAX_BLE_DEVICES) statsCount(statsBleWrites[hub]);
+}
+
+// Start a new window for the loop rates, only the periodic status update does this so other readers don't skew it
+void statsNewWindow(void)
+{
+    statsLastTime     = millis();
+    statsLastLoops    = statsCounters.loops;
+    statsLastLoopBusy = statsCounters.loopBusy;
+}
+
+// Consolidated counters as JSON, the loop rate and CPU load are averaged since the last statsNewWindow
+size_t statsGetJson(char * buffer, size_t size)
+{
+    unsigned long elapsed = max(1UL, millis() - statsLastTime);
+    uint32_t loops        = statsCounters.loops - statsLastLoops;
+    uint32_t busy         = statsCounters.loopBusy - statsLastLoopBusy;
+
+    size_t len = snprintf_P(
+        buffer, size,
+        PSTR("{\"uptime\":%lu,\"loops\":%u,\"loopCpu\":%u,\"heapFree\":%u,\"heapMaxBlock\":%u,\"heapFrag\":%u,"
+             "\"mqttIn\":%u,\"mqttInBytes\":%u,\"mqttOut\":%u,\"mqttOutBytes\":%u,\"mqttDropped\":%u,"
+             "\"mqttReconnects\":%u,\"mqttLastOutage\":%u,\"mqttMaxOutage\":%u,\"wifiReconnects\":%u,"
+             "\"wifiLastReconnect\":%u,\"wifiRoams\":%u,\"wifiLastRoam\":%u,\"wifiRssi\":%d,"
+             "\"xmlParsed\":%u,\"xmlDropped\":%u,\"bleScanTime\":%u,\"syslogSent\":%u,\"syslogDropped\":%u,"
+             "\"coexDeferrals\":%u,\"coexDeferredTime\":%u,\"safetyStops\":%u,"
+             "\"estops\":%u,\"estopLastLatency\":%u,\"estopMaxLatency\":%u,"
+             "\"bleWrites\":["),
+        millis() / 1000, (uint32_t)(loops * 1000ULL / elapsed), (uint32_t)(busy / 10 / elapsed),
+        (uint32_t)halGetFreeHeap(), (uint32_t)halGetMaxFreeBlock(), halGetHeapFragmentation(), statsCounters.mqttIn,
+        statsCounters.mqttInBytes, statsCounters.mqttOut, statsCounters.mqttOutBytes, statsCounters.mqttDropped,
+        statsCounters.mqttReconnects, statsCounters.mqttLastOutage, statsCounters.mqttMaxOutage,
+        statsCounters.wifiReconnects, statsCounters.wifiLastReconnect, statsCounters.wifiRoams,
+        statsCounters.wifiLastRoam, statsCounters.wifiRssi, statsCounters.xmlParsed, statsCounters.xmlDropped,
+        statsCounters.bleScanTime, statsCounters.syslogSent, statsCounters.syslogDropped, statsCounters.coexDeferrals,
+        statsCounters.coexDeferredTime, statsCounters.safetyStops, statsCounters.estops, statsCounters.estopLastLatency,
+        statsCounters.estopMaxLatency);
+
+    for(uint8_t i = 0; i < MAX_BLE_DEVICES && len < size; i++) {
+        len += snprintf_P(buffer + len, size - len, PSTR("%s%u"), i ? "," : "", statsBleWrites[i]);
+    }
+    if(len < size) len += snprintf_P(buffer + len, size - len, PSTR("]}"));
+    return min(len, size - 1);
+}
+
+// Only the first time a phase is reached counts, later reconnects are not part of the boot
+void statsBootMark(uint8_t phase)
+{
+    uint32_t expected = 0;
+    if(phase < STATS_BOOT_COUNT) {
+        __atomic_compare_exchange_n(&statsBootTime[phase], &expected, max(1UL, millis()), false, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+    }
+}
+
+bool statsBootComplete(void)
+{
+    if(millis() >= STATS_BOOT_TIMEOUT) return true;
+    for(uint8_t i = 0; i < STATS_BOOT_COUNT; i++) {
+        if(statsBootTime[i] == 0) return false;
+    }
+    return true;
+}
+
+// ms since power-on at the end of each phase, phases not reached are left out
+size_t statsGetBootJson(char * buffer, size_t size)
+{
+    uint8_t count = 0;
+    size_t len    = snprintf_P(buffer, size, PSTR("{"));
+    for(uint8_t i = 0; i < STATS_BOOT_COUNT && len < size; i++) {
+        uint32_t time = __atomic_load_n(&statsBootTime[i], __ATOMIC_RELAXED);
+        if(time == 0) continue;
+        len += snprintf_P(buffer + len, size - len, PSTR("%s\"%s\":%u"), count++ ? "," : "", statsBootNames[i], time);
+    }
+    if(len < size) len += snprintf_P(buffer + len, size - len, PSTR("}"));
+    return min(len, size - 1);
+}
@@ -0,0 +1,106 @@
+#ifndef LEGO_STATS_H
+#define LEGO_STATS_H
+
+#include <Arduino.h>
+
+// Ingress of a speed command
+enum {
+    STATS_SOURCE_NONE = 0,
+    STATS_SOURCE_REMOTE,
+    STATS_SOURCE_MQTT,
+    STATS_SOURCE_XML,
+    STATS_SOURCE_GROUP,
+    STATS_SOURCE_SERIAL,
+    STATS_SOURCE_TELNET,
+    STATS_SOURCE_HTTP,
+    STATS_SOURCE_COUNT
+};
+
+#define STATS_LATENCY_BUCKETS 12 // Bucket n counts latencies below 256 << n us, the last bucket has no upper bound
+
+struct commandStamp_t
+{
+    uint8_t source = STATS_SOURCE_NONE;
+    uint8_t remote = 0xFF; // Hub slot of the remote that pressed the button, for STATS_SOURCE_REMOTE
+    uint32_t time  = 0;    // micros() at ingress
+    uint32_t seq   = 0; // Sequence id of an MQTT command envelope, acknowledged once written to the hub
+};
+
+// Latency histograms are kept per source, per hub and per coexistence mode
+enum { STATS_LATENCY_SOURCE = 0, STATS_LATENCY_HUB, STATS_LATENCY_COEX };
+
+commandStamp_t statsStamp(uint8_t source);
+void statsRecordLatency(const commandStamp_t & stamp, uint8_t hub);
+void statsResetLatency(void);
+const char * statsSourceName(uint8_t source);
+bool statsGetLatencyJson(char * buffer, size_t size, uint8_t group, uint8_t index);
+void statsPrintLatency(Print * output);
+
+// Runtime counters, incremented from any task with statsCount
+struct statsCounters_t
+{
+    uint32_t loops;    // Iterations of the Arduino loop
+    uint32_t loopBusy; // us spent in the loop, excluding its delay
+    uint32_t mqttIn;
+    uint32_t mqttInBytes;
+    uint32_t mqttOut;
+    uint32_t mqttOutBytes;
+    uint32_t mqttDropped; // Messages too large to process
+    uint32_t mqttReconnects;
+    uint32_t mqttLastOutage; // ms from losing the broker until commands flowed again
+    uint32_t mqttMaxOutage;
+    uint32_t wifiReconnects;
+    uint32_t wifiLastReconnect; // ms from losing the access point until an IP address was received again
+    uint32_t wifiRoams;
+    uint32_t wifiLastRoam; // ms from leaving the weak access point until the new one gave an IP address
+    int32_t wifiRssi;      // dBm of the current access point
+    uint32_t xmlParsed;
+    uint32_t xmlDropped;       // Loco messages disregarded
+    uint32_t bleScanTime;      // ms spent scanning for hubs
+    uint32_t syslogSent;       // Datagrams handed to the network
+    uint32_t syslogDropped;    // Log records lost to a full queue or a failed send
+    uint32_t coexDeferrals;    // Hub scans held back by speed commands
+    uint32_t coexDeferredTime; // ms the scans were held back
+    uint32_t safetyStops;      // Channels brought to a stop by the supervisor
+    uint32_t estops;           // Emergency stops raised here or by the group
+    uint32_t estopLastLatency; // us until the slowest hub wrote the last emergency stop
+    uint32_t estopMaxLatency;
+};
+extern statsCounters_t statsCounters;
+
+inline void statsCount(uint32_t & counter, uint32_t amount = 1)
+{
+    __atomic_fetch_add(&counter, amount, __ATOMIC_RELAXED);
+}
+
+// Boot phases, the setup stages in the order setup() runs them followed by the milestones reached in the background
+enum {
+    STATS_BOOT_SERIAL = 0,
+    STATS_BOOT_DEBUG,
+    STATS_BOOT_CONFIG,
+    STATS_BOOT_WIFI,
+    STATS_BOOT_BLE,
+    STATS_BOOT_MQTT,
+    STATS_BOOT_SERVICES,
+    STATS_BOOT_SETUP,
+    STATS_BOOT_WIFI_IP,
+    STATS_BOOT_MQTT_CONNECTED,
+    STATS_BOOT_FIRST_HUB, // Trains can be controlled
+    STATS_BOOT_COUNT
+};
+
+#ifndef STATS_BOOT_TIMEOUT
+#define STATS_BOOT_TIMEOUT 60000 // ms after which the boot profile is reported with milestones still missing
+#endif
+
+void statsBootMark(uint8_t phase);
+bool statsBootComplete(void);
+size_t statsGetBootJson(char * buffer, size_t size);
+
+void statsRecordLoop(uint32_t busy);
+void statsRecordWrite(uint8_t hub);
+#define STATS_JSON_SIZE 896 // Buffer for statsGetJson with every counter at its maximum
+size_t statsGetJson(char * buffer, size_t size);
+void statsNewWindow(void);
+
+#endif
@@ -0,0 +1,111 @@
+/* Safety supervisor
+ *
+ * Runs the checks of lego_safety in a task of its own, above the hub tasks, so a busy loop or a stuck hub task
+ * can't keep it from stopping the trains. The normal path only stores timestamps: the MQTT loop and the remote hub
+ * tasks beat for their links, the hub tasks for themselves. A lost link or a stalled hub task ramps the affected
+ * channels down to a stop. Tasks that can hang for good are also registered with the task watchdog, which resets
+ * the controller when they stop reporting; the hubs stop their motors when the connection drops.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_SUPERVISOR > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+#include "esp_task_wdt.h"
+
+#include "lego_supervisor.h"
+#include "lego_ble.h"
+
+static_assert(LEGO_NUM_CHANNELS <= SAFETY_MAX_CHANNELS, "Channels don't fit the supervisor bitmask");
+static_assert(MAX_BLE_DEVICES <= SAFETY_MAX_HUBS, "Hubs don't fit the supervisor table");
+
+static uint8_t supervisor_link(const commandStamp_t & stamp)
+{
+    switch(stamp.source) {
+        case STATS_SOURCE_NONE:
+            return SAFETY_LINK_SYSTEM;
+        case STATS_SOURCE_REMOTE: // Owned by the remote that sent it, another remote staying alive doesn't count
+            return stamp.remote < SAFETY_MAX_HUBS ? SAFETY_LINK_REMOTE + stamp.remote : SAFETY_LINK_NONE;
+        case STATS_SOURCE_MQTT:
+        case STATS_SOURCE_XML:
+        case STATS_SOURCE_GROUP:
+            return SAFETY_LINK_MQTT;
+        default:
+            return SAFETY_LINK_NONE;
+    }
+}
+
+// Called for every speed command, from whichever task received it
+void supervisorNoteCommand(uint8_t channel, int8_t speed, const commandStamp_t & stamp)
+{
+    safetyNoteCommand(channel, supervisor_link(stamp), speed);
+}
+
+// Let the task watchdog reset the controller when the calling task stops reporting
+void supervisorWatchTask(void)
+{
+    esp_task_wdt_add(NULL);
+}
+
+void supervisorReleaseTask(void)
+{
+    esp_task_wdt_delete(NULL);
+}
+
+void supervisorTaskAlive(void)
+{
+    esp_task_wdt_reset();
+}
+
+static void supervisor_report(uint32_t stop, uint32_t lostLinks, uint16_t stalledHubs)
+{
+    if(lostLinks & (1UL << SAFETY_LINK_MQTT)) Log.warning(F("SAFE: mqtt link lost"));
+    for(uint8_t hub = 0; hub < MAX_BLE_DEVICES; hub++) {
+        if(lostLinks & (1UL << (SAFETY_LINK_REMOTE + hub))) Log.warning(F("SAFE: Remote %u link lost"), hub);
+    }
+    for(uint8_t hub = 0; hub < MAX_BLE_DEVICES; hub++) {
+        if(stalledHubs & (1 << hub)) Log.warning(F("SAFE: Hub %u task stalled"), hub);
+    }
+    if(stop != 0) Log.warning(F("SAFE: Stopping channels 0x%x"), stop);
+}
+
+static void supervisor_task(void * parameter)
+{
+    supervisorWatchTask();
+
+    while(true) {
+        uint32_t lostLinks   = 0;
+        uint16_t stalledHubs = 0;
+        uint32_t stop        = safetyCheck(millis(), &lostLinks, &stalledHubs);
+        if(lostLinks != 0 || stalledHubs != 0) supervisor_report(stop, lostLinks, stalledHubs);
+        if(stop != 0) statsCount(statsCounters.safetyStops, __builtin_popcount(stop));
+
+        uint32_t ramping = safetyGetRamping();
+        for(uint8_t channel = 0; ramping != 0 && channel < LEGO_NUM_CHANNELS; channel++) {
+            if(!(ramping & (1UL << channel))) continue;
+
+            int8_t speed = ble_get_motor_speed(channel);
+            if(speed == 0) {
+                safetyRampDone(channel);
+            } else {
+                ble_set_motor_speed(channel, safetyRamp(speed), commandStamp_t());
+            }
+        }
+
+        supervisorTaskAlive();
+        vTaskDelay(SUPERVISOR_TICK / portTICK_PERIOD_MS);
+    }
+
+    vTaskDelete(NULL);
+}
+
+void supervisorSetup(void)
+{
+    safetyReset();
+    esp_task_wdt_init(SUPERVISOR_WDT_TIMEOUT, true); // Panic and restart, the hubs stop when the link drops
+
+    // One priority above the hub tasks, a hub task spinning in ble_ready_wait can't starve it
+    xTaskCreate(supervisor_task, "SafetyTask", 3072, NULL, 2, NULL);
+}
+
+#endif // LEGO_USE_SUPERVISOR
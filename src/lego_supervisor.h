@@ -0,0 +1,22 @@
+#ifndef LEGO_SUPERVISOR_H
+#define LEGO_SUPERVISOR_H
+
+#include <Arduino.h>
+#include "lego_stats.h"
+#include "lego_safety.h"
+
+#ifndef SUPERVISOR_TICK
+#define SUPERVISOR_TICK 100 // ms between checks, also the pace of the ramp to a stop
+#endif
+
+#ifndef SUPERVISOR_WDT_TIMEOUT
+#define SUPERVISOR_WDT_TIMEOUT 35 // s before a hung task resets the controller, above the 30 s BLE connect timeout
+#endif
+
+void supervisorSetup(void);
+void supervisorNoteCommand(uint8_t channel, int8_t speed, const commandStamp_t & stamp);
+void supervisorWatchTask(void);
+void supervisorReleaseTask(void);
+void supervisorTaskAlive(void);
+
+#endif
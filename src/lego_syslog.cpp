@@ -0,0 +1,225 @@
+#include "lego_conf.h"
+
+#if LEGO_USE_SYSLOG > 0
+#include "ArduinoLog.h"
+
+#if defined(ARDUINO_ARCH_ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+#endif
+#include <WiFiUdp.h>
+
+#include "lego_debug.h"
+#include "lego_mqtt.h"
+#include "lego_stats.h"
+#include "lego_syslog.h"
+
+#ifndef APP_NAME
+#define APP_NAME "PUPT"
+#endif
+
+// Log lines are queued by the logging caller and sent by syslog_task, so a log statement in a BLE callback only
+// costs a copy into memory, never a DNS lookup or a UDP send
+
+struct syslogRecord_t
+{
+    uint8_t severity;
+    uint8_t length;
+    char text[SYSLOG_RECORD_SIZE];
+};
+
+class SyslogOutput : public Print {
+  public:
+    size_t write(uint8_t ch) override;
+    size_t write(const uint8_t * buffer, size_t size) override;
+};
+
+const char * syslogAppName = APP_NAME;
+
+static SyslogOutput syslogPrint;
+static SemaphoreHandle_t syslogMutex = NULL; // Guards the queue and the record being written
+static TaskHandle_t syslogTask       = NULL;
+static syslogRecord_t syslogQueue[SYSLOG_QUEUE_SIZE];
+static syslogRecord_t syslogPending;             // Record being written by the logging caller
+static volatile TaskHandle_t syslogWriter = NULL; // Task holding syslogMutex, only its bytes go into the record
+static uint8_t syslogHead                 = 0;    // Oldest record in the queue
+static uint8_t syslogCount                = 0;
+
+static WiFiUDP syslogClient;
+static IPAddress syslogServerIp;
+static char syslogResolvedHost[32]    = "";
+static uint32_t syslogTokens          = 0; // Datagrams that may be sent before the rate limit kicks in
+static unsigned long syslogLastRefill = 0;
+static uint32_t syslogDroppedReported = 0;
+
+// ArduinoLog levels to syslog severities
+static const uint8_t syslogSeverity[] = {7, 2, 3, 4, 5, 6, 7};
+
+// Called from the log prefix, every byte printed until syslogEndRecord is part of the record
+void syslogBeginRecord(int level)
+{
+    // Don't stall the caller behind a concurrent log statement, drop its record instead
+    if(syslogMutex == NULL || xSemaphoreTake(syslogMutex, pdMS_TO_TICKS(5)) != pdTRUE) {
+        statsCount(statsCounters.syslogDropped);
+        return;
+    }
+
+    syslogPending.severity = syslogSeverity[constrain(level, LOG_LEVEL_SILENT, LOG_LEVEL_VERBOSE)];
+    syslogPending.length   = 0;
+    syslogWriter           = xTaskGetCurrentTaskHandle();
+}
+
+// A task whose record was dropped in syslogBeginRecord doesn't hold the mutex and must not give it
+static inline bool syslog_is_writer(void)
+{
+    return syslogWriter != NULL && syslogWriter == xTaskGetCurrentTaskHandle();
+}
+
+void syslogEndRecord(void)
+{
+    if(!syslog_is_writer()) return;
+    syslogWriter = NULL;
+
+    bool flush = false;
+    if(syslogCount < SYSLOG_QUEUE_SIZE) {
+        syslogRecord_t * record = &syslogQueue[(syslogHead + syslogCount) % SYSLOG_QUEUE_SIZE];
+        record->severity        = syslogPending.severity;
+        record->length          = syslogPending.length;
+        memcpy(record->text, syslogPending.text, syslogPending.length);
+        syslogCount++;
+        flush = syslogCount >= SYSLOG_QUEUE_SIZE / 2;
+    } else {
+        statsCount(statsCounters.syslogDropped);
+    }
+    xSemaphoreGive(syslogMutex);
+
+    // Wake the sender early when the queue fills up faster than the flush interval
+    if(flush && syslogTask != NULL) xTaskNotifyGive(syslogTask);
+}
+
+size_t SyslogOutput::write(uint8_t ch)
+{
+    if(ch == '\r' || ch == '\n' || !syslog_is_writer()) return 1;
+    if(syslogPending.length < SYSLOG_RECORD_SIZE) syslogPending.text[syslogPending.length++] = ch;
+    return 1;
+}
+
+size_t SyslogOutput::write(const uint8_t * buffer, size_t size)
+{
+    for(size_t i = 0; i < size; i++) write(buffer[i]);
+    return size;
+}
+
+Print * syslogOutput(void)
+{
+    return &syslogPrint;
+}
+
+static bool syslog_resolve(void)
+{
+    if(strcmp(syslogResolvedHost, debugSyslogHost) == 0) return true;
+
+    IPAddress ip;
+    if(!WiFi.hostByName(debugSyslogHost, ip)) return false;
+
+    syslogServerIp = ip;
+    strncpy(syslogResolvedHost, debugSyslogHost, sizeof(syslogResolvedHost) - 1);
+    return true;
+}
+
+static bool syslog_send(uint8_t severity, const char * text, uint8_t length)
+{
+    char header[64];
+    uint8_t priority = ((debugSyslogFacility + 16) << 3) | severity; // localx facility, x = 0-7
+
+    if(debugSyslogProtocol == 0) {
+        // RFC 5424, the controller has no wall clock so the timestamp is nil
+        snprintf_P(header, sizeof(header), PSTR("<%u>1 - %s %s - - - "), priority, mqttNodeName, syslogAppName);
+    } else {
+        // RFC 3164
+        snprintf_P(header, sizeof(header), PSTR("<%u>%s %s: "), priority, mqttNodeName, syslogAppName);
+    }
+
+    if(!syslogClient.beginPacket(syslogServerIp, debugSyslogPort)) return false;
+    syslogClient.write((const uint8_t *)header, strlen(header));
+    syslogClient.write((const uint8_t *)text, length);
+    if(!syslogClient.endPacket()) return false;
+
+    statsCount(statsCounters.syslogSent);
+    return true;
+}
+
+static void syslog_refill(void)
+{
+    if(debugSyslogRate == 0) {
+        syslogTokens     = UINT32_MAX;
+        syslogLastRefill = millis(); // A rate set later starts with a burst of at most one second
+        return;
+    }
+
+    // Allow a burst of at most one second worth of datagrams, also right after the rate was lowered
+    if(syslogTokens > debugSyslogRate) syslogTokens = debugSyslogRate;
+
+    unsigned long elapsed = millis() - syslogLastRefill;
+    uint32_t tokens       = elapsed * debugSyslogRate / 1000;
+    if(tokens == 0) return;
+
+    syslogTokens     = min((uint32_t)debugSyslogRate, syslogTokens + tokens);
+    syslogLastRefill = millis();
+}
+
+static void syslog_send_batch(void)
+{
+    if(strlen(debugSyslogHost) == 0 || !WiFi.isConnected() || !syslog_resolve()) return;
+
+    syslog_refill();
+
+    // Report records lost since the last batch before sending the ones that made it
+    uint32_t dropped = statsCounters.syslogDropped;
+    if(dropped != syslogDroppedReported && syslogTokens > 0) {
+        char text[48];
+        int len = snprintf_P(text, sizeof(text), PSTR("SYSLOG: %u records dropped"), dropped - syslogDroppedReported);
+        if(syslog_send(4, text, len)) syslogTokens--;
+        syslogDroppedReported = dropped;
+    }
+
+    syslogRecord_t record;
+    while(syslogTokens > 0) {
+        xSemaphoreTake(syslogMutex, portMAX_DELAY);
+        if(syslogCount == 0) {
+            xSemaphoreGive(syslogMutex);
+            break;
+        }
+        record     = syslogQueue[syslogHead];
+        syslogHead = (syslogHead + 1) % SYSLOG_QUEUE_SIZE;
+        syslogCount--;
+        xSemaphoreGive(syslogMutex);
+
+        if(!syslog_send(record.severity, record.text, record.length)) {
+            statsCount(statsCounters.syslogDropped);
+            break;
+        }
+        syslogTokens--;
+    }
+}
+
+static void syslog_task(void * parameter)
+{
+    while(1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SYSLOG_FLUSH_INTERVAL));
+        syslog_send_batch();
+    }
+}
+
+void syslogSetup(void)
+{
+    if(syslogMutex != NULL) return;
+
+    syslogMutex      = xSemaphoreCreateMutex();
+    syslogLastRefill = millis();
+    syslogTokens     = debugSyslogRate;
+    xTaskCreate(syslog_task, "SyslogTask", 3072, NULL, 1, &syslogTask);
+}
+
+#endif // LEGO_USE_SYSLOG
@@ -0,0 +1,27 @@
+#ifndef LEGO_SYSLOG_H
+#define LEGO_SYSLOG_H
+
+#include <Arduino.h>
+
+#ifndef SYSLOG_QUEUE_SIZE
+#define SYSLOG_QUEUE_SIZE 16 // Records buffered while the sender catches up
+#endif
+
+#ifndef SYSLOG_RECORD_SIZE
+#define SYSLOG_RECORD_SIZE 160 // Longer log lines are truncated
+#endif
+
+#ifndef SYSLOG_FLUSH_INTERVAL
+#define SYSLOG_FLUSH_INTERVAL 200 // ms between batches
+#endif
+
+#ifndef SYSLOG_RATE
+#define SYSLOG_RATE 50 // Datagrams per second, 0 is unlimited
+#endif
+
+void syslogSetup(void);
+void syslogBeginRecord(int level);
+void syslogEndRecord(void);
+Print * syslogOutput(void);
+
+#endif
@@ -0,0 +1,339 @@
+/* Telnet console
+ *
+ * Log lines, command replies and the BLE dashboard are copied into an output ring per client by whichever task
+ * produces them, telnetLoop moves the rings to non-blocking sockets. A client that stops reading fills its ring
+ * and loses output, it never holds up the logging caller or the loop.
+ */
+#include "lego_conf.h"
+#if LEGO_USE_TELNET > 0
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+
+#include <WiFi.h>
+#include "lwip/sockets.h"
+
+#include "lego_ble.h"
+#include "lego_debug.h"
+#include "lego_dispatch.h"
+#include "lego_stats.h"
+#include "lego_telnet.h"
+
+#define TELNET_LINE_SIZE 128
+#define TELNET_RX_BUDGET 256 // Bytes read per client per loop
+
+// Telnet protocol bytes
+#define TELNET_IAC 255
+#define TELNET_WILL 251
+#define TELNET_SB 250
+#define TELNET_SE 240
+
+// Negotiation sequences are skipped, the console works in the client's default line mode
+enum { TELNET_IAC_NONE = 0, TELNET_IAC_COMMAND, TELNET_IAC_OPTION, TELNET_IAC_SUB };
+
+struct telnetClient_t
+{
+    int socket;
+    uint16_t head;   // Oldest unsent byte in the ring
+    uint16_t length; // Bytes waiting in the ring
+    uint32_t dropped;
+    uint8_t iac;
+    uint8_t lineLength;
+    bool dashboard; // Refresh the BLE dashboard every second, log lines are discarded while it is shown
+    bool lastCr;    // The last byte queued was a CR, bare LFs are sent as CR LF
+    char line[TELNET_LINE_SIZE];
+    uint8_t ring[TELNET_RING_SIZE];
+};
+
+class TelnetOutput : public Print {
+  public:
+    explicit TelnetOutput(int8_t client);
+    size_t write(uint8_t ch) override;
+    size_t write(const uint8_t * buffer, size_t size) override;
+
+    int8_t client; // Client slot, -1 writes to every client
+};
+
+uint16_t telnetPort = TELNET_PORT;
+
+static telnetClient_t telnetClients[TELNET_MAX_CLIENTS];
+static portMUX_TYPE telnetMux       = portMUX_INITIALIZER_UNLOCKED; // Guards the rings, which any task may write to
+static int telnetServer             = -1;
+static volatile uint8_t telnetCount = 0; // Connected clients, log lines are not copied anywhere without one
+static TelnetOutput telnetLog(-1);
+static TelnetOutput telnetConsole(0); // Replies to the command being dispatched
+
+static inline void telnet_ring_put(telnetClient_t * client, uint8_t ch)
+{
+    client->ring[(client->head + client->length) % TELNET_RING_SIZE] = ch;
+    client->length++;
+}
+
+// Call within telnetMux, a write is queued whole or dropped whole
+static void telnet_ring_write(telnetClient_t * client, const uint8_t * buffer, size_t size)
+{
+    if(client->socket < 0) return;
+
+    size_t needed = size;
+    bool cr       = client->lastCr;
+    for(size_t i = 0; i < size; i++) {
+        if(buffer[i] == '\n' && !cr) needed++;
+        cr = buffer[i] == '\r';
+    }
+    if(needed > (size_t)(TELNET_RING_SIZE - client->length)) {
+        client->dropped += size;
+        return;
+    }
+
+    for(size_t i = 0; i < size; i++) {
+        if(buffer[i] == '\n' && !client->lastCr) telnet_ring_put(client, '\r');
+        telnet_ring_put(client, buffer[i]);
+        client->lastCr = buffer[i] == '\r';
+    }
+}
+
+TelnetOutput::TelnetOutput(int8_t client) : client(client)
+{}
+
+size_t TelnetOutput::write(uint8_t ch)
+{
+    return write(&ch, 1);
+}
+
+size_t TelnetOutput::write(const uint8_t * buffer, size_t size)
+{
+    if(telnetCount == 0) return size;
+
+    portENTER_CRITICAL(&telnetMux);
+    if(client >= 0) {
+        telnet_ring_write(&telnetClients[client], buffer, size);
+    } else {
+        for(uint8_t i = 0; i < TELNET_MAX_CLIENTS; i++) {
+            if(!telnetClients[i].dashboard) telnet_ring_write(&telnetClients[i], buffer, size);
+        }
+    }
+    portEXIT_CRITICAL(&telnetMux);
+    return size;
+}
+
+Print * telnetConsoleOutput(void)
+{
+    return &telnetConsole;
+}
+
+static void telnet_close(uint8_t index)
+{
+    telnetClient_t * client = &telnetClients[index];
+
+    portENTER_CRITICAL(&telnetMux);
+    int socket     = client->socket;
+    client->socket = -1;
+    client->length = 0;
+    if(socket >= 0) telnetCount--;
+    portEXIT_CRITICAL(&telnetMux);
+
+    if(socket < 0) return;
+    close(socket);
+
+    Log.notice(F("TELNET: Client %d disconnected"), index);
+}
+
+// Write as much of the ring as the socket accepts right now
+static void telnet_flush(uint8_t index)
+{
+    telnetClient_t * client = &telnetClients[index];
+
+    for(uint8_t pass = 0; pass < 2; pass++) { // The second pass sends the part that wrapped around
+        portENTER_CRITICAL(&telnetMux);
+        uint16_t head    = client->head;
+        uint16_t length  = client->length;
+        uint32_t dropped = client->dropped;
+        if(length == 0) client->dropped = 0;
+        portEXIT_CRITICAL(&telnetMux);
+
+        if(length == 0) {
+            if(dropped > 0) {
+                telnetConsole.client = index;
+                telnetConsole.printf(PSTR("\r\n*** %u bytes of output dropped ***\r\n"), dropped);
+            }
+            return;
+        }
+
+        // Bytes between head and head + length are not touched by writers, send them outside the lock
+        size_t chunk = min((size_t)length, (size_t)(TELNET_RING_SIZE - head));
+        int sent     = send(client->socket, client->ring + head, chunk, MSG_DONTWAIT);
+        if(sent < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) telnet_close(index);
+            return;
+        }
+
+        portENTER_CRITICAL(&telnetMux);
+        client->head = (client->head + sent) % TELNET_RING_SIZE;
+        client->length -= sent;
+        portEXIT_CRITICAL(&telnetMux);
+
+        if((size_t)sent < chunk) return;
+    }
+}
+
+static void telnet_execute(uint8_t index, const char * line)
+{
+    telnetClient_t * client = &telnetClients[index];
+
+    if(!strcmp_P(line, PSTR("exit")) || !strcmp_P(line, PSTR("quit"))) {
+        telnet_close(index);
+    } else if(!strcmp_P(line, PSTR("dashboard"))) {
+        client->dashboard = !client->dashboard;
+        if(!client->dashboard) {
+            telnetConsole.client = index;
+            telnetConsole.print(F("\e[2J\e[0;0f\e[?25h")); // Clear the table and show the cursor again
+        }
+    } else {
+        telnetConsole.client = index;
+        dispatchCommand(line, statsStamp(STATS_SOURCE_TELNET));
+    }
+}
+
+static void telnet_receive(uint8_t index, uint8_t ch)
+{
+    telnetClient_t * client = &telnetClients[index];
+
+    switch(client->iac) {
+        case TELNET_IAC_COMMAND:
+            client->iac = ch == TELNET_SB ? TELNET_IAC_SUB : ch >= TELNET_WILL ? TELNET_IAC_OPTION : TELNET_IAC_NONE;
+            return;
+        case TELNET_IAC_OPTION:
+            client->iac = TELNET_IAC_NONE;
+            return;
+        case TELNET_IAC_SUB:
+            if(ch == TELNET_SE) client->iac = TELNET_IAC_NONE;
+            return;
+    }
+
+    if(ch == TELNET_IAC) {
+        client->iac = TELNET_IAC_COMMAND;
+    } else if(ch == 4) { // Ctrl-D
+        telnet_close(index);
+    } else if(ch == '\r' || ch == '\n' || ch == 0) {
+        if(client->lineLength == 0) return;
+        client->line[client->lineLength] = 0;
+        client->lineLength               = 0;
+        telnet_execute(index, client->line);
+    } else if(ch == 8 || ch == 127) { // Backspace
+        if(client->lineLength > 0) client->lineLength--;
+    } else if(client->lineLength < TELNET_LINE_SIZE - 1) {
+        client->line[client->lineLength++] = ch;
+    }
+}
+
+static void telnet_read(uint8_t index)
+{
+    telnetClient_t * client = &telnetClients[index];
+    uint8_t buffer[TELNET_RX_BUDGET];
+
+    int received = recv(client->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        telnet_close(index);
+        return;
+    }
+
+    for(int i = 0; i < received && client->socket >= 0; i++) telnet_receive(index, buffer[i]);
+}
+
+static void telnet_accept(void)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+
+    int socket = accept(telnetServer, (struct sockaddr *)&address, &length);
+    if(socket < 0) return;
+
+    uint8_t index = 0;
+    while(index < TELNET_MAX_CLIENTS && telnetClients[index].socket >= 0) index++;
+    if(index >= TELNET_MAX_CLIENTS) {
+        send(socket, "Too many clients\r\n", 18, MSG_DONTWAIT);
+        close(socket);
+        return;
+    }
+
+    int nodelay = 1;
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    telnetClient_t * client = &telnetClients[index];
+    client->iac             = TELNET_IAC_NONE;
+    client->lineLength      = 0;
+    client->dashboard       = false;
+
+    portENTER_CRITICAL(&telnetMux);
+    client->head    = 0;
+    client->length  = 0;
+    client->dropped = 0;
+    client->lastCr  = false;
+    client->socket  = socket;
+    telnetCount++;
+    portEXIT_CRITICAL(&telnetMux);
+
+    telnetConsole.client = index;
+    telnetConsole.println(debugHeader());
+
+    Log.notice(F("TELNET: Client %d connected from %s"), index, inet_ntoa(address.sin_addr));
+}
+
+static void telnet_listen(void)
+{
+    if(!WiFi.isConnected()) return;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(telnetPort);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    int reuse    = 1;
+    telnetServer = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(telnetServer >= 0) setsockopt(telnetServer, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(telnetServer < 0 || bind(telnetServer, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+       listen(telnetServer, TELNET_MAX_CLIENTS) < 0) {
+        Log.warning(F("TELNET: Failed to listen on port %u"), telnetPort);
+        if(telnetServer >= 0) close(telnetServer);
+        telnetServer = -1;
+        return;
+    }
+    fcntl(telnetServer, F_SETFL, fcntl(telnetServer, F_GETFL, 0) | O_NONBLOCK);
+    Log.notice(F("TELNET: Listening on port %u"), telnetPort);
+}
+
+void telnetSetup(void)
+{
+    for(uint8_t i = 0; i < TELNET_MAX_CLIENTS; i++) telnetClients[i].socket = -1;
+
+    // Registered once, changing the outputs while another task logs is not safe
+    Log.registerOutput(DEBUG_LOG_SLOT_TELNET, &telnetLog, LOG_LEVEL_TRACE, true);
+}
+
+void telnetLoop(void)
+{
+    if(telnetServer < 0) return;
+
+    telnet_accept();
+    for(uint8_t i = 0; i < TELNET_MAX_CLIENTS; i++) {
+        if(telnetClients[i].socket >= 0) telnet_read(i);
+        if(telnetClients[i].socket >= 0) telnet_flush(i);
+    }
+}
+
+void telnetEverySecond(void)
+{
+    // The server is opened once the network is up, and retried every second if that fails
+    if(telnetServer < 0) telnet_listen();
+
+    for(uint8_t i = 0; i < TELNET_MAX_CLIENTS; i++) {
+        if(telnetClients[i].socket >= 0 && telnetClients[i].dashboard) {
+            telnetConsole.client = i;
+            ble_print_dashboard(&telnetConsole);
+        }
+    }
+}
+
+#endif // LEGO_USE_TELNET
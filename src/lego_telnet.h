@@ -0,0 +1,25 @@
+#ifndef LEGO_TELNET_H
+#define LEGO_TELNET_H
+
+#include <Arduino.h>
+
+#ifndef TELNET_PORT
+#define TELNET_PORT 23
+#endif
+
+#ifndef TELNET_MAX_CLIENTS
+#define TELNET_MAX_CLIENTS 2
+#endif
+
+#ifndef TELNET_RING_SIZE
+#define TELNET_RING_SIZE 2048 // Output buffered per client, bytes that don't fit are dropped
+#endif
+
+extern uint16_t telnetPort;
+
+void telnetSetup(void);
+void telnetLoop(void);
+void telnetEverySecond(void);
+Print * telnetConsoleOutput(void);
+
+#endif
@@ -6,6 +6,8 @@
 #if LEGO_USE_WIFI > 0
 
 #include "lego_debug.h"
+#include "lego_roam.h"
+#include "lego_stats.h"
 
 #if defined(ARDUINO_ARCH_ESP32)
 #include <Wifi.h>
@@ -33,28 +35,83 @@ char wifiPassword[32] = "";
 #endif
 uint8_t wifiReconnectCounter = 0;
 
+#ifndef RTC_NOINIT_ATTR
+#define RTC_NOINIT_ATTR // Only the ESP32 keeps this memory across a restart
+#endif
+#define WIFI_CACHE_MAGIC 0x57494649
+
+// Access point of the last association, kept across a restart so the next connect can skip the channel scan
+struct wifiApCache_t
+{
+    uint32_t magic;
+    uint8_t bssid[6];
+    uint8_t channel;
+    char ssid[32];
+};
+RTC_NOINIT_ATTR static wifiApCache_t wifiApCache;
+
+static roamState_t wifiRoam;
+static volatile unsigned long wifiConnectStart = 0; // Link lost or roam started, 0 while connected
+static volatile bool wifiRoaming               = false;
+static volatile bool wifiAssociated            = false; // New association, the roaming history starts over
+static bool wifiScanning                       = false;
+
+static void wifi_begin(bool useCache)
+{
+    if(useCache && wifiApCache.magic == WIFI_CACHE_MAGIC && !strncmp(wifiApCache.ssid, wifiSsid, sizeof(wifiSsid))) {
+        WiFi.begin(wifiSsid, wifiPassword, wifiApCache.channel, wifiApCache.bssid);
+        Log.notice(F("WIFI: Connecting to : %s on channel %u"), wifiSsid, wifiApCache.channel);
+    } else {
+        WiFi.begin(wifiSsid, wifiPassword);
+        Log.notice(F("WIFI: Connecting to : %s"), wifiSsid);
+    }
+}
+
 // const byte DNS_PORT = 53;
 // DNSServer dnsServer;
 
 void wifiConnected(IPAddress ipaddress)
 {
+    statsBootMark(STATS_BOOT_WIFI_IP);
     Log.notice(F("WIFI: Received IP address %s"), ipaddress.toString().c_str());
     Log.verbose(F("WIFI: Connected = %s"), WiFi.status() == WL_CONNECTED ? PSTR("yes") : PSTR("no"));
 
-    // if(isConnected) {
-    // mqttReconnect();
+#if LEGO_USE_MQTT > 0
+    mqttNetworkUp();
+#endif
+    static bool wifiFirstConnect = true;
+    if(wifiConnectStart != 0) {
+        uint32_t elapsed = millis() - wifiConnectStart;
+        if(wifiRoaming) {
+            statsCounters.wifiLastRoam = elapsed;
+            statsCount(statsCounters.wifiRoams);
+        } else {
+            statsCounters.wifiLastReconnect = elapsed;
+        }
+        Log.notice(F("WIFI: %s took %u ms"), wifiRoaming ? PSTR("Roaming") : PSTR("Reconnecting"), elapsed);
+    }
+    if(!wifiFirstConnect && !wifiRoaming) statsCount(statsCounters.wifiReconnects);
+    wifiFirstConnect = false;
+    wifiConnectStart = 0;
+    wifiRoaming      = false;
+    wifiAssociated   = true;
+
+    memcpy(wifiApCache.bssid, WiFi.BSSID(), sizeof(wifiApCache.bssid));
+    wifiApCache.channel = WiFi.channel();
+    strncpy(wifiApCache.ssid, wifiSsid, sizeof(wifiApCache.ssid));
+    wifiApCache.magic = WIFI_CACHE_MAGIC;
     // httpReconnect();
-    // mdnsStart();
-    //}
+#if LEGO_USE_MDNS > 0
+    mdnsNetworkUp();
+#endif
 }
 
 void wifiDisconnected(const char * ssid, uint8_t reason)
 {
-    wifiReconnectCounter++;
-    if(wifiReconnectCounter > 45) {
-        Log.error(F("WIFI: Retries exceed %u: Rebooting..."), wifiReconnectCounter);
-        // dispatchReboot(false);
-    }
+#if LEGO_USE_MQTT > 0
+    mqttNetworkDown();
+#endif
+    if(wifiConnectStart == 0) wifiConnectStart = max(1UL, millis()); // A roam already started the clock
     Log.warning(F("WIFI: Disconnected from %s (Reason: %d)"), ssid, reason);
 }
 
@@ -117,8 +174,57 @@ void wifiSetup()
     WiFi.onEvent(wifi_callback);
     WiFi.setSleep(false);
 #endif
-    WiFi.begin(wifiSsid, wifiPassword);
-    Log.notice(F("WIFI: Connecting to : %s"), wifiSsid);
+    wifi_begin(true);
+}
+
+// Pick the strongest other access point of our network from the scan, if it is enough of an improvement
+static void wifi_roam(int16_t count)
+{
+    uint8_t current[6];
+    memcpy(current, WiFi.BSSID(), sizeof(current));
+
+    int16_t best = -1;
+    for(int16_t i = 0; i < count; i++) {
+        if(strcmp(WiFi.SSID(i).c_str(), wifiSsid) != 0 || !memcmp(WiFi.BSSID(i), current, sizeof(current))) continue;
+        if(best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best)) best = i;
+    }
+
+    if(best < 0 || !roamShouldRoam(&wifiRoam, WiFi.RSSI(best))) {
+        Log.verbose(F("WIFI: No stronger access point found"));
+        return;
+    }
+
+    Log.notice(F("WIFI: Roaming from %d dBm to %s at %d dBm"), roamGetRssi(&wifiRoam), WiFi.BSSIDstr(best).c_str(),
+               WiFi.RSSI(best));
+    wifiRoaming      = true;
+    wifiConnectStart = max(1UL, millis());
+    WiFi.begin(wifiSsid, wifiPassword, WiFi.channel(best), WiFi.BSSID(best));
+}
+
+// Watch the signal of the current access point and roam when a scan finds a better one
+void wifiEverySecond()
+{
+    if(!WiFi.isConnected()) return;
+
+    if(wifiAssociated) {
+        wifiAssociated = false;
+        roamReset(&wifiRoam, millis());
+    }
+
+    if(wifiScanning) {
+        int16_t count = WiFi.scanComplete();
+        if(count == WIFI_SCAN_RUNNING) return;
+        wifiScanning = false;
+        if(count > 0) wifi_roam(count);
+        WiFi.scanDelete();
+        return;
+    }
+
+    statsCounters.wifiRssi = WiFi.RSSI();
+    if(roamSample(&wifiRoam, statsCounters.wifiRssi, millis()) == ROAM_SCAN) {
+        Log.notice(F("WIFI: Signal weak at %d dBm, scanning for a stronger access point"), roamGetRssi(&wifiRoam));
+        wifiScanning = WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING; // Async, the loop keeps running
+    }
 }
 
 bool wifiEvery5Seconds()
@@ -128,17 +234,32 @@ bool wifiEvery5Seconds()
     } else if(WiFi.status() == WL_CONNECTED) {
         return true;
     } else {
-        wifiReconnectCounter++;
+        // Only counted here, the disconnect event fires for every failed attempt as well. Saturates instead of
+        // wrapping to 0, which would try the cached access point again as if the outage had just started.
+        if(wifiReconnectCounter < UINT8_MAX) wifiReconnectCounter++;
         if(wifiReconnectCounter > 45) {
             Log.error(F("WIFI: Retries exceed %u: Rebooting..."), wifiReconnectCounter);
             // dispatchReboot(false);
         }
         Log.warning(F("WIFI: No Connection... retry %u"), wifiReconnectCounter);
-        if(wifiReconnectCounter % 6 == 0) WiFi.begin(wifiSsid, wifiPassword);
+
+        // The cached access point is tried once, after that it may be gone and only a full scan finds another
+        if(wifiReconnectCounter % 2 == 0 || wifiReconnectCounter == UINT8_MAX) {
+            wifiRoaming = false; // A roam that didn't complete is an outage now
+            wifi_begin(wifiReconnectCounter <= 2);
+        }
         return false;
     }
 }
 
+// Join the network again with changed credentials
+void wifiReconnect()
+{
+    wifiReconnectCounter = 0;
+    WiFi.disconnect();
+    wifi_begin(true);
+}
+
 void wifiStop()
 {
     wifiReconnectCounter = 0; // Prevent endless loop in wifiDisconnected
@@ -1,8 +1,13 @@
 #ifndef LEGO_WIFI_H
 #define LEGO_WIFI_H
 
+extern char wifiSsid[32];
+extern char wifiPassword[32];
+
 void wifiSetup();
+void wifiEverySecond(void);
 bool wifiEvery5Seconds(void);
 void wifiStop(void);
+void wifiReconnect(void);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "lego_debug.h"
 #include "lego_ble.h"
+#include "lego_capture.h"
 
 bool isConnected;
 uint8_t mainLoopCounter        = 0;
@@ -11,8 +12,8 @@ unsigned long mainLastLoopTime = 0;
 void setup()
 {
     Serial.begin(115200); /* prepare for possible serial debug */
-    delay(1000);
     Serial.println();
+    statsBootMark(STATS_BOOT_SERIAL);
 
     /****************************
      * Constant initialzations
@@ -27,28 +28,45 @@ void setup()
      * Apply User Configuration
      ***************************/
     debugSetup();
-    ble_setup();
+    statsBootMark(STATS_BOOT_DEBUG);
+#if LEGO_USE_CONFIG > 0
+    configSetup(); // Saved settings replace the compiled-in defaults before the modules start
+#endif
+    statsBootMark(STATS_BOOT_CONFIG);
 
+    // Nothing below waits for the network or the hubs: the WiFi association runs in the background while the hub
+    // tasks scan, MQTT connects from the loop as soon as an IP address arrives
 #if LEGO_USE_WIFI > 0
     wifiSetup();
 #endif
+    statsBootMark(STATS_BOOT_WIFI);
+
+#if LEGO_USE_COEX > 0
+    coexSetup();
+#endif
+#if LEGO_USE_SUPERVISOR > 0
+    supervisorSetup(); // Before the hub tasks, which register with the task watchdog
+#endif
+    ble_setup();
+    statsBootMark(STATS_BOOT_BLE);
+
+#if LEGO_USE_MQTT > 0
+    mqttSetup();
+#endif
+    statsBootMark(STATS_BOOT_MQTT);
 
 #if LEGO_USE_MDNS > 0
     mdnsSetup();
 #endif
 
 #if LEGO_USE_OTA > 0
-    // otaSetup();
+    otaSetup();
 #endif
 
 #if LEGO_USE_ETHERNET > 0
     ethernetSetup();
 #endif
 
-#if LEGO_USE_MQTT > 0
-    mqttSetup();
-#endif
-
 #if LEGO_USE_HTTP > 0
     httpSetup();
 #endif
@@ -56,15 +74,22 @@ void setup()
 #if LEGO_USE_TELNET > 0
     telnetSetup();
 #endif
+    statsBootMark(STATS_BOOT_SERVICES);
 
     mainLastLoopTime = millis() - 1000; // reset loop counter
 
+    statsBootMark(STATS_BOOT_SETUP);
     Serial.println("ESP32 Init Done");
 }
 
 void loop()
 {
+    uint32_t loopStart = micros();
     debugLoop();
+    captureLoop();
+#if LEGO_USE_CONFIG > 0
+    configLoop();
+#endif
 
     /* Network Services Loops */
 #if LEGO_USE_ETHERNET > 0
@@ -97,8 +122,17 @@ void loop()
     if(millis() - mainLastLoopTime >= 1000) {
 
         /* Run Every Second */
+#if LEGO_USE_WIFI > 0
+        wifiEverySecond();
+#endif
+#if LEGO_USE_COEX > 0
+        coexEverySecond();
+#endif
 #if LEGO_USE_OTA > 0
         otaEverySecond();
+#endif
+#if LEGO_USE_TELNET > 0
+        telnetEverySecond();
 #endif
         debugEverySecond();
 
@@ -131,5 +165,6 @@ void loop()
         mainLastLoopTime += 1000;
     }
 
+    statsRecordLoop(micros() - loopStart);
     delay(5);
 }
\ No newline at end of file
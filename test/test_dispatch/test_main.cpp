@@ -0,0 +1,141 @@
+/* JSON lines dispatcher: the accepted formats and the command rate on the host
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "lego_ble.h"
+#include "lego_dispatch.h"
+
+#define THROUGHPUT_LINES 20000     // Two speed commands per line
+#define THROUGHPUT_MIN_RATE 100000 // cmd/s, far below what any host reaches, only catches a parser gone quadratic
+
+static commandStamp_t stamp;
+
+// Feeds text in chunks of the given size, the way MQTT hands over a streamed payload
+static void feed(dispatchParser_t & parser, const char * text, size_t chunk)
+{
+    for(size_t length = strlen(text); length > 0;) {
+        size_t part = min(chunk, length);
+        dispatchJsonlFeed(parser, text, part);
+        text += part;
+        length -= part;
+    }
+}
+
+void setUp(void)
+{
+    ble_setup();
+    ble_take_changed_channels();
+    stamp = statsStamp(STATS_SOURCE_SERIAL);
+}
+
+void tearDown(void)
+{}
+
+// Objects and arrays of command strings, several commands per line
+static void test_formats(void)
+{
+    dispatchParser_t parser;
+    dispatchJsonlBegin(parser, stamp);
+    feed(parser, "{\"speed0\":50,\"speed1\":\"-30\"}\n[\"speed2=20\", \"speed3 -40\"]\n{\"speed4\": 10 }\n", 1000);
+    dispatchJsonlEnd(parser);
+
+    TEST_ASSERT_EQUAL_UINT16(5, parser.commands);
+    TEST_ASSERT_EQUAL_UINT16(0, parser.errors);
+    TEST_ASSERT_EQUAL_INT8(50, ble_get_motor_speed(0));
+    TEST_ASSERT_EQUAL_INT8(-30, ble_get_motor_speed(1));
+    TEST_ASSERT_EQUAL_INT8(20, ble_get_motor_speed(2));
+    TEST_ASSERT_EQUAL_INT8(-40, ble_get_motor_speed(3));
+    TEST_ASSERT_EQUAL_INT8(10, ble_get_motor_speed(4));
+}
+
+// A line split at any byte gives the same result as the whole line
+static void test_chunks(void)
+{
+    const char * text = "{\"speed5\":70,\"speed6\":-70}\n[\"speed7=15\"]\n";
+
+    for(size_t chunk = 1; chunk <= strlen(text); chunk++) {
+        dispatchParser_t parser;
+        dispatchJsonlBegin(parser, stamp);
+        ble_setup();
+        feed(parser, text, chunk);
+        dispatchJsonlEnd(parser);
+
+        TEST_ASSERT_EQUAL_UINT16(3, parser.commands);
+        TEST_ASSERT_EQUAL_UINT16(0, parser.errors);
+        TEST_ASSERT_EQUAL_INT8(70, ble_get_motor_speed(5));
+        TEST_ASSERT_EQUAL_INT8(-70, ble_get_motor_speed(6));
+        TEST_ASSERT_EQUAL_INT8(15, ble_get_motor_speed(7));
+    }
+}
+
+// A bad line is counted and skipped, the next line is parsed again
+static void test_errors(void)
+{
+    dispatchParser_t parser;
+    dispatchJsonlBegin(parser, stamp);
+    feed(parser, "{\"speed0\":{\"nested\":1}}\n{\"nosuch\":1}\nspeed1=5\n{\"speed99\":5}\n{\"speed2\":25}\n", 1000);
+    dispatchJsonlEnd(parser);
+
+    TEST_ASSERT_EQUAL_UINT16(1, parser.commands);
+    TEST_ASSERT_EQUAL_UINT16(4, parser.errors);
+    TEST_ASSERT_EQUAL_INT8(0, ble_get_motor_speed(0));
+    TEST_ASSERT_EQUAL_INT8(0, ble_get_motor_speed(1));
+    TEST_ASSERT_EQUAL_INT8(25, ble_get_motor_speed(2));
+}
+
+// Speeds out of range are clamped, group commands are applied without being replicated again
+static void test_sources(void)
+{
+    TEST_ASSERT_TRUE(dispatchCommand("speed0=250", stamp));
+    TEST_ASSERT_EQUAL_INT8(100, ble_get_motor_speed(0));
+    TEST_ASSERT_EQUAL_UINT32(1UL << 0, ble_take_changed_channels());
+
+    TEST_ASSERT_TRUE(dispatchCommand("speed1=-60", statsStamp(STATS_SOURCE_GROUP)));
+    TEST_ASSERT_EQUAL_INT8(-60, ble_get_motor_speed(1));
+    TEST_ASSERT_EQUAL_UINT32(0, ble_take_changed_channels());
+
+    TEST_ASSERT_FALSE(dispatchCommand("", stamp));
+    TEST_ASSERT_FALSE(dispatchKeyValue("speedx", "10", stamp));
+}
+
+// Commands per second through the whole path: parser, command table and the channel table
+static void test_throughput(void)
+{
+    static char line[64];
+    dispatchParser_t parser;
+    dispatchJsonlBegin(parser, stamp);
+
+    uint32_t start = micros();
+    for(uint16_t i = 0; i < THROUGHPUT_LINES; i++) {
+        snprintf(line, sizeof(line), "{\"speed%u\":%d,\"speed%u\":%d}\n", i % LEGO_NUM_CHANNELS, i % 100,
+                 (i + 1) % LEGO_NUM_CHANNELS, -(i % 100));
+        dispatchJsonlFeed(parser, line, strlen(line));
+    }
+    uint32_t elapsed = max(1UL, micros() - start);
+    dispatchJsonlEnd(parser);
+
+    uint32_t rate = (uint64_t)parser.commands * 1000000 / elapsed;
+    char message[80];
+    snprintf(message, sizeof(message), "%u commands in %u us, %u cmd/s", parser.commands, elapsed, rate);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_EQUAL_UINT16(THROUGHPUT_LINES * 2, parser.commands);
+    TEST_ASSERT_EQUAL_UINT16(0, parser.errors);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(THROUGHPUT_MIN_RATE, rate);
+
+    uint16_t last = THROUGHPUT_LINES - 1;
+    TEST_ASSERT_EQUAL_INT8(-(last % 100), ble_get_motor_speed((last + 1) % LEGO_NUM_CHANNELS));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_formats);
+    RUN_TEST(test_chunks);
+    RUN_TEST(test_errors);
+    RUN_TEST(test_sources);
+    RUN_TEST(test_throughput);
+    return UNITY_END();
+}
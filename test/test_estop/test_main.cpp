@@ -0,0 +1,196 @@
+/* Emergency stop fan-out to nine hubs and replication to the group
+ *
+ * The hub tasks are modelled like in lego_ble: each sleeps on its wake semaphore for up to HUB_LOOP_TIME, writes the
+ * stop when it is pending and reports back under a shared lock. A BLE write takes up to HUB_WRITE_MAX.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unity.h>
+
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lego_estop.h"
+
+#define HUBS 9
+#define HUB_LOOP_TIME 50    // ms a hub task sleeps between two passes
+#define HUB_WRITE_MAX 8     // ms until a write reaches the hub, one connection interval
+#define SCHEDULING_SLACK 20 // ms for the host scheduler, the hub tasks run at a high priority on the ESP32
+#define LATENCY_BOUND ((HUB_WRITE_MAX + SCHEDULING_SLACK) * 1000) // us, well within one HUB_LOOP_TIME
+
+static estopFanout_t fanout;
+static portMUX_TYPE fanoutMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t hubWake[HUBS];
+static volatile bool hubPending[HUBS];
+static volatile bool hubConnected[HUBS];
+static volatile bool wakeHubs = true;
+static volatile uint32_t fanoutWorst;
+static volatile bool fanoutComplete;
+
+static void done(uint8_t hub, bool written)
+{
+    uint32_t now   = micros();
+    uint32_t worst = 0;
+
+    portENTER_CRITICAL(&fanoutMux);
+    bool last = estopDone(&fanout, hub, written, now, &worst);
+    portEXIT_CRITICAL(&fanoutMux);
+    if(!last) return;
+
+    fanoutWorst    = worst;
+    fanoutComplete = true;
+}
+
+static void hub_task(void * parameter)
+{
+    uint8_t hub = (uintptr_t)parameter;
+    while(true) {
+        xSemaphoreTake(hubWake[hub], HUB_LOOP_TIME);
+
+        portENTER_CRITICAL(&fanoutMux);
+        bool pending    = hubPending[hub];
+        hubPending[hub] = false;
+        portEXIT_CRITICAL(&fanoutMux);
+
+        if(!pending) continue;
+        if(!hubConnected[hub]) {
+            done(hub, false);
+            continue;
+        }
+        vTaskDelay(1 + rand() % HUB_WRITE_MAX);
+        done(hub, true);
+    }
+}
+
+// ble_halt_all: mark every hub, start the fan-out and wake the hub tasks. Returns once all hubs are done.
+static uint32_t halt_all(void)
+{
+    uint32_t hubs = 0;
+
+    fanoutComplete = false;
+    portENTER_CRITICAL(&fanoutMux);
+    for(uint8_t i = 0; i < HUBS; i++) {
+        hubPending[i] = true;
+        hubs |= 1UL << i;
+    }
+    estopRaise(&fanout, hubs, micros());
+    portEXIT_CRITICAL(&fanoutMux);
+
+    if(wakeHubs) {
+        for(uint8_t i = 0; i < HUBS; i++) xSemaphoreGive(hubWake[i]);
+    }
+
+    uint32_t start = millis();
+    while(!fanoutComplete && millis() - start < 1000) delay(1);
+    TEST_ASSERT_TRUE(fanoutComplete);
+    return fanoutWorst;
+}
+
+void setUp(void)
+{
+    wakeHubs = true;
+    for(uint8_t i = 0; i < HUBS; i++) hubConnected[i] = true;
+}
+
+void tearDown(void)
+{}
+
+// Hubs report in any order, the last one completes the fan-out with the latency of the slowest writer
+static void test_fanout(void)
+{
+    estopFanout_t stop;
+    uint32_t worst = 0;
+
+    estopRaise(&stop, 0x1FF, 1000);
+    for(uint8_t i = 8; i > 0; i--) TEST_ASSERT_FALSE(estopDone(&stop, i, true, 1000 + i * 100, &worst));
+    TEST_ASSERT_EQUAL_UINT32(800, worst);
+    TEST_ASSERT_FALSE(estopDone(&stop, 8, true, 9000, &worst));  // Reported twice
+    TEST_ASSERT_FALSE(estopDone(&stop, 12, true, 9000, &worst)); // Not part of the fan-out
+
+    // A hub that drops its connection is stopped by that, its late report adds no latency
+    TEST_ASSERT_TRUE(estopDone(&stop, 0, false, 50000, &worst));
+    TEST_ASSERT_EQUAL_UINT32(800, worst);
+
+    // A new stop while one is under way starts over, across the wrap of micros()
+    estopRaise(&stop, 0x3, 0xFFFFFF00);
+    TEST_ASSERT_FALSE(estopDone(&stop, 1, true, 0x100, &worst));
+    TEST_ASSERT_TRUE(estopDone(&stop, 0, true, 0x80, &worst));
+    TEST_ASSERT_EQUAL_UINT32(0x200, worst);
+}
+
+// Nine hub tasks woken by the stop write it within one BLE write and the scheduling slack, whatever their phase
+static void test_nine_hubs(void)
+{
+    uint32_t worst = 0;
+    for(uint8_t round = 0; round < 20; round++) {
+        delay(rand() % HUB_LOOP_TIME); // Catch the hub tasks anywhere in their sleep
+        uint32_t latency = halt_all();
+        if(latency > worst) worst = latency;
+    }
+
+    // Without the wake the hub tasks only see the stop at the end of their sleep
+    wakeHubs        = false;
+    uint32_t polled = 0;
+    for(uint8_t round = 0; round < 5; round++) {
+        delay(rand() % HUB_LOOP_TIME);
+        uint32_t latency = halt_all();
+        if(latency > polled) polled = latency;
+    }
+
+    char message[96];
+    snprintf(message, sizeof(message), "worst case %u us with the wake, %u us polling, bound %u us", worst, polled,
+             LATENCY_BOUND);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(LATENCY_BOUND, worst);
+}
+
+// A hub that disconnects during the fan-out neither holds it up nor counts toward the latency
+static void test_disconnect(void)
+{
+    hubConnected[4] = false;
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(LATENCY_BOUND, halt_all());
+}
+
+// mqttLoop against a broker that refuses publishes: the stop goes out with the first accepted one
+static void test_retry(void)
+{
+    estopRetry_t retry = {};
+    uint32_t now       = 0;
+    uint16_t attempts  = 0;
+
+    estopRetryRaise(&retry, now); // Raised right at boot
+    TEST_ASSERT_TRUE(estopRetryPending(&retry));
+    for(; estopRetryPending(&retry); now += 10) {
+        TEST_ASSERT_FALSE(estopRetryExpired(&retry, now));
+        if(++attempts == 30) estopRetrySent(&retry); // The broker takes the 30th publish
+    }
+    TEST_ASSERT_EQUAL_UINT16(30, attempts);
+    TEST_ASSERT_FALSE(estopRetryExpired(&retry, now + MQTT_ESTOP_RETRY_TIME * 2));
+
+    // Never accepted: given up once after MQTT_ESTOP_RETRY_TIME, a new stop starts another window
+    estopRetryRaise(&retry, 5000);
+    TEST_ASSERT_FALSE(estopRetryExpired(&retry, 5000 + MQTT_ESTOP_RETRY_TIME));
+    TEST_ASSERT_TRUE(estopRetryExpired(&retry, 5001 + MQTT_ESTOP_RETRY_TIME));
+    TEST_ASSERT_FALSE(estopRetryPending(&retry));
+    TEST_ASSERT_FALSE(estopRetryExpired(&retry, 6000 + MQTT_ESTOP_RETRY_TIME));
+
+    estopRetryRaise(&retry, 20000);
+    TEST_ASSERT_TRUE(estopRetryPending(&retry));
+}
+
+int main(void)
+{
+    srand(1);
+    for(uint8_t i = 0; i < HUBS; i++) {
+        hubWake[i] = xSemaphoreCreateBinary();
+        xTaskCreate(hub_task, "HubTask", 4096, (void *)(uintptr_t)i, 2, NULL);
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_fanout);
+    RUN_TEST(test_nine_hubs);
+    RUN_TEST(test_disconnect);
+    RUN_TEST(test_retry);
+    return UNITY_END();
+}
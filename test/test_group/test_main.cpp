@@ -0,0 +1,202 @@
+/* Channel replication between two controllers of a group, connected through an in-memory broker
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "lego_group.h"
+
+#define GROUP_TOPIC "lego/layout/"
+#define BROKER_QUEUE 32
+
+struct node_t
+{
+    const char * name;
+    groupChannels_t channels;
+    uint16_t applied; // Replicated speeds applied
+};
+
+struct message_t
+{
+    char topic[64];
+    char payload[8];
+};
+
+static node_t nodes[2];
+static message_t queue[BROKER_QUEUE];
+static uint8_t queued;
+static uint16_t published;
+
+static void publish(const char * topic, const char * payload)
+{
+    TEST_ASSERT_TRUE(queued < BROKER_QUEUE);
+    snprintf(queue[queued].topic, sizeof(queue[queued].topic), "%s", topic);
+    snprintf(queue[queued].payload, sizeof(queue[queued].payload), "%s", payload);
+    queued++;
+    published++;
+}
+
+// mqtt_send_channels: one message per channel changed by a local source
+static void send_channels(node_t * node)
+{
+    channelMask_t changed = groupTakeChanged(&node->channels);
+
+    for(uint8_t channel = 0; changed != 0; channel++, changed >>= 1) {
+        if((changed & 1) == 0) continue;
+
+        char topic[64];
+        char payload[8];
+        TEST_ASSERT_TRUE(groupChannelTopic(topic, sizeof(topic), GROUP_TOPIC, channel, node->name) > 0);
+        snprintf(payload, sizeof(payload), "%d", node->channels.speed[channel]);
+        publish(topic, payload);
+    }
+}
+
+// mqtt_message_cb for the group topics: replicated speeds and group commands, neither is replicated again
+static void receive(node_t * node, const char * topic, const char * payload)
+{
+    if(strncmp(topic, GROUP_TOPIC, strlen(GROUP_TOPIC)) != 0) return;
+    topic += strlen(GROUP_TOPIC);
+
+    if(strncmp(topic, "channel/", 8) == 0) {
+        int8_t channel = groupParseChannel(topic, node->name);
+        if(channel >= 0 && groupSyncSpeed(&node->channels, channel, atoi(payload))) node->applied++;
+    } else if(strncmp(topic, "command/", 8) == 0) {
+        groupSyncSpeed(&node->channels, atoi(topic + 8), atoi(payload));
+    }
+}
+
+// Every subscriber gets every message, the sender included, until nobody has anything left to send
+static uint8_t run_broker(void)
+{
+    uint8_t rounds = 0;
+
+    for(;;) {
+        for(uint8_t i = 0; i < 2; i++) send_channels(&nodes[i]);
+        if(queued == 0) return rounds;
+
+        uint8_t count = queued;
+        message_t delivered[BROKER_QUEUE];
+        memcpy(delivered, queue, sizeof(message_t) * count);
+        queued = 0;
+        for(uint8_t m = 0; m < count; m++)
+            for(uint8_t i = 0; i < 2; i++) receive(&nodes[i], delivered[m].topic, delivered[m].payload);
+
+        TEST_ASSERT_TRUE(++rounds < 10);
+    }
+}
+
+void setUp(void)
+{
+    nodes[0].name = "north";
+    nodes[1].name = "south";
+    for(uint8_t i = 0; i < 2; i++) {
+        groupReset(&nodes[i].channels);
+        nodes[i].applied = 0;
+    }
+    queued    = 0;
+    published = 0;
+}
+
+void tearDown(void)
+{}
+
+// A local speed reaches the other controller with a single publish
+static void test_replicate(void)
+{
+    TEST_ASSERT_TRUE(groupSetSpeed(&nodes[0].channels, 2, 50));
+    TEST_ASSERT_EQUAL_UINT8(1, run_broker());
+
+    TEST_ASSERT_EQUAL_UINT16(1, published);
+    TEST_ASSERT_EQUAL_INT8(50, nodes[1].channels.speed[2]);
+    TEST_ASSERT_EQUAL_UINT16(1, nodes[1].applied);
+    TEST_ASSERT_EQUAL_UINT16(0, nodes[0].applied);
+}
+
+// The echo of our own publish and the applied speed on the other side don't start a loop
+static void test_no_echo(void)
+{
+    groupSetSpeed(&nodes[0].channels, 0, 30);
+    groupSetSpeed(&nodes[1].channels, 1, -40);
+    run_broker();
+    TEST_ASSERT_EQUAL_UINT16(2, published);
+
+    published = 0;
+    TEST_ASSERT_EQUAL_UINT8(0, run_broker());
+    TEST_ASSERT_EQUAL_UINT16(0, published);
+    TEST_ASSERT_EQUAL_INT8(30, nodes[1].channels.speed[0]);
+    TEST_ASSERT_EQUAL_INT8(-40, nodes[0].channels.speed[1]);
+}
+
+// Setting the speed a channel already has is not published again
+static void test_unchanged(void)
+{
+    groupSetSpeed(&nodes[0].channels, 3, 20);
+    run_broker();
+    published = 0;
+
+    groupSetSpeed(&nodes[0].channels, 3, 20);
+    groupSetSpeed(&nodes[1].channels, 3, 20);
+    run_broker();
+    TEST_ASSERT_EQUAL_UINT16(0, published);
+}
+
+// A group command reaches every controller itself, so nobody replicates it
+static void test_group_command(void)
+{
+    publish(GROUP_TOPIC "command/4", "60");
+    run_broker();
+
+    TEST_ASSERT_EQUAL_UINT16(1, published);
+    TEST_ASSERT_EQUAL_INT8(60, nodes[0].channels.speed[4]);
+    TEST_ASSERT_EQUAL_INT8(60, nodes[1].channels.speed[4]);
+}
+
+// A stop replicates the channels that were moving, a stop received from the group is kept local
+static void test_stop_all(void)
+{
+    groupSetSpeed(&nodes[0].channels, 5, 70);
+    groupSetSpeed(&nodes[0].channels, 6, -70);
+    run_broker();
+    published = 0;
+
+    TEST_ASSERT_EQUAL_UINT32((1UL << 5) | (1UL << 6), groupStopAll(&nodes[1].channels, true));
+    run_broker();
+    TEST_ASSERT_EQUAL_UINT16(2, published);
+    TEST_ASSERT_EQUAL_INT8(0, nodes[0].channels.speed[5]);
+    TEST_ASSERT_EQUAL_INT8(0, nodes[0].channels.speed[6]);
+
+    groupSetSpeed(&nodes[0].channels, 5, 10);
+    run_broker();
+    published = 0;
+    groupStopAll(&nodes[1].channels, false);
+    run_broker();
+    TEST_ASSERT_EQUAL_UINT16(0, published);
+}
+
+// Malformed topics and channels out of range are ignored
+static void test_parse(void)
+{
+    TEST_ASSERT_EQUAL_INT8(7, groupParseChannel("channel/7/south", "north"));
+    TEST_ASSERT_EQUAL_INT8(-1, groupParseChannel("channel/7/north", "north"));
+    TEST_ASSERT_EQUAL_INT8(-1, groupParseChannel("channel/7", "north"));
+    TEST_ASSERT_EQUAL_INT8(-1, groupParseChannel("channel//south", "north"));
+    TEST_ASSERT_EQUAL_INT8(-1, groupParseChannel("channel/-1/south", "north"));
+    TEST_ASSERT_EQUAL_INT8(-1, groupParseChannel("channel/99/south", "north"));
+    TEST_ASSERT_EQUAL_INT8(-1, groupParseChannel("estop/south", "north"));
+    TEST_ASSERT_FALSE(groupSetSpeed(&nodes[0].channels, LEGO_NUM_CHANNELS, 10));
+    TEST_ASSERT_EQUAL_UINT32(0, groupTakeChanged(&nodes[0].channels));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_replicate);
+    RUN_TEST(test_no_echo);
+    RUN_TEST(test_unchanged);
+    RUN_TEST(test_group_command);
+    RUN_TEST(test_stop_all);
+    RUN_TEST(test_parse);
+    return UNITY_END();
+}
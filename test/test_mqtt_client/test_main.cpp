@@ -0,0 +1,364 @@
+/* Non-blocking MQTT client against a broker stand-in on a loopback socket
+ *
+ * The broker speaks just enough MQTT 3.1.1 for the client: CONNECT with an optional delay or refusal of the CONNACK,
+ * SUBSCRIBE, PUBLISH in both directions with QoS 1 towards the client, PINGREQ and DISCONNECT. It runs on the test
+ * thread, every step of the test polls the client and the broker in turn.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include <Arduino.h>
+#include "lwip/sockets.h"
+#include "lego_mqtt_client.h"
+
+#define BROKER_BUFFER 2048
+#define CLIENT_ID "plate_test"
+#define WILL_TOPIC "lego/node1/status"
+#define LOOP_BUDGET 5000 // us a single mqttClientLoop call may take, it must never wait on the network
+
+struct broker_t
+{
+    int listener;
+    int client;
+    uint16_t port;
+    uint8_t rx[BROKER_BUFFER];
+    size_t rxLength;
+
+    uint32_t connackDelay; // ms between the CONNECT and the CONNACK
+    uint8_t connackCode;
+    uint32_t connectTime; // millis() the CONNECT arrived, 0 = none pending
+
+    char clientId[32];
+    char willTopic[64];
+    char subscription[64];
+    uint8_t subscriptionQos;
+    char topic[64]; // Last publish received from the client
+    char payload[64];
+    uint16_t publishes;
+    uint16_t pubacks;
+    uint16_t pings;
+};
+
+static broker_t broker;
+static char receivedTopic[64];
+static char receivedPayload[64];
+static uint16_t received;
+
+static void client_message(char * topic, byte * payload, unsigned int length)
+{
+    snprintf(receivedTopic, sizeof(receivedTopic), "%s", topic);
+    snprintf(receivedPayload, sizeof(receivedPayload), "%.*s", (int)length, (char *)payload);
+    received++;
+}
+
+/* ===== Broker stand-in ===== */
+
+static void broker_send(const uint8_t * data, size_t length)
+{
+    if(broker.client >= 0) TEST_ASSERT_EQUAL_INT((int)length, send(broker.client, data, length, 0));
+}
+
+static void broker_drop()
+{
+    if(broker.client >= 0) close(broker.client);
+    broker.client   = -1;
+    broker.rxLength = 0;
+}
+
+static void broker_start()
+{
+    memset(&broker, 0, sizeof(broker));
+    broker.client = -1;
+
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    broker.listener = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_TRUE(broker.listener >= 0);
+    TEST_ASSERT_EQUAL_INT(0, bind(broker.listener, (struct sockaddr *)&address, sizeof(address)));
+    TEST_ASSERT_EQUAL_INT(0, listen(broker.listener, 1));
+    TEST_ASSERT_EQUAL_INT(0, getsockname(broker.listener, (struct sockaddr *)&address, &size));
+    fcntl(broker.listener, F_SETFL, O_NONBLOCK);
+    broker.port = ntohs(address.sin_port);
+}
+
+static void broker_stop()
+{
+    broker_drop();
+    close(broker.listener);
+}
+
+static size_t broker_string(const uint8_t * data, char * buffer, size_t size)
+{
+    size_t length = (data[0] << 8) | data[1];
+    snprintf(buffer, size, "%.*s", (int)length, (const char *)data + 2);
+    return 2 + length;
+}
+
+// Publish to the client, QoS 1 with packet id 1
+static void broker_publish(const char * topic, const char * payload)
+{
+    uint8_t packet[128];
+    size_t topicLength = strlen(topic), payloadLength = strlen(payload);
+    size_t length      = 0;
+
+    packet[length++] = 0x32;
+    packet[length++] = 2 + topicLength + 2 + payloadLength;
+    packet[length++] = topicLength >> 8;
+    packet[length++] = topicLength & 0xFF;
+    memcpy(packet + length, topic, topicLength);
+    length += topicLength;
+    packet[length++] = 0;
+    packet[length++] = 1;
+    memcpy(packet + length, payload, payloadLength);
+    broker_send(packet, length + payloadLength);
+}
+
+static void broker_packet(uint8_t header, const uint8_t * body, size_t length)
+{
+    switch(header & 0xF0) {
+        case 0x10: { // CONNECT: protocol name, level, flags, keepalive, client id, will
+            size_t offset = 2 + 4 + 1;
+            uint8_t flags = body[offset];
+            offset += 1 + 2;
+            offset += broker_string(body + offset, broker.clientId, sizeof(broker.clientId));
+            if(flags & 0x04) broker_string(body + offset, broker.willTopic, sizeof(broker.willTopic));
+            broker.connectTime = max(1UL, millis());
+            break;
+        }
+        case 0x30: { // PUBLISH at QoS 0
+            size_t offset = broker_string(body, broker.topic, sizeof(broker.topic));
+            snprintf(broker.payload, sizeof(broker.payload), "%.*s", (int)(length - offset), body + offset);
+            broker.publishes++;
+            break;
+        }
+        case 0x40: // PUBACK
+            broker.pubacks++;
+            break;
+        case 0x80: { // SUBSCRIBE: packet id, topic filter, QoS
+            size_t offset          = 2 + broker_string(body + 2, broker.subscription, sizeof(broker.subscription));
+            broker.subscriptionQos = body[offset];
+            const uint8_t suback[] = {0x90, 3, body[0], body[1], body[offset]};
+            broker_send(suback, sizeof(suback));
+            break;
+        }
+        case 0xC0: { // PINGREQ
+            const uint8_t pingresp[] = {0xD0, 0};
+            broker_send(pingresp, sizeof(pingresp));
+            broker.pings++;
+            break;
+        }
+        case 0xE0: // DISCONNECT
+            broker_drop();
+            break;
+    }
+}
+
+// Accept, read and answer whatever is pending, without waiting
+static void broker_poll()
+{
+    if(broker.client < 0) {
+        broker.client = accept(broker.listener, NULL, NULL);
+        if(broker.client < 0) return;
+        fcntl(broker.client, F_SETFL, O_NONBLOCK);
+    }
+
+    int count = recv(broker.client, broker.rx + broker.rxLength, sizeof(broker.rx) - broker.rxLength, 0);
+    if(count == 0) return broker_drop();
+    if(count > 0) broker.rxLength += count;
+
+    // Complete packets only, a partial one stays in the buffer for the next poll
+    while(broker.client >= 0 && broker.rxLength >= 2) {
+        size_t remaining = 0, offset = 1;
+        uint8_t shift = 0;
+        do {
+            if(offset >= broker.rxLength) return;
+            remaining |= (size_t)(broker.rx[offset] & 0x7F) << shift;
+            shift += 7;
+        } while(broker.rx[offset++] & 0x80);
+        if(offset + remaining > broker.rxLength) break;
+
+        broker_packet(broker.rx[0], broker.rx + offset, remaining);
+        if(broker.client < 0) break;
+        broker.rxLength -= offset + remaining;
+        memmove(broker.rx, broker.rx + offset + remaining, broker.rxLength);
+    }
+
+    if(broker.connectTime != 0 && millis() - broker.connectTime >= broker.connackDelay) {
+        const uint8_t connack[] = {0x20, 2, 0, broker.connackCode};
+        broker_send(connack, sizeof(connack));
+        broker.connectTime = 0;
+        if(broker.connackCode != 0) broker_drop();
+    }
+}
+
+/* ===== Test helpers ===== */
+
+// Polls the client and the broker until done() or the timeout, returns the longest mqttClientLoop call in us
+static uint32_t run(bool (*done)(void), uint32_t timeout)
+{
+    uint32_t longest = 0;
+    uint32_t start   = millis();
+
+    while(!done() && millis() - start < timeout) {
+        uint32_t begin = micros();
+        mqttClientLoop();
+        longest = max(longest, (uint32_t)(micros() - begin));
+        broker_poll();
+        delay(1);
+    }
+    TEST_ASSERT_TRUE(done());
+    return longest;
+}
+
+static bool is_connected(void)
+{
+    return mqttClientState() == MQTT_CLIENT_CONNECTED;
+}
+
+static bool is_disconnected(void)
+{
+    return mqttClientState() == MQTT_CLIENT_DISCONNECTED;
+}
+
+static void connect(const char * host)
+{
+    mqttClientSetServer(host, broker.port);
+    TEST_ASSERT_TRUE(mqttClientConnect(CLIENT_ID, "", "", WILL_TOPIC, "OFF"));
+}
+
+void setUp(void)
+{
+    broker_start();
+    received = 0;
+    mqttClientSetCallback(client_message);
+}
+
+void tearDown(void)
+{
+    mqttClientDisconnect();
+    broker_stop();
+}
+
+/* ===== Tests ===== */
+
+// A broker name is looked up in the background, mqttClientConnect returns right away
+static void test_connect_by_name(void)
+{
+    uint32_t start = micros();
+    connect("localhost");
+    uint32_t elapsed = micros() - start;
+
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(LOOP_BUDGET, elapsed);
+    TEST_ASSERT_EQUAL_UINT8(MQTT_CLIENT_RESOLVING, mqttClientState());
+
+    uint32_t longest = run(is_connected, 2000);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(LOOP_BUDGET, longest);
+    TEST_ASSERT_EQUAL_STRING(CLIENT_ID, broker.clientId);
+    TEST_ASSERT_EQUAL_STRING(WILL_TOPIC, broker.willTopic);
+}
+
+// An address skips the lookup
+static void test_connect_by_address(void)
+{
+    connect("127.0.0.1");
+    TEST_ASSERT_EQUAL_UINT8(MQTT_CLIENT_CONNECTING, mqttClientState());
+    run(is_connected, 2000);
+}
+
+// A broker that takes its time to accept never holds up the loop
+static void test_slow_broker(void)
+{
+    broker.connackDelay = 300;
+    uint32_t start      = millis();
+    connect("localhost");
+    uint32_t longest = run(is_connected, 2000);
+    uint32_t elapsed = millis() - start;
+
+    char message[80];
+    snprintf(message, sizeof(message), "connected after %u ms, longest loop call %u us", elapsed, longest);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(broker.connackDelay, elapsed);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(LOOP_BUDGET, longest);
+}
+
+static void test_refused(void)
+{
+    broker.connackCode = 5;
+    connect("127.0.0.1");
+    run(is_disconnected, 2000);
+    TEST_ASSERT_EQUAL_STRING("Client was not authorized to connect", mqttClientLastError());
+}
+
+static bool is_subscribed(void)
+{
+    return broker.subscription[0] != 0;
+}
+
+static bool has_received(void)
+{
+    return received > 0 && broker.pubacks > 0;
+}
+
+static bool has_published(void)
+{
+    return broker.publishes > 0;
+}
+
+// Commands come in at QoS 1 and are acknowledged, states go out
+static void test_messages(void)
+{
+    connect("localhost");
+    run(is_connected, 2000);
+
+    TEST_ASSERT_TRUE(mqttClientSubscribe("lego/node1/command/#", 1));
+    run(is_subscribed, 1000);
+    TEST_ASSERT_EQUAL_STRING("lego/node1/command/#", broker.subscription);
+    TEST_ASSERT_EQUAL_UINT8(1, broker.subscriptionQos);
+
+    broker_publish("lego/node1/command/speed0", "40");
+    run(has_received, 1000);
+    TEST_ASSERT_EQUAL_STRING("lego/node1/command/speed0", receivedTopic);
+    TEST_ASSERT_EQUAL_STRING("40", receivedPayload);
+    TEST_ASSERT_EQUAL_UINT16(1, broker.pubacks);
+
+    TEST_ASSERT_TRUE(mqttClientPublish("lego/node1/state/battery", "84"));
+    run(has_published, 1000);
+    TEST_ASSERT_EQUAL_STRING("lego/node1/state/battery", broker.topic);
+    TEST_ASSERT_EQUAL_STRING("84", broker.payload);
+}
+
+// A lost broker is noticed and a new attempt connects again
+static void test_broker_lost(void)
+{
+    connect("localhost");
+    run(is_connected, 2000);
+
+    broker_drop();
+    run(is_disconnected, 1000);
+    TEST_ASSERT_EQUAL_STRING("Network connection was broken", mqttClientLastError());
+    TEST_ASSERT_FALSE(mqttClientPublish("lego/node1/state/battery", "84"));
+
+    connect("localhost");
+    run(is_connected, 2000);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN); // A write to the dropped connection must fail, not end the test
+
+    UNITY_BEGIN();
+    RUN_TEST(test_connect_by_name);
+    RUN_TEST(test_connect_by_address);
+    RUN_TEST(test_slow_broker);
+    RUN_TEST(test_refused);
+    RUN_TEST(test_messages);
+    RUN_TEST(test_broker_lost);
+    return UNITY_END();
+}
@@ -0,0 +1,231 @@
+/* Firmware download against an HTTP server stand-in, the image is written to OTA_IMAGE_FILE like to a partition
+ *
+ * The server runs on the test thread and answers one request at a time while the OTA task downloads. It can send
+ * the body in small pieces, drop the connection at a given offset and answer Range requests with 206.
+ */
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unity.h>
+
+#include <Arduino.h>
+#include "lwip/sockets.h"
+#include "mbedtls/sha256.h"
+#include "lego_ble.h"
+#include "lego_ota.h"
+
+#define IMAGE_FILE "ota_image.bin"
+#define IMAGE_SIZE (3 * OTA_CHUNK_SIZE + 1234) // Ends in a partial chunk
+#define MAX_REQUESTS 4
+
+struct server_t
+{
+    int listener;
+    uint16_t port;
+    int status;                   // Reply to every request, 0 = serve the image
+    size_t piece;                 // Bytes per send
+    uint32_t cutAt[MAX_REQUESTS]; // Offset at which the nth connection is dropped, 0 = never
+    uint8_t requests;
+    int32_t rangeStart[MAX_REQUESTS]; // Range asked for by the nth request, -1 = none
+    uint16_t tornWrites;              // File sizes seen during the download that are not whole chunks
+};
+
+static server_t server;
+static uint8_t image[IMAGE_SIZE];
+static char imageDigest[65];
+static char url[64];
+
+static void digest_hex(const uint8_t * data, size_t length, char * hex)
+{
+    uint8_t digest[32];
+    mbedtls_sha256_context context;
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts_ret(&context, 0);
+    mbedtls_sha256_update_ret(&context, data, length);
+    mbedtls_sha256_finish_ret(&context, digest);
+    mbedtls_sha256_free(&context);
+    for(uint8_t i = 0; i < sizeof(digest); i++) sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+/* ===== HTTP server stand-in ===== */
+
+static void server_check_file(void)
+{
+    struct stat info;
+    if(stat(IMAGE_FILE, &info) == 0 && info.st_size % OTA_CHUNK_SIZE != 0 && info.st_size != IMAGE_SIZE)
+        server.tornWrites++;
+}
+
+static void server_reply(int client)
+{
+    char request[512] = "";
+    size_t length     = 0;
+    while(length < sizeof(request) - 1 && !strstr(request, "\r\n\r\n")) {
+        int received = recv(client, request + length, sizeof(request) - 1 - length, 0);
+        if(received <= 0) return;
+        length += received;
+        request[length] = 0;
+    }
+
+    uint8_t index            = server.requests++;
+    const char * range       = strcasestr(request, "\r\nRange: bytes=");
+    uint32_t start           = range != NULL ? strtoul(range + 15, NULL, 10) : 0;
+    server.rangeStart[index] = range != NULL ? (int32_t)start : -1;
+
+    char header[160];
+    if(server.status != 0) {
+        snprintf(header, sizeof(header), "HTTP/1.1 %d Error\r\nContent-Length: 0\r\n\r\n", server.status);
+    } else if(range != NULL) {
+        snprintf(header, sizeof(header),
+                 "HTTP/1.1 206 Partial Content\r\nContent-Length: %u\r\nContent-Range: bytes %u-%u/%u\r\n\r\n",
+                 IMAGE_SIZE - start, start, IMAGE_SIZE - 1, IMAGE_SIZE);
+    } else {
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n", IMAGE_SIZE);
+    }
+    send(client, header, strlen(header), 0);
+    if(server.status != 0) return;
+
+    uint32_t end = index < MAX_REQUESTS && server.cutAt[index] != 0 ? server.cutAt[index] : IMAGE_SIZE;
+    for(uint32_t offset = start; offset < end; offset += server.piece) {
+        if(send(client, image + offset, min((uint32_t)server.piece, end - offset), 0) <= 0) return;
+        delay(1);
+        server_check_file();
+    }
+}
+
+// Serves requests until the update has been downloaded and verified or has failed
+static uint8_t server_run(uint32_t timeout)
+{
+    uint32_t start = millis();
+    while(millis() - start < timeout) {
+        uint8_t state = otaGetState();
+        if(state != OTA_DOWNLOADING && state != OTA_VERIFYING) return state;
+
+        struct pollfd waiting = {server.listener, POLLIN, 0};
+        if(poll(&waiting, 1, 10) <= 0) continue;
+        int client = accept(server.listener, NULL, NULL);
+        if(client < 0) continue;
+        server_reply(client);
+        close(client);
+    }
+    return otaGetState();
+}
+
+void setUp(void)
+{
+    int listener  = server.listener;
+    uint16_t port = server.port;
+    memset(&server, 0, sizeof(server));
+    server.listener = listener;
+    server.port     = port;
+    server.piece    = 512;
+}
+
+void tearDown(void)
+{
+    remove(IMAGE_FILE);
+}
+
+static void test_sha256(void)
+{
+    char hex[65];
+    digest_hex((const uint8_t *)"abc", 3, hex);
+    TEST_ASSERT_EQUAL_STRING("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", hex);
+}
+
+// A malformed digest never starts the task, an unusable URL or a missing image fail without retrying
+static void test_rejected(void)
+{
+    TEST_ASSERT_FALSE(otaStart(url, "0123"));
+    TEST_ASSERT_EQUAL_UINT8(OTA_IDLE, otaGetState());
+
+    TEST_ASSERT_TRUE(otaStart("ftp://127.0.0.1/firmware.bin", ""));
+    TEST_ASSERT_EQUAL_UINT8(OTA_FAILED, server_run(5000));
+    TEST_ASSERT_EQUAL_UINT8(0, server.requests);
+
+    server.status = 404;
+    TEST_ASSERT_TRUE(otaStart(url, ""));
+    TEST_ASSERT_EQUAL_UINT8(OTA_FAILED, server_run(5000));
+    TEST_ASSERT_EQUAL_UINT8(1, server.requests);
+}
+
+// The image goes out in OTA_CHUNK_SIZE writes, an image that doesn't match the digest is not accepted
+static void test_chunks_and_digest(void)
+{
+    char wrong[65];
+    strcpy(wrong, imageDigest);
+    wrong[0] = wrong[0] == '0' ? '1' : '0';
+
+    TEST_ASSERT_TRUE(otaStart(url, wrong));
+    TEST_ASSERT_EQUAL_UINT8(OTA_FAILED, server_run(5000));
+    TEST_ASSERT_EQUAL_UINT8(1, server.requests);
+    TEST_ASSERT_EQUAL_UINT16(0, server.tornWrites);
+
+    // Everything arrived, only the digest was wrong
+    static uint8_t written[IMAGE_SIZE + 1];
+    FILE * file = fopen(IMAGE_FILE, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_SIZE, fread(written, 1, sizeof(written), file));
+    fclose(file);
+    TEST_ASSERT_EQUAL_MEMORY(image, written, IMAGE_SIZE);
+}
+
+// Dropped connections resume right after the last byte written, the verified image stops the trains
+static void test_resume(void)
+{
+    server.cutAt[0] = 5000;               // Within the second chunk
+    server.cutAt[1] = 2 * OTA_CHUNK_SIZE; // On a chunk boundary
+    commandStamp_t stamp;
+    ble_setup();
+    ble_set_motor_speed(0, 50, stamp);
+
+    uint32_t start = millis();
+    TEST_ASSERT_TRUE(otaStart(url, imageDigest));
+    TEST_ASSERT_EQUAL_UINT8(OTA_STOPPING, server_run(10000));
+
+    char message[64];
+    snprintf(message, sizeof(message), "%u requests, image ready after %u ms", server.requests,
+             (uint32_t)(millis() - start));
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_EQUAL_UINT8(3, server.requests);
+    TEST_ASSERT_EQUAL_INT32(-1, server.rangeStart[0]);
+    TEST_ASSERT_EQUAL_INT32(5000, server.rangeStart[1]);
+    TEST_ASSERT_EQUAL_INT32(2 * OTA_CHUNK_SIZE, server.rangeStart[2]);
+
+    // Trains run on until the image is ready
+    TEST_ASSERT_EQUAL_INT8(50, ble_get_motor_speed(0));
+    otaLoop();
+    TEST_ASSERT_EQUAL_INT8(0, ble_get_motor_speed(0));
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    srand(1);
+    for(uint32_t i = 0; i < IMAGE_SIZE; i++) image[i] = rand();
+    digest_hex(image, IMAGE_SIZE, imageDigest);
+
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.listener         = socket(AF_INET, SOCK_STREAM, 0);
+    bind(server.listener, (struct sockaddr *)&address, sizeof(address));
+    getsockname(server.listener, (struct sockaddr *)&address, &size);
+    listen(server.listener, 2);
+    server.port = ntohs(address.sin_port);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/firmware.bin", server.port);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_sha256);
+    RUN_TEST(test_rejected);
+    RUN_TEST(test_chunks_and_digest);
+    RUN_TEST(test_resume); // Last, the updater stays in OTA_STOPPING until the reboot
+    return UNITY_END();
+}
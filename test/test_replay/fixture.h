@@ -0,0 +1,49 @@
+/* Serial capture of node1 in group trains, recorded with capture=serial and the log on the same port:
+ *
+ *   +40 ms  lego/node1/command          speed0=40
+ *   +25 ms  lego/node1/command/speed1   -30
+ *           log line
+ *   +60 ms  lego/trains/command/yellow  25
+ *   +10 ms  hub property of hub 0, the raw message holds SLIP_END and SLIP_ESC
+ *   +15 ms  lego/node1/command/json     {"speed2":60,"speed0":50}
+ *           log line
+ *   +30 ms  remote button of hub 1
+ *   +20 ms  lego/node2/command          speed4=99, another node
+ *   +35 ms  lego/node1/command/red      20
+ *
+ * The log before the magic frame and after the last record is left in as well.
+ */
+#define FIXTURE_EVENTS 8
+#define FIXTURE_DURATION_US 235000 // Sum of the deltas, rounded down
+
+static const uint8_t fixtureSession[] = {
+    0x4d, 0x51, 0x54, 0x54, 0x3a, 0x20, 0x43, 0x6f, 0x6e, 0x6e, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20,
+    0x74, 0x6f, 0x20, 0x62, 0x72, 0x6f, 0x6b, 0x65, 0x72, 0x0d, 0x0a, 0xc0, 0x50, 0x43, 0x50, 0x55,
+    0x50, 0x43, 0x01, 0xc0, 0x43, 0x41, 0x50, 0x54, 0x3a, 0x20, 0x43, 0x61, 0x70, 0x74, 0x75, 0x72,
+    0x69, 0x6e, 0x67, 0x20, 0x74, 0x6f, 0x20, 0x73, 0x65, 0x72, 0x69, 0x61, 0x6c, 0x0d, 0x0a, 0xc0,
+    0x50, 0x43, 0x02, 0x9d, 0x00, 0x00, 0x01, 0x12, 0x1b, 0x00, 0x6c, 0x65, 0x67, 0x6f, 0x2f, 0x6e,
+    0x6f, 0x64, 0x65, 0x31, 0x2f, 0x63, 0x6f, 0x6d, 0x6d, 0x61, 0x6e, 0x64, 0x73, 0x70, 0x65, 0x65,
+    0x64, 0x30, 0x3d, 0x34, 0x30, 0xc0, 0xc0, 0x50, 0x43, 0x0a, 0x62, 0x00, 0x00, 0x01, 0x19, 0x1c,
+    0x00, 0x6c, 0x65, 0x67, 0x6f, 0x2f, 0x6e, 0x6f, 0x64, 0x65, 0x31, 0x2f, 0x63, 0x6f, 0x6d, 0x6d,
+    0x61, 0x6e, 0x64, 0x2f, 0x73, 0x70, 0x65, 0x65, 0x64, 0x31, 0x2d, 0x33, 0x30, 0xc0, 0x42, 0x4c,
+    0x45, 0x3a, 0x20, 0x48, 0x75, 0x62, 0x20, 0x31, 0x20, 0x62, 0x61, 0x74, 0x74, 0x65, 0x72, 0x79,
+    0x20, 0x38, 0x34, 0x25, 0x0d, 0x0a, 0xc0, 0x50, 0x43, 0xef, 0xea, 0x00, 0x00, 0x01, 0x1a, 0x1c,
+    0x00, 0x6c, 0x65, 0x67, 0x6f, 0x2f, 0x74, 0x72, 0x61, 0x69, 0x6e, 0x73, 0x2f, 0x63, 0x6f, 0x6d,
+    0x6d, 0x61, 0x6e, 0x64, 0x2f, 0x79, 0x65, 0x6c, 0x6c, 0x6f, 0x77, 0x32, 0x35, 0xc0, 0xc0, 0x50,
+    0x43, 0x91, 0x27, 0x00, 0x00, 0x03, 0x00, 0x07, 0x00, 0x06, 0x06, 0x00, 0x01, 0x06, 0xdb, 0xdc,
+    0xdb, 0xdd, 0xc0, 0xc0, 0x50, 0x43, 0x8c, 0x3c, 0x00, 0x00, 0x01, 0x17, 0x31, 0x00, 0x6c, 0x65,
+    0x67, 0x6f, 0x2f, 0x6e, 0x6f, 0x64, 0x65, 0x31, 0x2f, 0x63, 0x6f, 0x6d, 0x6d, 0x61, 0x6e, 0x64,
+    0x2f, 0x6a, 0x73, 0x6f, 0x6e, 0x7b, 0x22, 0x73, 0x70, 0x65, 0x65, 0x64, 0x32, 0x22, 0x3a, 0x36,
+    0x30, 0x2c, 0x22, 0x73, 0x70, 0x65, 0x65, 0x64, 0x30, 0x22, 0x3a, 0x35, 0x30, 0x7d, 0x0a, 0xc0,
+    0x44, 0x49, 0x53, 0x50, 0x3a, 0x20, 0x32, 0x20, 0x63, 0x6f, 0x6d, 0x6d, 0x61, 0x6e, 0x64, 0x73,
+    0x0d, 0x0a, 0xc0, 0x50, 0x43, 0xdb, 0xdc, 0x75, 0x00, 0x00, 0x02, 0x01, 0x02, 0x00, 0x00, 0x01,
+    0xc0, 0xc0, 0x50, 0x43, 0xae, 0x4e, 0x00, 0x00, 0x01, 0x12, 0x1b, 0x00, 0x6c, 0x65, 0x67, 0x6f,
+    0x2f, 0x6e, 0x6f, 0x64, 0x65, 0x32, 0x2f, 0x63, 0x6f, 0x6d, 0x6d, 0x61, 0x6e, 0x64, 0x73, 0x70,
+    0x65, 0x65, 0x64, 0x34, 0x3d, 0x39, 0x39, 0xc0, 0xc0, 0x50, 0x43, 0xe0, 0x95, 0x00, 0x00, 0x01,
+    0x16, 0x18, 0x00, 0x6c, 0x65, 0x67, 0x6f, 0x2f, 0x6e, 0x6f, 0x64, 0x65, 0x31, 0x2f, 0x63, 0x6f,
+    0x6d, 0x6d, 0x61, 0x6e, 0x64, 0x2f, 0x72, 0x65, 0x64, 0x32, 0x30, 0xc0, 0x43, 0x41, 0x50, 0x54,
+    0x3a, 0x20, 0x53, 0x74, 0x6f, 0x70, 0x70, 0x65, 0x64, 0x2c, 0x20, 0x38, 0x20, 0x65, 0x76, 0x65,
+    0x6e, 0x74, 0x73, 0x20, 0x63, 0x61, 0x70, 0x74, 0x75, 0x72, 0x65, 0x64, 0x2c, 0x20, 0x30, 0x20,
+    0x64, 0x72, 0x6f, 0x70, 0x70, 0x65, 0x64, 0x0d, 0x0a, 0x43, 0x41, 0x50, 0x54, 0x3a, 0x20, 0x64,
+    0x6f, 0x6e, 0x65, 0x0d, 0x0a,
+};
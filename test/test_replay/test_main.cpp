@@ -0,0 +1,104 @@
+/* Capture replay on the host: a recorded serial session fed through the command topics of the dispatcher
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "lego_ble.h"
+#include "lego_capture.h"
+#include "fixture.h"
+
+#define NODE_TOPIC "lego/node1/"
+#define GROUP_TOPIC "lego/trains/"
+
+static uint32_t replay(const void * data, size_t size, uint8_t speedFactor)
+{
+    FILE * file = fmemopen((void *)data, size, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    uint32_t events = captureReplayFile(file, NODE_TOPIC, GROUP_TOPIC, speedFactor);
+    fclose(file);
+    return events;
+}
+
+void setUp(void)
+{
+    ble_setup();
+    ble_take_changed_channels();
+}
+
+void tearDown(void)
+{}
+
+// Every record is replayed, the log around the frames and the commands for node2 leave no trace
+static void test_session(void)
+{
+    TEST_ASSERT_EQUAL_UINT32(FIXTURE_EVENTS, replay(fixtureSession, sizeof(fixtureSession), 0));
+
+    TEST_ASSERT_EQUAL_INT8(20, ble_get_motor_speed(0));
+    TEST_ASSERT_EQUAL_INT8(-30, ble_get_motor_speed(1));
+    TEST_ASSERT_EQUAL_INT8(60, ble_get_motor_speed(2));
+    TEST_ASSERT_EQUAL_INT8(25, ble_get_motor_speed(3));
+    TEST_ASSERT_EQUAL_INT8(0, ble_get_motor_speed(4));
+}
+
+// The group command is applied like on the controller, without being replicated again
+static void test_group_source(void)
+{
+    replay(fixtureSession, sizeof(fixtureSession), 0);
+    TEST_ASSERT_EQUAL_UINT32(0x07, ble_take_changed_channels());
+}
+
+// At 4x the session takes a quarter of the recorded time, never less
+static void test_speed_factor(void)
+{
+    uint32_t start   = micros();
+    uint32_t events  = replay(fixtureSession, sizeof(fixtureSession), 4);
+    uint32_t elapsed = micros() - start;
+
+    char message[64];
+    snprintf(message, sizeof(message), "%u events replayed at 4x in %u us", events, elapsed);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_EQUAL_UINT32(FIXTURE_EVENTS, events);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(FIXTURE_DURATION_US / 4, elapsed);
+    TEST_ASSERT_EQUAL_INT8(20, ble_get_motor_speed(0));
+}
+
+// A capture cut off in the middle of a record replays what came before, a stream without the magic frame nothing
+static void test_truncated(void)
+{
+    const uint8_t * red = (const uint8_t *)memmem(fixtureSession, sizeof(fixtureSession), "command/red", 11);
+    TEST_ASSERT_NOT_NULL(red);
+    TEST_ASSERT_EQUAL_UINT32(FIXTURE_EVENTS - 1, replay(fixtureSession, red + 11 - fixtureSession, 0));
+    TEST_ASSERT_EQUAL_INT8(50, ble_get_motor_speed(0));
+
+    ble_setup();
+    const uint8_t * magic = (const uint8_t *)memmem(fixtureSession, sizeof(fixtureSession), "PUPC", 4);
+    TEST_ASSERT_NOT_NULL(magic);
+    size_t skip = magic + 5 - fixtureSession;
+    TEST_ASSERT_EQUAL_UINT32(0, replay(fixtureSession + skip, sizeof(fixtureSession) - skip, 0));
+    TEST_ASSERT_EQUAL_INT8(0, ble_get_motor_speed(1));
+}
+
+// JSON lines as typed on the console after jsonl=
+static void test_jsonl(void)
+{
+    const char * text = "{\"speed0\":35,\"speed1\":-35}\n[\"speed2=10\", \"speed3 15\"]\n";
+    TEST_ASSERT_EQUAL_UINT32(2, replay(text, strlen(text), 1));
+
+    TEST_ASSERT_EQUAL_INT8(35, ble_get_motor_speed(0));
+    TEST_ASSERT_EQUAL_INT8(-35, ble_get_motor_speed(1));
+    TEST_ASSERT_EQUAL_INT8(10, ble_get_motor_speed(2));
+    TEST_ASSERT_EQUAL_INT8(15, ble_get_motor_speed(3));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_session);
+    RUN_TEST(test_group_source);
+    RUN_TEST(test_speed_factor);
+    RUN_TEST(test_truncated);
+    RUN_TEST(test_jsonl);
+    return UNITY_END();
+}
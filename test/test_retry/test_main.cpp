@@ -0,0 +1,164 @@
+/* MQTT reconnect backoff against a broker stand-in on a simulated clock, and the offline queue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "lego_retry.h"
+
+#define LOOP_TIME 10     // ms between two mqttLoop calls
+#define CONNECT_TIME 120 // ms from the connect attempt until the broker has accepted it
+
+static retryBackoff_t backoff;
+static retryQueue_t queue;
+
+void setUp(void)
+{
+    retryBackoffReset(&backoff);
+    retryQueueReset(&queue);
+    srand(1);
+}
+
+void tearDown(void)
+{}
+
+// Every attempt lands in the upper half of a window that doubles up to MQTT_BACKOFF_MAX
+static void test_backoff_window(void)
+{
+    uint32_t now = 1000;
+    TEST_ASSERT_TRUE(retryBackoffDue(&backoff, now));
+
+    uint32_t window = MQTT_BACKOFF_MIN;
+    for(uint8_t i = 0; i < 16; i++) {
+        TEST_ASSERT_EQUAL_UINT32(window / 2, retryBackoffAttempt(&backoff, now, 0));
+        TEST_ASSERT_FALSE(retryBackoffDue(&backoff, now + window / 2 - 1));
+        TEST_ASSERT_TRUE(retryBackoffDue(&backoff, now + window / 2));
+        window = window * 2 < MQTT_BACKOFF_MAX ? window * 2 : MQTT_BACKOFF_MAX;
+    }
+    TEST_ASSERT_EQUAL_UINT32(MQTT_BACKOFF_MAX, retryBackoffAttempt(&backoff, now, MQTT_BACKOFF_MAX / 2));
+
+    // A network event skips the rest of the window, the next attempt starts over at the minimum
+    retryBackoffReset(&backoff);
+    TEST_ASSERT_TRUE(retryBackoffDue(&backoff, now));
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(MQTT_BACKOFF_MIN, retryBackoffAttempt(&backoff, now, rand()));
+}
+
+// mqttLoop with a broker that is down for outage ms. Returns the ms from the broker coming back until the
+// connection is accepted and commands flow again, attempts counts the connects made.
+static uint32_t outage(uint32_t length, uint32_t * attempts)
+{
+    uint32_t brokerUp  = 5000 + length;
+    uint32_t accepted  = 0; // Time the pending attempt is accepted, 0 = none pending
+    uint32_t connected = 0;
+
+    *attempts = 0;
+    retryBackoffReset(&backoff); // Connection lost
+    for(uint32_t now = 5000; connected == 0; now += LOOP_TIME) {
+        if(accepted != 0) { // Attempt in progress
+            if(now >= accepted) connected = now;
+            continue;
+        }
+        if(!retryBackoffDue(&backoff, now)) continue;
+
+        retryBackoffAttempt(&backoff, now, rand());
+        (*attempts)++;
+        if(now >= brokerUp) accepted = now + CONNECT_TIME;
+    }
+
+    return connected - brokerUp;
+}
+
+// Once the broker is back the controller reconnects within one backoff window, whatever the outage lasted
+static void test_reconnect_bound(void)
+{
+    static const uint32_t outages[] = {100, 1000, 5000, 30000, 120000, 600000};
+    const uint32_t bound = MQTT_BACKOFF_MAX + CONNECT_TIME + LOOP_TIME;
+
+    for(uint8_t i = 0; i < sizeof(outages) / sizeof(*outages); i++) {
+        uint32_t worst = 0, attempts = 0;
+        for(uint8_t run = 0; run < 50; run++) {
+            uint32_t flowing = outage(outages[i], &attempts);
+            if(flowing > worst) worst = flowing;
+        }
+
+        char message[96];
+        snprintf(message, sizeof(message), "outage %6u ms: commands flowing after at most %5u ms, %u attempts",
+                 outages[i], worst, attempts);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_LESS_OR_EQUAL_UINT32(bound, worst);
+        // Never more than one attempt per half window once the backoff is at its maximum
+        TEST_ASSERT_LESS_OR_EQUAL_UINT32(10 + outages[i] / (MQTT_BACKOFF_MAX / 2), attempts);
+    }
+}
+
+// Repeated states of one topic take a single slot and keep the last value
+static void test_queue_coalescing(void)
+{
+    char payload[16];
+    for(uint8_t i = 0; i < 100; i++) {
+        snprintf(payload, sizeof(payload), "%u", i);
+        TEST_ASSERT_TRUE(retryQueuePut(&queue, "battery", payload));
+    }
+    TEST_ASSERT_TRUE(retryQueuePut(&queue, "hubs", "[]"));
+
+    TEST_ASSERT_EQUAL_UINT8(2, queue.count);
+    TEST_ASSERT_EQUAL_UINT32(0, queue.dropped);
+
+    retryQueueItem_t * item = retryQueueOldest(&queue);
+    TEST_ASSERT_EQUAL_STRING("battery", item->subtopic);
+    TEST_ASSERT_EQUAL_STRING("99", item->payload);
+    retryQueueRemove(&queue, item);
+    TEST_ASSERT_EQUAL_STRING("hubs", retryQueueOldest(&queue)->subtopic);
+}
+
+// A full queue gives up the topic updated longest ago and drains in the order of the last update
+static void test_queue_full(void)
+{
+    char subtopic[16];
+    for(uint8_t i = 0; i <= MQTT_QUEUE_SIZE; i++) {
+        snprintf(subtopic, sizeof(subtopic), "topic%u", i);
+        TEST_ASSERT_TRUE(retryQueuePut(&queue, subtopic, "x"));
+    }
+    TEST_ASSERT_EQUAL_UINT8(MQTT_QUEUE_SIZE, queue.count);
+    TEST_ASSERT_EQUAL_UINT32(1, queue.dropped);
+
+    TEST_ASSERT_TRUE(retryQueuePut(&queue, "topic1", "y")); // Moves to the end
+    TEST_ASSERT_EQUAL_UINT32(1, queue.dropped);
+
+    for(uint8_t i = 2; i <= MQTT_QUEUE_SIZE; i++) {
+        snprintf(subtopic, sizeof(subtopic), "topic%u", i);
+        retryQueueItem_t * item = retryQueueOldest(&queue);
+        TEST_ASSERT_EQUAL_STRING(subtopic, item->subtopic);
+        retryQueueRemove(&queue, item);
+    }
+    TEST_ASSERT_EQUAL_STRING("y", retryQueueOldest(&queue)->payload);
+    retryQueueRemove(&queue, retryQueueOldest(&queue));
+    TEST_ASSERT_EQUAL_UINT8(0, queue.count);
+    TEST_ASSERT_TRUE(retryQueueOldest(&queue) == NULL);
+}
+
+// Values that don't fit a slot are counted as lost
+static void test_queue_too_long(void)
+{
+    char payload[MQTT_QUEUE_PAYLOAD_SIZE + 1];
+    memset(payload, 'x', sizeof(payload) - 1);
+    payload[sizeof(payload) - 1] = 0;
+
+    TEST_ASSERT_FALSE(retryQueuePut(&queue, "sensors", payload));
+    TEST_ASSERT_FALSE(retryQueuePut(&queue, "a_subtopic_much_too_long_for_a_slot", "1"));
+    TEST_ASSERT_EQUAL_UINT8(0, queue.count);
+    TEST_ASSERT_EQUAL_UINT32(2, queue.dropped);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_backoff_window);
+    RUN_TEST(test_reconnect_bound);
+    RUN_TEST(test_queue_coalescing);
+    RUN_TEST(test_queue_full);
+    RUN_TEST(test_queue_too_long);
+    return UNITY_END();
+}
@@ -0,0 +1,101 @@
+/* Roaming decisions replayed from RSSI traces, one sample per second like lego_wifi feeds them
+ */
+#include <unity.h>
+
+#include "lego_roam.h"
+
+#define SAMPLE_INTERVAL 1000
+
+static roamState_t state;
+
+// Feeds the same reading for a number of seconds, returns the number of scans requested
+static uint8_t feed(int8_t rssi, uint32_t * now, uint16_t seconds)
+{
+    uint8_t scans = 0;
+    for(uint16_t i = 0; i < seconds; i++) {
+        *now += SAMPLE_INTERVAL;
+        if(roamSample(&state, rssi, *now) == ROAM_SCAN) scans++;
+    }
+    return scans;
+}
+
+void setUp(void)
+{
+    roamReset(&state, 1000);
+}
+
+void tearDown(void)
+{}
+
+// A single dip while a train passes is smoothed out and never counts as weak
+static void test_spike_is_smoothed(void)
+{
+    uint32_t now = 1000;
+    feed(-60, &now, 5);
+    feed(-90, &now, 1);
+    TEST_ASSERT_TRUE(roamGetRssi(&state) >= ROAM_RSSI_THRESHOLD);
+    TEST_ASSERT_EQUAL_UINT32(0, state.weakSince);
+}
+
+// Right after an association a weak signal doesn't scan until the hold-off has passed
+static void test_holdoff_after_association(void)
+{
+    uint32_t now = 1000;
+    TEST_ASSERT_EQUAL_UINT8(0, feed(-80, &now, ROAM_HOLDOFF / SAMPLE_INTERVAL - 1));
+    TEST_ASSERT_EQUAL_UINT8(1, feed(-80, &now, 2));
+}
+
+// The signal has to stay weak for ROAM_WEAK_TIME, recovering in between starts the wait over
+static void test_weak_time(void)
+{
+    uint32_t now = 1000;
+    feed(-60, &now, ROAM_HOLDOFF / SAMPLE_INTERVAL);
+
+    TEST_ASSERT_EQUAL_UINT8(0, feed(-85, &now, ROAM_WEAK_TIME / SAMPLE_INTERVAL - 2));
+    feed(-50, &now, 5);
+    TEST_ASSERT_EQUAL_UINT8(0, feed(-85, &now, ROAM_WEAK_TIME / SAMPLE_INTERVAL - 2));
+    TEST_ASSERT_EQUAL_UINT8(1, feed(-85, &now, 5));
+}
+
+// While the signal stays weak the scans are spaced by ROAM_SCAN_INTERVAL
+static void test_scan_interval(void)
+{
+    uint32_t now = 1000;
+    feed(-85, &now, ROAM_HOLDOFF / SAMPLE_INTERVAL + 1);
+    TEST_ASSERT_EQUAL_UINT8(2, feed(-85, &now, 2 * ROAM_SCAN_INTERVAL / SAMPLE_INTERVAL));
+}
+
+// A candidate only wins with at least ROAM_HYSTERESIS dB over the current access point
+static void test_hysteresis(void)
+{
+    uint32_t now = 1000;
+    feed(-78, &now, 10);
+
+    TEST_ASSERT_FALSE(roamShouldRoam(&state, -78 + ROAM_HYSTERESIS - 1));
+    TEST_ASSERT_TRUE(roamShouldRoam(&state, -78 + ROAM_HYSTERESIS));
+    TEST_ASSERT_FALSE(roamShouldRoam(&state, 0)); // No reading
+}
+
+// Two access points of similar strength: after roaming to the other one the controller stays there
+static void test_no_flapping(void)
+{
+    uint32_t now = 1000;
+    feed(-74, &now, 10);
+    TEST_ASSERT_FALSE(roamShouldRoam(&state, -71));
+
+    roamReset(&state, now);
+    TEST_ASSERT_EQUAL_UINT8(0, feed(-71, &now, ROAM_HOLDOFF / SAMPLE_INTERVAL - 1));
+    TEST_ASSERT_FALSE(roamShouldRoam(&state, -74));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_spike_is_smoothed);
+    RUN_TEST(test_holdoff_after_association);
+    RUN_TEST(test_weak_time);
+    RUN_TEST(test_scan_interval);
+    RUN_TEST(test_hysteresis);
+    RUN_TEST(test_no_flapping);
+    return UNITY_END();
+}
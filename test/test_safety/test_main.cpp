@@ -0,0 +1,138 @@
+/* Supervisor decisions: link and hub timeouts, channel ownership and the ramp down
+ */
+#include <unity.h>
+
+#include "lego_safety.h"
+
+#define REMOTE(slot) (SAFETY_LINK_REMOTE + (slot))
+
+static uint32_t lostLinks;
+static uint16_t stalledHubs;
+
+static uint32_t check(uint32_t now)
+{
+    lostLinks   = 0;
+    stalledHubs = 0;
+    return safetyCheck(now, &lostLinks, &stalledHubs);
+}
+
+void setUp(void)
+{
+    safetyReset();
+}
+
+void tearDown(void)
+{}
+
+// A lost link stops the channels it drives and nothing else
+static void test_link_timeout(void)
+{
+    safetyBeatLink(SAFETY_LINK_MQTT, 1000);
+    safetyBeatLink(REMOTE(0), 1000);
+    safetyNoteCommand(0, SAFETY_LINK_MQTT, 50);
+    safetyNoteCommand(1, REMOTE(0), 50);
+
+    TEST_ASSERT_EQUAL_UINT32(0, check(1000 + SAFETY_LINK_TIMEOUT));
+
+    safetyBeatLink(REMOTE(0), 1000 + SAFETY_LINK_TIMEOUT);
+    TEST_ASSERT_EQUAL_UINT32(1UL << 0, check(1001 + SAFETY_LINK_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(1UL << SAFETY_LINK_MQTT, lostLinks);
+    TEST_ASSERT_EQUAL_UINT32(1UL << 0, safetyGetRamping());
+}
+
+// Every remote owns the channels it set moving, another remote that stays connected doesn't keep them alive
+static void test_remote_ownership(void)
+{
+    safetyBeatLink(REMOTE(0), 1000);
+    safetyBeatLink(REMOTE(1), 1000);
+    safetyNoteCommand(2, REMOTE(0), 30);
+    safetyNoteCommand(3, REMOTE(1), -30);
+
+    safetyBeatLink(REMOTE(0), 1000 + SAFETY_LINK_TIMEOUT);
+    TEST_ASSERT_EQUAL_UINT32(1UL << 3, check(1001 + SAFETY_LINK_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(1UL << REMOTE(1), lostLinks);
+}
+
+// The last command decides the owner, a channel taken over by a live link keeps running
+static void test_takeover(void)
+{
+    safetyBeatLink(SAFETY_LINK_MQTT, 1000);
+    safetyBeatLink(REMOTE(0), 1000);
+    safetyNoteCommand(4, REMOTE(0), 40);
+    safetyNoteCommand(4, SAFETY_LINK_MQTT, 60);
+
+    safetyBeatLink(SAFETY_LINK_MQTT, 1000 + SAFETY_LINK_TIMEOUT);
+    TEST_ASSERT_EQUAL_UINT32(0, check(1001 + SAFETY_LINK_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(1UL << REMOTE(0), lostLinks);
+}
+
+// A stopped channel and the supervisor's own commands take no ownership
+static void test_no_owner(void)
+{
+    safetyBeatLink(SAFETY_LINK_MQTT, 1000);
+    safetyNoteCommand(5, SAFETY_LINK_MQTT, 50);
+    safetyNoteCommand(5, SAFETY_LINK_MQTT, 0);
+    safetyNoteCommand(6, SAFETY_LINK_SYSTEM, 50);
+
+    TEST_ASSERT_EQUAL_UINT32(0, check(1001 + SAFETY_LINK_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(1UL << SAFETY_LINK_MQTT, lostLinks);
+}
+
+// An outage is reported once, a link that comes back can be lost again
+static void test_reported_once(void)
+{
+    safetyBeatLink(SAFETY_LINK_MQTT, 1000);
+    safetyNoteCommand(0, SAFETY_LINK_MQTT, 50);
+
+    TEST_ASSERT_EQUAL_UINT32(1UL << 0, check(1001 + SAFETY_LINK_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(0, check(2001 + SAFETY_LINK_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(0, lostLinks);
+
+    safetyBeatLink(SAFETY_LINK_MQTT, 10000);
+    check(10000);
+    safetyNoteCommand(0, SAFETY_LINK_MQTT, 50);
+    TEST_ASSERT_EQUAL_UINT32(1UL << 0, check(10001 + SAFETY_LINK_TIMEOUT));
+}
+
+// A stalled hub task stops its channel, a hub task without a hub is not expected to beat
+static void test_hub_stall(void)
+{
+    safetyBeatHub(0, 7, 1000);
+    safetyBeatHub(1, 8, 1000);
+    safetyHubIdle(1);
+
+    TEST_ASSERT_EQUAL_UINT32(0, check(1000 + SAFETY_HUB_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(1UL << 7, check(1001 + SAFETY_HUB_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT16(1 << 0, stalledHubs);
+}
+
+// Ramping ends when the channel is stopped or a new command arrives
+static void test_ramp(void)
+{
+    TEST_ASSERT_EQUAL_INT8(50 - SAFETY_RAMP_STEP, safetyRamp(50));
+    TEST_ASSERT_EQUAL_INT8(-50 + SAFETY_RAMP_STEP, safetyRamp(-50));
+    TEST_ASSERT_EQUAL_INT8(0, safetyRamp(SAFETY_RAMP_STEP));
+    TEST_ASSERT_EQUAL_INT8(0, safetyRamp(-SAFETY_RAMP_STEP));
+
+    safetyBeatLink(SAFETY_LINK_MQTT, 1000);
+    safetyNoteCommand(0, SAFETY_LINK_MQTT, 50);
+    safetyNoteCommand(1, SAFETY_LINK_MQTT, 50);
+    TEST_ASSERT_EQUAL_UINT32(3, check(1001 + SAFETY_LINK_TIMEOUT));
+
+    safetyRampDone(0);
+    safetyNoteCommand(1, REMOTE(2), 20);
+    TEST_ASSERT_EQUAL_UINT32(0, safetyGetRamping());
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_link_timeout);
+    RUN_TEST(test_remote_ownership);
+    RUN_TEST(test_takeover);
+    RUN_TEST(test_no_owner);
+    RUN_TEST(test_reported_once);
+    RUN_TEST(test_hub_stall);
+    RUN_TEST(test_ramp);
+    return UNITY_END();
+}
@@ -0,0 +1,124 @@
+/* Port value messages decoded into the port state, as the hub sends them: length, hub id, type 0x45, port, value
+ */
+#include <string.h>
+#include <unity.h>
+
+#include "lego_sensor.h"
+
+static sensorPort_t port;
+
+void setUp(void)
+{
+    memset(&port, 0xAA, sizeof(port)); // Garbage that sensorAttach must clear
+}
+
+void tearDown(void)
+{}
+
+static void test_attach(void)
+{
+    sensorAttach(&port, 37);
+    TEST_ASSERT_EQUAL_UINT8(SENSOR_KIND_COLOR_DISTANCE, port.kind);
+    TEST_ASSERT_EQUAL_INT32(0, port.position);
+
+    sensorAttach(&port, 255); // Pulled out
+    TEST_ASSERT_EQUAL_UINT8(0, port.deviceType);
+    TEST_ASSERT_EQUAL_UINT8(SENSOR_KIND_NONE, port.kind);
+
+    sensorAttach(&port, 2);
+    TEST_ASSERT_TRUE(sensorIsMotor(&port));
+    sensorAttach(&port, 75);
+    TEST_ASSERT_TRUE(sensorIsMotor(&port));
+    sensorAttach(&port, 8); // Lights have no readings
+    TEST_ASSERT_FALSE(sensorIsMotor(&port));
+}
+
+static void test_color_distance(void)
+{
+    const uint8_t message[] = {6, 0, 0x45, 1, 9, 3};
+
+    sensorAttach(&port, 37);
+    TEST_ASSERT_TRUE(sensorDecode(&port, message));
+    TEST_ASSERT_EQUAL_UINT8(9, port.color);
+    TEST_ASSERT_EQUAL_UINT8(3, port.distance);
+    TEST_ASSERT_FALSE(sensorDecode(&port, message)); // Unchanged
+}
+
+static void test_tilt(void)
+{
+    const uint8_t message[] = {6, 0, 0x45, 0, 0xF6, 45}; // x -10, y 45
+
+    sensorAttach(&port, 34);
+    TEST_ASSERT_TRUE(sensorDecode(&port, message));
+    TEST_ASSERT_EQUAL_INT8(-10, port.tiltX);
+    TEST_ASSERT_EQUAL_INT8(45, port.tiltY);
+    TEST_ASSERT_FALSE(sensorDecode(&port, message));
+}
+
+static void test_tacho(void)
+{
+    const uint8_t forward[]  = {8, 0, 0x45, 1, 0x10, 0x27, 0, 0};       // 10000
+    const uint8_t backward[] = {8, 0, 0x45, 1, 0x9C, 0xFF, 0xFF, 0xFF}; // -100
+
+    sensorAttach(&port, 38);
+    TEST_ASSERT_TRUE(sensorDecode(&port, forward));
+    TEST_ASSERT_EQUAL_INT32(10000, port.position);
+    TEST_ASSERT_TRUE(sensorDecode(&port, backward));
+    TEST_ASSERT_EQUAL_INT32(-100, port.position);
+}
+
+// A message too short for the mode of the device leaves the state alone
+static void test_short_message(void)
+{
+    const uint8_t shortTacho[] = {6, 0, 0x45, 1, 0x10, 0x27};
+    const uint8_t shortColor[] = {5, 0, 0x45, 1, 9};
+
+    sensorAttach(&port, 46);
+    TEST_ASSERT_FALSE(sensorDecode(&port, shortTacho));
+    TEST_ASSERT_EQUAL_INT32(0, port.position);
+
+    sensorAttach(&port, 37);
+    TEST_ASSERT_FALSE(sensorDecode(&port, shortColor));
+    TEST_ASSERT_EQUAL_UINT8(0, port.color);
+}
+
+// Devices without readings ignore port values
+static void test_no_readings(void)
+{
+    const uint8_t message[] = {5, 0, 0x45, 0, 50};
+
+    sensorAttach(&port, 2);
+    TEST_ASSERT_FALSE(sensorDecode(&port, message));
+    sensorAttach(&port, 0);
+    TEST_ASSERT_FALSE(sensorDecode(&port, message));
+}
+
+static void test_json(void)
+{
+    sensorPort_t ports[SENSOR_PORTS];
+    const uint8_t message[] = {6, 0, 0x45, 1, 9, 3};
+    char buffer[96];
+
+    sensorAttach(&ports[0], 2);
+    sensorAttach(&ports[1], 37);
+    sensorDecode(&ports[1], message);
+    sensorGetJson(ports, SENSOR_PORTS, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL_STRING("[{\"type\":2},{\"type\":37,\"color\":9,\"distance\":3}]", buffer);
+
+    // Truncated output stays terminated within the buffer
+    TEST_ASSERT_EQUAL_UINT32(15, sensorGetJson(ports, SENSOR_PORTS, buffer, 16));
+    TEST_ASSERT_EQUAL_UINT32(15, strlen(buffer));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_attach);
+    RUN_TEST(test_color_distance);
+    RUN_TEST(test_tilt);
+    RUN_TEST(test_tacho);
+    RUN_TEST(test_short_message);
+    RUN_TEST(test_no_readings);
+    RUN_TEST(test_json);
+    return UNITY_END();
+}
@@ -0,0 +1,179 @@
+/* Syslog output against a UDP listener on the loopback: record format, batching, rate limit and drop reports
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unity.h>
+
+#include "ArduinoLog.h"
+#include "lego_debug.h"
+#include "lego_syslog.h"
+
+static int listener = -1;
+
+// The hooks of lego_debug, without its timestamp and priority decorations
+static void test_prefix(int level, Print * output)
+{
+    if(output == syslogOutput()) syslogBeginRecord(level);
+}
+
+static void test_suffix(int level, Print * output)
+{
+    if(output == syslogOutput()) syslogEndRecord();
+}
+
+// Next datagram, empty when none arrives within timeout ms
+static bool receive(char * buffer, size_t size, uint32_t timeout)
+{
+    struct timeval tv = {(time_t)(timeout / 1000), (suseconds_t)(timeout % 1000 * 1000)};
+    setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    ssize_t len = recv(listener, buffer, size - 1, 0);
+    buffer[len > 0 ? len : 0] = 0;
+    return len > 0;
+}
+
+static void drain(void)
+{
+    char buffer[256];
+    while(receive(buffer, sizeof(buffer), 2 * SYSLOG_FLUSH_INTERVAL)) {
+    }
+}
+
+void setUp(void)
+{
+    debugSyslogFacility = 0;
+    debugSyslogProtocol = 0;
+    debugSyslogRate     = 0;
+}
+
+void tearDown(void)
+{
+    drain();
+}
+
+// RFC 5424 with the nil timestamp, local0 and the node name as host
+static void test_rfc5424(void)
+{
+    char buffer[256];
+    Log.notice(F("TEST: hello %d"), 5);
+    TEST_ASSERT_TRUE(receive(buffer, sizeof(buffer), 1000));
+    TEST_ASSERT_EQUAL_STRING("<133>1 - node1 PUPT - - - TEST: hello 5", buffer);
+}
+
+// RFC 3164 in the configured facility, the log level picks the severity
+static void test_rfc3164(void)
+{
+    char buffer[256];
+    debugSyslogProtocol = 1;
+    debugSyslogFacility = 2;
+    Log.error(F("TEST: broken"));
+    TEST_ASSERT_TRUE(receive(buffer, sizeof(buffer), 1000));
+    TEST_ASSERT_EQUAL_STRING("<147>node1 PUPT: TEST: broken", buffer);
+
+    // Below the level of the syslog slot nothing is queued
+    Log.verbose(F("TEST: chatter"));
+    TEST_ASSERT_FALSE(receive(buffer, sizeof(buffer), 2 * SYSLOG_FLUSH_INTERVAL));
+}
+
+// The log statement only copies into the queue, the records arrive in order with the next batch
+static void test_batch(void)
+{
+    char buffer[256], expected[64];
+    uint32_t start = micros();
+    for(uint8_t i = 0; i < SYSLOG_QUEUE_SIZE / 2 - 1; i++) Log.notice(F("TEST: record %u"), i);
+    uint32_t elapsed = micros() - start;
+
+    snprintf(expected, sizeof(expected), "%u us per log statement", elapsed / (SYSLOG_QUEUE_SIZE / 2 - 1));
+    TEST_MESSAGE(expected);
+    TEST_ASSERT_LESS_THAN_UINT32(1000, elapsed / (SYSLOG_QUEUE_SIZE / 2 - 1));
+
+    for(uint8_t i = 0; i < SYSLOG_QUEUE_SIZE / 2 - 1; i++) {
+        TEST_ASSERT_TRUE(receive(buffer, sizeof(buffer), 2 * SYSLOG_FLUSH_INTERVAL));
+        snprintf(expected, sizeof(expected), "<133>1 - node1 PUPT - - - TEST: record %u", i);
+        TEST_ASSERT_EQUAL_STRING(expected, buffer);
+    }
+}
+
+struct rateCount_t
+{
+    uint32_t received, reported, firstSecond, first;
+};
+
+// Sorts the datagrams arriving within ms into records and drop reports
+static void rate_collect(rateCount_t * count, uint32_t ms)
+{
+    char buffer[256];
+    unsigned dropped;
+    uint32_t start = millis();
+
+    do {
+        if(!receive(buffer, sizeof(buffer), 10)) continue;
+        if(count->first == 0) count->first = millis();
+        if(millis() - count->first < 1000) count->firstSecond++;
+
+        const char * text = strstr(buffer, " - - - ") + 7;
+        if(!strncmp(text, "TEST: burst ", 12)) {
+            count->received++;
+        } else if(sscanf(text, "SYSLOG: %u records dropped", &dropped) == 1) {
+            count->reported += dropped;
+        }
+    } while(millis() - start < ms);
+}
+
+// Two seconds of 100 records per second are cut to the rate, every lost record is accounted for in a report
+static void test_rate_limit(void)
+{
+    const uint8_t total = 200;
+    rateCount_t count   = {};
+    debugSyslogRate     = 20;
+
+    for(uint8_t i = 0; i < total; i++) {
+        Log.notice(F("TEST: burst %u"), i);
+        if(i % 10 == 9) rate_collect(&count, 100);
+    }
+    rate_collect(&count, 3000);
+
+    char message[128];
+    snprintf(message, sizeof(message), "%u of %u records sent, %u reported dropped, %u datagrams in the first second",
+             count.received, total, count.reported, count.firstSecond);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_GREATER_THAN_UINT32(0, count.reported);
+    TEST_ASSERT_EQUAL_UINT32(total, count.received + count.reported);
+    // The bucket starts with one second worth of datagrams and refills another one within the second
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(2 * debugSyslogRate, count.firstSecond);
+}
+
+int main(void)
+{
+    listener                = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {};
+    socklen_t addrlen       = sizeof(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(listener, (struct sockaddr *)&addr, &addrlen);
+
+    strcpy(debugSyslogHost, "127.0.0.1");
+    debugSyslogPort = ntohs(addr.sin_port);
+
+    Log.setPrefix(test_prefix);
+    Log.setSuffix(test_suffix);
+    syslogSetup();
+    Log.registerOutput(DEBUG_LOG_SLOT_SYSLOG, syslogOutput(), LOG_LEVEL_NOTICE, true);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_rfc5424);
+    RUN_TEST(test_rfc3164);
+    RUN_TEST(test_batch);
+    RUN_TEST(test_rate_limit);
+    int failures = UNITY_END();
+
+    close(listener);
+    return failures;
+}
@@ -0,0 +1,213 @@
+/* Telnet console against loopback clients: header, commands, log lines, negotiation, a client that falls behind
+ *
+ * The test thread is the loop task, every step polls telnetLoop while the clients read and write their sockets.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include <Arduino.h>
+#include "ArduinoLog.h"
+#include "lwip/sockets.h"
+#include "lego_ble.h"
+#include "lego_telnet.h"
+
+#define HEADER "LEGO train controller on the host\r\n"
+
+static int clients[TELNET_MAX_CLIENTS + 1];
+
+static void pump(uint32_t ms)
+{
+    uint32_t start = millis();
+    do {
+        telnetLoop();
+        delay(1);
+    } while(millis() - start < ms);
+}
+
+static int client_connect(void)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(telnetPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL_INT(0, connect(client, (struct sockaddr *)&address, sizeof(address)));
+    for(uint8_t i = 0; i <= TELNET_MAX_CLIENTS; i++) {
+        if(clients[i] < 0) {
+            clients[i] = client;
+            break;
+        }
+    }
+    return client;
+}
+
+static void client_send(int client, const void * data, size_t length)
+{
+    TEST_ASSERT_EQUAL_INT((int)length, send(client, data, length, 0));
+}
+
+// Everything the console sends within ms, returns -1 once the console has closed the connection
+static int client_read(int client, char * buffer, size_t size, uint32_t ms)
+{
+    size_t length  = 0;
+    uint32_t start = millis();
+    do {
+        telnetLoop();
+        int received = recv(client, buffer + length, size - 1 - length, MSG_DONTWAIT);
+        if(received == 0) {
+            buffer[length] = 0;
+            return -1;
+        }
+        if(received > 0) length += received;
+        delay(1);
+    } while(millis() - start < ms && length < size - 1);
+
+    buffer[length] = 0;
+    return length;
+}
+
+void setUp(void)
+{
+    for(uint8_t i = 0; i <= TELNET_MAX_CLIENTS; i++) clients[i] = -1;
+    ble_setup();
+}
+
+void tearDown(void)
+{
+    for(uint8_t i = 0; i <= TELNET_MAX_CLIENTS; i++) {
+        if(clients[i] >= 0) close(clients[i]);
+    }
+    pump(50); // The console notices the closed connections and frees the slots
+}
+
+// A new client gets the header, log lines reach it with CR LF line ends
+static void test_header_and_log(void)
+{
+    char buffer[512];
+    int client = client_connect();
+    TEST_ASSERT_GREATER_THAN(0, client_read(client, buffer, sizeof(buffer), 50));
+    TEST_ASSERT_EQUAL_STRING_LEN(HEADER, buffer, strlen(HEADER));
+
+    Log.notice(F("TEST: first\nTEST: second\r\n"));
+    client_read(client, buffer, sizeof(buffer), 50);
+    TEST_ASSERT_NOT_NULL(strstr(buffer, "TEST: first\r\nTEST: second\r\n"));
+}
+
+// Commands go through the dispatcher like the serial console, with backspaces applied
+static void test_command(void)
+{
+    char buffer[512];
+    int client = client_connect();
+    client_read(client, buffer, sizeof(buffer), 50);
+
+    client_send(client, "speed2=30\r\n", 11);
+    client_send(client, "speed3=9\b-15\n", 13);
+    pump(50);
+    TEST_ASSERT_EQUAL_INT8(30, ble_get_motor_speed(2));
+    TEST_ASSERT_EQUAL_INT8(-15, ble_get_motor_speed(3));
+}
+
+// Option negotiation and subnegotiation of the client are skipped, also split over several reads
+static void test_negotiation(void)
+{
+    static const uint8_t will[]   = {255, 251, 1, 255, 253, 3};
+    static const uint8_t sub[]    = {255, 250, 24, 0, 'x', 't', 'e', 'r', 'm'};
+    static const uint8_t subEnd[] = {255, 240, 's', 'p', 'e', 'e', 'd', '1', '=', '4', '0', '\r', 0};
+    char buffer[512];
+
+    int client = client_connect();
+    client_read(client, buffer, sizeof(buffer), 50);
+    client_send(client, will, sizeof(will));
+    client_send(client, sub, sizeof(sub));
+    pump(20);
+    client_send(client, subEnd, sizeof(subEnd));
+    pump(50);
+    TEST_ASSERT_EQUAL_INT8(40, ble_get_motor_speed(1));
+}
+
+// A client that isn't served in time loses output and is told how much, the logging caller never waits
+static void test_overflow(void)
+{
+    char buffer[8192];
+    int client = client_connect();
+    client_read(client, buffer, sizeof(buffer), 50);
+
+    const char * line    = "TEST: a log line that overflows the ring of the client\n";
+    const uint16_t lines = 100;
+    uint32_t start       = micros();
+    for(uint16_t i = 0; i < lines; i++) Log.notice(line);
+    uint32_t elapsed = micros() - start;
+
+    TEST_ASSERT_GREATER_THAN(0, client_read(client, buffer, sizeof(buffer), 100));
+    const char * notice = strstr(buffer, "\r\n*** ");
+    unsigned dropped    = 0;
+    TEST_ASSERT_NOT_NULL(notice);
+    TEST_ASSERT_EQUAL_INT(1, sscanf(notice, "\r\n*** %u bytes of output dropped ***", &dropped));
+
+    // The ring was sent up to the notice, what arrived and what was dropped add up to what was logged
+    uint32_t arrived = 0, complete = 0;
+    for(const char * p = buffer; p < notice; p++) {
+        if(*p != '\r') arrived++;
+        if(*p == '\n') complete++;
+    }
+
+    snprintf(buffer, sizeof(buffer), "%u of %u lines sent, %u bytes dropped, %u us per log statement", complete,
+             lines, dropped, elapsed / lines);
+    TEST_MESSAGE(buffer);
+
+    TEST_ASSERT_EQUAL_UINT32(lines * strlen(line), arrived + dropped);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(TELNET_RING_SIZE / (strlen(line) + 1) - 1, complete);
+    TEST_ASSERT_LESS_THAN_UINT32(1000, elapsed / lines);
+}
+
+// A client beyond TELNET_MAX_CLIENTS is turned away, exit closes a session and frees its slot
+static void test_clients(void)
+{
+    char buffer[512];
+    int first = client_connect();
+    for(uint8_t i = 1; i < TELNET_MAX_CLIENTS; i++) client_connect();
+    client_read(first, buffer, sizeof(buffer), 50);
+
+    int extra = client_connect();
+    TEST_ASSERT_EQUAL_INT(-1, client_read(extra, buffer, sizeof(buffer), 100));
+    TEST_ASSERT_EQUAL_STRING("Too many clients\r\n", buffer);
+
+    client_send(first, "exit\r\n", 6);
+    TEST_ASSERT_EQUAL_INT(-1, client_read(first, buffer, sizeof(buffer), 100));
+
+    int next = client_connect();
+    client_read(next, buffer, sizeof(buffer), 50);
+    TEST_ASSERT_EQUAL_STRING_LEN(HEADER, buffer, strlen(HEADER));
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    // A free port for the console
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int probe               = socket(AF_INET, SOCK_STREAM, 0);
+    bind(probe, (struct sockaddr *)&address, sizeof(address));
+    getsockname(probe, (struct sockaddr *)&address, &size);
+    close(probe);
+    telnetPort = ntohs(address.sin_port);
+
+    telnetSetup();
+    telnetEverySecond();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_header_and_log);
+    RUN_TEST(test_command);
+    RUN_TEST(test_negotiation);
+    RUN_TEST(test_overflow);
+    RUN_TEST(test_clients);
+    return UNITY_END();
+}